@@ -43,10 +43,17 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib> // getenv
+#include <cstring> // strlen
 #include <iostream>
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include <ofxsImageEffect.h>
 #include <ofxsMacros.h>
+#include "ofxsFileOpen.h"
 
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(WIN64)
 #include <windows.h> // for GetSystemInfo()
@@ -331,7 +338,7 @@ FFmpegFile::isCodecWhitelistedForWriting(const char* codecName)
     return (whitelistEntry && whitelistEntry->enableWriter);
 }
 
-SwsContext*
+FFmpeg::SwsSlicedContext*
 FFmpegFile::Stream::getConvertCtx(AVPixelFormat srcPixelFormat,
                                   int srcWidth,
                                   int srcHeight,
@@ -345,10 +352,8 @@ FFmpegFile::Stream::getConvertCtx(AVPixelFormat srcPixelFormat,
     // that reflects the UI selection.
     if (_resetConvertCtx) {
         _resetConvertCtx = false;
-        if (_convertCtx) {
-            sws_freeContext(_convertCtx);
-            _convertCtx = nullptr;
-        }
+        delete _convertCtx;
+        _convertCtx = nullptr;
     }
 
     if (!_convertCtx) {
@@ -383,9 +388,16 @@ FFmpegFile::Stream::getConvertCtx(AVPixelFormat srcPixelFormat,
             break;
         }
 
-        _convertCtx = sws_getContext(srcWidth, srcHeight, srcPixelFormat, // src format
-                                     dstWidth, dstHeight, dstPixelFormat, // dest format
-                                     SWS_BICUBIC, nullptr, nullptr, nullptr);
+        // the image is converted by horizontal bands, in parallel
+        _convertCtx = new FFmpeg::SwsSlicedContext;
+        if (!_convertCtx->init(srcWidth, srcHeight, srcPixelFormat, // src format
+                               dstWidth, dstHeight, dstPixelFormat, // dest format
+                               SWS_BICUBIC)) {
+            delete _convertCtx;
+            _convertCtx = nullptr;
+
+            return nullptr;
+        }
 
         // Set up the SoftWareScaler to convert colorspaces correctly.
         // Colorspace conversion makes no sense for RGB->RGB conversions
@@ -423,14 +435,13 @@ FFmpegFile::Stream::getConvertCtx(AVPixelFormat srcPixelFormat,
             break;
         }
 
-        int result = sws_setColorspaceDetails(_convertCtx,
-                                              sws_getCoefficients(colorspace), // inv_table
-                                              srcRange, // srcRange -flag indicating the white-black range of the input (1=jpeg / 0=mpeg) 0 = 16..235, 1 = 0..255
-                                              sws_getCoefficients(SWS_CS_DEFAULT), // table
-                                              1, // dstRange - 0 = 16..235, 1 = 0..255
-                                              0, // brightness fixed point, with 0 meaning no change,
-                                              1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
-                                              1 << 16); // saturation fixed point, with 1<<16 meaning no change);
+        int result = _convertCtx->setColorspaceDetails(sws_getCoefficients(colorspace), // inv_table
+                                                       srcRange, // srcRange -flag indicating the white-black range of the input (1=jpeg / 0=mpeg) 0 = 16..235, 1 = 0..255
+                                                       sws_getCoefficients(SWS_CS_DEFAULT), // table
+                                                       1, // dstRange - 0 = 16..235, 1 = 0..255
+                                                       0, // brightness fixed point, with 0 meaning no change,
+                                                       1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
+                                                       1 << 16); // saturation fixed point, with 1<<16 meaning no change);
 
         assert(result != -1);
     }
@@ -720,6 +731,228 @@ CheckStreamPropertiesMatch(const AVStream* streamA,
     return (codecA->codec_id == codecB->codec_id) && (codecA->bits_per_raw_sample == codecB->bits_per_raw_sample) && (codecA->width == codecB->width) && (codecA->height == codecB->height) && (codecA->sample_aspect_ratio.num == codecB->sample_aspect_ratio.num) && (codecA->sample_aspect_ratio.den == codecB->sample_aspect_ratio.den) && (pixFmtDescA->nb_components == pixFmtDescB->nb_components) && (streamA->sample_aspect_ratio.num == streamB->sample_aspect_ratio.num) && (streamA->sample_aspect_ratio.den == streamB->sample_aspect_ratio.den) && (streamA->time_base.num == streamB->time_base.num) && (streamA->time_base.den == streamB->time_base.den) && (streamA->start_time == streamB->start_time) && (streamA->duration == streamB->duration) && (streamA->nb_frames == streamB->nb_frames) && (streamA->r_frame_rate.num == streamB->r_frame_rate.num) && (streamA->r_frame_rate.den == streamB->r_frame_rate.den);
 }
 
+// The stream start time and number of frames may require demuxing large parts of the file
+// (see getStreamStartTime() and getStreamFrames()), so they are stored in an on-disk cache,
+// indexed by filename and stream index. The file size and modification time are stored too,
+// so that a modified file is probed again. The modification time has sub-second resolution
+// where the platform provides it, so that a file rewritten within the same second is detected.
+// The cache location can be set using the OFX_FFMPEG_STREAMINFO_CACHE environment variable
+// (an empty value disables the cache).
+#define kStreamInfoCacheEnv "OFX_FFMPEG_STREAMINFO_CACHE"
+#define kStreamInfoCacheFileName "openfx-io-ffmpeg-streaminfo.txt"
+// The cache is reset when it contains more than this number of lines.
+#define kStreamInfoCacheMaxEntries 4096
+
+namespace {
+struct StreamInfo {
+    int64_t fileSize;
+    int64_t fileTime;
+    int64_t startPTS;
+    int64_t startDTS;
+    int64_t frames;
+};
+
+typedef std::map<std::pair<string, int>, StreamInfo> StreamInfoMap;
+
+class StreamInfoCache {
+public:
+    StreamInfoCache()
+        : _lock()
+        , _loaded(false)
+        , _path()
+        , _infos()
+    {
+    }
+
+    bool find(const string& filename,
+              int streamIndex,
+              int64_t fileSize,
+              int64_t fileTime,
+              StreamInfo* info)
+    {
+        FFmpegFile::AutoMutex guard(_lock);
+        load();
+        StreamInfoMap::const_iterator found = _infos.find(make_pair(filename, streamIndex));
+        if ((found == _infos.end()) || (found->second.fileSize != fileSize) || (found->second.fileTime != fileTime)) {
+            return false;
+        }
+        *info = found->second;
+
+        return true;
+    }
+
+    void insert(const string& filename,
+                int streamIndex,
+                const StreamInfo& info)
+    {
+        if (filename.find_first_of("\r\n") != string::npos) {
+            return;
+        }
+        FFmpegFile::AutoMutex guard(_lock);
+        load();
+        _infos[make_pair(filename, streamIndex)] = info;
+        if (_path.empty()) {
+            return;
+        }
+        // append a single line, so that several processes may share the cache
+        std::FILE* file = OFX::fopen_utf8(_path.c_str(), "ab");
+        if (file) {
+            std::fprintf(file, "%lld %lld %d %lld %lld %lld %s\n",
+                         (long long)info.fileSize, (long long)info.fileTime, streamIndex,
+                         (long long)info.startPTS, (long long)info.startDTS, (long long)info.frames,
+                         filename.c_str());
+            std::fclose(file);
+        }
+    }
+
+private:
+    static string defaultPath()
+    {
+        const char* env = std::getenv(kStreamInfoCacheEnv);
+        if (env) {
+            return string(env);
+        }
+        string dir;
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(WIN64)
+        if (const char* localAppData = std::getenv("LOCALAPPDATA")) {
+            dir = localAppData;
+        } else if (const char* temp = std::getenv("TEMP")) {
+            dir = temp;
+        }
+        if (!dir.empty()) {
+            dir += '\\';
+        }
+#else
+        if (const char* xdgCache = std::getenv("XDG_CACHE_HOME")) {
+            dir = xdgCache;
+        } else if (const char* home = std::getenv("HOME")) {
+            dir = home;
+#ifdef __APPLE__
+            dir += "/Library/Caches";
+#else
+            dir += "/.cache";
+#endif
+        }
+        if (!dir.empty()) {
+            dir += '/';
+        }
+#endif
+        if (dir.empty()) {
+            return string();
+        }
+
+        return dir + kStreamInfoCacheFileName;
+    }
+
+    // read the cache file, must be called with _lock held
+    void load()
+    {
+        if (_loaded) {
+            return;
+        }
+        _loaded = true;
+        _path = defaultPath();
+        if (_path.empty()) {
+            return;
+        }
+        std::FILE* file = OFX::fopen_utf8(_path.c_str(), "rb");
+        if (!file) {
+            return;
+        }
+        int lines = 0;
+        char buf[4096];
+        while (std::fgets(buf, sizeof(buf), file)) {
+            ++lines;
+            size_t len = std::strlen(buf);
+            if ((len == 0) || (buf[len - 1] != '\n')) {
+                // truncated line
+                continue;
+            }
+            buf[len - 1] = '\0';
+            long long fileSize, fileTime, startPTS, startDTS, frames;
+            int streamIndex;
+            int pos = 0;
+            // the filename follows a single space, and may itself start with spaces
+            if ((std::sscanf(buf, "%lld %lld %d %lld %lld %lld%n", &fileSize, &fileTime, &streamIndex, &startPTS, &startDTS, &frames, &pos) != 6) || (pos <= 0) || (buf[pos] != ' ') || (buf[pos + 1] == '\0')) {
+                continue;
+            }
+            ++pos;
+            StreamInfo info;
+            info.fileSize = fileSize;
+            info.fileTime = fileTime;
+            info.startPTS = startPTS;
+            info.startDTS = startDTS;
+            info.frames = frames;
+            // later lines override earlier ones
+            _infos[make_pair(string(buf + pos), streamIndex)] = info;
+        }
+        std::fclose(file);
+        if (lines > kStreamInfoCacheMaxEntries) {
+            // start over with an empty cache
+            std::remove(_path.c_str());
+            _infos.clear();
+        }
+    }
+
+    FFmpegFile::Mutex _lock;
+    bool _loaded;
+    string _path;
+    StreamInfoMap _infos;
+};
+
+StreamInfoCache&
+streamInfoCache()
+{
+    static StreamInfoCache cache;
+
+    return cache;
+}
+
+// get the size and modification time of a file, used to validate the stream info cache
+bool
+getFileSizeAndTime(const string& filename,
+                   int64_t* fileSize,
+                   int64_t* fileTime)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(WIN64)
+    int wlen = MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, nullptr, 0);
+    if (wlen <= 0) {
+        return false;
+    }
+    std::vector<wchar_t> wfilename(wlen);
+    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, &wfilename[0], wlen);
+    struct _stat64 st;
+    if (_wstat64(&wfilename[0], &st) != 0) {
+        return false;
+    }
+    // _stat64 only gives whole seconds, the last write time is in 100ns units
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExW(&wfilename[0], GetFileExInfoStandard, &attributes)) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    if ((st.st_mode & S_IFMT) != S_IFREG) {
+        // not a regular file (URL, pipe, device...)
+        return false;
+    }
+    *fileSize = (int64_t)st.st_size;
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(WIN64)
+    *fileTime = ((int64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | (int64_t)attributes.ftLastWriteTime.dwLowDateTime;
+#elif defined(__APPLE__)
+    *fileTime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + (int64_t)st.st_mtimespec.tv_nsec;
+#else
+    *fileTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + (int64_t)st.st_mtim.tv_nsec;
+#endif
+
+    return true;
+}
+} // namespace
+
 // constructor
 FFmpegFile::FFmpegFile(const string& filename)
     : _filename(filename)
@@ -773,6 +1006,10 @@ FFmpegFile::FFmpegFile(const string& filename)
     // fill the array with all available video streams
     bool unsupported_codec = false;
 
+    int64_t fileSize = 0;
+    int64_t fileTime = 0;
+    const bool useStreamInfoCache = getFileSizeAndTime(_filename, &fileSize, &fileTime);
+
     // find all streams that the library is able to decode
     for (unsigned i = 0; i < _context->nb_streams; ++i) {
 #if TRACE_FILE_OPEN
@@ -985,8 +1222,26 @@ FFmpegFile::FFmpegFile(const string& filename)
         stream->_aspect = Stream::GetStreamAspectRatio(stream);
 
         // set stream start time and numbers of frames
-        stream->_startPTS = getStreamStartTime(*stream);
-        stream->_frames = getStreamFrames(*stream);
+        StreamInfo info;
+        if (useStreamInfoCache && streamInfoCache().find(_filename, (int)i, fileSize, fileTime, &info)) {
+#if TRACE_FILE_OPEN
+            std::cout << "      Start PTS and frame count obtained from the stream info cache" << std::endl;
+#endif
+            stream->_startPTS = info.startPTS;
+            stream->_startDTS = info.startDTS;
+            stream->_frames = info.frames;
+        } else {
+            stream->_startPTS = getStreamStartTime(*stream);
+            stream->_frames = getStreamFrames(*stream);
+            if (useStreamInfoCache) {
+                info.fileSize = fileSize;
+                info.fileTime = fileTime;
+                info.startPTS = stream->_startPTS;
+                info.startDTS = stream->_startDTS;
+                info.frames = stream->_frames;
+                streamInfoCache().insert(_filename, (int)i, info);
+            }
+        }
 
         // save the stream
         _streams.push_back(stream);
@@ -1190,6 +1445,31 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
     AutoMutex guard(_lock);
 #endif
 
+    return decodeFrame(frame, loadNearest, buffer, nullptr);
+}
+
+// decode a single frame without converting it, thread safe
+bool
+FFmpegFile::decodeNative(const ImageEffect* /*plugin*/,
+                         int frame,
+                         bool loadNearest,
+                         AVFrame* avFrameOut)
+{
+    assert(avFrameOut);
+#ifdef OFX_IO_MT_FFMPEG
+    AutoMutex guard(_lock);
+#endif
+
+    return decodeFrame(frame, loadNearest, nullptr, avFrameOut);
+}
+
+// decode a single frame, either converted into |buffer|, or referenced by |nativeFrameOut| if it is not NULL
+bool
+FFmpegFile::decodeFrame(int frame,
+                        bool loadNearest,
+                        unsigned char* buffer,
+                        AVFrame* nativeFrameOut)
+{
     if (_streams.empty()) {
         return false;
     }
@@ -1250,23 +1530,25 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
     avFrameOut->height = stream->_height;
     avFrameOut->format = stream->_outputPixelFormat;
 
-    int res = 0;
+    if (buffer) {
+        int res = 0;
 
-    if ((res = av_image_fill_linesizes(avFrameOut->linesize, stream->_outputPixelFormat, stream->_width)) < 0) {
-        setInternalError(res, "FFmpeg Reader Failed to fill image linesizes: ");
-        return false;
-    }
+        if ((res = av_image_fill_linesizes(avFrameOut->linesize, stream->_outputPixelFormat, stream->_width)) < 0) {
+            setInternalError(res, "FFmpeg Reader Failed to fill image linesizes: ");
+            return false;
+        }
 
-    res = av_image_fill_pointers(
-        avFrameOut->data,
-        stream->_outputPixelFormat,
-        stream->_height,
-        buffer,
-        avFrameOut->linesize);
+        res = av_image_fill_pointers(
+            avFrameOut->data,
+            stream->_outputPixelFormat,
+            stream->_height,
+            buffer,
+            avFrameOut->linesize);
 
-    if (res < 0) {
-        setInternalError(res, "FFmpeg Reader Failed to fill image pointers: ");
-        return false;
+        if (res < 0) {
+            setInternalError(res, "FFmpeg Reader Failed to fill image pointers: ");
+            return false;
+        }
     }
 
     bool retriedSeek = false;
@@ -1276,7 +1558,7 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
 
         retriedDecode = retriedSeek ? true : false;
 
-        hasPicture = demuxAndDecode(avFrameOut, frame);
+        hasPicture = demuxAndDecode(avFrameOut, frame, nativeFrameOut);
 
         // A last ditch effot to get a frame out for non-intra codecs.
         // This will perform a seek to the start of the file. which is
@@ -1291,7 +1573,7 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
     }
 
     return hasPicture;
-} // FFmpegFile::decode
+} // FFmpegFile::decodeFrame
 
 bool
 FFmpegFile::seekToFrame(int64_t frame, int seekFlags)
@@ -1339,7 +1621,7 @@ mov64_av_decode(AVCodecContext* avctx, AVFrame* frame,
 }
 
 bool
-FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame)
+FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame, AVFrame* nativeFrameOut)
 {
     Stream* stream = _selectedStream;
     MyAVPacket avPacket;
@@ -1393,7 +1675,7 @@ FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame)
 
             if (frameDecoded) {
                 if (foundCorrectFrame(avFrameDecodeDst, frame)) {
-                    hasPicture = imageConvert(avFrameDecodeDst, avFrameOut);
+                    hasPicture = outputFrame(avFrameDecodeDst, avFrameOut, nativeFrameOut);
                     return hasPicture;
                 }
             }
@@ -1417,7 +1699,7 @@ FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame)
 
             if (frameDecoded) {
                 if (foundCorrectFrame(avFrameDecodeDst, frame)) {
-                    return imageConvert(avFrameDecodeDst, avFrameOut);
+                    return outputFrame(avFrameDecodeDst, avFrameOut, nativeFrameOut);
                 }
             } else {
                 break;
@@ -1428,6 +1710,30 @@ FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame)
     return hasPicture;
 }
 
+// Convert the decoded frame into avFrameOut, or if nativeFrameOut is not NULL,
+// reference the decoded frame from it without any conversion.
+bool
+FFmpegFile::outputFrame(AVFrame* avFrameIn, AVFrame* avFrameOut, AVFrame* nativeFrameOut)
+{
+    if (!nativeFrameOut) {
+        return imageConvert(avFrameIn, avFrameOut);
+    }
+
+    // the timestamps of avFrameOut are used to detect sequential reads in decodeFrame()
+    avFrameOut->pts = avFrameIn->pts;
+    avFrameOut->pkt_dts = avFrameIn->pkt_dts;
+    avFrameOut->pkt_duration = avFrameIn->pkt_duration;
+
+    av_frame_unref(nativeFrameOut);
+    int res = av_frame_ref(nativeFrameOut, avFrameIn);
+    if (res < 0) {
+        setInternalError(res, "FFmpeg Reader Failed to reference the decoded frame: ");
+        return false;
+    }
+
+    return true;
+}
+
 bool
 FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
 {
@@ -1453,7 +1759,7 @@ FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
         }
     }
 
-    SwsContext* context = stream->getConvertCtx(
+    FFmpeg::SwsSlicedContext* context = stream->getConvertCtx(
         srcPixFmt,
         avFrameIn->width,
         avFrameIn->height,
@@ -1466,12 +1772,9 @@ FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
     // context. Otherwise, no scaling/conversion is required after
     // decoding the frame.
     if (context) {
-        sws_scale(
-            context,
+        context->scale(
             avFrameIn->data,
             avFrameIn->linesize,
-            0,
-            avFrameIn->height,
             avFrameOut->data,
             avFrameOut->linesize);
     } else {
@@ -1539,14 +1842,37 @@ FFmpegFile::getBufferBytesCount() const
     return stream->_width * stream->_height * stream->_numberOfComponents * pixelDepth;
 }
 
+// Maximum number of files opened simultaneously by FFmpegFileManager::prefetch().
+// Each opened decoder also creates its own threads, see the FFmpegFile constructor.
+#define kFFmpegProbeThreadsMax 4
+
 FFmpegFileManager::FFmpegFileManager()
     : _files()
     , _lock(nullptr)
+    , _pending()
+    , _pendingMutex()
+    , _pendingCond()
+    , _probeThreads()
+    , _probeQuit(false)
 {
 }
 
 FFmpegFileManager::~FFmpegFileManager()
 {
+    _pendingMutex.lock();
+    _probeQuit = true;
+    _pendingCond.notify_all();
+    _pendingMutex.unlock();
+    for (std::vector<tthread::thread*>::iterator it = _probeThreads.begin(); it != _probeThreads.end(); ++it) {
+        (*it)->join();
+        delete *it;
+    }
+    _probeThreads.clear();
+    for (PendingList::iterator it = _pending.begin(); it != _pending.end(); ++it) {
+        delete (*it)->file;
+        delete *it;
+    }
+    _pending.clear();
     for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
         for (std::list<FFmpegFile*>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
             delete *it2;
@@ -1565,6 +1891,7 @@ FFmpegFileManager::init()
 void
 FFmpegFileManager::clear(void const* plugin)
 {
+    collectPending(plugin, nullptr);
     assert(_lock);
     FFmpegFile::AutoMutex guard(*_lock);
     FilesMap::iterator found = _files.find(plugin);
@@ -1583,6 +1910,7 @@ FFmpegFileManager::get(void const* plugin,
     if (filename.empty() || !plugin) {
         return 0;
     }
+    collectPending(plugin, &filename);
     assert(_lock);
     FFmpegFile::AutoMutex guard(*_lock);
     FilesMap::iterator found = _files.find(plugin);
@@ -1610,6 +1938,7 @@ FFmpegFileManager::getOrCreate(void const* plugin,
     if (filename.empty() || !plugin) {
         return 0;
     }
+    collectPending(plugin, &filename);
     assert(_lock);
     FFmpegFile::AutoMutex guard(*_lock);
     FilesMap::iterator found = _files.find(plugin);
@@ -1638,3 +1967,163 @@ FFmpegFileManager::getOrCreate(void const* plugin,
 
     return file;
 }
+
+void
+FFmpegFileManager::prefetch(void const* plugin,
+                            const string& filename)
+{
+    if (filename.empty() || !plugin || FFmpegFile::isImageFile(filename)) {
+        return;
+    }
+    assert(_lock);
+    {
+        FFmpegFile::AutoMutex guard(*_lock);
+        FilesMap::iterator found = _files.find(plugin);
+        if (found != _files.end()) {
+            for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
+                if ((*it)->getFilename() == filename) {
+                    // already opened
+                    return;
+                }
+            }
+        }
+    }
+
+    tthread::lock_guard<tthread::mutex> guard(_pendingMutex);
+    for (PendingList::iterator it = _pending.begin(); it != _pending.end(); ++it) {
+        if (((*it)->plugin == plugin) && ((*it)->filename == filename)) {
+            // already queued
+            return;
+        }
+    }
+    PendingFile* pending = new PendingFile;
+    pending->plugin = plugin;
+    pending->filename = filename;
+    pending->file = nullptr;
+    pending->started = false;
+    pending->done = false;
+    _pending.push_back(pending);
+    // threads are launched on demand
+    int nThreads = (std::min)((int)MultiThread::getNumCPUs(), kFFmpegProbeThreadsMax);
+    if ((int)_probeThreads.size() < nThreads) {
+        _probeThreads.push_back(new tthread::thread(probeThreadFunction, this));
+    }
+    _pendingCond.notify_one();
+}
+
+void
+FFmpegFileManager::probeThreadFunction(void* arg)
+{
+    FFmpegFileManager* manager = (FFmpegFileManager*)arg;
+
+    manager->probe();
+}
+
+// open the queued files, until the manager is destroyed
+void
+FFmpegFileManager::probe()
+{
+    _pendingMutex.lock();
+    while (!_probeQuit) {
+        PendingFile* pending = nullptr;
+        for (PendingList::iterator it = _pending.begin(); it != _pending.end(); ++it) {
+            if (!(*it)->started) {
+                pending = *it;
+                break;
+            }
+        }
+        if (!pending) {
+            _pendingCond.wait(_pendingMutex);
+            continue;
+        }
+        pending->started = true;
+        _pendingMutex.unlock();
+        FFmpegFile* file = nullptr;
+        try {
+            file = new FFmpegFile(pending->filename);
+        } catch (...) {
+            // getOrCreate() will try again and report the error
+            file = nullptr;
+        }
+        _pendingMutex.lock();
+        pending->file = file;
+        pending->done = true;
+        _pendingCond.notify_all();
+    }
+    _pendingMutex.unlock();
+}
+
+void
+FFmpegFileManager::collectPending(void const* plugin,
+                                  const string* filename) const
+{
+    std::list<PendingFile*> collected;
+    std::list<PendingFile*> notStarted;
+    {
+        _pendingMutex.lock();
+        bool waiting = true;
+        while (waiting) {
+            waiting = false;
+            for (PendingList::iterator it = _pending.begin(); it != _pending.end();) {
+                PendingFile* pending = *it;
+                if ((pending->plugin != plugin) || (filename && (pending->filename != *filename))) {
+                    ++it;
+                } else if (pending->started && !pending->done) {
+                    // being opened by a probe thread
+                    waiting = true;
+                    ++it;
+                } else if (!pending->started && filename) {
+                    // not picked by a probe thread yet: open it here rather than losing the prefetch
+                    pending->started = true;
+                    notStarted.push_back(pending);
+                    it = _pending.erase(it);
+                } else {
+                    // files of an instance being cleared which were not opened yet are dropped
+                    collected.push_back(pending);
+                    it = _pending.erase(it);
+                }
+            }
+            if (waiting) {
+                _pendingCond.wait(_pendingMutex);
+            }
+        }
+        _pendingMutex.unlock();
+    }
+    for (std::list<PendingFile*>::iterator it = notStarted.begin(); it != notStarted.end(); ++it) {
+        try {
+            (*it)->file = new FFmpegFile((*it)->filename);
+        } catch (...) {
+            // getOrCreate() will try again and report the error
+            (*it)->file = nullptr;
+        }
+        (*it)->done = true;
+        collected.push_back(*it);
+    }
+    if (collected.empty()) {
+        return;
+    }
+
+    assert(_lock);
+    FFmpegFile::AutoMutex guard(*_lock);
+    for (std::list<PendingFile*>::iterator it = collected.begin(); it != collected.end(); ++it) {
+        FFmpegFile* file = (*it)->file;
+        delete *it;
+        if (!file) {
+            continue;
+        }
+        std::list<FFmpegFile*>& fileList = _files[plugin];
+        bool found = false;
+        for (std::list<FFmpegFile*>::iterator it2 = fileList.begin(); it2 != fileList.end(); ++it2) {
+            if ((*it2)->getFilename() == file->getFilename()) {
+                found = true;
+                break;
+            }
+        }
+        if (found) {
+            // opened synchronously in the meantime
+            delete file;
+        } else {
+            fileList.push_back(file);
+        }
+    }
+} // FFmpegFileManager::collectPending
@@ -52,11 +52,13 @@ extern "C" {
 }
 
 #include "ofxsMultiThread.h"
+#include "SwsSlicedContext.h"
 #ifndef OFX_USE_MULTITHREAD_MUTEX
 // some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
 // prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
 #include "fast_mutex.h"
 #endif
+#include "tinythread.h"
 
 #define CHECKMSG(x, msg)         \
     {                            \
@@ -142,7 +144,7 @@ private:
         const AVCodec* _videoCodec;
         AVFrame* _avFrame; // decoding frame
         AVFrame* _avIntermediateFrame; // decode into this if an image conversion is required
-        SwsContext* _convertCtx;
+        FFmpeg::SwsSlicedContext* _convertCtx;
         bool _resetConvertCtx;
 
         int _fpsNum;
@@ -228,9 +230,7 @@ private:
                 avcodec_free_context(&_codecContext);
             }
 
-            if (_convertCtx) {
-                sws_freeContext(_convertCtx);
-            }
+            delete _convertCtx;
         }
 
         static void destroy(Stream* s)
@@ -298,7 +298,7 @@ private:
 
         // Generate the conversion context used by SoftWareScaler if not already set.
         // |reset| forces recalculation of cached context.
-        SwsContext* getConvertCtx(AVPixelFormat srcPixelFormat, int srcWidth, int srcHeight, int srcColorRange, AVPixelFormat dstPixelFormat, int dstWidth, int dstHeight);
+        FFmpeg::SwsSlicedContext* getConvertCtx(AVPixelFormat srcPixelFormat, int srcWidth, int srcHeight, int srcColorRange, AVPixelFormat dstPixelFormat, int dstWidth, int dstHeight);
 
         // Return the number of input frames needed by this stream's codec before it can produce output. We expect to have to
         // wait this many frames to receive output; any more and a decode stall is detected.
@@ -506,6 +506,10 @@ public:
     // decode a single frame into the buffer. Thread safe
     bool decode(const OFX::ImageEffect* plugin, int frame, bool loadNearest, unsigned char* buffer);
 
+    // decode a single frame without any conversion: avFrameOut references the planes output by the decoder,
+    // and must be unreferenced by the caller. Thread safe
+    bool decodeNative(const OFX::ImageEffect* plugin, int frame, bool loadNearest, AVFrame* avFrameOut);
+
     // get stream information
     bool getFPS(double& fps,
                 unsigned streamIdx = 0);
@@ -533,7 +537,11 @@ public:
 private:
     bool seekToFrame(int64_t frame, int seekFlags);
 
-    bool demuxAndDecode(AVFrame* avFrameOut, int64_t frame);
+    bool decodeFrame(int frame, bool loadNearest, unsigned char* buffer, AVFrame* nativeFrameOut);
+
+    bool demuxAndDecode(AVFrame* avFrameOut, int64_t frame, AVFrame* nativeFrameOut);
+
+    bool outputFrame(AVFrame* avFrameIn, AVFrame* avFrameOut, AVFrame* nativeFrameOut);
 
     bool imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut);
 };
@@ -544,6 +552,22 @@ class FFmpegFileManager {
     mutable FilesMap _files;
     mutable FFmpegFile::Mutex* _lock;
 
+    /// A file queued for opening by prefetch()
+    struct PendingFile {
+        void const* plugin;
+        std::string filename;
+        FFmpegFile* file;
+        bool started; //< a thread is opening the file
+        bool done; //< file is set (it may be NULL if opening failed)
+    };
+    typedef std::list<PendingFile*> PendingList;
+
+    mutable PendingList _pending; //< protected by _pendingMutex
+    mutable tthread::mutex _pendingMutex;
+    mutable tthread::condition_variable _pendingCond;
+    std::vector<tthread::thread*> _probeThreads;
+    bool _probeQuit; //< protected by _pendingMutex
+
 public:
     FFmpegFileManager();
 
@@ -555,6 +579,18 @@ public:
 
     FFmpegFile* get(void const* plugin, const std::string& filename) const;
     FFmpegFile* getOrCreate(void const* plugin, const std::string& filename) const;
+
+    /// Start opening the file in a background thread, so that a subsequent get() or getOrCreate() does not have to probe it.
+    void prefetch(void const* plugin, const std::string& filename);
+
+private:
+    static void probeThreadFunction(void* arg);
+
+    void probe();
+
+    /// Wait for the pending files of a plug-in instance (or only the given filename) and move them to _files.
+    /// With a filename, the files that no probe thread has started are opened by the calling thread.
+    void collectPending(void const* plugin, const std::string* filename) const;
 };
 
 #endif /* defined(__Io__FFmpegHandler__) */
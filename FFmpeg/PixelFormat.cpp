@@ -19,6 +19,9 @@
 
 #include "PixelFormat.h"
 
+#include <algorithm>
+#include <vector>
+
 extern "C" {
 #include <libavutil/pixdesc.h>
 }
@@ -26,8 +29,10 @@ extern "C" {
 namespace OFX {
 namespace FFmpeg {
 
-    bool
-    pixelFormatIsYUV(AVPixelFormat pix_fmt)
+    // The pixel format properties are computed once for each pixel format, and
+    // stored in a table indexed by the AVPixelFormat value, see PixelFormatTable below.
+    static bool
+    computePixelFormatIsYUV(AVPixelFormat pix_fmt)
     {
         // from swscale_internal.h
         const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
@@ -35,16 +40,16 @@ namespace FFmpeg {
         return desc && !(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->nb_components >= 2;
     }
 
-    bool
-    pixelFormatAlpha(AVPixelFormat pix_fmt)
+    static bool
+    computePixelFormatAlpha(AVPixelFormat pix_fmt)
     {
         const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
 
         return desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA);
     }
 
-    int
-    pixelFormatBPP(const AVPixelFormat pixelFormat)
+    static int
+    computePixelFormatBPP(const AVPixelFormat pixelFormat)
     {
 #if 1
         const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixelFormat);
@@ -555,13 +560,12 @@ namespace FFmpeg {
             break;
         } // switch
 #endif
-    } // WriteFFmpegPlugin::pixelFormatBPP
+    } // computePixelFormatBPP
 
     // av_get_bits_per_sample knows about surprisingly few codecs.
     // We have to do this manually.
-    /*static*/
-    int
-    pixelFormatBitDepth(const AVPixelFormat pixelFormat)
+    static int
+    computePixelFormatBitDepth(const AVPixelFormat pixelFormat)
     {
         switch (pixelFormat) {
         case AV_PIX_FMT_NONE:
@@ -1099,10 +1103,10 @@ namespace FFmpeg {
             return 0;
         } // switch
 
-    } // WriteFFmpegPlugin::pixelFormatBitDepth
+    } // computePixelFormatBitDepth
 
-    PixelCodingEnum
-    pixelFormatCoding(const AVPixelFormat pixelFormat)
+    static PixelCodingEnum
+    computePixelFormatCoding(const AVPixelFormat pixelFormat)
     {
         switch (pixelFormat) {
         case AV_PIX_FMT_NONE:
@@ -1641,7 +1645,106 @@ namespace FFmpeg {
             return ePixelCodingNone;
         } // switch
 
-    } // pixelFormatCoding
+    } // computePixelFormatCoding
+
+    namespace {
+        struct PixelFormatInfo {
+            PixelFormatInfo()
+                : coding(ePixelCodingNone)
+                , bitDepth(0)
+                , bpp(0)
+                , alpha(false)
+                , yuv(false)
+            {
+            }
+
+            explicit PixelFormatInfo(AVPixelFormat pixelFormat)
+                : coding(computePixelFormatCoding(pixelFormat))
+                , bitDepth(computePixelFormatBitDepth(pixelFormat))
+                , bpp(computePixelFormatBPP(pixelFormat))
+                , alpha(computePixelFormatAlpha(pixelFormat))
+                , yuv(computePixelFormatIsYUV(pixelFormat))
+            {
+            }
+
+            PixelCodingEnum coding;
+            int bitDepth;
+            int bpp;
+            bool alpha;
+            bool yuv;
+        };
+
+        // The properties of all the pixel formats known by the libavutil we are running with.
+        // The number of pixel formats is not AV_PIX_FMT_NB, which is the number of formats
+        // in the headers we were compiled with.
+        class PixelFormatTable {
+        public:
+            PixelFormatTable()
+            {
+                int maxPixelFormat = -1;
+                const AVPixFmtDescriptor* desc = nullptr;
+                while ((desc = av_pix_fmt_desc_next(desc))) {
+                    maxPixelFormat = (std::max)(maxPixelFormat, (int)av_pix_fmt_desc_get_id(desc));
+                }
+                _infos.reserve(maxPixelFormat + 1);
+                for (int i = 0; i <= maxPixelFormat; ++i) {
+                    _infos.push_back(PixelFormatInfo((AVPixelFormat)i));
+                }
+            }
+
+            const PixelFormatInfo& get(AVPixelFormat pixelFormat) const
+            {
+                if ((pixelFormat < 0) || ((std::size_t)pixelFormat >= _infos.size())) {
+                    return _none;
+                }
+
+                return _infos[pixelFormat];
+            }
+
+        private:
+            std::vector<PixelFormatInfo> _infos;
+            PixelFormatInfo _none;
+        };
+
+        const PixelFormatInfo&
+        pixelFormatInfo(AVPixelFormat pixelFormat)
+        {
+            // built on first use, which is thread-safe in C++11
+            static const PixelFormatTable table;
+
+            return table.get(pixelFormat);
+        }
+    }
+
+    bool
+    pixelFormatIsYUV(AVPixelFormat pixelFormat)
+    {
+        return pixelFormatInfo(pixelFormat).yuv;
+    }
+
+    bool
+    pixelFormatAlpha(AVPixelFormat pixelFormat)
+    {
+        return pixelFormatInfo(pixelFormat).alpha;
+    }
+
+    int
+    pixelFormatBPP(AVPixelFormat pixelFormat)
+    {
+        return pixelFormatInfo(pixelFormat).bpp;
+    }
+
+    int
+    pixelFormatBitDepth(AVPixelFormat pixelFormat)
+    {
+        return pixelFormatInfo(pixelFormat).bitDepth;
+    }
+
+    PixelCodingEnum
+    pixelFormatCoding(AVPixelFormat pixelFormat)
+    {
+        return pixelFormatInfo(pixelFormat).coding;
+    }
 
     int
     pixelFormatBPPFromSpec(PixelCodingEnum coding, int bitdepth, bool alpha)
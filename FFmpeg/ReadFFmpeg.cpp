@@ -42,6 +42,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <sstream>
 #ifdef DEBUG
 #include <cstdio>
@@ -57,6 +58,10 @@
 #include "GenericReader.h"
 #include "ofxsCopier.h"
 
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 0, 0)
 #error "This requires FFmpeg >= 4.0"
 #endif
@@ -93,6 +98,21 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamFirstTrackOnly "firstTrackOnly"
 #define kParamFirstTrackOnlyLabelAndHint "First Track Only", "Causes the reader to ignore all but the first video track it finds in the file. This should be selected in a multiview project if the file happens to contain multiple video tracks that don't correspond to different views."
 
+#define kParamOutputMode "outputMode"
+#define kParamOutputModeLabel "Output Mode"
+#define kParamOutputModeHint                                                                                                                      \
+    "What is written to the output channels when the video is stored as Y'CbCr, which is the case for most codecs. RGB videos are always output as RGB.\n" \
+    "The Y'CbCr and Luma modes read the planes output by the decoder, and skip the conversion to RGB, which is much faster. The values are normalized " \
+    "according to the video range (limited or full), with Cb and Cr centered on 0.5. The File Colorspace should be set to raw or linear in these modes."
+#define kParamOutputModeOptionRGB "RGB", "Convert to RGB using the color matrix of the video.", "rgb"
+#define kParamOutputModeOptionYCbCr "Y'CbCr", "Output Y', Cb and Cr in the red, green and blue channels. Subsampled chroma is replicated.", "ycbcr"
+#define kParamOutputModeOptionLuma "Luma", "Output Y' in the red, green and blue channels. This is the fastest mode, and is suitable for analysis.", "luma"
+enum OutputModeEnum {
+    eOutputModeRGB = 0,
+    eOutputModeYCbCr,
+    eOutputModeLuma,
+};
+
 #define kParamLibraryInfo "libraryInfo"
 #define kParamLibraryInfoLabel "FFmpeg Info...", "Display information about the underlying library."
 
@@ -106,6 +126,7 @@ class ReadFFmpegPlugin
     : public GenericReaderPlugin {
     FFmpegFileManager& _manager;
     BooleanParam* _firstTrackOnly;
+    ChoiceParam* _outputMode;
 
 public:
     ReadFFmpegPlugin(FFmpegFileManager& manager, OfxImageEffectHandle handle, const vector<string>& extensions);
@@ -152,17 +173,190 @@ private:
     virtual bool getSequenceTimeDomain(const string& filename, OfxRangeI& range) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, int view, OfxRectI* bounds, OfxRectI* format, double* par, string* error, int* tile_width, int* tile_height) OVERRIDE FINAL;
     virtual bool getFrameRate(const string& filename, double* fps) const OVERRIDE FINAL;
+
+    bool decodeYCbCr(FFmpegFile* file, OfxTime time, bool lumaOnly, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int rowBytes);
 };
 
+// Converts a planar or semi-planar Y'CbCr frame, as output by the decoder, to float.
+// Values are normalized using the video range, without any color matrix.
+template <typename SRCPIX, int nDstComp>
+class YCbCrConverterProcessor
+    : public PixelProcessor {
+    const AVFrame* _srcFrame;
+    const AVPixFmtDescriptor* _desc;
+    bool _lumaOnly;
+    float _scale[4]; // per-component normalization: value * _scale + _offset
+    float _offset[4];
+
+public:
+    YCbCrConverterProcessor(ImageEffect& instance)
+        : PixelProcessor(instance)
+        , _srcFrame(NULL)
+        , _desc(NULL)
+        , _lumaOnly(false)
+    {
+        for (int c = 0; c < 4; ++c) {
+            _scale[c] = 1.f;
+            _offset[c] = 0.f;
+        }
+    }
+
+    void setValues(const AVFrame* srcFrame,
+                   const AVPixFmtDescriptor* desc,
+                   bool lumaOnly)
+    {
+        _srcFrame = srcFrame;
+        _desc = desc;
+        _lumaOnly = lumaOnly;
+
+        const bool fullRange = (srcFrame->color_range == AVCOL_RANGE_JPEG);
+        for (int c = 0; c < desc->nb_components && c < 4; ++c) {
+            const int depth = desc->comp[c].depth;
+            const float maxValue = (float)((1 << depth) - 1);
+            if ( fullRange || (c == 3) ) {
+                // alpha is always full range
+                _scale[c] = 1.f / maxValue;
+                _offset[c] = 0.f;
+            } else if (c == 0) {
+                // Y' in [16,235] for 8 bits
+                _scale[c] = 1.f / (219 << (depth - 8));
+                _offset[c] = -(float)(16 << (depth - 8)) * _scale[c];
+            } else {
+                // Cb and Cr in [16,240] for 8 bits, centered on 128
+                _scale[c] = 1.f / (224 << (depth - 8));
+                _offset[c] = 0.5f - (float)(128 << (depth - 8)) * _scale[c];
+            }
+        }
+    }
+
+private:
+    // pointer to the first sample of component c on row y of the frame
+    const uint8_t* componentRow(int c,
+                                int y) const
+    {
+        const AVComponentDescriptor& comp = _desc->comp[c];
+        const int rowShift = (c == 1 || c == 2) ? _desc->log2_chroma_h : 0;
+
+        return _srcFrame->data[comp.plane] + (std::ptrdiff_t)(y >> rowShift) * _srcFrame->linesize[comp.plane] + comp.offset;
+    }
+
+    virtual void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        const int nComps = _desc->nb_components;
+        const bool hasAlpha = (_desc->flags & AV_PIX_FMT_FLAG_ALPHA) && nComps == 4;
+        const int log2ChromaW = _desc->log2_chroma_w;
+
+        for (int dsty = procWindow.y1; dsty < procWindow.y2; ++dsty) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            // frames are stored top-down
+            const int srcY = _dstBounds.y2 - dsty - 1;
+            if ( (srcY < 0) || (srcY >= _srcFrame->height) ) {
+                continue;
+            }
+            float* dstPix = (float*)getDstPixelAddress(procWindow.x1, dsty);
+            assert(dstPix);
+
+            const uint8_t* y = componentRow(0, srcY);
+            const uint8_t* cb = componentRow(1, srcY);
+            const uint8_t* cr = componentRow(2, srcY);
+            const uint8_t* a = hasAlpha ? componentRow(3, srcY) : NULL;
+            const int yStep = _desc->comp[0].step;
+            const int cbStep = _desc->comp[1].step;
+            const int crStep = _desc->comp[2].step;
+            const int aStep = hasAlpha ? _desc->comp[3].step : 0;
+            const int x2 = (std::min)(procWindow.x2, _srcFrame->width);
+
+            for (int x = procWindow.x1; x < x2; ++x, dstPix += nDstComp) {
+                const float luma = (*(const SRCPIX*)(y + x * yStep) >> _desc->comp[0].shift) * _scale[0] + _offset[0];
+                if (nDstComp >= 3) {
+                    if (_lumaOnly) {
+                        dstPix[0] = dstPix[1] = dstPix[2] = luma;
+                    } else {
+                        const int xc = x >> log2ChromaW;
+                        dstPix[0] = luma;
+                        dstPix[1] = (*(const SRCPIX*)(cb + xc * cbStep) >> _desc->comp[1].shift) * _scale[1] + _offset[1];
+                        dstPix[2] = (*(const SRCPIX*)(cr + xc * crStep) >> _desc->comp[2].shift) * _scale[2] + _offset[2];
+                    }
+                }
+                if (nDstComp == 4) {
+                    dstPix[3] = hasAlpha ? ((*(const SRCPIX*)(a + x * aStep) >> _desc->comp[3].shift) * _scale[3] + _offset[3]) : 1.f;
+                }
+            }
+        }
+    } // multiThreadProcessImages
+};
+
+template <typename SRCPIX>
+static void
+convertYCbCrForDstNComps(ImageEffect* effect,
+                         const AVFrame* srcFrame,
+                         const AVPixFmtDescriptor* desc,
+                         bool lumaOnly,
+                         const OfxRectI& renderWindow,
+                         const OfxPointD& renderScale,
+                         float* dstPixelData,
+                         const OfxRectI& dstBounds,
+                         PixelComponentEnum dstPixelComponents,
+                         int dstRowBytes)
+{
+    if (dstPixelComponents == ePixelComponentRGBA) {
+        YCbCrConverterProcessor<SRCPIX, 4> p(*effect);
+        p.setValues(srcFrame, desc, lumaOnly);
+        p.setDstImg(dstPixelData, dstBounds, dstPixelComponents, 4, eBitDepthFloat, dstRowBytes);
+        p.setRenderWindow(renderWindow, renderScale);
+        p.process();
+    } else {
+        assert(dstPixelComponents == ePixelComponentRGB);
+        YCbCrConverterProcessor<SRCPIX, 3> p(*effect);
+        p.setValues(srcFrame, desc, lumaOnly);
+        p.setDstImg(dstPixelData, dstBounds, dstPixelComponents, 3, eBitDepthFloat, dstRowBytes);
+        p.setRenderWindow(renderWindow, renderScale);
+        p.process();
+    }
+}
+
+// true if the samples of this pixel format can be read directly by YCbCrConverterProcessor
+static bool
+canConvertYCbCr(const AVPixFmtDescriptor* desc)
+{
+    if ( !desc || (desc->nb_components < 3) ||
+         ( desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL) ) ) {
+        return false;
+    }
+#ifdef AV_PIX_FMT_FLAG_FLOAT
+    if (desc->flags & AV_PIX_FMT_FLAG_FLOAT) {
+        return false;
+    }
+#endif
+    const int depth = desc->comp[0].depth;
+    const int sampleSize = (depth > 8) ? 2 : 1;
+    for (int c = 0; c < desc->nb_components; ++c) {
+        const AVComponentDescriptor& comp = desc->comp[c];
+        // all components must be stored in samples of the same size, e.g. no packed 10-bit formats
+        if ( (comp.depth < 8) || (comp.depth > 16) || ( (comp.depth > 8) != (depth > 8) ) ||
+             (comp.step % sampleSize) || (comp.offset % sampleSize) || (comp.shift + comp.depth > sampleSize * 8) ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
                                    OfxImageEffectHandle handle,
                                    const vector<string>& extensions)
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
     , _manager(manager)
     , _firstTrackOnly(NULL)
+    , _outputMode(NULL)
 {
     _firstTrackOnly = fetchBooleanParam(kParamFirstTrackOnly);
-    assert(_firstTrackOnly);
+    _outputMode = fetchChoiceParam(kParamOutputMode);
+    assert(_firstTrackOnly && _outputMode);
     int originalFrameRangeMin, originalFrameRangeMax;
     _originalFrameRange->getValue(originalFrameRangeMin, originalFrameRangeMax);
     if (originalFrameRangeMin == 0) {
@@ -189,7 +383,12 @@ void
 ReadFFmpegPlugin::restoreStateFromParams()
 {
     GenericReaderPlugin::restoreStateFromParams();
-    //_manager.getOrCreate(this, filename);
+    // Probe the file in the background: when a project with many readers is loaded,
+    // this is called for each instance before the first getFrameBounds() or getSequenceTimeDomain(),
+    // which will then wait for the file to be opened.
+    string filename;
+    _fileParam->getValue(filename);
+    _manager.prefetch(this, filename);
 }
 
 bool
@@ -383,6 +582,14 @@ ReadFFmpegPlugin::decode(const string& filename,
         return;
     }
 
+    const OutputModeEnum outputMode = (OutputModeEnum)_outputMode->getValueAtTime(time);
+    if ( (outputMode != eOutputModeRGB) && (pixelComponents != ePixelComponentAlpha) && file->isYUV() ) {
+        if ( decodeYCbCr(file, time, outputMode == eOutputModeLuma, renderWindow, renderScale, pixelData, imgBounds, pixelComponents, rowBytes) ) {
+            return;
+        }
+        // else the pixel format cannot be read directly, convert it to RGB
+    }
+
     // not in FFmpeg Reader: initialize the output buffer
     // TODO: use avpicture_get_size? see WriteFFmpeg
     unsigned int numComponents = file->getNumberOfComponents();
@@ -430,6 +637,71 @@ ReadFFmpegPlugin::decode(const string& filename,
     convertDepthAndComponents(buffer, renderWindow, renderScale, imgBounds, numComponents == 3 ? ePixelComponentRGB : ePixelComponentRGBA, sizeOfData == sizeof(unsigned char) ? eBitDepthUByte : eBitDepthUShort, srcRowBytes, pixelData, imgBounds, pixelComponents, rowBytes);
 } // ReadFFmpegPlugin::decode
 
+// Decode a frame without converting it to RGB, and write its Y'CbCr or luma
+// components to pixelData.
+// Returns false if the pixel format of the decoded frame is not supported, in
+// which case the frame should be decoded as RGB. Errors are reported using
+// exceptions, as in decode().
+bool
+ReadFFmpegPlugin::decodeYCbCr(FFmpegFile* file,
+                              OfxTime time,
+                              bool lumaOnly,
+                              const OfxRectI& renderWindow,
+                              const OfxPointD& renderScale,
+                              float* pixelData,
+                              const OfxRectI& imgBounds,
+                              PixelComponentEnum pixelComponents,
+                              int rowBytes)
+{
+    AVFrame* avFrame = av_frame_alloc();
+    if (!avFrame) {
+        throwSuiteStatusException(kOfxStatErrMemory);
+
+        return true;
+    }
+
+    bool decoded = false;
+    try {
+        decoded = file->decodeNative(this, (int)time, loadNearestFrame(), avFrame);
+    } catch (const std::exception& e) {
+        av_frame_free(&avFrame);
+        int choice;
+        _missingFrameParam->getValue(choice);
+        if (choice == 1) { // error
+            setPersistentMessage(Message::eMessageError, "", e.what());
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+
+        return true;
+    }
+    if (!decoded) {
+        av_frame_free(&avFrame);
+        if (abort()) {
+            // decode() probably existed because plugin was aborted
+            return true;
+        }
+        setPersistentMessage(Message::eMessageError, "", file->getError());
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return true;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)avFrame->format);
+    if ( !canConvertYCbCr(desc) ) {
+        av_frame_free(&avFrame);
+
+        return false;
+    }
+    if (desc->comp[0].depth > 8) {
+        convertYCbCrForDstNComps<unsigned short>(this, avFrame, desc, lumaOnly, renderWindow, renderScale, pixelData, imgBounds, pixelComponents, rowBytes);
+    } else {
+        convertYCbCrForDstNComps<unsigned char>(this, avFrame, desc, lumaOnly, renderWindow, renderScale, pixelData, imgBounds, pixelComponents, rowBytes);
+    }
+    av_frame_free(&avFrame);
+
+    return true;
+} // ReadFFmpegPlugin::decodeYCbCr
+
 bool
 ReadFFmpegPlugin::getSequenceTimeDomain(const string& filename,
                                         OfxRangeI& range)
@@ -949,6 +1221,23 @@ ReadFFmpegPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamOutputMode);
+        param->setLabel(kParamOutputModeLabel);
+        param->setHint(kParamOutputModeHint);
+        assert(param->getNOptions() == eOutputModeRGB);
+        param->appendOption(kParamOutputModeOptionRGB);
+        assert(param->getNOptions() == eOutputModeYCbCr);
+        param->appendOption(kParamOutputModeOptionYCbCr);
+        assert(param->getNOptions() == eOutputModeLuma);
+        param->appendOption(kParamOutputModeOptionLuma);
+        param->setDefault(eOutputModeRGB);
+        param->setAnimates(false);
+        param->setLayoutHint(eLayoutHintDivider);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamLibraryInfo);
         param->setLabelAndHint(kParamLibraryInfoLabel);
@@ -0,0 +1,223 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#include "SwsSlicedContext.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+
+// Slices are aligned on this number of rows, which is a multiple of the period of the ordered dither used by libswscale.
+#define kSwsSliceAlignment 16
+// Do not create slices smaller than this number of rows.
+#define kSwsSliceMinHeight 64
+
+namespace OFX {
+namespace FFmpeg {
+
+    namespace {
+        // true if rows of this pixel format can be converted independently from each other
+        bool
+        canSlicePixelFormat(AVPixelFormat pixelFormat)
+        {
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixelFormat);
+            if (!desc || desc->log2_chroma_h ||
+                (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL))) {
+                return false;
+            }
+            for (int c = 0; c < desc->nb_components; ++c) {
+                // libswscale uses error diffusion dithering for low bit depths
+                if (desc->comp[c].depth < 8) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        class SwsSliceProcessor
+            : public MultiThread::Processor {
+        public:
+            SwsSliceProcessor(const SwsSlicedContext& context,
+                              const uint8_t* const src[],
+                              const int srcStride[],
+                              uint8_t* const dst[],
+                              const int dstStride[])
+                : _context(context)
+                , _src(src)
+                , _srcStride(srcStride)
+                , _dst(dst)
+                , _dstStride(dstStride)
+            {
+            }
+
+        private:
+            virtual void multiThreadFunction(unsigned int threadID,
+                                             unsigned int nThreads) OVERRIDE FINAL
+            {
+                for (int i = (int)threadID; i < _context.getNumSlices(); i += (int)nThreads) {
+                    _context.scaleSlice(i, _src, _srcStride, _dst, _dstStride);
+                }
+            }
+
+            const SwsSlicedContext& _context;
+            const uint8_t* const* _src;
+            const int* _srcStride;
+            uint8_t* const* _dst;
+            const int* _dstStride;
+        };
+    }
+
+    SwsSlicedContext::SwsSlicedContext()
+        : _slices()
+        , _srcPlanes(0)
+        , _dstPlanes(0)
+    {
+    }
+
+    SwsSlicedContext::~SwsSlicedContext()
+    {
+        reset();
+    }
+
+    void
+    SwsSlicedContext::reset()
+    {
+        for (std::vector<Slice>::iterator it = _slices.begin(); it != _slices.end(); ++it) {
+            sws_freeContext(it->context);
+        }
+        _slices.clear();
+    }
+
+    bool
+    SwsSlicedContext::init(int srcWidth,
+                           int srcHeight,
+                           AVPixelFormat srcFormat,
+                           int dstWidth,
+                           int dstHeight,
+                           AVPixelFormat dstFormat,
+                           int flags)
+    {
+        reset();
+        _srcPlanes = av_pix_fmt_count_planes(srcFormat);
+        _dstPlanes = av_pix_fmt_count_planes(dstFormat);
+
+        int nSlices = 1;
+        if ((srcHeight == dstHeight) && canSlicePixelFormat(srcFormat) && canSlicePixelFormat(dstFormat)) {
+            nSlices = (std::min)((int)MultiThread::getNumCPUs(), srcHeight / kSwsSliceMinHeight);
+            nSlices = (std::max)(1, nSlices);
+        }
+
+        // slice boundaries, aligned on kSwsSliceAlignment rows
+        int y = 0;
+        for (int i = 0; i < nSlices && y < srcHeight; ++i) {
+            int y2 = (i == nSlices - 1) ? srcHeight : (int)(((int64_t)srcHeight * (i + 1)) / nSlices);
+            y2 = (std::min)(srcHeight, (y2 + kSwsSliceAlignment - 1) / kSwsSliceAlignment * kSwsSliceAlignment);
+            if (y2 <= y) {
+                continue;
+            }
+            Slice slice;
+            slice.y = y;
+            slice.height = y2 - y;
+            slice.context = sws_getContext(srcWidth, (nSlices == 1) ? srcHeight : slice.height, srcFormat,
+                                           dstWidth, (nSlices == 1) ? dstHeight : slice.height, dstFormat,
+                                           flags, nullptr, nullptr, nullptr);
+            if (!slice.context) {
+                reset();
+
+                return false;
+            }
+            _slices.push_back(slice);
+            y = y2;
+        }
+
+        return !_slices.empty();
+    } // SwsSlicedContext::init
+
+    int
+    SwsSlicedContext::setColorspaceDetails(const int invTable[4],
+                                           int srcRange,
+                                           const int table[4],
+                                           int dstRange,
+                                           int brightness,
+                                           int contrast,
+                                           int saturation)
+    {
+        int ret = 0;
+        for (std::vector<Slice>::iterator it = _slices.begin(); it != _slices.end(); ++it) {
+            int r = sws_setColorspaceDetails(it->context, invTable, srcRange, table, dstRange, brightness, contrast, saturation);
+            if (r < 0) {
+                ret = r;
+            }
+        }
+
+        return ret;
+    }
+
+    void
+    SwsSlicedContext::scaleSlice(int i,
+                                 const uint8_t* const src[],
+                                 const int srcStride[],
+                                 uint8_t* const dst[],
+                                 const int dstStride[]) const
+    {
+        assert(i >= 0 && i < (int)_slices.size());
+        const Slice& slice = _slices[i];
+        if (_slices.size() == 1) {
+            sws_scale(slice.context, src, srcStride, 0, slice.height, dst, dstStride);
+
+            return;
+        }
+
+        // there is no vertical chroma subsampling, so all planes start at row slice.y
+        const uint8_t* srcSlice[4] = { nullptr, nullptr, nullptr, nullptr };
+        uint8_t* dstSlice[4] = { nullptr, nullptr, nullptr, nullptr };
+        for (int p = 0; p < _srcPlanes && p < 4; ++p) {
+            srcSlice[p] = src[p] ? src[p] + (std::ptrdiff_t)slice.y * srcStride[p] : nullptr;
+        }
+        for (int p = 0; p < _dstPlanes && p < 4; ++p) {
+            dstSlice[p] = dst[p] ? dst[p] + (std::ptrdiff_t)slice.y * dstStride[p] : nullptr;
+        }
+        sws_scale(slice.context, srcSlice, srcStride, 0, slice.height, dstSlice, dstStride);
+    }
+
+    void
+    SwsSlicedContext::scale(const uint8_t* const src[],
+                            const int srcStride[],
+                            uint8_t* const dst[],
+                            const int dstStride[])
+    {
+        assert(!_slices.empty());
+        if (_slices.size() == 1) {
+            scaleSlice(0, src, srcStride, dst, dstStride);
+
+            return;
+        }
+        SwsSliceProcessor processor(*this, src, srcStride, dst, dstStride);
+        processor.multiThread((unsigned int)_slices.size());
+    }
+}
+}
@@ -0,0 +1,92 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef SwsSlicedContext_h
+#define SwsSlicedContext_h
+
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+namespace OFX {
+namespace FFmpeg {
+
+    /**
+     * @brief A drop-in replacement for a SwsContext which converts horizontal bands
+     * of the image in parallel, on the host multithread suite.
+     *
+     * Each band has its own SwsContext, which converts it as if it were a whole image.
+     * The image is only split when this gives the same result as converting it at once:
+     * no vertical scaling, no vertical chroma subsampling in the source or destination
+     * formats, and bands aligned on the ordered dither period.
+     * Otherwise, a single SwsContext converts the whole image.
+     **/
+    class SwsSlicedContext {
+    public:
+        SwsSlicedContext();
+
+        ~SwsSlicedContext();
+
+        // Create the SwsContexts, see sws_getContext(). Returns false if they could not be created.
+        bool init(int srcWidth, int srcHeight, AVPixelFormat srcFormat,
+                  int dstWidth, int dstHeight, AVPixelFormat dstFormat,
+                  int flags);
+
+        // Set the colorspace conversion of all SwsContexts, see sws_setColorspaceDetails().
+        int setColorspaceDetails(const int invTable[4], int srcRange,
+                                 const int table[4], int dstRange,
+                                 int brightness, int contrast, int saturation);
+
+        // Convert a whole image, see sws_scale().
+        void scale(const uint8_t* const src[], const int srcStride[],
+                   uint8_t* const dst[], const int dstStride[]);
+
+        bool isValid() const { return !_slices.empty(); }
+
+        int getNumSlices() const { return (int)_slices.size(); }
+
+        // Free all SwsContexts.
+        void reset();
+
+        // Convert slice i. Called by scale() from the threads of the multithread suite.
+        void scaleSlice(int i,
+                        const uint8_t* const src[], const int srcStride[],
+                        uint8_t* const dst[], const int dstStride[]) const;
+
+    private:
+        SwsSlicedContext(const SwsSlicedContext&);
+        SwsSlicedContext& operator=(const SwsSlicedContext&);
+
+        struct Slice {
+            SwsContext* context;
+            int y; // first row of the slice in the source and destination images
+            int height;
+        };
+
+        std::vector<Slice> _slices;
+        int _srcPlanes;
+        int _dstPlanes;
+    };
+}
+}
+
+#endif /* defined(SwsSlicedContext_h) */
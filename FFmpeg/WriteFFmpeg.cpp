@@ -38,10 +38,12 @@
 
 #include <algorithm>
 #include <cctype> // ::tolower
+#include <chrono>
 #include <cfloat> // DBL_MAX
 #include <climits> // INT_MAX
 #include <cstdio>
 #include <cstring> // strncpy
+#include <memory>
 #include <sstream>
 #include <string>
 #ifdef DEBUG
@@ -73,6 +75,7 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 }
 #include "IOUtility.h"
@@ -85,6 +88,7 @@ extern "C" {
 #include "FFmpegFile.h"
 #include "GenericWriter.h"
 #include "PixelFormat.h"
+#include "SwsSlicedContext.h"
 
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 0, 0)
 #error "This requires FFmpeg >= 4.0"
@@ -95,6 +99,11 @@ extern "C" {
 #define OFX_FFMPEG_TIMECODE 0 // timecode support
 #define OFX_FFMPEG_AUDIO 0 // audio support
 #define OFX_FFMPEG_MBDECISION 0 // add the macroblock decision parameter
+#define OFX_FFMPEG_REORDER_BUFFER_MB 1024 // maximum memory used by converted frames waiting for the previous frames to be encoded
+#define OFX_FFMPEG_TWO_PASS_SPOOL_MB 65536 // maximum disk space used by the frames stored by the first pass of two-pass encoding
+#define OFX_FFMPEG_MAX_ENCODER_THREADS 64 // MAX_THREADS in libavcodec/frame_thread_encoder.c, maximum value of the Max Threads parameter
+#define OFX_FFMPEG_FRAME_ALIGN 32 // byte alignment of the frame buffers, as in av_image_alloc() calls
+#define OFX_FFMPEG_FRAME_PADDING 64 // extra bytes at the end of the frame buffers, AV_INPUT_BUFFER_PADDING_SIZE in recent FFmpeg versions
 
 #if OFX_FFMPEG_PRINT_CODECS
 #include <iostream>
@@ -330,6 +339,25 @@ enum X26xSpeedEnum {
     "Option -bt in ffmpeg (multiplied by 1000000)."
 #define kParamBitrateToleranceMax ((int)(INT_MAX / 1000000)) // tol*1000000 is stored in an int
 
+#define kParamSegmentLength "segmentLength"
+#define kParamSegmentLengthLabel "Segment Length"
+#define kParamSegmentLengthHint                                                                                                                                         \
+    "Only for intra-only codecs (e.g. ProRes, DNxHD, MJPEG, FFV1). If not 0, the movie is encoded as independent segments of this number of frames, and the segments " \
+    "are encoded at the same time when the host renders several frames in parallel. Each segment is written to a temporary file next to the output file, and the "    \
+    "segments are concatenated into the output file at the end of the render, without re-encoding.\n"                                                                  \
+    "0 means that the frames are encoded sequentially into the output file."
+
+#define kParamTwoPass "twoPass"
+#define kParamTwoPassLabel "Two-Pass Encoding"
+#define kParamTwoPassHint                                                                                                                                               \
+    "Encode in two passes to reach the target bitrate more accurately, with a better distribution of the bits across the sequence. Only used when the bitrate is "      \
+    "used, i.e. if Output Quality is None and Global Quality is -1, and only available for the encoders which support it (e.g. libx264, libx265, libvpx, mpeg4).\n"    \
+    "During the render, the frames are analyzed by a first pass, and stored uncompressed next to the output file, in the pixel format of the encoder (about 3MB "     \
+    "per 1080p frame in yuv420p). The render fails if they would take more than 64GB. The second pass needs the statistics of all the frames, so it encodes the "    \
+    "stored frames at the end of the render. If the render is aborted, it fails, the stored frames are removed, and the movie is not finalized. The duration of "   \
+    "each pass is reported in a message at the end of the render.\n"                                                                                                  \
+    "Options -pass 1 and -pass 2 in ffmpeg."
+
 #define kParamQuality "quality"
 #define kParamQualityLabel "Quality"
 #define kParamQualityHint                                                                                 \
@@ -363,6 +391,29 @@ enum X26xSpeedEnum {
 #define kParamWriteNCLCHint \
     "Write nclc data in the colr atom of the video header. QuickTime only."
 
+#define kParamThreadType "threadType"
+#define kParamThreadTypeLabel "Threading"
+#define kParamThreadTypeHint                                                                                                                                        \
+    "How the encoder uses multiple threads. Only supported by certain codecs.\n"                                                                                    \
+    "Slice threading encodes several parts of each frame in parallel, and does not add any delay. Frame threading encodes several frames in parallel, at the " \
+    "expense of memory and of a delay of one frame per thread. Which one is faster depends on the codec and on the machine.\n"                                  \
+    "Option -thread_type in ffmpeg."
+#define kParamThreadTypeOptionAuto "Auto", "Use slice threading if the codec supports it, else let the codec choose. This is the behaviour of previous versions.", "auto"
+#define kParamThreadTypeOptionSlice "Slice", "Encode several slices of each frame in parallel.", "slice"
+#define kParamThreadTypeOptionFrame "Frame", "Encode several frames in parallel, if the codec supports it.", "frame"
+enum ThreadTypeEnum {
+    eThreadTypeAuto = 0,
+    eThreadTypeSlice,
+    eThreadTypeFrame,
+};
+
+#define kParamThreads "threads"
+#define kParamThreadsLabel "Max Threads"
+#define kParamThreadsHint                                                                                                                                                               \
+    "Maximum number of threads used by the encoder. 0 means to use the codec default if it manages its own threads (e.g. libx264, libx265), else the number of CPUs, limited to " \
+    "16. Higher values are passed to the encoder, up to 64.\n"                                                                                                                    \
+    "Option -threads in ffmpeg."
+
 #define kParamLibraryInfo "libraryInfo"
 #define kParamLibraryInfoLabel "FFmpeg Info...", "Display information about the underlying library."
 
@@ -981,8 +1032,439 @@ MyAVFrame::deallocateAVFrameData()
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// FrameConverter
+// Convert the float RGB(A) image from the host to an AVFrame, by bands of rows
+// on the host multithread suite.
+// * Packed RGB24, RGBA, RGB48 and RGBA64 frames are converted to the pixel
+//   format of the encoder by sws_scale afterwards.
+// * Planar RGB and YUV frames (e.g. GBRP10, YUV422P10, YUVA444P10) are written
+//   directly in the pixel format of the encoder, applying the RGB to YUV
+//   matrix and the chroma subsampling on the fly, so that sws_scale can be
+//   skipped.
+// The inner loops work on rows of floats, so that the compiler can vectorize them.
+//
+class FrameConverter
+    : public MultiThread::Processor {
+public:
+    FrameConverter(const float* pixelData,
+                   int width,
+                   int height,
+                   int pixelDataNComps,
+                   int rowBytes,
+                   bool hasAlpha,
+                   AVFrame* avFrame)
+        : _pixelData(pixelData)
+        , _width(width)
+        , _height(height)
+        , _pixelDataNComps(pixelDataNComps)
+        , _rowBytes(rowBytes)
+        , _hasAlpha(hasAlpha)
+        , _avFrame(avFrame)
+        , _desc(av_pix_fmt_desc_get((AVPixelFormat)avFrame->format))
+        , _kr(0.2126f)
+        , _kb(0.0722f)
+        , _fullRange(false)
+    {
+        assert(_desc);
+    }
+
+    // Set the RGB to YUV conversion: Rec.709 or Rec.601 matrix, full (0..255) or video (16..235) range.
+    void setYUVConversion(bool rec709,
+                          bool fullRange)
+    {
+        _kr = rec709 ? 0.2126f : 0.299f;
+        _kb = rec709 ? 0.0722f : 0.114f;
+        _fullRange = fullRange;
+    }
+
+    // Can frames in this pixel format be written directly, without sws_scale?
+    static bool canConvertDirectly(AVPixelFormat pixelFormat)
+    {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixelFormat);
+        if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+            (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM))) {
+            return false;
+        }
+#ifdef AV_PIX_FMT_FLAG_FLOAT
+        if (desc->flags & AV_PIX_FMT_FLAG_FLOAT) {
+            return false;
+        }
+#endif
+        if ((desc->nb_components < 3) || (desc->log2_chroma_w > 1) || (desc->log2_chroma_h > 1)) {
+            return false;
+        }
+        if ((desc->flags & AV_PIX_FMT_FLAG_RGB) && (desc->log2_chroma_w || desc->log2_chroma_h)) {
+            return false;
+        }
+        const int depth = desc->comp[0].depth;
+        if ((depth < 8) || (depth > 16)) {
+            return false;
+        }
+        if ((depth > 8) && (!(desc->flags & AV_PIX_FMT_FLAG_BE) != !AV_HAVE_BIGENDIAN)) {
+            return false; // not in native byte order
+        }
+        for (int c = 0; c < desc->nb_components; ++c) {
+            if ((desc->comp[c].depth != depth) || (desc->comp[c].shift != 0)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        if (_desc->flags & AV_PIX_FMT_FLAG_PLANAR) {
+            // split by groups of rows sharing the same chroma row
+            const int rowsPerGroup = 1 << _desc->log2_chroma_h;
+            const int nGroups = (_height + rowsPerGroup - 1) / rowsPerGroup;
+            const int g1 = (int)(((int64_t)nGroups * threadID) / nThreads);
+            const int g2 = (int)(((int64_t)nGroups * (threadID + 1)) / nThreads);
+            convertPlanar(g1, g2);
+        } else {
+            const int y1 = (int)(((int64_t)_height * threadID) / nThreads);
+            const int y2 = (int)(((int64_t)_height * (threadID + 1)) / nThreads);
+            convertPacked(y1, y2);
+        }
+    }
+
+    // the host image is bottom-up, the AVFrame is top-down
+    const float* srcRow(int y) const
+    {
+        return (const float*)((const char*)_pixelData + (_height - 1 - y) * (ptrdiff_t)_rowBytes);
+    }
+
+    // extract the components of row y, clamped to [0,1]
+    void fetchRow(int y,
+                  float* r,
+                  float* g,
+                  float* b,
+                  float* a) const
+    {
+        const float* src = srcRow(y);
+        const int n = _pixelDataNComps;
+        for (int x = 0; x < _width; ++x) {
+            r[x] = (std::max)(0.f, (std::min)(src[x * n + 0], 1.f));
+            g[x] = (std::max)(0.f, (std::min)(src[x * n + 1], 1.f));
+            b[x] = (std::max)(0.f, (std::min)(src[x * n + 2], 1.f));
+        }
+        if (_hasAlpha && (n == 4)) {
+            for (int x = 0; x < _width; ++x) {
+                a[x] = (std::max)(0.f, (std::min)(src[x * n + 3], 1.f));
+            }
+        } else {
+            std::fill(a, a + _width, 1.f);
+        }
+    }
+
+    // store v * scale + offset, rounded and clamped, to component c of row y
+    template <typename T>
+    void storeRow(int c,
+                  int y,
+                  const float* v,
+                  int n,
+                  float scale,
+                  float offset) const
+    {
+        const AVComponentDescriptor& comp = _desc->comp[c];
+        const float maxValue = (float)((1 << comp.depth) - 1);
+        uint8_t* dst = _avFrame->data[comp.plane] + y * (ptrdiff_t)_avFrame->linesize[comp.plane] + comp.offset;
+        const int step = comp.step / (int)sizeof(T);
+        T* d = (T*)dst;
+        for (int x = 0; x < n; ++x) {
+            const float q = v[x] * scale + offset + 0.5f;
+            d[x * step] = (T)((std::max)(0.f, (std::min)(q, maxValue)));
+        }
+    }
+
+    void store(int c,
+               int y,
+               const float* v,
+               int n,
+               float scale,
+               float offset) const
+    {
+        if (_desc->comp[c].depth > 8) {
+            storeRow<uint16_t>(c, y, v, n, scale, offset);
+        } else {
+            storeRow<uint8_t>(c, y, v, n, scale, offset);
+        }
+    }
+
+    void convertPlanar(int g1,
+                       int g2) const
+    {
+        const int depth = _desc->comp[0].depth;
+        const float maxValue = (float)((1 << depth) - 1);
+        const float unit = (float)(1 << (depth - 8)); // value of 1 in 8 bits
+        const bool isRGB = (_desc->flags & AV_PIX_FMT_FLAG_RGB) != 0;
+        const bool hasAlphaPlane = (_desc->nb_components == 4);
+        const int cw = _desc->log2_chroma_w;
+        const int ch = _desc->log2_chroma_h;
+        const int chromaWidth = (_width + (1 << cw) - 1) >> cw;
+        const float kg = 1.f - _kr - _kb;
+        const float scaleY = _fullRange ? maxValue : 219.f * unit;
+        const float offsetY = _fullRange ? 0.f : 16.f * unit;
+        const float scaleC = _fullRange ? maxValue : 224.f * unit;
+        const float offsetC = 128.f * unit;
+
+        vector<float> r(_width), g(_width), b(_width), a(_width), luma(_width);
+        vector<float> sumR(chromaWidth), sumG(chromaWidth), sumB(chromaWidth), count(chromaWidth);
+        vector<float> cb(chromaWidth), cr(chromaWidth);
+
+        for (int cy = g1; cy < g2; ++cy) {
+            const int y1 = cy << ch;
+            const int y2 = (std::min)(_height, (cy + 1) << ch);
+            std::fill(sumR.begin(), sumR.end(), 0.f);
+            std::fill(sumG.begin(), sumG.end(), 0.f);
+            std::fill(sumB.begin(), sumB.end(), 0.f);
+            std::fill(count.begin(), count.end(), 0.f);
+            for (int y = y1; y < y2; ++y) {
+                fetchRow(y, &r[0], &g[0], &b[0], &a[0]);
+                if (hasAlphaPlane) {
+                    store(3, y, &a[0], _width, maxValue, 0.f);
+                }
+                if (isRGB) {
+                    store(0, y, &r[0], _width, maxValue, 0.f);
+                    store(1, y, &g[0], _width, maxValue, 0.f);
+                    store(2, y, &b[0], _width, maxValue, 0.f);
+                    continue;
+                }
+                for (int x = 0; x < _width; ++x) {
+                    luma[x] = _kr * r[x] + kg * g[x] + _kb * b[x];
+                }
+                store(0, y, &luma[0], _width, scaleY, offsetY);
+                for (int x = 0; x < _width; ++x) {
+                    sumR[x >> cw] += r[x];
+                    sumG[x >> cw] += g[x];
+                    sumB[x >> cw] += b[x];
+                    count[x >> cw] += 1.f;
+                }
+            }
+            if (isRGB) {
+                continue;
+            }
+            // the chroma of the average color, which is the average chroma since the matrix is linear
+            for (int x = 0; x < chromaWidth; ++x) {
+                const float rr = sumR[x] / count[x];
+                const float gg = sumG[x] / count[x];
+                const float bb = sumB[x] / count[x];
+                const float yy = _kr * rr + kg * gg + _kb * bb;
+                cb[x] = (bb - yy) / (2.f * (1.f - _kb));
+                cr[x] = (rr - yy) / (2.f * (1.f - _kr));
+            }
+            store(1, cy, &cb[0], chromaWidth, scaleC, offsetC);
+            store(2, cy, &cr[0], chromaWidth, scaleC, offsetC);
+        }
+    } // convertPlanar
+
+    void convertPacked(int y1,
+                       int y2) const
+    {
+        const AVPixelFormat pixelFormat = (AVPixelFormat)_avFrame->format;
+        assert(pixelFormat == AV_PIX_FMT_RGB24 || pixelFormat == AV_PIX_FMT_RGBA || pixelFormat == AV_PIX_FMT_RGB48 || pixelFormat == AV_PIX_FMT_RGBA64);
+        const int numDestChannels = (pixelFormat == AV_PIX_FMT_RGBA || pixelFormat == AV_PIX_FMT_RGBA64) ? 4 : 3;
+        const bool is16Bits = (pixelFormat == AV_PIX_FMT_RGB48 || pixelFormat == AV_PIX_FMT_RGBA64);
+
+        for (int y = y1; y < y2; ++y) {
+            const float* src_pixels = srcRow(y);
+
+            if (is16Bits) {
+                // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
+                assert(_avFrame->linesize[0] / 2 >= _width * numDestChannels);
+                unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(_avFrame->data[0]) + y * (_avFrame->linesize[0] / 2);
+
+                for (int x = 0; x < _width; ++x) {
+                    int srcCol = x * _pixelDataNComps;
+                    int dstCol = x * numDestChannels;
+                    dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
+                    dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
+                    dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
+                    if (numDestChannels == 4) {
+                        dst_pixels[dstCol + 3] = floatToInt<65536>((_pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
+                    }
+                }
+            } else {
+                assert(_avFrame->linesize[0] >= _width * numDestChannels);
+                unsigned char* dst_pixels = _avFrame->data[0] + y * _avFrame->linesize[0];
+
+                for (int x = 0; x < _width; ++x) {
+                    int srcCol = x * _pixelDataNComps;
+                    int dstCol = x * numDestChannels;
+                    dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
+                    dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
+                    dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
+                    if (numDestChannels == 4) {
+                        dst_pixels[dstCol + 3] = floatToInt<256>((_pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
+                    }
+                }
+            }
+        }
+    } // convertPacked
+
+    const float* _pixelData;
+    int _width;
+    int _height;
+    int _pixelDataNComps;
+    int _rowBytes;
+    bool _hasAlpha;
+    AVFrame* _avFrame;
+    const AVPixFmtDescriptor* _desc;
+    float _kr;
+    float _kb;
+    bool _fullRange;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// FramePool
+// Recycle the video frames, so that no image buffer is allocated per frame.
+// The buffers come from an AVBufferPool and are reference-counted: the encoder
+// can keep a reference to a frame (e.g. with frame threading or B-frames)
+// without copying it, and each buffer goes back to the pool when its last
+// reference is released.
+// Frames obtained from the pool must be released before the pool is destroyed.
+//
+class FramePool
+{
+public:
+    FramePool()
+        : _mutex()
+        , _bufferPool(nullptr)
+        , _frames()
+        , _width(0)
+        , _height(0)
+        , _pixelFormat(AV_PIX_FMT_NONE)
+    {
+    }
+
+    ~FramePool()
+    {
+        reset();
+    }
+
+    // Get a frame of the given size and pixel format. The frame goes back to the
+    // pool when the returned pointer is released.
+    // Returns an empty pointer if allocation failed.
+    std::shared_ptr<AVFrame> get(int width,
+                                 int height,
+                                 AVPixelFormat pixelFormat)
+    {
+        AVFrame* frame = nullptr;
+        AVBufferRef* buffer = nullptr;
+        {
+            AutoMutex lock(_mutex);
+            if (!_bufferPool || (width != _width) || (height != _height) || (pixelFormat != _pixelFormat)) {
+                // The buffers of the previous pool are freed when they are released.
+                av_buffer_pool_uninit(&_bufferPool);
+                int size = av_image_get_buffer_size(pixelFormat, width, height, OFX_FFMPEG_FRAME_ALIGN);
+                if (size < 0) {
+                    return std::shared_ptr<AVFrame>();
+                }
+                _bufferPool = av_buffer_pool_init(size + OFX_FFMPEG_FRAME_PADDING, nullptr);
+                if (!_bufferPool) {
+                    return std::shared_ptr<AVFrame>();
+                }
+                _width = width;
+                _height = height;
+                _pixelFormat = pixelFormat;
+            }
+            buffer = av_buffer_pool_get(_bufferPool);
+            if (!_frames.empty()) {
+                frame = _frames.back();
+                _frames.pop_back();
+            }
+        }
+        if (!buffer) {
+            if (frame) {
+                release(frame);
+            }
+
+            return std::shared_ptr<AVFrame>();
+        }
+        if (!frame) {
+            frame = av_frame_alloc();
+            if (!frame) {
+                av_buffer_unref(&buffer);
+
+                return std::shared_ptr<AVFrame>();
+            }
+        }
+        frame->buf[0] = buffer;
+        frame->width = width;
+        frame->height = height;
+        frame->format = (int)pixelFormat;
+        if (av_image_fill_arrays(frame->data, frame->linesize, buffer->data, pixelFormat, width, height, OFX_FFMPEG_FRAME_ALIGN) < 0) {
+            release(frame);
+
+            return std::shared_ptr<AVFrame>();
+        }
+
+        return std::shared_ptr<AVFrame>(frame, [this](AVFrame* f) { release(f); });
+    }
+
+    // Free the unused frames and the pool.
+    void reset()
+    {
+        AutoMutex lock(_mutex);
+        av_buffer_pool_uninit(&_bufferPool);
+        for (vector<AVFrame*>::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+            av_frame_free(&*it);
+        }
+        _frames.clear();
+        _width = 0;
+        _height = 0;
+        _pixelFormat = AV_PIX_FMT_NONE;
+    }
+
+private:
+    void release(AVFrame* frame)
+    {
+        // drop the reference to the buffer, and reset the frame properties
+        av_frame_unref(frame);
+        AutoMutex lock(_mutex);
+        _frames.push_back(frame);
+    }
+
+    Mutex _mutex;
+    AVBufferPool* _bufferPool;
+    vector<AVFrame*> _frames; // unused frames, without buffers
+    int _width;
+    int _height;
+    AVPixelFormat _pixelFormat;
+};
+
+// A segment of the movie, encoded independently from the others into a temporary file, in segmented
+// encoding mode. The segments are concatenated into the output file by endEncode().
+struct MovieSegment {
+    MovieSegment()
+        : filename()
+        , formatContext(nullptr)
+        , stream({ nullptr, nullptr })
+        , nextFrame(INT_MIN)
+        , lastFrame(INT_MIN)
+        , encodedFrames(0)
+        , pendingFrames()
+        , encoding(false)
+    {
+    }
+
+    string filename;
+    AVFormatContext* formatContext; //< NULL if the segment is not open yet, or closed
+    MyAVStream stream;
+    int nextFrame; //< the frame index we need to encode next in this segment
+    int lastFrame; //< the last frame index of this segment
+    int encodedFrames;
+    map<int, std::shared_ptr<AVFrame>> pendingFrames; //< converted frames waiting for the previous frames of the segment to be encoded
+    bool encoding; //< true while a render thread is encoding the pending frames of this segment
+};
+
 class WriteFFmpegPlugin
     : public GenericWriterPlugin {
+    friend class FFmpegSingleton; // computes the per-codec tables with GetCodecSupportedParams() and SelectPixelFormats()
+
 private:
     enum WriterError { SUCCESS = 0,
                        IGNORE_FINISH,
@@ -1059,6 +1541,8 @@ private:
     const AVOutputFormat* initFormat(bool reportErrors) const;
     bool initCodec(const AVOutputFormat* fmt, AVCodecID& outCodecId, const AVCodec*& outCodec) const;
 
+    bool isCodecSupportedInContainer(const AVOutputFormat* fmt, AVCodecID codecId, const AVCodec* videoCodec) const;
+    void getCodecSupportedParams(const AVCodec* videoCodec, CodecParams* p) const;
     void getPixelFormats(const AVCodec* videoCodec,
                          FFmpeg::PixelCodingEnum pixelCoding,
                          int bitdepth,
@@ -1073,19 +1557,41 @@ private:
     static bool IsRGBFromShortName(const char* shortName, int codecProfile);
     static AVPixelFormat GetRGBPixelFormatFromBitDepth(const int bitDepth, const bool hasAlpha);
     static void GetCodecSupportedParams(const AVCodec* codec, CodecParams* p);
+    static void SelectPixelFormats(const AVCodec* videoCodec,
+                                   FFmpeg::PixelCodingEnum prefPixelCoding,
+                                   int prefBitDepth,
+                                   bool prefAlpha,
+                                   AVPixelFormat& outRgbBufferPixelFormat,
+                                   AVPixelFormat& outTargetPixelFormat);
 
     void configureAudioStream(const AVCodec* avCodec, AVStream* avStream);
     void configureVideoStream(const AVCodec* avCodec, MyAVStream* avStream);
+    void setThreading(AVCodecContext* avCodecContext);
+    void configureVideoCodec(const AVCodec* avCodec, MyAVStream* myAVStream, AVPixelFormat targetPixelFormat, float pixelAspectRatio);
+    bool openOutput(const AVCodec* videoCodec);
+    bool beginAnalysisPass(const AVCodec* videoCodec);
+    int encodeAnalysisFrame(const AVFrame* avFrame);
+    int analyzeFrame(AVFrame* avFrame);
+    bool encodeSecondPass();
+    MovieSegment* getSegment(int time);
+    bool openSegment(MovieSegment* segment);
+    int encodeSegmentFrame(MovieSegment* segment, AVFrame* avFrame);
+    int closeSegment(MovieSegment* segment);
+    bool concatSegments();
+    void freeSegments();
     void configureTimecodeStream(AVCodec* avCodec, AVStream* avStream);
     void addStream(AVFormatContext* avFormatContext, enum AVCodecID avCodecId, const AVCodec** pavCodec, MyAVStream* myStreamOut);
     int openCodec(AVFormatContext* avFormatContext, const AVCodec* avCodec, MyAVStream* myAVStream);
     int writeAudio(AVFormatContext* avFormatContext, AVStream* avStream, bool flush);
-    int writeVideo(AVFormatContext* avFormatContext, MyAVStream* myAVStream, bool flush, double time, const float* pixelData = nullptr, const OfxRectI* bounds = nullptr, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
+    int convertFrame(AVCodecContext* avCodecContext, const float* pixelData, const OfxRectI* bounds, int pixelDataNComps, int rowBytes, std::shared_ptr<AVFrame>* avFrameOut);
+    int writeVideo(AVFormatContext* avFormatContext, MyAVStream* myAVStream, bool flush, AVFrame* avFrame = nullptr);
     int encodeVideo(AVCodecContext* avCodecContext, const AVFrame* avFrame, AVPacket* avPacketOut);
 
-    int writeToFile(AVFormatContext* avFormatContext, bool finalise, double time, const float* pixelData = nullptr, const OfxRectI* bounds = nullptr, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
+    int writeToFile(AVFormatContext* avFormatContext, bool finalise, AVFrame* avFrame = nullptr);
 
     int colourSpaceConvert(AVFrame* avFrameIn, AVFrame* avFrameOut, AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat, AVCodecContext* avCodecContext);
+    FFmpeg::SwsSlicedContext* getConvertContext(AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat, AVCodecContext* avCodecContext);
+    void releaseConvertContext(FFmpeg::SwsSlicedContext* convertCtx);
 
     // Returns true if the selected channels contain alpha and that the channel is valid
     bool alphaEnabled() const;
@@ -1107,16 +1613,38 @@ private:
     uint64_t _pts_counter;
     WriterError _error;
     AVFormatContext* _formatContext;
-    SwsContext* _convertCtx;
+    // SwsContexts are not thread-safe: each frame conversion takes one from this pool, see getConvertContext()
+    Mutex _convertCtxPoolMutex;
+    vector<FFmpeg::SwsSlicedContext*> _convertCtxPool;
     MyAVStream _streamVideo;
     MyAVStream _streamAudio;
     AVStream* _streamTimecode;
     tthread::mutex _nextFrameToEncodeMutex;
     tthread::condition_variable _nextFrameToEncodeCond;
     int _nextFrameToEncode; //< the frame index we need to encode next, INT_MIN means uninitialized
+    FramePool _inputFramePool; //< packed RGB frames, before sws_scale
+    FramePool _outputFramePool; //< frames in the pixel format of the encoder, must outlive _pendingFrames
+    map<int, std::shared_ptr<AVFrame>> _pendingFrames; //< converted frames waiting for the previous frames to be encoded
+    bool _encodingFrames; //< true while a render thread is encoding the pending frames
+    int64_t _frameBytes; //< size of a converted frame
+    int64_t _pendingFrameBytes; //< memory used by the frames being converted or waiting to be encoded, in all segments
+    int64_t _maxPendingFrameBytes; //< frames which are not the next to encode wait before being converted if this is reached
     int _firstFrameToEncode;
     int _lastFrameToEncode;
     int _frameStep;
+    // two-pass encoding: the frames are analyzed by a first pass encoder during the render, and stored to be encoded by endEncode()
+    bool _twoPassEncoding;
+    AVCodecContext* _analysisCodecContext; //< first pass encoder
+    string _statsFilename; //< first pass statistics
+    std::FILE* _statsFile; //< NULL if the encoder writes its statistics file itself
+    string _spoolFilename; //< frames stored for the second pass, in the pixel format of the encoder
+    std::FILE* _spoolFile;
+    vector<uint8_t> _spoolBuffer;
+    int _analyzedFrames;
+    double _analysisTime; //< time spent in the first pass encoder, in seconds
+    // segmented encoding: each segment of _segmentFrames frames is encoded into its own temporary file, and concatenated by endEncode()
+    int _segmentFrames; //< 0 if segmented encoding is disabled
+    map<int, MovieSegment> _segments; //< indexed by segment number
     ChoiceParam* _format;
     DoubleParam* _fps;
     ChoiceParam* _prefPixelCoding;
@@ -1139,10 +1667,14 @@ private:
     DoubleParam* _qscale;
     DoubleParam* _bitrate;
     DoubleParam* _bitrateTolerance;
+    BooleanParam* _twoPass;
+    IntParam* _segmentLength;
     Int2DParam* _quality;
     IntParam* _gopSize;
     IntParam* _bFrames;
     BooleanParam* _writeNCLC;
+    ChoiceParam* _threadType;
+    IntParam* _threads;
 #if OFX_FFMPEG_MBDECISION
     ChoiceParam* _mbDecision;
 #endif
@@ -1160,9 +1692,6 @@ private:
     uint8_t* _scratchBuffer;
     std::size_t _scratchBufferSize;
 #endif
-    // we use shared_ptr here as both frames can point to the same AVFrame (ProRes, DNxHD case)
-    std::shared_ptr<AVFrame> inputFrame_;
-    std::shared_ptr<AVFrame> outputFrame_;
 };
 
 class FFmpegSingleton {
@@ -1187,6 +1716,59 @@ public:
 
     const vector<vector<size_t>>& getCodecsFormats() const { return _codecsFormats; }
 
+    // the muxer for each format, nullptr for format 0 ("default")
+    const vector<const AVOutputFormat*>& getFormatsOutputFormats() const { return _formatsOutputFormats; }
+
+    // the encoder for each codec, nullptr if it cannot be found by name
+    const vector<const AVCodec*>& getCodecsEncoders() const { return _codecsEncoders; }
+
+    // the parameters supported by each codec, see WriteFFmpegPlugin::GetCodecSupportedParams()
+    const vector<WriteFFmpegPlugin::CodecParams>& getCodecsParams() const { return _codecsParams; }
+
+    // the pixel formats of each codec, as shown by the "Show Avail." button
+    const vector<string>& getCodecsPixelFormatsNames() const { return _codecsPixelFormatsNames; }
+
+    // index of the format with the given muxer, or -1 (format 0, "default", has no muxer)
+    int getFormatIndex(const AVOutputFormat* fmt) const
+    {
+        if (!fmt) {
+            return -1;
+        }
+        for (size_t f = 1; f < _formatsOutputFormats.size(); ++f) {
+            if (_formatsOutputFormats[f] == fmt) {
+                return (int)f;
+            }
+        }
+
+        return -1;
+    }
+
+    // index of the codec with the given short name, or -1
+    int getCodecIndex(const string& codecShortName) const
+    {
+        map<string, int>::const_iterator it = _codecsIndices.find(codecShortName);
+
+        return (it == _codecsIndices.end()) ? -1 : it->second;
+    }
+
+    // true if the codec can be written in the format (format 0, "default", is compatible with all codecs)
+    bool isCodecCompatible(int codec,
+                           int format) const
+    {
+        assert(0 <= codec && codec < (int)_codecsIds.size() && 0 <= format && format < (int)_formatsShortNames.size());
+
+        return !format || _codecsFormatsCompatible[codec * _formatsShortNames.size() + format];
+    }
+
+    // the pixel formats selected by WriteFFmpegPlugin::SelectPixelFormats() for the codec and preferences,
+    // computed the first time each combination is asked for
+    void getCodecPixelFormats(int codec,
+                              FFmpeg::PixelCodingEnum prefPixelCoding,
+                              int prefBitDepth,
+                              bool prefAlpha,
+                              AVPixelFormat& outRgbBufferPixelFormat,
+                              AVPixelFormat& outTargetPixelFormat);
+
 private:
     FFmpegSingleton& operator=(const FFmpegSingleton&)
     {
@@ -1209,10 +1791,23 @@ private:
     vector<string> _codecsKnobLabels;
     vector<AVCodecID> _codecsIds;
     vector<vector<size_t>> _codecsFormats; // for each codec, give the list of compatible formats (indices in the formats list)
+    // The following are computed once, so that the UI does not look up muxers and encoders by name on each parameter change.
+    vector<const AVOutputFormat*> _formatsOutputFormats;
+    vector<const AVCodec*> _codecsEncoders;
+    map<string, int> _codecsIndices;
+    vector<bool> _codecsFormatsCompatible; // codec-major matrix of _codecsFormats
+    vector<WriteFFmpegPlugin::CodecParams> _codecsParams;
+    vector<string> _codecsPixelFormatsNames;
+    // The pixel format selection depends on the user preferences, so it is filled on demand.
+    // This is not an OFX mutex: the singleton is constructed before the host suites are available.
+    tthread::mutex _codecsPixelFormatsSelectedMutex;
+    vector<map<int, std::pair<AVPixelFormat, AVPixelFormat>>> _codecsPixelFormatsSelected; // (rgb buffer, target) for each preferences key
 };
 
 FFmpegSingleton FFmpegSingleton::m_instance = FFmpegSingleton();
 
+static string pix_fmt_name_canonical(const char* name);
+
 FFmpegSingleton::FFmpegSingleton()
 {
     // TODO: add a log buffer and a way to display it / clear it.
@@ -1367,6 +1962,67 @@ FFmpegSingleton::FFmpegSingleton()
             }
         }
     }
+
+    // capability tables
+    _formatsOutputFormats.resize(_formatsShortNames.size(), nullptr);
+    for (size_t f = 1; f < _formatsShortNames.size(); ++f) { // format 0 is "default"
+        _formatsOutputFormats[f] = av_guess_format(_formatsShortNames[f].c_str(), nullptr, nullptr);
+    }
+    _codecsEncoders.resize(_codecsShortNames.size(), nullptr);
+    _codecsFormatsCompatible.resize(_codecsShortNames.size() * _formatsShortNames.size(), false);
+    for (size_t c = 0; c < _codecsShortNames.size(); ++c) {
+        _codecsEncoders[c] = avcodec_find_encoder_by_name(getCodecFromShortName(_codecsShortNames[c]));
+        _codecsIndices[_codecsShortNames[c]] = (int)c;
+        for (size_t i = 0; i < _codecsFormats[c].size(); ++i) {
+            _codecsFormatsCompatible[c * _formatsShortNames.size() + _codecsFormats[c][i]] = true;
+        }
+    }
+    _codecsParams.resize(_codecsShortNames.size());
+    _codecsPixelFormatsNames.resize(_codecsShortNames.size());
+    _codecsPixelFormatsSelected.resize(_codecsShortNames.size());
+    for (size_t c = 0; c < _codecsShortNames.size(); ++c) {
+        const AVCodec* codec = _codecsEncoders[c];
+        if (!codec) {
+            continue;
+        }
+        WriteFFmpegPlugin::GetCodecSupportedParams(codec, &_codecsParams[c]);
+        if (codec->pix_fmts == nullptr || *codec->pix_fmts == -1) {
+            _codecsPixelFormatsNames[c] = "none";
+        } else {
+            string& names = _codecsPixelFormatsNames[c];
+            for (const AVPixelFormat* currPixFormat = codec->pix_fmts; *currPixFormat != -1; ++currPixFormat) {
+                if (currPixFormat != codec->pix_fmts) {
+                    names += ", ";
+                }
+                const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(*currPixFormat);
+                names += (desc ? pix_fmt_name_canonical(desc->name) : "unknown");
+            }
+            names += '.';
+        }
+    }
+}
+
+void
+FFmpegSingleton::getCodecPixelFormats(int codec,
+                                      FFmpeg::PixelCodingEnum prefPixelCoding,
+                                      int prefBitDepth,
+                                      bool prefAlpha,
+                                      AVPixelFormat& outRgbBufferPixelFormat,
+                                      AVPixelFormat& outTargetPixelFormat)
+{
+    assert(0 <= codec && codec < (int)_codecsEncoders.size());
+    const int key = ((int)prefPixelCoding * 64 + prefBitDepth) * 2 + (prefAlpha ? 1 : 0);
+    tthread::lock_guard<tthread::mutex> guard(_codecsPixelFormatsSelectedMutex);
+    map<int, std::pair<AVPixelFormat, AVPixelFormat>>& selected = _codecsPixelFormatsSelected[codec];
+    map<int, std::pair<AVPixelFormat, AVPixelFormat>>::const_iterator it = selected.find(key);
+    if (it == selected.end()) {
+        AVPixelFormat rgbBufferPixelFormat = AV_PIX_FMT_NONE;
+        AVPixelFormat targetPixelFormat = AV_PIX_FMT_NONE;
+        WriteFFmpegPlugin::SelectPixelFormats(_codecsEncoders[codec], prefPixelCoding, prefBitDepth, prefAlpha, rgbBufferPixelFormat, targetPixelFormat);
+        it = selected.insert(std::make_pair(key, std::make_pair(rgbBufferPixelFormat, targetPixelFormat))).first;
+    }
+    outRgbBufferPixelFormat = it->second.first;
+    outTargetPixelFormat = it->second.second;
 }
 
 FFmpegSingleton::~FFmpegSingleton()
@@ -1382,16 +2038,33 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     , _pts_counter(0)
     , _error(IGNORE_FINISH)
     , _formatContext(nullptr)
-    , _convertCtx(nullptr)
+    , _convertCtxPoolMutex()
+    , _convertCtxPool()
     , _streamVideo({ nullptr, nullptr })
     , _streamAudio({ nullptr, nullptr })
     , _streamTimecode(nullptr)
     , _nextFrameToEncodeMutex()
     , _nextFrameToEncodeCond()
     , _nextFrameToEncode(INT_MIN)
+    , _pendingFrames()
+    , _encodingFrames(false)
+    , _frameBytes(1)
+    , _pendingFrameBytes(0)
+    , _maxPendingFrameBytes(1)
     , _firstFrameToEncode(1)
     , _lastFrameToEncode(1)
     , _frameStep(1)
+    , _twoPassEncoding(false)
+    , _analysisCodecContext(nullptr)
+    , _statsFilename()
+    , _statsFile(nullptr)
+    , _spoolFilename()
+    , _spoolFile(nullptr)
+    , _spoolBuffer()
+    , _analyzedFrames(0)
+    , _analysisTime(0.)
+    , _segmentFrames(0)
+    , _segments()
     , _format(nullptr)
     , _fps(nullptr)
     , _prefPixelCoding(nullptr)
@@ -1413,10 +2086,14 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     , _qscale(nullptr)
     , _bitrate(nullptr)
     , _bitrateTolerance(nullptr)
+    , _twoPass(nullptr)
+    , _segmentLength(nullptr)
     , _quality(nullptr)
     , _gopSize(nullptr)
     , _bFrames(nullptr)
     , _writeNCLC(nullptr)
+    , _threadType(nullptr)
+    , _threads(nullptr)
 #if OFX_FFMPEG_MBDECISION
     , _mbDecision(nullptr)
 #endif
@@ -1448,10 +2125,14 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     _qscale = fetchDoubleParam(kParamQScale);
     _bitrate = fetchDoubleParam(kParamBitrate);
     _bitrateTolerance = fetchDoubleParam(kParamBitrateTolerance);
+    _twoPass = fetchBooleanParam(kParamTwoPass);
+    _segmentLength = fetchIntParam(kParamSegmentLength);
     _quality = fetchInt2DParam(kParamQuality);
     _gopSize = fetchIntParam(kParamGopSize);
     _bFrames = fetchIntParam(kParamBFrames);
     _writeNCLC = fetchBooleanParam(kParamWriteNCLC);
+    _threadType = fetchChoiceParam(kParamThreadType);
+    _threads = fetchIntParam(kParamThreads);
 #if OFX_FFMPEG_MBDECISION
     _mbDecision = fetchChoiceParam(kParamMBDecision);
 #endif
@@ -1628,10 +2309,10 @@ WriteFFmpegPlugin::initFormat(bool reportErrors) const
             return nullptr;
         }
     } else {
-        const vector<string>& formatsShortNames = FFmpegSingleton::Instance().getFormatsShortNames();
-        assert(format < (int)formatsShortNames.size());
+        const vector<const AVOutputFormat*>& formatsOutputFormats = FFmpegSingleton::Instance().getFormatsOutputFormats();
+        assert(format < (int)formatsOutputFormats.size());
 
-        fmt = av_guess_format(formatsShortNames[format].c_str(), nullptr, nullptr);
+        fmt = formatsOutputFormats[format];
         if (!fmt && reportErrors) {
             return nullptr;
         }
@@ -1650,13 +2331,13 @@ WriteFFmpegPlugin::initCodec(const AVOutputFormat* fmt,
         return false;
     }
     outCodecId = fmt->video_codec;
-    const vector<string>& codecsShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
+    const vector<const AVCodec*>& codecsEncoders = FFmpegSingleton::Instance().getCodecsEncoders();
 
     assert(_codec);
     int codec = _codec->getValue();
-    assert(codec >= 0 && codec < (int)codecsShortNames.size());
+    assert(codec >= 0 && codec < (int)codecsEncoders.size());
 
-    const AVCodec* userCodec = avcodec_find_encoder_by_name(getCodecFromShortName(codecsShortNames[codec]));
+    const AVCodec* userCodec = codecsEncoders[codec];
     if (userCodec) {
         outCodecId = userCodec->id;
     }
@@ -1678,6 +2359,37 @@ WriteFFmpegPlugin::initCodec(const AVOutputFormat* fmt,
     return true;
 }
 
+// Same as codecCompatible(), but reads the precomputed table when the muxer and the encoder are in the lists.
+bool
+WriteFFmpegPlugin::isCodecSupportedInContainer(const AVOutputFormat* fmt,
+                                               AVCodecID codecId,
+                                               const AVCodec* videoCodec) const
+{
+    assert(fmt);
+    const FFmpegSingleton& singleton = FFmpegSingleton::Instance();
+    const int format = singleton.getFormatIndex(fmt);
+    const int codec = _codec->getValue();
+    if (format > 0 && 0 <= codec && codec < (int)singleton.getCodecsEncoders().size() && singleton.getCodecsEncoders()[codec] == videoCodec) {
+        return singleton.isCodecCompatible(codec, format);
+    }
+
+    return codecCompatible(fmt, codecId);
+}
+
+// Same as GetCodecSupportedParams(), but reads the precomputed table when the encoder is the selected codec.
+void
+WriteFFmpegPlugin::getCodecSupportedParams(const AVCodec* videoCodec,
+                                           CodecParams* p) const
+{
+    const FFmpegSingleton& singleton = FFmpegSingleton::Instance();
+    const int codec = _codec->getValue();
+    if (0 <= codec && codec < (int)singleton.getCodecsEncoders().size() && singleton.getCodecsEncoders()[codec] == videoCodec) {
+        *p = singleton.getCodecsParams()[codec];
+    } else {
+        GetCodecSupportedParams(videoCodec, p);
+    }
+}
+
 void
 WriteFFmpegPlugin::getPixelFormats(const AVCodec* videoCodec,
                                    FFmpeg::PixelCodingEnum prefPixelCoding,
@@ -1726,7 +2438,33 @@ WriteFFmpegPlugin::getPixelFormats(const AVCodec* videoCodec,
         } else {
             outTargetPixelFormat = AV_PIX_FMT_YUV422P;
         }
-    } else if (videoCodec->pix_fmts != nullptr) {
+    } else {
+        // This is the most frequent path, which only depends on the codec and the preferences.
+        FFmpegSingleton& singleton = FFmpegSingleton::Instance();
+        const int codec = _codec->getValue();
+        if (0 <= codec && codec < (int)singleton.getCodecsEncoders().size() && singleton.getCodecsEncoders()[codec] == videoCodec) {
+            singleton.getCodecPixelFormats(codec, prefPixelCoding, prefBitDepth, prefAlpha, outRgbBufferPixelFormat, outTargetPixelFormat);
+        } else {
+            SelectPixelFormats(videoCodec, prefPixelCoding, prefBitDepth, prefAlpha, outRgbBufferPixelFormat, outTargetPixelFormat);
+        }
+    }
+
+    // update outRGBPixelFormat from the selected format (do not need alpha if format does not have it)
+    outRgbBufferPixelFormat = GetRGBPixelFormatFromBitDepth(FFmpeg::pixelFormatBitDepth(outTargetPixelFormat),
+                                                            FFmpeg::pixelFormatAlpha(outTargetPixelFormat));
+} // WriteFFmpegPlugin::getPixelFormats
+
+/*static*/
+void
+WriteFFmpegPlugin::SelectPixelFormats(const AVCodec* videoCodec,
+                                      FFmpeg::PixelCodingEnum prefPixelCoding,
+                                      int prefBitDepth,
+                                      bool prefAlpha,
+                                      AVPixelFormat& outRgbBufferPixelFormat,
+                                      AVPixelFormat& outTargetPixelFormat)
+{
+    assert(videoCodec);
+    if (videoCodec->pix_fmts != nullptr) {
         // This is the most frequent path, where we can guess best pix format using ffmpeg.
         // find highest bit depth pix fmt.
         const AVPixelFormat* currPixFormat = videoCodec->pix_fmts;
@@ -1891,11 +2629,7 @@ WriteFFmpegPlugin::getPixelFormats(const AVCodec* videoCodec,
         // Lowest common denominator defaults.
         outTargetPixelFormat = AV_PIX_FMT_YUV420P;
     }
-
-    // update outRGBPixelFormat from the selected format (do not need alpha if format does not have it)
-    outRgbBufferPixelFormat = GetRGBPixelFormatFromBitDepth(FFmpeg::pixelFormatBitDepth(outTargetPixelFormat),
-                                                            FFmpeg::pixelFormatAlpha(outTargetPixelFormat));
-} // WriteFFmpegPlugin::getPixelFormats
+} // WriteFFmpegPlugin::SelectPixelFormats
 
 /*static*/
 AVPixelFormat
@@ -2300,7 +3034,7 @@ WriteFFmpegPlugin::configureVideoStream(const AVCodec* avCodec,
     // This deals with cases where values are left on an old value when knob disabled.
     CodecParams p;
     if (avCodec) {
-        GetCodecSupportedParams(avCodec, &p);
+        getCodecSupportedParams(avCodec, &p);
     }
 
     assert(_crf && _x26xSpeed && _qscale && _bitrate && _bitrateTolerance && _quality);
@@ -3206,43 +3940,73 @@ WriteFFmpegPlugin::colourSpaceConvert(AVFrame* avFrameIn,
     if (!avFrameIn || !avFrameOut || !avCodecContext) {
         return -1;
     }
-    int ret = 0;
+    FFmpeg::SwsSlicedContext* convertCtx = getConvertContext(srcPixelFormat, dstPixelFormat, avCodecContext);
+    if (!convertCtx) {
+        return -1;
+    }
+
+    // the frame is converted by horizontal bands, in parallel
+    convertCtx->scale(avFrameIn->data, // src
+                      avFrameIn->linesize, // src rowbytes
+                      avFrameOut->data, // dst
+                      avFrameOut->linesize); // dst rowbytes
+
+    releaseConvertContext(convertCtx);
+
+    return 0;
+}
+
+// Get a SwsContext from the pool, or create a new one if all are in use by other render threads.
+// The pixel formats and sizes are the same for the whole sequence, so all contexts in the pool are equivalent.
+FFmpeg::SwsSlicedContext*
+WriteFFmpegPlugin::getConvertContext(AVPixelFormat srcPixelFormat,
+                                     AVPixelFormat dstPixelFormat,
+                                     AVCodecContext* avCodecContext)
+{
+    {
+        AutoMutex lock(_convertCtxPoolMutex);
+        if (!_convertCtxPool.empty()) {
+            FFmpeg::SwsSlicedContext* convertCtx = _convertCtxPool.back();
+            _convertCtxPool.pop_back();
+
+            return convertCtx;
+        }
+    }
+
     int width = (_rodPixel.x2 - _rodPixel.x1);
     int height = (_rodPixel.y2 - _rodPixel.y1);
-    if (!_convertCtx) {
-        _convertCtx = sws_getContext(width, height, srcPixelFormat, // from
-                                     avCodecContext->width, avCodecContext->height, dstPixelFormat, // to
-                                     (width == avCodecContext->width && height == avCodecContext->height) ? SWS_POINT : SWS_BICUBIC, nullptr, nullptr, nullptr);
-        if (!_convertCtx) {
-            return -1;
-        }
+    FFmpeg::SwsSlicedContext* convertCtx = new FFmpeg::SwsSlicedContext;
+    if (!convertCtx->init(width, height, srcPixelFormat, // from
+                          avCodecContext->width, avCodecContext->height, dstPixelFormat, // to
+                          (width == avCodecContext->width && height == avCodecContext->height) ? SWS_POINT : SWS_BICUBIC)) {
+        delete convertCtx;
 
-        // Only apply colorspace conversions for YUV.
-        if (FFmpeg::pixelFormatIsYUV(dstPixelFormat)) {
-            // Set up the sws (SoftWareScaler) to convert colourspaces correctly, in the sws_scale function below
-            const int colorspace = isRec709Format(height) ? SWS_CS_ITU709 : SWS_CS_ITU601;
-            const int dstRange = (avCodecContext->codec_id == AV_CODEC_ID_MJPEG || avCodecContext->codec_id == AV_CODEC_ID_MJPEGB) ? 1 : 0; // 0 = 16..235, 1 = 0..255
+        return nullptr;
+    }
 
-            ret = sws_setColorspaceDetails(_convertCtx,
-                                           sws_getCoefficients(SWS_CS_DEFAULT), // inv_table
-                                           1, // srcRange - 0 = 16..235, 1 = 0..255
-                                           sws_getCoefficients(colorspace), // table
-                                           dstRange, // dstRange - 0 = 16..235, 1 = 0..255
-                                           0, // brightness fixed point, with 0 meaning no change,
-                                           1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
-                                           1 << 16); // saturation fixed point, with 1<<16 meaning no change);
-        }
+    // Only apply colorspace conversions for YUV.
+    if (FFmpeg::pixelFormatIsYUV(dstPixelFormat)) {
+        // Set up the sws (SoftWareScaler) to convert colourspaces correctly, in the sws_scale function below
+        const int colorspace = isRec709Format(height) ? SWS_CS_ITU709 : SWS_CS_ITU601;
+        const int dstRange = (avCodecContext->codec_id == AV_CODEC_ID_MJPEG || avCodecContext->codec_id == AV_CODEC_ID_MJPEGB) ? 1 : 0; // 0 = 16..235, 1 = 0..255
+
+        convertCtx->setColorspaceDetails(sws_getCoefficients(SWS_CS_DEFAULT), // inv_table
+                                         1, // srcRange - 0 = 16..235, 1 = 0..255
+                                         sws_getCoefficients(colorspace), // table
+                                         dstRange, // dstRange - 0 = 16..235, 1 = 0..255
+                                         0, // brightness fixed point, with 0 meaning no change,
+                                         1 << 16, // contrast   fixed point, with 1<<16 meaning no change,
+                                         1 << 16); // saturation fixed point, with 1<<16 meaning no change);
     }
 
-    sws_scale(_convertCtx,
-              avFrameIn->data, // src
-              avFrameIn->linesize, // src rowbytes
-              0,
-              height,
-              avFrameOut->data, // dst
-              avFrameOut->linesize); // dst rowbytes
+    return convertCtx;
+}
 
-    return ret;
+void
+WriteFFmpegPlugin::releaseConvertContext(FFmpeg::SwsSlicedContext* convertCtx)
+{
+    AutoMutex lock(_convertCtxPoolMutex);
+    _convertCtxPool.push_back(convertCtx);
 }
 
 bool
@@ -3261,11 +4025,89 @@ WriteFFmpegPlugin::numberOfDestChannels() const
     return alphaEnabled() ? 4 : 3;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// convertFrame
+//
+// Convert Nuke float RGB values to the ffmpeg pixel format of the encoder.
+// This does not modify the encoder state, so that it may be called concurrently
+// by several render threads.
+//
+// @param avCodecContext A reference to the AVCodecContext of the video stream.
+// @param avFrameOut Receives the converted frame.
+//
+// @return 0 if successful,
+//         <0 otherwise for any failure to allocate or convert the frame.
+//
+int
+WriteFFmpegPlugin::convertFrame(AVCodecContext* avCodecContext,
+                                const float* pixelData,
+                                const OfxRectI* bounds,
+                                int pixelDataNComps,
+                                int rowBytes,
+                                std::shared_ptr<AVFrame>* avFrameOut)
+{
+    assert(avCodecContext && pixelData && bounds && avFrameOut);
+    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
+    // Create a buffer to hold either  16-bit or 8-bit RGB.
+    // Create another buffer to convert from either 16-bit or 8-bit RGB
+    // to the input pixel format required by the encoder.
+    AVPixelFormat pixelFormatCodec = avCodecContext->pix_fmt;
+    int width = _rodPixel.x2 - _rodPixel.x1;
+    int height = _rodPixel.y2 - _rodPixel.y1;
+
+    assert(bounds->x1 == _rodPixel.x1 && bounds->x2 == _rodPixel.x2 && bounds->y1 == _rodPixel.y1 && bounds->y2 == _rodPixel.y2);
+
+    const bool hasAlpha = alphaEnabled();
+    AVPixelFormat pixelFormatNuke;
+    if (hasAlpha) {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
+    } else {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48 : AV_PIX_FMT_RGB24;
+    }
+
+    assert(rowBytes && rowBytes >= (int)sizeof(float) * width * pixelDataNComps);
+
+    std::shared_ptr<AVFrame> outputFrame = _outputFramePool.get(avCodecContext->width, avCodecContext->height, pixelFormatCodec);
+    if (!outputFrame) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = 0;
+
+    if ((width == avCodecContext->width) && (height == avCodecContext->height) && FrameConverter::canConvertDirectly(pixelFormatCodec)) {
+        // Write directly in the pixel format of the encoder, using the same conversion as colourSpaceConvert()
+        FrameConverter converter(pixelData, width, height, pixelDataNComps, rowBytes, hasAlpha, outputFrame.get());
+        converter.setYUVConversion(isRec709Format(height), avCodecContext->codec_id == AV_CODEC_ID_MJPEG || avCodecContext->codec_id == AV_CODEC_ID_MJPEGB);
+        converter.multiThread();
+    } else {
+        // Convert floating point values to unsigned values, and then to the pixel format of the encoder.
+        std::shared_ptr<AVFrame> inputFrame = _inputFramePool.get(width, height, pixelFormatNuke);
+        if (!inputFrame) {
+            return AVERROR(ENOMEM);
+        }
+
+        FrameConverter converter(pixelData, width, height, pixelDataNComps, rowBytes, hasAlpha, inputFrame.get());
+        converter.multiThread();
+
+        ret = colourSpaceConvert(inputFrame.get(), outputFrame.get(), pixelFormatNuke, pixelFormatCodec, avCodecContext);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // see ffmpeg.c:1199 from ffmpeg 3.2.2
+    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
+    outputFrame->quality = avCodecContext->global_quality;
+    outputFrame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    *avFrameOut = outputFrame;
+
+    return 0;
+} // WriteFFmpegPlugin::convertFrame
+
 ////////////////////////////////////////////////////////////////////////////////
 // writeVideo
 //
-// * Convert Nuke float RGB values to the ffmpeg pixel format of the encoder.
-// * Encode.
+// * Encode a frame converted by convertFrame().
 // * Write to file.
 //
 // @param avFormatContext A reference to an AVFormatContext of the file.
@@ -3273,23 +4115,19 @@ WriteFFmpegPlugin::numberOfDestChannels() const
 // @param flush A boolean value to flag that any remaining frames in the internal
 //              queue of the encoder should be written to the file. No new
 //              frames will be queued for encoding.
+// @param avFrame The frame to encode, in the pixel format of the encoder. Its pts
+//                is set by this function.
 //
 // @return 0 if successful,
-//         <0 otherwise for any failure to convert the pixel format, encode the
+//         <0 otherwise for any failure to encode the
 //         video or write to the file.
 //
 int
 WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                               MyAVStream* myAVStream,
                               bool flush,
-                              double /*time*/,
-                              const float* pixelData,
-                              const OfxRectI* bounds,
-                              int pixelDataNComps,
-                              int dstNComps,
-                              int rowBytes)
+                              AVFrame* avFrame)
 {
-    assert(dstNComps == 3 || dstNComps == 4 || dstNComps == 0);
     // FIXME enum needed for error codes.
     if (!_isOpen) {
         return -5; // writer is not open!
@@ -3299,127 +4137,20 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
         return -6;
     }
     assert(avFormatContext);
-    if (!avFormatContext || (!flush && (!pixelData || !bounds))) {
+    if (!avFormatContext || (!flush && !avFrame)) {
         return -7;
     }
     int ret = 0;
-    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
-    // Create a buffer to hold either  16-bit or 8-bit RGB.
     AVCodecContext* avCodecContext = myAVStream->codecContext;
     assert(avCodecContext);
     if (!avCodecContext) {
         return -8;
     }
-    // Create another buffer to convert from either 16-bit or 8-bit RGB
-    // to the input pixel format required by the encoder.
-    AVPixelFormat pixelFormatCodec = avCodecContext->pix_fmt;
-    int width = _rodPixel.x2 - _rodPixel.x1;
-    int height = _rodPixel.y2 - _rodPixel.y1;
-
-    if (!flush) {
-        assert(pixelData && bounds);
-        assert(bounds->x1 == _rodPixel.x1 && bounds->x2 == _rodPixel.x2 && bounds->y1 == _rodPixel.y1 && bounds->y2 == _rodPixel.y2);
-
-        const bool hasAlpha = alphaEnabled();
-        AVPixelFormat pixelFormatNuke;
-        if (hasAlpha) {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
-        } else {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48 : AV_PIX_FMT_RGB24;
-        }
-
-        inputFrame_.reset(av_frame_alloc(), [](AVFrame* frame) { av_freep(&frame->data[0]); av_frame_free(&frame); });
-        ret = av_image_alloc(inputFrame_->data, inputFrame_->linesize, width, height, pixelFormatNuke, 32);
-
-        if (ret < 0) {
-            inputFrame_.reset();
-        }
-        if (inputFrame_) {
-            ret = 0;
-            // Convert floating point values to unsigned values.
-            assert(rowBytes && rowBytes >= (int)sizeof(float) * width * pixelDataNComps);
-            const int numDestChannels = hasAlpha ? 4 : 3;
-
-            for (int y = 0; y < height; ++y) {
-                int srcY = height - 1 - y;
-                const float* src_pixels = (float*)((char*)pixelData + srcY * rowBytes);
-
-                if (avCodecContext->bits_per_raw_sample > 8) {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48);
-
-                    // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
-                    assert(inputFrame_->linesize[0] / 2 >= width * numDestChannels);
-                    unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(inputFrame_->data[0]) + y * (inputFrame_->linesize[0] / 2);
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<65536>((pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
-                        }
-                    }
-                } else {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
-
-                    assert(inputFrame_->linesize[0] >= width * numDestChannels);
-                    unsigned char* dst_pixels = inputFrame_->data[0] + y * inputFrame_->linesize[0];
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<256>((pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
-                        }
-                    }
-                }
-            }
-
-            assert(inputFrame_);
-            if (!inputFrame_) {
-                ret = -1;
-            } else {
-                // For any codec an
-                // intermediate buffer is allocated for the
-                // colour space conversion.
-
-                if (!outputFrame_) {
-                    outputFrame_.reset(av_frame_alloc(), [](AVFrame* frame) { av_freep(&frame->data[0]); av_frame_free(&frame); });
-
-                    outputFrame_->width = avCodecContext->width;
-                    outputFrame_->height = avCodecContext->height;
-                    outputFrame_->format = avCodecContext->pix_fmt;
-
-                    int bufferSize = av_image_alloc(outputFrame_->data, outputFrame_->linesize, outputFrame_->width, outputFrame_->height, pixelFormatCodec, 32);
-
-                    if (bufferSize < 0) {
-                        outputFrame_.reset();
-                    }
-                }
-
-                if (outputFrame_) {
-                    colourSpaceConvert(inputFrame_.get(), outputFrame_.get(), pixelFormatNuke, pixelFormatCodec, avCodecContext);
-
-                    // see ffmpeg.c:1199 from ffmpeg 3.2.2
-                    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
-                    outputFrame_->quality = avCodecContext->global_quality;
-                    outputFrame_->pict_type = AV_PICTURE_TYPE_NONE;
-                    outputFrame_->pts = _pts_counter;
-                } else {
-                    // av_image_alloc failed.
-                    ret = -1;
-                }
-            }
-        }
-    } else {
-        inputFrame_.reset();
-        outputFrame_.reset();
-    }
+    if (flush) {
+        avFrame = nullptr;
+    } else {
+        avFrame->pts = _pts_counter;
+    }
 
     if (!ret) {
         bool error = false;
@@ -3439,7 +4170,7 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
         //       alloc will not have been called.
 
         _pts_counter++;
-        const int bytesEncoded = encodeVideo(avCodecContext, outputFrame_.get(), pkt.pkt());
+        const int bytesEncoded = encodeVideo(avCodecContext, avFrame, pkt.pkt());
         const bool encodeSucceeded = (bytesEncoded > 0);
         if (encodeSucceeded) {
             // Each of these packets should consist of a single frame therefore each one
@@ -3539,6 +4270,7 @@ WriteFFmpegPlugin::encodeVideo(AVCodecContext* avCodecContext, const AVFrame* av
 //                        write.
 // @param finalise A flag to indicate that the streams should be flushed as
 //                 no further frames are to be encoded.
+// @param avFrame The video frame to encode, converted by convertFrame().
 //
 // @return 0 if successful.
 //         <0 otherwise.
@@ -3546,12 +4278,7 @@ WriteFFmpegPlugin::encodeVideo(AVCodecContext* avCodecContext, const AVFrame* av
 int
 WriteFFmpegPlugin::writeToFile(AVFormatContext* avFormatContext,
                                bool finalise,
-                               double time,
-                               const float* pixelData,
-                               const OfxRectI* bounds,
-                               int pixelDataNComps,
-                               int dstNComps,
-                               int rowBytes)
+                               AVFrame* avFrame)
 {
 #if OFX_FFMPEG_AUDIO
     // Write interleaved audio and video if an audio file has
@@ -3585,11 +4312,896 @@ WriteFFmpegPlugin::writeToFile(AVFormatContext* avFormatContext,
         return -6;
     }
     assert(avFormatContext);
-    if (!avFormatContext || (!finalise && (!pixelData || !bounds))) {
+    if (!avFormatContext || (!finalise && !avFrame)) {
         return -7;
     }
 
-    return writeVideo(avFormatContext, &_streamVideo, finalise, time, pixelData, bounds, pixelDataNComps, dstNComps, rowBytes);
+    return writeVideo(avFormatContext, &_streamVideo, finalise, avFrame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// setThreading
+// Set the number of threads and the threading type of the video encoder from
+// the Threading and Max Threads parameters. This must be done before opening
+// the codec.
+//
+// @param avCodecContext The codec context of the video stream.
+//
+void
+WriteFFmpegPlugin::setThreading(AVCodecContext* avCodecContext)
+{
+    const AVCodec* codec = avCodecContext->codec;
+    assert(codec);
+    if (!codec) {
+        return;
+    }
+
+    int threadCount = _threads->getValue();
+    if (threadCount <= 0) {
+        threadCount = (std::min)((int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS);
+#if defined(AV_CODEC_CAP_OTHER_THREADS)
+        if (codec->capabilities & AV_CODEC_CAP_OTHER_THREADS) {
+            threadCount = 0; // the codec manages its own threads, e.g. libx264
+        }
+#elif defined(AV_CODEC_CAP_AUTO_THREADS)
+        if (codec->capabilities & AV_CODEC_CAP_AUTO_THREADS) {
+            threadCount = 0; // the codec manages its own threads, e.g. libx264
+        }
+#endif
+    }
+    avCodecContext->thread_count = (std::min)(threadCount, OFX_FFMPEG_MAX_ENCODER_THREADS);
+
+    switch ((ThreadTypeEnum)_threadType->getValue()) {
+    case eThreadTypeAuto:
+        if (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
+            // multiple threads are used to encode a single frame. Reduces delay
+            // also, mjpeg prefers this, see libavcodec/frame_thread_encoder.c:ff_frame_thread_encoder_init()
+            avCodecContext->thread_type = FF_THREAD_SLICE;
+        }
+        break;
+    case eThreadTypeSlice:
+        avCodecContext->thread_type = FF_THREAD_SLICE;
+        break;
+    case eThreadTypeFrame:
+        // Several frames are encoded in parallel, which adds a delay of thread_count frames:
+        // the remaining packets are written when the encoder is flushed in endEncode().
+        // Codecs which only support slice threading (e.g. mjpeg) still use it.
+        if (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+            avCodecContext->thread_type = FF_THREAD_FRAME;
+        } else {
+            avCodecContext->thread_type = FF_THREAD_SLICE;
+        }
+        break;
+    }
+} // WriteFFmpegPlugin::setThreading
+
+////////////////////////////////////////////////////////////////////////////////
+// configureVideoCodec
+// Set the parameters of a video codec context which depend on the output
+// pixel format. configureVideoStream() must have been called first.
+// This is called for the codec context of the video stream, and for the first
+// pass encoder if two-pass encoding is enabled.
+//
+// @param avCodec The video codec.
+// @param myAVStream The video stream and the codec context to configure.
+// @param targetPixelFormat The pixel format of the encoder.
+// @param pixelAspectRatio The pixel aspect ratio of the images.
+//
+void
+WriteFFmpegPlugin::configureVideoCodec(const AVCodec* avCodec,
+                                       MyAVStream* myAVStream,
+                                       AVPixelFormat targetPixelFormat,
+                                       float pixelAspectRatio)
+{
+    AVCodecContext* avCodecContext = myAVStream->codecContext;
+    avCodecContext->pix_fmt = targetPixelFormat;
+
+    avCodecContext->bits_per_raw_sample = FFmpeg::pixelFormatBitDepth(targetPixelFormat);
+    avCodecContext->sample_aspect_ratio = av_d2q(pixelAspectRatio, 255);
+
+    // Now that the stream has been created, and the pixel format
+    // is known, for DNxHD, set the YUV range.
+    if (AV_CODEC_ID_DNXHD == avCodecContext->codec_id) {
+        int encodeVideoRange = _encodeVideoRange->getValue();
+        // Set the metadata for the YUV range. This modifies the appropriate
+        // field in the 'ACLR' atom in the video sample description.
+        // Set 'full range' = 1 or 'legal range' = 2.
+        avCodecContext->color_range = encodeVideoRange ? AVColorRange::AVCOL_RANGE_MPEG : AVColorRange::AVCOL_RANGE_JPEG;
+    }
+
+    // Bug 45010 The following flags must be set BEFORE calling
+    // openCodec (avcodec_open2). This will ensure that codec
+    // specific data is created and initialized. (E.g. for MPEG4
+    // the AVCodecContext::extradata will contain Elementary Stream
+    // Descriptor which is required for QuickTime to decode the
+    // stream.)
+    // Some formats want stream headers to be separate.
+    // see ffmpeg_opt.c:1408 in ffmpeg 3.3.3
+    if ((_formatContext->oformat->flags & AVFMT_GLOBALHEADER) || !strcmp(_formatContext->oformat->name, "mp4") || !strcmp(_formatContext->oformat->name, "mov") || !strcmp(_formatContext->oformat->name, "3gp")) {
+        avCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avCodec->id == AV_CODEC_ID_PRORES) {
+        int index = _codec->getValue();
+        const vector<string>& codecsShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
+        assert(index < (int)codecsShortNames.size());
+        // avCodecContext->profile = getProfileFromShortName(codecsShortNames[index]);
+        av_opt_set(avCodecContext->priv_data, "profile", getProfileStringFromShortName(codecsShortNames[index]), 0);
+        av_opt_set(avCodecContext->priv_data, "bits_per_mb", "8000", 0);
+        // ProRes vendor should be apl0
+        // ref: https://ffmpeg.org/ffmpeg-all.html#toc-Private-Options-for-prores_002dks
+        av_opt_set(avCodecContext->priv_data, "vendor", "apl0", 0);
+    }
+    // The default vendor ID is "FFMP" (FFmpeg), and it is hardcoded (see mov_write_video_tag in libavformat/movenc.c)
+    // Some tools may check that QuickTime movies were made by Apple ("appl", as seen in exiftool source).
+    // Maybe one day a future version of movenc.c will use it rather than the hardcoded FFMP.
+    // if ( !strcmp(_formatContext->oformat->name, "mov") ) {
+    //    av_opt_set(_formatContext->metadata, "vendor", "appl", 0);
+    //}
+
+    // Activate multithreaded encoding. This must be done before opening the codec; see
+    // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
+    setThreading(avCodecContext);
+} // WriteFFmpegPlugin::configureVideoCodec
+
+////////////////////////////////////////////////////////////////////////////////
+// openOutput
+// Open the video codec, the output file, and write the file header.
+//
+// @param videoCodec The video codec.
+//
+// @return true if successful,
+//         false otherwise, and an error message was set.
+//
+bool
+WriteFFmpegPlugin::openOutput(const AVCodec* videoCodec)
+{
+    if (openCodec(_formatContext, videoCodec, &_streamVideo) < 0) {
+        return false;
+    }
+
+    avcodec_parameters_from_context(_streamVideo.stream->codecpar, _streamVideo.codecContext);
+
+    if (!(_formatContext->oformat->flags & AVFMT_NOFILE)) {
+        int error = avio_open(&_formatContext->pb, _filename.c_str(), AVIO_FLAG_WRITE);
+        if (error < 0) {
+            // Report the error.
+            char szError[1024] = { 0 };
+            av_strerror(error, szError, sizeof(szError));
+            setPersistentMessage(Message::eMessageError, "", string("Unable to open file: ") + szError);
+
+            return false;
+        }
+    }
+
+    // avformat_init_output may set the "encoder" metadata (see libavformat/muc.c:init_muxer)
+    int error = avformat_init_output(_formatContext, nullptr);
+    if (error < 0) {
+        // Report the error.
+        char szError[1024] = { 0 };
+        av_strerror(error, szError, sizeof(szError));
+        setPersistentMessage(Message::eMessageError, "", string("Unable to initialize output: ") + szError);
+
+        return false;
+    }
+
+    std::string movflags = "write_colr";
+    if (_fastStart->getValue()) {
+        movflags += "+faststart";
+    }
+
+    AVDictionary* header_params = nullptr;
+    av_dict_set(&header_params, "movflags", movflags.c_str(), 0);
+
+    error = avformat_write_header(_formatContext, NULL);
+    if (error < 0) {
+        // Report the error.
+        char szError[1024] = { 0 };
+        av_strerror(error, szError, sizeof(szError));
+        setPersistentMessage(Message::eMessageError, "", string("Unable to write file header: ") + szError);
+
+        return false;
+    }
+
+    // Special behaviour.
+    // Valid on Aug 2014 for ffmpeg v2.1.4
+    //
+    // R.e. libavformat/movenc.c::mov_write_udta_tag
+    // R.e. libavformat/movenc.c::mov_write_string_metadata
+    //
+    // Remove all ffmpeg references from the QuickTime movie.
+    // The 'encoder' key in the AVFormatContext metadata will
+    // result in the writer adding @swr with libavformat
+    // version information in the 'udta' atom.
+    //
+    // Prevent the @swr libavformat reference from appearing
+    // in the 'udta' atom by setting the 'encoder' key in the
+    // metadata to null. From movenc.c a zero length value
+    // will not be written to the 'udta' atom.
+    //
+    AVDictionaryEntry* tag = av_dict_get(_formatContext->metadata, "encoder", nullptr, AV_DICT_IGNORE_SUFFIX);
+    if (tag) {
+        av_dict_set(&_formatContext->metadata, "encoder", videoCodec->name, 0);
+    }
+
+    // Set the stream encoder to proper values for ProRes, DNxHD/DNxHR, and others (used in MOV)
+    // see:
+    // - https://trac.ffmpeg.org/ticket/6465
+    // - https://lists.ffmpeg.org/pipermail/ffmpeg-user/2015-May/026742.html
+    // - https://forum.blackmagicdesign.com/viewtopic.php?f=21&t=51457#p355458
+    const char* encoder = nullptr;
+    if (videoCodec->id == AV_CODEC_ID_PRORES) {
+        int index = _codec->getValue();
+        const vector<string>& codecsShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
+        assert(index < (int)codecsShortNames.size());
+        switch (getProfileFromShortName(codecsShortNames[index])) {
+        case kProresProfile4444XQ:
+            encoder = "Apple ProRes 4444 (XQ)";
+            break;
+        case kProresProfile4444:
+            encoder = "Apple ProRes 4444";
+            break;
+        case kProresProfileHQ:
+            encoder = "Apple ProRes 422 (HQ)";
+            break;
+        case kProresProfileSQ:
+            encoder = "Apple ProRes 422";
+            break;
+        case kProresProfileLT:
+            encoder = "Apple ProRes 422 (LT)";
+            break;
+        case kProresProfileProxy:
+            encoder = "Apple ProRes 422 (Proxy)";
+            break;
+        }
+    }
+    if (AV_CODEC_ID_DNXHD == videoCodec->id) {
+        DNxHDCodecProfileEnum dnxhdCodecProfile = (DNxHDCodecProfileEnum)_dnxhdCodecProfile->getValue();
+        switch (dnxhdCodecProfile) {
+        case eDNxHDCodecProfileHR444:
+            // http://users.mur.at/ms/attachments/dnxhr-444.mov
+            encoder = "DNxHR 444";
+            break;
+        case eDNxHDCodecProfileHRHQX:
+            // http://users.mur.at/ms/attachments/dnxhr-hqx.mov
+            encoder = "DNxHR HQX";
+            break;
+        case eDNxHDCodecProfileHRHQ:
+            encoder = "DNxHR HQ";
+            break;
+        case eDNxHDCodecProfileHRSQ:
+            encoder = "DNxHR SQ";
+            break;
+        case eDNxHDCodecProfileHRLB:
+            encoder = "DNxHR LB";
+            break;
+        case eDNxHDCodecProfile440x:
+        case eDNxHDCodecProfile220x:
+        case eDNxHDCodecProfile220:
+        case eDNxHDCodecProfile145:
+        case eDNxHDCodecProfile36:
+            encoder = "DNxHD";
+            break;
+        }
+    }
+    if (AV_CODEC_ID_CINEPAK == videoCodec->id) {
+        encoder = "Cinepak";
+    }
+    if (AV_CODEC_ID_SVQ1 == videoCodec->id) {
+        encoder = "Sorenson Video";
+    }
+    if (AV_CODEC_ID_SVQ3 == videoCodec->id) {
+        encoder = "Sorenson Video 3";
+    }
+    if (AV_CODEC_ID_MJPEG == videoCodec->id) {
+        encoder = "Photo - JPEG";
+    }
+    if (AV_CODEC_ID_JPEG2000 == videoCodec->id) {
+        encoder = "JPEG 2000";
+    }
+    if (AV_CODEC_ID_H263 == videoCodec->id) {
+        encoder = "H.263";
+    }
+    if (AV_CODEC_ID_H264 == videoCodec->id) {
+        encoder = "H.264";
+    }
+    if (AV_CODEC_ID_GIF == videoCodec->id) {
+        encoder = "GIF";
+    }
+    if (AV_CODEC_ID_PNG == videoCodec->id) {
+        encoder = "PNG";
+    }
+    if (AV_CODEC_ID_DPX == videoCodec->id) {
+        encoder = "DPX";
+    }
+    if (AV_CODEC_ID_TARGA == videoCodec->id) {
+        encoder = "TGA";
+    }
+    if (AV_CODEC_ID_TIFF == videoCodec->id) {
+        encoder = "TIFF";
+    }
+    if (AV_CODEC_ID_QTRLE == videoCodec->id) {
+        encoder = "Animation";
+    }
+    if (AV_CODEC_ID_8BPS == videoCodec->id) {
+        encoder = "Planar RGB";
+    }
+    if (AV_CODEC_ID_SMC == videoCodec->id) {
+        encoder = "Graphics";
+    }
+    if (AV_CODEC_ID_MSRLE == videoCodec->id) {
+        encoder = "BMP";
+    }
+    if (AV_CODEC_ID_RPZA == videoCodec->id) {
+        encoder = "Video";
+    }
+    // FFmpeg sets the encoder for XDCAM (see libavformat/movenc.c:find_compressor)
+    if (encoder != nullptr) {
+        av_dict_set(&_formatContext->metadata, "encoder", encoder, 0);
+    }
+
+    return true;
+} // WriteFFmpegPlugin::openOutput
+
+// How the statistics of the first pass are passed to the second pass of two-pass encoding.
+enum TwoPassStatsEnum {
+    eTwoPassStatsNone = 0, //< the encoder ignores AV_CODEC_FLAG_PASS1/AV_CODEC_FLAG_PASS2, two-pass encoding is not available
+    eTwoPassStatsContext, //< AVCodecContext::stats_out and AVCodecContext::stats_in
+    eTwoPassStatsX264, //< the encoder reads and writes its statistics file itself, see the "stats" option in libavcodec/libx264.c
+    eTwoPassStatsX265, //< the "pass" and "stats" entries of the "x265-params" option, libavcodec/libx265.c ignores the flags
+};
+
+static TwoPassStatsEnum
+encoderTwoPassStats(const AVCodec* avCodec)
+{
+    if (!avCodec) {
+        return eTwoPassStatsNone;
+    }
+    const char* name = avCodec->name;
+    if (!strcmp(name, "libx264") || !strcmp(name, "libx264rgb")) {
+        return eTwoPassStatsX264;
+    }
+    if (!strcmp(name, "libx265")) {
+        return eTwoPassStatsX265;
+    }
+    // the encoders which use stats_in and stats_out (the mpegvideo rate control, and the libraries wrapped with two-pass support)
+    const char* const contextEncoders[] = {
+        "mpeg1video", "mpeg2video", "mpeg4", "msmpeg4v2", "msmpeg4", "wmv1", "wmv2", "h263", "h263p", "flv", "snow",
+        "libxvid", "libtheora", "libvpx", "libvpx-vp9", "libaom-av1",
+    };
+    for (std::size_t i = 0; i < sizeof(contextEncoders) / sizeof(contextEncoders[0]); ++i) {
+        if (!strcmp(name, contextEncoders[i])) {
+            return eTwoPassStatsContext;
+        }
+    }
+
+    return eTwoPassStatsNone;
+}
+
+// Set the pass number and the statistics file of libx265, keeping the other x265 parameters.
+static void
+setX265Pass(AVCodecContext* avCodecContext,
+            const char* pass,
+            const string& statsFilename)
+{
+    // the dictionary is set directly rather than parsed from a string, since the file name may contain ':'
+    AVDictionary* params = nullptr;
+    av_opt_get_dict_val(avCodecContext->priv_data, "x265-params", 0, &params);
+    av_dict_set(&params, "pass", pass, 0);
+    av_dict_set(&params, "stats", statsFilename.c_str(), 0);
+    av_opt_set_dict_val(avCodecContext->priv_data, "x265-params", params, 0);
+    av_dict_free(&params);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// beginAnalysisPass
+// Open the first pass encoder of two-pass encoding, the file which stores the
+// frames for the second pass, and the file which stores the first pass
+// statistics. These files are in the same directory as the output file, and
+// are removed by freeFormat().
+// The codec context of the video stream must already be configured.
+//
+// @param videoCodec The video codec.
+//
+// @return true if successful,
+//         false otherwise, and an error message was set.
+//
+bool
+WriteFFmpegPlugin::beginAnalysisPass(const AVCodec* videoCodec)
+{
+    assert(!_analysisCodecContext && !_spoolFile && !_statsFile);
+    _analyzedFrames = 0;
+    _analysisTime = 0.;
+
+    MyAVStream analysisStream;
+    analysisStream.stream = _streamVideo.stream;
+    analysisStream.codecContext = avcodec_alloc_context3(videoCodec);
+    if (!analysisStream.codecContext) {
+        setPersistentMessage(Message::eMessageError, "", "could not allocate codec context");
+
+        return false;
+    }
+    _analysisCodecContext = analysisStream.codecContext;
+    // the first pass encoder has the same settings as the final encoder
+    configureVideoStream(videoCodec, &analysisStream);
+    configureVideoCodec(videoCodec, &analysisStream, _streamVideo.codecContext->pix_fmt, _pixelAspectRatio);
+    _analysisCodecContext->flags |= AV_CODEC_FLAG_PASS1;
+
+    _statsFilename = _filename + ".2pass.log";
+    _spoolFilename = _filename + ".2pass.frames";
+    const TwoPassStatsEnum statsMode = encoderTwoPassStats(videoCodec);
+    assert(statsMode != eTwoPassStatsNone);
+    if (statsMode == eTwoPassStatsX264) {
+        av_opt_set(_analysisCodecContext->priv_data, "stats", _statsFilename.c_str(), 0);
+    } else if (statsMode == eTwoPassStatsX265) {
+        setX265Pass(_analysisCodecContext, "1", _statsFilename);
+    } else {
+        _statsFile = OFX::fopen_utf8(_statsFilename.c_str(), "wb");
+        if (!_statsFile) {
+            setPersistentMessage(Message::eMessageError, "", string("Cannot create the two-pass statistics file ") + _statsFilename);
+
+            return false;
+        }
+    }
+    _spoolFile = OFX::fopen_utf8(_spoolFilename.c_str(), "wb");
+    if (!_spoolFile) {
+        setPersistentMessage(Message::eMessageError, "", string("Cannot create the two-pass frames file ") + _spoolFilename);
+
+        return false;
+    }
+
+    int error = avcodec_open2(_analysisCodecContext, videoCodec, nullptr);
+    if (error < 0) {
+        // Report the error.
+        char szError[1024] = { 0 };
+        av_strerror(error, szError, sizeof(szError));
+        setPersistentMessage(Message::eMessageError, "", string("Could not open video codec for the first pass: ") + szError);
+
+        return false;
+    }
+
+    return true;
+} // WriteFFmpegPlugin::beginAnalysisPass
+
+////////////////////////////////////////////////////////////////////////////////
+// encodeAnalysisFrame
+// Encode a frame with the first pass encoder. The packets are discarded, only
+// the statistics are kept.
+//
+// @param avFrame The frame to encode, or NULL to flush the encoder.
+//
+// @return 0 if successful,
+//         <0 otherwise.
+//
+int
+WriteFFmpegPlugin::encodeAnalysisFrame(const AVFrame* avFrame)
+{
+    int ret = avcodec_send_frame(_analysisCodecContext, avFrame);
+    if (ret < 0 && ret != AVERROR_EOF) {
+        return ret;
+    }
+    MyAVPacket pkt;
+    for (;;) {
+        ret = avcodec_receive_packet(_analysisCodecContext, pkt.pkt());
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        // see ffmpeg.c:1378 from ffmpeg 3.2.2
+        if (_statsFile && _analysisCodecContext->stats_out) {
+            if (std::fputs(_analysisCodecContext->stats_out, _statsFile) < 0) {
+                return AVERROR(EIO);
+            }
+        }
+        av_packet_unref(pkt.pkt());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// analyzeFrame
+// First pass of two-pass encoding: encode a frame converted by convertFrame()
+// with the first pass encoder, and store it for the second pass.
+//
+// @param avFrame The frame to encode, in the pixel format of the encoder. Its pts
+//                is set by this function.
+//
+// @return 0 if successful,
+//         <0 otherwise, and an error message was set.
+//
+int
+WriteFFmpegPlugin::analyzeFrame(AVFrame* avFrame)
+{
+    assert(_analysisCodecContext && _spoolFile);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // the frames are stored without padding
+    const int frameSize = av_image_get_buffer_size((AVPixelFormat)avFrame->format, avFrame->width, avFrame->height, 1);
+    if (frameSize <= 0) {
+        setPersistentMessage(Message::eMessageError, "", "Cannot store frame for the second pass");
+
+        return AVERROR(EINVAL);
+    }
+    _spoolBuffer.resize(frameSize);
+    int ret = av_image_copy_to_buffer(&_spoolBuffer[0], frameSize, avFrame->data, avFrame->linesize, (AVPixelFormat)avFrame->format, avFrame->width, avFrame->height, 1);
+    if (ret < 0 || std::fwrite(&_spoolBuffer[0], 1, frameSize, _spoolFile) != (std::size_t)frameSize) {
+        setPersistentMessage(Message::eMessageError, "", string("Cannot write to the two-pass frames file ") + _spoolFilename);
+
+        return AVERROR(EIO);
+    }
+
+    avFrame->pts = _analyzedFrames;
+    ret = encodeAnalysisFrame(avFrame);
+    if (ret < 0) {
+        // Report the error.
+        char szError[1024] = { 0 };
+        av_strerror(ret, szError, sizeof(szError));
+        setPersistentMessage(Message::eMessageError, "", string("Cannot encode frame (first pass): ") + szError);
+
+        return ret;
+    }
+    ++_analyzedFrames;
+    _analysisTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return 0;
+} // WriteFFmpegPlugin::analyzeFrame
+
+////////////////////////////////////////////////////////////////////////////////
+// encodeSecondPass
+// Second pass of two-pass encoding: flush the first pass encoder, open the
+// output with the first pass statistics, and encode the stored frames. The
+// final encoder is flushed by endEncode().
+// Fails if the render is aborted: the output is then not finalized, and the
+// stored frames are removed by freeFormat().
+//
+// @return true if successful,
+//         false otherwise, and an error message was set.
+//
+bool
+WriteFFmpegPlugin::encodeSecondPass()
+{
+    assert(_analysisCodecContext && _spoolFile);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int ret = encodeAnalysisFrame(nullptr);
+    const AVCodec* videoCodec = _analysisCodecContext->codec;
+    avcodec_free_context(&_analysisCodecContext);
+    if (ret < 0) {
+        setPersistentMessage(Message::eMessageError, "", "Cannot flush the first pass encoder");
+
+        return false;
+    }
+    _analysisTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    AVCodecContext* avCodecContext = _streamVideo.codecContext;
+    avCodecContext->flags |= AV_CODEC_FLAG_PASS2;
+    const TwoPassStatsEnum statsMode = encoderTwoPassStats(videoCodec);
+    if (statsMode == eTwoPassStatsX264) {
+        av_opt_set(avCodecContext->priv_data, "stats", _statsFilename.c_str(), 0);
+    } else if (statsMode == eTwoPassStatsX265) {
+        setX265Pass(avCodecContext, "2", _statsFilename);
+    } else {
+        // the statistics are passed as a string to the second pass encoder
+        assert(_statsFile);
+        long statsSize = -1;
+        if (std::fflush(_statsFile) == 0 && std::fseek(_statsFile, 0, SEEK_END) == 0) {
+            statsSize = std::ftell(_statsFile);
+        }
+        std::fclose(_statsFile);
+        _statsFile = nullptr;
+        std::FILE* statsFile = (statsSize >= 0) ? OFX::fopen_utf8(_statsFilename.c_str(), "rb") : nullptr;
+        char* stats = statsFile ? (char*)av_malloc(statsSize + 1) : nullptr;
+        if (!stats || std::fread(stats, 1, statsSize, statsFile) != (std::size_t)statsSize) {
+            av_free(stats);
+            if (statsFile) {
+                std::fclose(statsFile);
+            }
+            setPersistentMessage(Message::eMessageError, "", string("Cannot read the two-pass statistics file ") + _statsFilename);
+
+            return false;
+        }
+        std::fclose(statsFile);
+        stats[statsSize] = '\0';
+        av_freep(&avCodecContext->stats_in);
+        avCodecContext->stats_in = stats; // freed by freeFormat()
+    }
+
+    // read the frames from the beginning
+    std::fclose(_spoolFile);
+    _spoolFile = OFX::fopen_utf8(_spoolFilename.c_str(), "rb");
+    if (!_spoolFile) {
+        setPersistentMessage(Message::eMessageError, "", string("Cannot read the two-pass frames file ") + _spoolFilename);
+
+        return false;
+    }
+
+    if (!openOutput(videoCodec)) {
+        return false;
+    }
+
+    const AVPixelFormat pixelFormat = avCodecContext->pix_fmt;
+    const int width = avCodecContext->width;
+    const int height = avCodecContext->height;
+    const int frameSize = av_image_get_buffer_size(pixelFormat, width, height, 1);
+    if (frameSize <= 0) {
+        setPersistentMessage(Message::eMessageError, "", "Cannot read frames for the second pass");
+
+        return false;
+    }
+    _spoolBuffer.resize(frameSize);
+    uint8_t* spoolData[4];
+    int spoolLinesize[4];
+    av_image_fill_arrays(spoolData, spoolLinesize, &_spoolBuffer[0], pixelFormat, width, height, 1);
+    for (int i = 0; i < _analyzedFrames; ++i) {
+        if (abort()) {
+            setPersistentMessage(Message::eMessageError, "", "Render aborted during the second pass of two-pass encoding");
+
+            return false;
+        }
+        if (std::fread(&_spoolBuffer[0], 1, frameSize, _spoolFile) != (std::size_t)frameSize) {
+            setPersistentMessage(Message::eMessageError, "", string("Cannot read the two-pass frames file ") + _spoolFilename);
+
+            return false;
+        }
+        std::shared_ptr<AVFrame> avFrame = _outputFramePool.get(width, height, pixelFormat);
+        if (!avFrame) {
+            setPersistentMessage(Message::eMessageError, "", "Cannot allocate frame");
+
+            return false;
+        }
+        av_image_copy(avFrame->data, avFrame->linesize, (const uint8_t**)spoolData, spoolLinesize, pixelFormat, width, height);
+        avFrame->quality = avCodecContext->global_quality;
+        avFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        if (writeToFile(_formatContext, false, avFrame.get())) {
+            return false;
+        }
+    }
+
+    return true;
+} // WriteFFmpegPlugin::encodeSecondPass
+
+
+////////////////////////////////////////////////////////////////////////////////
+// getSegment
+// Get the segment which contains a frame, in segmented encoding mode. The
+// segment is created if needed, but not opened.
+// _nextFrameToEncodeMutex must be locked.
+//
+// @param time The frame index.
+//
+// @return The segment which contains the frame.
+//
+MovieSegment*
+WriteFFmpegPlugin::getSegment(int time)
+{
+    assert(_segmentFrames > 0);
+    const int index = (time >= _firstFrameToEncode) ? ((time - _firstFrameToEncode) / _frameStep) / _segmentFrames : 0;
+    MovieSegment& segment = _segments[index];
+    if (segment.nextFrame == INT_MIN) {
+        segment.nextFrame = _firstFrameToEncode + index * _segmentFrames * _frameStep;
+        segment.lastFrame = (std::min)(segment.nextFrame + (_segmentFrames - 1) * _frameStep, _lastFrameToEncode);
+        std::stringstream ss;
+        ss << _filename << ".segment" << index;
+        segment.filename = ss.str();
+    }
+
+    return &segment;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// openSegment
+// Open the encoder and the temporary file of a segment, and write the file
+// header. The segment uses the same container and encoder settings as the
+// output file.
+//
+// @param segment The segment to open.
+//
+// @return true if successful,
+//         false otherwise, and an error message was set.
+//
+bool
+WriteFFmpegPlugin::openSegment(MovieSegment* segment)
+{
+    assert(segment && !segment->formatContext && _streamVideo.codecContext);
+    const AVCodec* videoCodec = _streamVideo.codecContext->codec;
+    avformat_alloc_output_context2(&segment->formatContext, _formatContext->oformat, nullptr, segment->filename.c_str());
+    if (!segment->formatContext) {
+        setPersistentMessage(Message::eMessageError, "", "could not allocate segment output context");
+
+        return false;
+    }
+    segment->stream.stream = avformat_new_stream(segment->formatContext, videoCodec);
+    segment->stream.codecContext = avcodec_alloc_context3(videoCodec);
+    if (!segment->stream.stream || !segment->stream.codecContext) {
+        setPersistentMessage(Message::eMessageError, "", "could not allocate segment stream");
+
+        return false;
+    }
+    configureVideoStream(videoCodec, &segment->stream);
+    configureVideoCodec(videoCodec, &segment->stream, _streamVideo.codecContext->pix_fmt, _pixelAspectRatio);
+
+    int error = avcodec_open2(segment->stream.codecContext, videoCodec, nullptr);
+    if (error >= 0) {
+        error = avcodec_parameters_from_context(segment->stream.stream->codecpar, segment->stream.codecContext);
+    }
+    if (error >= 0) {
+        error = avio_open(&segment->formatContext->pb, segment->filename.c_str(), AVIO_FLAG_WRITE);
+    }
+    if (error >= 0) {
+        error = avformat_write_header(segment->formatContext, nullptr);
+    }
+    if (error < 0) {
+        // Report the error.
+        char szError[1024] = { 0 };
+        av_strerror(error, szError, sizeof(szError));
+        setPersistentMessage(Message::eMessageError, "", string("Unable to open segment ") + segment->filename + ": " + szError);
+
+        return false;
+    }
+
+    return true;
+} // WriteFFmpegPlugin::openSegment
+
+////////////////////////////////////////////////////////////////////////////////
+// encodeSegmentFrame
+// Encode a frame of a segment, and write the packets to the segment file.
+//
+// @param segment The segment.
+// @param avFrame The frame to encode, in the pixel format of the encoder, or
+//                NULL to flush the encoder. Its pts is set by this function.
+//
+// @return 0 if successful,
+//         <0 otherwise, and an error message was set.
+//
+int
+WriteFFmpegPlugin::encodeSegmentFrame(MovieSegment* segment,
+                                      AVFrame* avFrame)
+{
+    AVCodecContext* avCodecContext = segment->stream.codecContext;
+    AVStream* avStream = segment->stream.stream;
+    if (avFrame) {
+        // the timestamps of each segment start at 0, see concatSegments()
+        avFrame->pts = segment->encodedFrames++;
+    }
+    int ret = avcodec_send_frame(avCodecContext, avFrame);
+    MyAVPacket pkt;
+    while (ret >= 0 || ret == AVERROR_EOF) {
+        ret = avcodec_receive_packet(avCodecContext, pkt.pkt());
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        }
+        if (ret < 0) {
+            break;
+        }
+        av_packet_rescale_ts(pkt.pkt(), avCodecContext->time_base, avStream->time_base);
+        pkt->stream_index = avStream->index;
+        ret = av_write_frame(segment->formatContext, pkt.pkt());
+        av_packet_unref(pkt.pkt());
+    }
+    // Report the error.
+    char szError[1024] = { 0 };
+    av_strerror(ret, szError, sizeof(szError));
+    setPersistentMessage(Message::eMessageError, "", string("Cannot encode segment ") + segment->filename + ": " + szError);
+
+    return ret;
+} // WriteFFmpegPlugin::encodeSegmentFrame
+
+////////////////////////////////////////////////////////////////////////////////
+// closeSegment
+// Flush the encoder of a segment, write the file trailer, and release the
+// encoder and the file. The segment file is kept for concatSegments().
+//
+// @param segment The segment.
+//
+// @return 0 if successful,
+//         <0 otherwise, and an error message was set.
+//
+int
+WriteFFmpegPlugin::closeSegment(MovieSegment* segment)
+{
+    assert(segment->formatContext);
+    int ret = encodeSegmentFrame(segment, nullptr);
+    if (ret == 0) {
+        ret = av_write_trailer(segment->formatContext);
+        if (ret < 0) {
+            setPersistentMessage(Message::eMessageError, "", string("Cannot finalize segment ") + segment->filename);
+        }
+    }
+    avio_closep(&segment->formatContext->pb);
+    avformat_free_context(segment->formatContext);
+    segment->formatContext = nullptr;
+    segment->stream.stream = nullptr;
+    avcodec_free_context(&segment->stream.codecContext);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// concatSegments
+// Close the segments which are still open (e.g. the last segment, if the
+// render was aborted), and copy the packets of all segments to the video
+// stream of the output file, in order.
+//
+// @return true if successful,
+//         false otherwise, and an error message was set.
+//
+bool
+WriteFFmpegPlugin::concatSegments()
+{
+    for (map<int, MovieSegment>::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        if (it->second.formatContext && closeSegment(&it->second) < 0) {
+            return false;
+        }
+    }
+
+    AVStream* avStream = _streamVideo.stream;
+    const AVRational frameTimeBase = _streamVideo.codecContext->time_base;
+    int64_t frameOffset = 0;
+    MyAVPacket pkt;
+    for (map<int, MovieSegment>::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        const MovieSegment& segment = it->second;
+        if (!segment.encodedFrames) {
+            continue;
+        }
+        AVFormatContext* segmentFormatContext = nullptr;
+        int error = avformat_open_input(&segmentFormatContext, segment.filename.c_str(), nullptr, nullptr);
+        if (error >= 0 && segmentFormatContext->nb_streams < 1) {
+            error = AVERROR_STREAM_NOT_FOUND;
+        }
+        while (error >= 0) {
+            error = av_read_frame(segmentFormatContext, pkt.pkt());
+            if (error < 0) {
+                break;
+            }
+            const AVStream* segmentStream = segmentFormatContext->streams[pkt->stream_index];
+            // stream copy: only the timestamps change, shifted by the frames of the previous segments
+            if (pkt->pts != AV_NOPTS_VALUE) {
+                pkt->pts = av_rescale_q(av_rescale_q(pkt->pts, segmentStream->time_base, frameTimeBase) + frameOffset, frameTimeBase, avStream->time_base);
+            }
+            if (pkt->dts != AV_NOPTS_VALUE) {
+                pkt->dts = av_rescale_q(av_rescale_q(pkt->dts, segmentStream->time_base, frameTimeBase) + frameOffset, frameTimeBase, avStream->time_base);
+            }
+            pkt->duration = av_rescale_q(pkt->duration, segmentStream->time_base, avStream->time_base);
+            pkt->stream_index = avStream->index;
+            pkt->pos = -1;
+            error = av_write_frame(_formatContext, pkt.pkt());
+            av_packet_unref(pkt.pkt());
+        }
+        if (segmentFormatContext) {
+            avformat_close_input(&segmentFormatContext);
+        }
+        if (error < 0 && error != AVERROR_EOF) {
+            // Report the error.
+            char szError[1024] = { 0 };
+            av_strerror(error, szError, sizeof(szError));
+            setPersistentMessage(Message::eMessageError, "", string("Cannot copy segment ") + segment.filename + ": " + szError);
+
+            return false;
+        }
+        frameOffset += segment.encodedFrames;
+    }
+
+    return true;
+} // WriteFFmpegPlugin::concatSegments
+
+// Release the segments, and remove their files.
+void
+WriteFFmpegPlugin::freeSegments()
+{
+    for (map<int, MovieSegment>::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        MovieSegment& segment = it->second;
+        if (segment.formatContext) {
+            avio_closep(&segment.formatContext->pb);
+            avformat_free_context(segment.formatContext);
+            segment.formatContext = nullptr;
+        }
+        avcodec_free_context(&segment.stream.codecContext);
+        if (!segment.filename.empty() && OFX::exists_utf8(segment.filename.c_str())) {
+            OFX::remove_utf8(segment.filename.c_str());
+        }
+    }
+    _segments.clear();
+    _segmentFrames = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3620,7 +5232,7 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
         return;
     }
 
-    assert(!_convertCtx);
+    assert(_convertCtxPool.empty());
 
     // first, check that the codec setting is OK
     checkCodec();
@@ -3744,7 +5356,7 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
     }
 
     // Test if the container recognises the codec type.
-    bool isCodecSupportedInContainer = codecCompatible(avOutputFormat, codecId);
+    bool isCodecSupportedInContainer = this->isCodecSupportedInContainer(avOutputFormat, codecId, videoCodec);
     // mov seems to be able to cope with anything, which the above function doesn't seem to think is the case (even with FF_COMPLIANCE_EXPERIMENTAL)
     // and it doesn't return -1 for in this case, so we'll special-case this situation to allow this
     // isCodecSupportedInContainer |= (strcmp(_formatContext->oformat->name, "mov") == 0); // commented out [FD]: recent ffmpeg gives correct answer
@@ -3807,281 +5419,82 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
             return;
         }
 
-        AVCodecContext* avCodecContext = _streamVideo.codecContext;
-        avCodecContext->pix_fmt = targetPixelFormat;
-
 #if OFX_FFMPEG_SCRATCHBUFFER
         std::size_t picSize = av_image_get_buffer_size(targetPixelFormat,
-                                                       max(avCodecContext->width, rodPixel.x2 - rodPixel.x1),
-                                                       max(avCodecContext->height, rodPixel.y2 - rodPixel.y1), 1);
+                                                       max(_streamVideo.codecContext->width, rodPixel.x2 - rodPixel.x1),
+                                                       max(_streamVideo.codecContext->height, rodPixel.y2 - rodPixel.y1), 1);
         if (_scratchBufferSize < picSize) {
             delete[] _scratchBuffer;
-            _scratchBuffer = new uint8_t[picSize];
-            _scratchBufferSize = picSize;
-        }
-#endif
-
-        avCodecContext->bits_per_raw_sample = FFmpeg::pixelFormatBitDepth(targetPixelFormat);
-        avCodecContext->sample_aspect_ratio = av_d2q(pixelAspectRatio, 255);
-
-        // Now that the stream has been created, and the pixel format
-        // is known, for DNxHD, set the YUV range.
-        if (AV_CODEC_ID_DNXHD == avCodecContext->codec_id) {
-            int encodeVideoRange = _encodeVideoRange->getValue();
-            // Set the metadata for the YUV range. This modifies the appropriate
-            // field in the 'ACLR' atom in the video sample description.
-            // Set 'full range' = 1 or 'legal range' = 2.
-            avCodecContext->color_range = encodeVideoRange ? AVColorRange::AVCOL_RANGE_MPEG : AVColorRange::AVCOL_RANGE_JPEG;
-        }
-
-        // Bug 45010 The following flags must be set BEFORE calling
-        // openCodec (avcodec_open2). This will ensure that codec
-        // specific data is created and initialized. (E.g. for MPEG4
-        // the AVCodecContext::extradata will contain Elementary Stream
-        // Descriptor which is required for QuickTime to decode the
-        // stream.)
-        // Some formats want stream headers to be separate.
-        // see ffmpeg_opt.c:1408 in ffmpeg 3.3.3
-        if ((_formatContext->oformat->flags & AVFMT_GLOBALHEADER) || !strcmp(_formatContext->oformat->name, "mp4") || !strcmp(_formatContext->oformat->name, "mov") || !strcmp(_formatContext->oformat->name, "3gp")) {
-            avCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-        }
-        if (codecId == AV_CODEC_ID_PRORES) {
-            int index = _codec->getValue();
-            const vector<string>& codecsShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
-            assert(index < (int)codecsShortNames.size());
-            // avCodecContext->profile = getProfileFromShortName(codecsShortNames[index]);
-            av_opt_set(avCodecContext->priv_data, "profile", getProfileStringFromShortName(codecsShortNames[index]), 0);
-            av_opt_set(avCodecContext->priv_data, "bits_per_mb", "8000", 0);
-            // ProRes vendor should be apl0
-            // ref: https://ffmpeg.org/ffmpeg-all.html#toc-Private-Options-for-prores_002dks
-            av_opt_set(avCodecContext->priv_data, "vendor", "apl0", 0);
-        }
-        // The default vendor ID is "FFMP" (FFmpeg), and it is hardcoded (see mov_write_video_tag in libavformat/movenc.c)
-        // Some tools may check that QuickTime movies were made by Apple ("appl", as seen in exiftool source).
-        // Maybe one day a future version of movenc.c will use it rather than the hardcoded FFMP.
-        // if ( !strcmp(_formatContext->oformat->name, "mov") ) {
-        //    av_opt_set(_formatContext->metadata, "vendor", "appl", 0);
-        //}
-
-        // Activate multithreaded decoding. This must be done before opening the codec; see
-        // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
-#ifdef AV_CODEC_CAP_AUTO_THREADS
-        if (avCodecContext->codec->capabilities & AV_CODEC_CAP_AUTO_THREADS) {
-            avCodecContext->thread_count = 0;
-        } else
-#endif
-        {
-            avCodecContext->thread_count = (std::min)((int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS);
-        }
-#ifdef AV_CODEC_CAP_SLICE_THREADS
-        if (avCodecContext->codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
-            // multiple threads are used to decode a single frame. Reduces delay
-            // also, mjpeg prefers this, see libavfocodec/frame_thread_encoder.c:ff_frame_thread_encoder_init()
-            avCodecContext->thread_type = FF_THREAD_SLICE;
-        }
-#endif
-
-#if OFX_FFMPEG_PRINT_CODECS
-        std::cout << "Format: " << _formatContext->oformat->name << " Codec: " << videoCodec->name << " rgbBufferPixelFormat: " << av_get_pix_fmt_name(rgbBufferPixelFormat) << " targetPixelFormat: " << av_get_pix_fmt_name(targetPixelFormat) << " infoBitDepth: " << _infoBitDepth->getValue() << " Profile: " << _streamVideo->codec->profile << std::endl;
-#endif //  FFMPEG_PRINT_CODECS
-        if (openCodec(_formatContext, videoCodec, &_streamVideo) < 0) {
-            freeFormat();
-            throwSuiteStatusException(kOfxStatFailed);
-
-            return;
-        }
-
-        avcodec_parameters_from_context(_streamVideo.stream->codecpar, avCodecContext);
-
-        if (!(avOutputFormat->flags & AVFMT_NOFILE)) {
-            int error = avio_open(&_formatContext->pb, filename.c_str(), AVIO_FLAG_WRITE);
-            if (error < 0) {
-                // Report the error.
-                char szError[1024] = { 0 };
-                av_strerror(error, szError, sizeof(szError));
-                setPersistentMessage(Message::eMessageError, "", string("Unable to open file: ") + szError);
-                freeFormat();
-                throwSuiteStatusException(kOfxStatFailed);
-
-                return;
-            }
-        }
-
-        // avformat_init_output may set the "encoder" metadata (see libavformat/muc.c:init_muxer)
-        int error = avformat_init_output(_formatContext, nullptr);
-        if (error < 0) {
-            // Report the error.
-            char szError[1024] = { 0 };
-            av_strerror(error, szError, sizeof(szError));
-            setPersistentMessage(Message::eMessageError, "", string("Unable to initialize output: ") + szError);
-            freeFormat();
-            throwSuiteStatusException(kOfxStatFailed);
+            _scratchBuffer = new uint8_t[picSize];
+            _scratchBufferSize = picSize;
+        }
+#endif
 
-            return;
+        configureVideoCodec(videoCodec, &_streamVideo, targetPixelFormat, pixelAspectRatio);
+
+        // Two-pass encoding is only useful if the encoder targets a bitrate (see configureVideoStream()).
+        _twoPassEncoding = false;
+        if (_twoPass->getValue()) {
+            CodecParams p;
+            getCodecSupportedParams(videoCodec, &p);
+            _twoPassEncoding = p.bitrate && (encoderTwoPassStats(videoCodec) != eTwoPassStatsNone) && !(p.crf && (CRFEnum)_crf->getValue() != eCRFNone) && !(p.qscale && _qscale->getValue() >= 0.);
         }
 
-        std::string movflags = "write_colr";
-        if (_fastStart->getValue()) {
-            movflags += "+faststart";
+        // Segmented encoding is only possible if the frames are encoded independently.
+        _segmentFrames = 0;
+        const AVCodecDescriptor* codecDesc = avcodec_descriptor_get(videoCodec->id);
+        if (codecDesc && (codecDesc->props & AV_CODEC_PROP_INTRA_ONLY) && !(avOutputFormat->flags & AVFMT_NOFILE)) {
+            _segmentFrames = (std::max)(0, _segmentLength->getValue());
+        }
+        if (_segmentFrames > 0) {
+            _twoPassEncoding = false;
         }
 
-        AVDictionary* header_params = nullptr;
-        av_dict_set(&header_params, "movflags", movflags.c_str(), 0);
+#if OFX_FFMPEG_PRINT_CODECS
+        std::cout << "Format: " << _formatContext->oformat->name << " Codec: " << videoCodec->name << " rgbBufferPixelFormat: " << av_get_pix_fmt_name(rgbBufferPixelFormat) << " targetPixelFormat: " << av_get_pix_fmt_name(targetPixelFormat) << " infoBitDepth: " << _infoBitDepth->getValue() << " Profile: " << _streamVideo->codec->profile << std::endl;
+#endif //  FFMPEG_PRINT_CODECS
+        if (_twoPassEncoding) {
+            // The frames stored for the second pass may fill the disk: check their size before rendering.
+            const int64_t spoolFrameSize = av_image_get_buffer_size(targetPixelFormat, _streamVideo.codecContext->width, _streamVideo.codecContext->height, 1);
+            const int64_t spoolFrames = ((int64_t)args.frameRange.max - (int64_t)args.frameRange.min) / (std::max)(1, (int)args.frameStep) + 1;
+            if ((spoolFrameSize * spoolFrames) > ((int64_t)OFX_FFMPEG_TWO_PASS_SPOOL_MB << 20)) {
+                stringstream ss;
+                ss << "Two-pass encoding would store " << ((spoolFrameSize * spoolFrames) >> 20) << "MB of frames next to the output, more than the limit of "
+                   << OFX_FFMPEG_TWO_PASS_SPOOL_MB << "MB. Render a shorter frame range, or disable Two-Pass Encoding.";
+                setPersistentMessage(Message::eMessageError, "", ss.str());
+                freeFormat();
+                throwSuiteStatusException(kOfxStatFailed);
 
-        error = avformat_write_header(_formatContext, NULL);
-        if (error < 0) {
-            // Report the error.
-            char szError[1024] = { 0 };
-            av_strerror(error, szError, sizeof(szError));
-            setPersistentMessage(Message::eMessageError, "", string("Unable to write file header: ") + szError);
+                return;
+            }
+            // The frames are analyzed by a first pass encoder during the render, and the output is
+            // opened by endEncode(), when the statistics of the first pass are known.
+            if (!beginAnalysisPass(videoCodec)) {
+                freeFormat();
+                throwSuiteStatusException(kOfxStatFailed);
+
+                return;
+            }
+        } else if (!openOutput(videoCodec)) {
             freeFormat();
             throwSuiteStatusException(kOfxStatFailed);
 
             return;
         }
-
-        // Special behaviour.
-        // Valid on Aug 2014 for ffmpeg v2.1.4
-        //
-        // R.e. libavformat/movenc.c::mov_write_udta_tag
-        // R.e. libavformat/movenc.c::mov_write_string_metadata
-        //
-        // Remove all ffmpeg references from the QuickTime movie.
-        // The 'encoder' key in the AVFormatContext metadata will
-        // result in the writer adding @swr with libavformat
-        // version information in the 'udta' atom.
-        //
-        // Prevent the @swr libavformat reference from appearing
-        // in the 'udta' atom by setting the 'encoder' key in the
-        // metadata to null. From movenc.c a zero length value
-        // will not be written to the 'udta' atom.
-        //
-        AVDictionaryEntry* tag = av_dict_get(_formatContext->metadata, "encoder", nullptr, AV_DICT_IGNORE_SUFFIX);
-        if (tag) {
-            av_dict_set(&_formatContext->metadata, "encoder", videoCodec->name, 0);
-        }
-    }
-
-    // Set the stream encoder to proper values for ProRes, DNxHD/DNxHR, and others (used in MOV)
-    // see:
-    // - https://trac.ffmpeg.org/ticket/6465
-    // - https://lists.ffmpeg.org/pipermail/ffmpeg-user/2015-May/026742.html
-    // - https://forum.blackmagicdesign.com/viewtopic.php?f=21&t=51457#p355458
-    const char* encoder = nullptr;
-    if (codecId == AV_CODEC_ID_PRORES) {
-        int index = _codec->getValue();
-        const vector<string>& codecsShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
-        assert(index < (int)codecsShortNames.size());
-        switch (getProfileFromShortName(codecsShortNames[index])) {
-        case kProresProfile4444XQ:
-            encoder = "Apple ProRes 4444 (XQ)";
-            break;
-        case kProresProfile4444:
-            encoder = "Apple ProRes 4444";
-            break;
-        case kProresProfileHQ:
-            encoder = "Apple ProRes 422 (HQ)";
-            break;
-        case kProresProfileSQ:
-            encoder = "Apple ProRes 422";
-            break;
-        case kProresProfileLT:
-            encoder = "Apple ProRes 422 (LT)";
-            break;
-        case kProresProfileProxy:
-            encoder = "Apple ProRes 422 (Proxy)";
-            break;
-        }
-    }
-    if (AV_CODEC_ID_DNXHD == videoCodec->id) {
-        DNxHDCodecProfileEnum dnxhdCodecProfile = (DNxHDCodecProfileEnum)_dnxhdCodecProfile->getValue();
-        switch (dnxhdCodecProfile) {
-        case eDNxHDCodecProfileHR444:
-            // http://users.mur.at/ms/attachments/dnxhr-444.mov
-            encoder = "DNxHR 444";
-            break;
-        case eDNxHDCodecProfileHRHQX:
-            // http://users.mur.at/ms/attachments/dnxhr-hqx.mov
-            encoder = "DNxHR HQX";
-            break;
-        case eDNxHDCodecProfileHRHQ:
-            encoder = "DNxHR HQ";
-            break;
-        case eDNxHDCodecProfileHRSQ:
-            encoder = "DNxHR SQ";
-            break;
-        case eDNxHDCodecProfileHRLB:
-            encoder = "DNxHR LB";
-            break;
-        case eDNxHDCodecProfile440x:
-        case eDNxHDCodecProfile220x:
-        case eDNxHDCodecProfile220:
-        case eDNxHDCodecProfile145:
-        case eDNxHDCodecProfile36:
-            encoder = "DNxHD";
-            break;
-        }
-    }
-    if (AV_CODEC_ID_CINEPAK == videoCodec->id) {
-        encoder = "Cinepak";
-    }
-    if (AV_CODEC_ID_SVQ1 == videoCodec->id) {
-        encoder = "Sorenson Video";
-    }
-    if (AV_CODEC_ID_SVQ3 == videoCodec->id) {
-        encoder = "Sorenson Video 3";
-    }
-    if (AV_CODEC_ID_MJPEG == videoCodec->id) {
-        encoder = "Photo - JPEG";
-    }
-    if (AV_CODEC_ID_JPEG2000 == videoCodec->id) {
-        encoder = "JPEG 2000";
-    }
-    if (AV_CODEC_ID_H263 == videoCodec->id) {
-        encoder = "H.263";
-    }
-    if (AV_CODEC_ID_H264 == videoCodec->id) {
-        encoder = "H.264";
-    }
-    if (AV_CODEC_ID_GIF == videoCodec->id) {
-        encoder = "GIF";
-    }
-    if (AV_CODEC_ID_PNG == videoCodec->id) {
-        encoder = "PNG";
-    }
-    if (AV_CODEC_ID_DPX == videoCodec->id) {
-        encoder = "DPX";
-    }
-    if (AV_CODEC_ID_TARGA == videoCodec->id) {
-        encoder = "TGA";
-    }
-    if (AV_CODEC_ID_TIFF == videoCodec->id) {
-        encoder = "TIFF";
-    }
-    if (AV_CODEC_ID_QTRLE == videoCodec->id) {
-        encoder = "Animation";
-    }
-    if (AV_CODEC_ID_8BPS == videoCodec->id) {
-        encoder = "Planar RGB";
-    }
-    if (AV_CODEC_ID_SMC == videoCodec->id) {
-        encoder = "Graphics";
-    }
-    if (AV_CODEC_ID_MSRLE == videoCodec->id) {
-        encoder = "BMP";
-    }
-    if (AV_CODEC_ID_RPZA == videoCodec->id) {
-        encoder = "Video";
-    }
-    // FFmpeg sets the encoder for XDCAM (see libavformat/movenc.c:find_compressor)
-    if (encoder != nullptr) {
-        av_dict_set(&_formatContext->metadata, "encoder", encoder, 0);
     }
 
     // Flag that we didn't encode any frame yet
     {
         tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
         _nextFrameToEncode = (int)args.frameRange.min;
+        _pendingFrames.clear();
+        _encodingFrames = false;
+        // bound the memory used by the frames waiting to be encoded
+        const int frameSize = av_image_get_buffer_size(_streamVideo.codecContext->pix_fmt, _streamVideo.codecContext->width, _streamVideo.codecContext->height, 32);
+        // (a single budget for all segments, so that encoding several segments does not use more memory)
+        _frameBytes = (frameSize > 0) ? frameSize : 1;
+        _pendingFrameBytes = 0;
+        _maxPendingFrameBytes = (frameSize > 0) ? max((int64_t)frameSize, (int64_t)OFX_FFMPEG_REORDER_BUFFER_MB << 20) : 1;
         _firstFrameToEncode = (int)args.frameRange.min;
         _lastFrameToEncode = (int)args.frameRange.max;
         _frameStep = (int)args.frameStep;
@@ -4148,11 +5561,34 @@ WriteFFmpegPlugin::encode(const string& filename,
         return;
     }
 
-    /// Check that we're really encoding in sequential order
+    // Frames may be rendered in parallel by the host, but they must be encoded in sequential order.
+    // The conversion to the codec pixel format is done in parallel by each render thread, and the
+    // converted frames are stored in _pendingFrames until all previous frames are encoded.
+    // When the memory used by the pending frames reaches OFX_FFMPEG_REORDER_BUFFER_MB, frames wait before
+    // being converted, except the next frame to encode, so that the encoding always progresses.
+    // In segmented mode, each segment has its own encoder, its own pending frames, and its own next
+    // frame to encode, so that several segments can be encoded at the same time.
+    int* nextFrameToEncode = &_nextFrameToEncode;
+    map<int, std::shared_ptr<AVFrame>>* pendingFrames = &_pendingFrames;
+    bool* encodingFrames = &_encodingFrames;
+    MovieSegment* segment = nullptr;
     {
         tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
 
-        while (_nextFrameToEncode != time && _nextFrameToEncode != INT_MIN) {
+        if (_segmentFrames > 0 && _nextFrameToEncode != INT_MIN) {
+            segment = getSegment((int)time);
+            nextFrameToEncode = &segment->nextFrame;
+            pendingFrames = &segment->pendingFrames;
+            encodingFrames = &segment->encoding;
+        }
+
+        while (_nextFrameToEncode != INT_MIN && (int)time != *nextFrameToEncode && (_pendingFrameBytes + _frameBytes) > _maxPendingFrameBytes) {
+            if (abort()) {
+                // the frames this one waits for may never come
+                _nextFrameToEncode = INT_MIN;
+                _nextFrameToEncodeCond.notify_all();
+                break;
+            }
             _nextFrameToEncodeCond.wait(guard);
         }
 
@@ -4165,36 +5601,138 @@ WriteFFmpegPlugin::encode(const string& filename,
 
             return;
         }
-        try {
-            _error = IGNORE_FINISH;
+        if (((int)time < *nextFrameToEncode) || pendingFrames->count((int)time)) {
+            _nextFrameToEncode = INT_MIN;
+            _nextFrameToEncodeCond.notify_all();
+            setPersistentMessage(Message::eMessageError, "", "Frames must be rendered in sequential order, and only once");
+            throwSuiteStatusException(kOfxStatFailed);
 
-            if (_isOpen) {
-                _error = CLEANUP;
+            return;
+        }
+        // released when the frame is encoded
+        _pendingFrameBytes += _frameBytes;
+    }
 
-                if (!_streamVideo.stream) {
-                    throwSuiteStatusException(kOfxStatErrBadHandle);
+    std::shared_ptr<AVFrame> avFrame;
+    if (convertFrame(_streamVideo.codecContext, pixelData, &bounds, pixelDataNComps, rowBytes, &avFrame) < 0) {
+        tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
+        _pendingFrameBytes -= _frameBytes;
+        _nextFrameToEncode = INT_MIN;
+        _nextFrameToEncodeCond.notify_all();
+        setPersistentMessage(Message::eMessageError, "", "Cannot convert frame to the codec pixel format");
+        throwSuiteStatusException(kOfxStatFailed);
 
-                    return;
-                }
-                assert(_formatContext);
-                if (!writeToFile(_formatContext, false, time, pixelData, &bounds, pixelDataNComps, dstNComps, rowBytes)) {
-                    _error = SUCCESS;
-                    _nextFrameToEncode = (int)time + _frameStep;
-                    if (abort()) {
-                        _nextFrameToEncode = INT_MIN;
-                    }
-                } else {
-                    throwSuiteStatusException(kOfxStatFailed);
+        return;
+    }
 
-                    return;
+    tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
+    if (_nextFrameToEncode == INT_MIN) {
+        // Another thread aborted
+        _pendingFrameBytes -= _frameBytes;
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    if (segment && !segment->formatContext && segment->encodedFrames) {
+        // the segment was already closed
+        _pendingFrameBytes -= _frameBytes;
+        _nextFrameToEncode = INT_MIN;
+        _nextFrameToEncodeCond.notify_all();
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    (*pendingFrames)[(int)time] = avFrame;
+    avFrame.reset();
+    if (*encodingFrames) {
+        // the thread which is encoding (or opening the segment) will also encode this frame when its turn comes
+        return;
+    }
+
+    // encode all the pending frames that are ready, in order. Only one thread encodes at a time
+    // (or one thread per segment).
+    *encodingFrames = true;
+    bool failed = false;
+    if (segment && !segment->formatContext) {
+        // a segment is opened when its first frame is ready, and closed after its last frame is encoded.
+        // Creating the file and opening the encoder may be slow: the lock is released meanwhile, and the
+        // encoding flag keeps the other threads from using the segment until it is open.
+        _nextFrameToEncodeMutex.unlock();
+        bool opened;
+        try {
+            opened = openSegment(segment);
+        } catch (const std::exception&) {
+            opened = false;
+        }
+        _nextFrameToEncodeMutex.lock();
+        if (!opened) {
+            _nextFrameToEncode = INT_MIN;
+            failed = true;
+        }
+    }
+    map<int, std::shared_ptr<AVFrame>>::iterator it;
+    while (_nextFrameToEncode != INT_MIN &&
+           (it = pendingFrames->find(*nextFrameToEncode)) != pendingFrames->end()) {
+        std::shared_ptr<AVFrame> frame = it->second;
+        const int frameToEncode = it->first;
+        pendingFrames->erase(it);
+
+        // set under the lock: another segment may be setting SUCCESS at the same time
+        _error = CLEANUP;
+        // other threads may add frames while this one is encoding
+        _nextFrameToEncodeMutex.unlock();
+        int ret;
+        try {
+            assert(_formatContext);
+            if (segment) {
+                ret = encodeSegmentFrame(segment, frame.get());
+                if (!ret && frameToEncode >= segment->lastFrame) {
+                    ret = closeSegment(segment);
                 }
+            } else if (_twoPassEncoding) {
+                ret = analyzeFrame(frame.get());
+            } else {
+                ret = writeToFile(_formatContext, false, frame.get());
             }
-        } catch (const std::exception& e) {
+        } catch (const std::exception&) {
+            ret = -1;
+        }
+        frame.reset();
+        _nextFrameToEncodeMutex.lock();
+        _pendingFrameBytes -= _frameBytes;
+
+        if (ret) {
             _nextFrameToEncode = INT_MIN;
-            throw e;
+            failed = true;
+        } else if (_nextFrameToEncode != INT_MIN) {
+            // do not overwrite the failure flag set by another thread while the lock was released
+            _error = SUCCESS;
+            *nextFrameToEncode = frameToEncode + _frameStep;
+            if (abort()) {
+                _nextFrameToEncode = INT_MIN;
+            }
         }
+        // wake up the threads waiting for memory
+        _nextFrameToEncodeCond.notify_all();
+    }
+    *encodingFrames = false;
+    if (_nextFrameToEncode == INT_MIN) {
         _nextFrameToEncodeCond.notify_all();
-    } // MultiThread::AutoMutex lock(_nextFrameToEncodeMutex);
+        // release the frames that will never be encoded. Frames still being converted by other
+        // threads release their own share when these threads see the failure.
+        int64_t droppedFrames = (int64_t)_pendingFrames.size();
+        _pendingFrames.clear();
+        for (map<int, MovieSegment>::iterator its = _segments.begin(); its != _segments.end(); ++its) {
+            droppedFrames += (int64_t)its->second.pendingFrames.size();
+            its->second.pendingFrames.clear();
+        }
+        _pendingFrameBytes -= droppedFrames * _frameBytes;
+    }
+    if (failed) {
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
 } // WriteFFmpegPlugin::encode
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -4221,12 +5759,45 @@ WriteFFmpegPlugin::endEncode(const EndSequenceRenderArguments& /*args*/)
         return;
     }
 
+    std::chrono::steady_clock::time_point secondPassStart;
+    if (_twoPassEncoding) {
+        // the output is opened by the second pass, which needs all the frames of the first pass
+        bool complete;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
+            complete = (_nextFrameToEncode != INT_MIN) && (_analyzedFrames == (_lastFrameToEncode - _firstFrameToEncode) / _frameStep + 1);
+        }
+        if (!complete || abort()) {
+            setPersistentMessage(Message::eMessageError, "", "Render aborted or incomplete: the first pass of two-pass encoding did not analyze all the frames, the output was not written");
+            freeFormat();
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        }
+        secondPassStart = std::chrono::steady_clock::now();
+        if (!encodeSecondPass()) {
+            freeFormat();
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        }
+    }
+    if (_segmentFrames > 0) {
+        // the video encoder of the output did not encode any frame, and flushing it below does nothing
+        if (!concatSegments()) {
+            freeFormat();
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        }
+    }
+
     bool flushFrames = true;
     while (flushFrames) {
         // Continue to write the audio/video interleave while there are still
         // frames in the video and/or audio encoder queues, without queuing any
         // new data to encode. This is ffmpeg specific.
-        flushFrames = !writeToFile(_formatContext, true, -1) ? true : false;
+        flushFrames = !writeToFile(_formatContext, true) ? true : false;
     }
 #if OFX_FFMPEG_AUDIO
     // The audio is written in ~0.5s chunks only when the video stream position
@@ -4254,6 +5825,16 @@ WriteFFmpegPlugin::endEncode(const EndSequenceRenderArguments& /*args*/)
     // Finalise the movie.
     av_write_trailer(_formatContext);
 
+    if (_twoPassEncoding) {
+        stringstream ss;
+        ss.setf(std::ios::fixed);
+        ss.precision(2);
+        ss << "Two-pass encoding of " << _analyzedFrames << " frames: first pass " << _analysisTime << "s (during the render), second pass "
+           << std::chrono::duration<double>(std::chrono::steady_clock::now() - secondPassStart).count() << "s (after the render).";
+        av_log(nullptr, AV_LOG_INFO, "%s\n", ss.str().c_str());
+        setPersistentMessage(Message::eMessageMessage, "", ss.str());
+    }
+
     freeFormat();
 
     _pts_counter = 0;
@@ -4290,10 +5871,10 @@ WriteFFmpegPlugin::updateVisibility()
         }
     }
 
-    const AVCodec* codec = avcodec_find_encoder_by_name(getCodecFromShortName(codecShortName));
+    const int codecIndex = FFmpegSingleton::Instance().getCodecIndex(codecShortName);
     CodecParams p;
-    if (codec) {
-        GetCodecSupportedParams(codec, &p);
+    if (codecIndex >= 0) {
+        p = FFmpegSingleton::Instance().getCodecsParams()[codecIndex];
     }
 
     _crf->setIsSecretAndDisabled(!p.crf);
@@ -4318,14 +5899,20 @@ WriteFFmpegPlugin::updateVisibility()
         _qscale->setEnabled(false);
     }
 
+    // encoders which ignore the pass flags and have no statistics option would encode twice for nothing
+    _twoPass->setIsSecretAndDisabled(!p.bitrate || encoderTwoPassStats(codec) == eTwoPassStatsNone);
     if (p.bitrate && !setbitrate) {
         _bitrate->setEnabled(false);
+        _twoPass->setEnabled(false);
         if (p.bitrateTol) {
             _bitrateTolerance->setEnabled(false);
         }
     }
     _gopSize->setIsSecretAndDisabled(!p.interGOP);
     _bFrames->setIsSecretAndDisabled(!p.interB);
+    _threadType->setEnabled(codec && (codec->capabilities & (AV_CODEC_CAP_SLICE_THREADS | AV_CODEC_CAP_FRAME_THREADS)));
+    const AVCodecDescriptor* codecDesc = codec ? avcodec_descriptor_get(codec->id) : nullptr;
+    _segmentLength->setIsSecretAndDisabled(!codecDesc || !(codecDesc->props & AV_CODEC_PROP_INTRA_ONLY));
 
     // We use the bitrate to set the min range for bitrate tolerance.
     updateBitrateToleranceRange();
@@ -4385,12 +5972,10 @@ WriteFFmpegPlugin::checkCodec()
     // codecShortName may be empty if this was configured in an old version
     if (!codecShortName.empty() && (((int)codecsShortNames.size() <= codec) || (codecShortName != codecsShortNames[codec]))) {
         // maybe it's another one but the label changed, if yes select it
-        vector<string>::const_iterator it;
-
-        it = find(codecsShortNames.begin(), codecsShortNames.end(), codecShortName);
-        if (it != codecsShortNames.end()) {
+        const int index = FFmpegSingleton::Instance().getCodecIndex(codecShortName);
+        if (index >= 0) {
             // found it! update the choice param
-            codec = it - codecsShortNames.begin();
+            codec = index;
             _codec->setValue(codec);
             updateVisibility();
             // hide the codec name
@@ -4498,7 +6083,7 @@ WriteFFmpegPlugin::updatePixelFormat()
     }
 
     // Test if the container recognises the codec type.
-    bool isCodecSupportedInContainer = codecCompatible(avOutputFormat, codecId);
+    bool isCodecSupportedInContainer = this->isCodecSupportedInContainer(avOutputFormat, codecId, videoCodec);
     // mov seems to be able to cope with anything, which the above function doesn't seem to think is the case (even with FF_COMPLIANCE_EXPERIMENTAL)
     // and it doesn't return -1 for in this case, so we'll special-case this situation to allow this
     // isCodecSupportedInContainer |= (strcmp(_formatContext->oformat->name, "mov") == 0); // commented out [FD]: recent ffmpeg gives correct answer
@@ -4592,7 +6177,7 @@ WriteFFmpegPlugin::availPixelFormats()
     }
 
     // Test if the container recognises the codec type.
-    bool isCodecSupportedInContainer = codecCompatible(avOutputFormat, codecId);
+    bool isCodecSupportedInContainer = this->isCodecSupportedInContainer(avOutputFormat, codecId, videoCodec);
     // mov seems to be able to cope with anything, which the above function doesn't seem to think is the case (even with FF_COMPLIANCE_EXPERIMENTAL)
     // and it doesn't return -1 for in this case, so we'll special-case this situation to allow this
     // isCodecSupportedInContainer |= (strcmp(_formatContext->oformat->name, "mov") == 0); // commented out [FD]: recent ffmpeg gives correct answer
@@ -4610,7 +6195,11 @@ WriteFFmpegPlugin::availPixelFormats()
     ret += avOutputFormat->name;
     ret += ":\n";
 
-    if (videoCodec->pix_fmts == nullptr || *videoCodec->pix_fmts == -1) {
+    const FFmpegSingleton& singleton = FFmpegSingleton::Instance();
+    const int codec = _codec->getValue();
+    if (0 <= codec && codec < (int)singleton.getCodecsEncoders().size() && singleton.getCodecsEncoders()[codec] == videoCodec) {
+        ret += singleton.getCodecsPixelFormatsNames()[codec];
+    } else if (videoCodec->pix_fmts == nullptr || *videoCodec->pix_fmts == -1) {
         ret += "none";
     } else {
         const AVPixelFormat* currPixFormat = videoCodec->pix_fmts;
@@ -4703,10 +6292,10 @@ WriteFFmpegPlugin::onOutputFileChanged(const string& filename,
             }
             if (setFormat) {
                 _format->setValue(i);
-                const AVOutputFormat* fmt = av_guess_format(FFmpegSingleton::Instance().getFormatsShortNames()[i].c_str(), nullptr, nullptr);
+                const AVOutputFormat* fmt = FFmpegSingleton::Instance().getFormatsOutputFormats()[i];
                 const vector<AVCodecID>& codecs = FFmpegSingleton::Instance().getCodecsIds();
                 // is the current codec compatible with this format ?
-                if (!codecCompatible(fmt, codecs[_codec->getValue()])) {
+                if (!FFmpegSingleton::Instance().isCodecCompatible(_codec->getValue(), i)) {
                     // set the default codec for this format, or the first compatible codec
                     enum AVCodecID default_video_codec = fmt->video_codec;
                     bool codecSet = false;
@@ -4716,7 +6305,7 @@ WriteFFmpegPlugin::onOutputFileChanged(const string& filename,
                             _codec->setValue(c);
                             // exit loop
                             codecSet = true;
-                        } else if ((compatible_codec == -1) && codecCompatible(fmt, codecs[c])) {
+                        } else if ((compatible_codec == -1) && FFmpegSingleton::Instance().isCodecCompatible(c, i)) {
                             compatible_codec = c;
                         }
                     }
@@ -4784,8 +6373,9 @@ WriteFFmpegPlugin::changedParam(const InstanceChangedArgs& args,
         updateVisibility();
         int format = _format->getValue();
         if (format > 0) {
-            const AVOutputFormat* fmt = av_guess_format(FFmpegSingleton::Instance().getFormatsShortNames()[format].c_str(), nullptr, nullptr);
-            if (fmt && !codecCompatible(fmt, FFmpegSingleton::Instance().getCodecsIds()[codec])) {
+            // the check is skipped if the muxer cannot be found
+            const AVOutputFormat* fmt = FFmpegSingleton::Instance().getFormatsOutputFormats()[format];
+            if (fmt && !FFmpegSingleton::Instance().isCodecCompatible(codec, format)) {
                 setPersistentMessage(Message::eMessageError, "", string("The codec ") + codecsShortNames[codec] + " is not supported in container " + FFmpegSingleton::Instance().getFormatsShortNames()[format]);
             } else {
                 clearPersistentMessage();
@@ -4797,8 +6387,9 @@ WriteFFmpegPlugin::changedParam(const InstanceChangedArgs& args,
         const vector<string>& codecsShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
         int format = _format->getValue();
         if (format > 0) {
-            const AVOutputFormat* fmt = av_guess_format(FFmpegSingleton::Instance().getFormatsShortNames()[format].c_str(), nullptr, nullptr);
-            if (fmt && !codecCompatible(fmt, FFmpegSingleton::Instance().getCodecsIds()[codec])) {
+            // the check is skipped if the muxer cannot be found
+            const AVOutputFormat* fmt = FFmpegSingleton::Instance().getFormatsOutputFormats()[format];
+            if (fmt && !FFmpegSingleton::Instance().isCodecCompatible(codec, format)) {
                 setPersistentMessage(Message::eMessageError, "", string("The codec ") + codecsShortNames[codec] + " is not supported in container " + FFmpegSingleton::Instance().getFormatsShortNames()[format]);
             } else {
                 clearPersistentMessage();
@@ -4847,6 +6438,9 @@ void
 WriteFFmpegPlugin::freeFormat()
 {
     if (_streamVideo.stream) {
+        if (_streamVideo.codecContext) {
+            av_freep(&_streamVideo.codecContext->stats_in); // set by encodeSecondPass()
+        }
         avcodec_free_context(&_streamVideo.codecContext);
         _streamVideo.codecContext = nullptr;
         _streamVideo.stream = nullptr;
@@ -4869,18 +6463,54 @@ WriteFFmpegPlugin::freeFormat()
         avformat_free_context(_formatContext); // also cleans up the allocation by avformat_new_stream()
         _formatContext = nullptr;
     }
-    if (_convertCtx) {
-        sws_freeContext(_convertCtx);
-        _convertCtx = nullptr;
+    {
+        AutoMutex lock(_convertCtxPoolMutex);
+        for (vector<FFmpeg::SwsSlicedContext*>::iterator it = _convertCtxPool.begin(); it != _convertCtxPool.end(); ++it) {
+            delete *it;
+        }
+        _convertCtxPool.clear();
     }
     {
         tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
         _nextFrameToEncode = INT_MIN;
+        _pendingFrames.clear();
+        freeSegments();
+        _encodingFrames = false;
         _firstFrameToEncode = 1;
         _lastFrameToEncode = 1;
         _frameStep = 1;
         _nextFrameToEncodeCond.notify_all();
     }
+    if (_twoPassEncoding) {
+        avcodec_free_context(&_analysisCodecContext);
+        if (_statsFile) {
+            std::fclose(_statsFile);
+            _statsFile = nullptr;
+        }
+        if (_spoolFile) {
+            std::fclose(_spoolFile);
+            _spoolFile = nullptr;
+        }
+        // also remove the files written by libx264 and libx265 (see x264's and x265's ratecontrol.c)
+        const char* const suffixes[] = { "", ".temp", ".mbtree", ".mbtree.temp", ".cutree", ".cutree.temp" };
+        for (std::size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+            const string statsFilename = _statsFilename + suffixes[i];
+            if (OFX::exists_utf8(statsFilename.c_str())) {
+                OFX::remove_utf8(statsFilename.c_str());
+            }
+        }
+        if (OFX::exists_utf8(_spoolFilename.c_str())) {
+            OFX::remove_utf8(_spoolFilename.c_str());
+        }
+        _statsFilename.clear();
+        _spoolFilename.clear();
+        vector<uint8_t>().swap(_spoolBuffer);
+        _analyzedFrames = 0;
+        _twoPassEncoding = false;
+    }
+    // buffers still referenced by a frame being converted are freed when it is released
+    _inputFramePool.reset();
+    _outputFramePool.reset();
 #if OFX_FFMPEG_SCRATCHBUFFER
     _scratchBufferSize = 0;
     delete[] _scratchBuffer;
@@ -5649,6 +7279,19 @@ WriteFFmpegPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             }
         }
 
+        ///////////Two-pass
+        {
+            BooleanParamDescriptor* param = desc.defineBooleanParam(kParamTwoPass);
+            param->setLabel(kParamTwoPassLabel);
+            param->setHint(kParamTwoPassHint);
+            param->setDefault(false);
+            param->setAnimates(false);
+            param->setParent(*group);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         ///////////Gop size
         {
             IntParamDescriptor* param = desc.defineIntParam(kParamGopSize);
@@ -5692,6 +7335,52 @@ WriteFFmpegPluginFactory::describeInContext(ImageEffectDescriptor& desc,
                 page->addChild(*param);
             }
         }
+        ///////////Threading
+        {
+            ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamThreadType);
+            param->setLabel(kParamThreadTypeLabel);
+            param->setHint(kParamThreadTypeHint);
+            assert(param->getNOptions() == eThreadTypeAuto);
+            param->appendOption(kParamThreadTypeOptionAuto);
+            assert(param->getNOptions() == eThreadTypeSlice);
+            param->appendOption(kParamThreadTypeOptionSlice);
+            assert(param->getNOptions() == eThreadTypeFrame);
+            param->appendOption(kParamThreadTypeOptionFrame);
+            param->setDefault(eThreadTypeAuto);
+            param->setAnimates(false);
+            param->setParent(*group);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+        ///////////Max Threads
+        {
+            IntParamDescriptor* param = desc.defineIntParam(kParamThreads);
+            param->setLabel(kParamThreadsLabel);
+            param->setHint(kParamThreadsHint);
+            param->setRange(0, OFX_FFMPEG_MAX_ENCODER_THREADS);
+            param->setDisplayRange(0, OFX_FFMPEG_MAX_ENCODER_THREADS);
+            param->setDefault(0);
+            param->setAnimates(false);
+            param->setParent(*group);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+        ///////////Segment Length
+        {
+            IntParamDescriptor* param = desc.defineIntParam(kParamSegmentLength);
+            param->setLabel(kParamSegmentLengthLabel);
+            param->setHint(kParamSegmentLengthHint);
+            param->setRange(0, INT_MAX);
+            param->setDisplayRange(0, 1000);
+            param->setDefault(0);
+            param->setAnimates(false);
+            param->setParent(*group);
+            if (page) {
+                page->addChild(*param);
+            }
+        }
 
 #if OFX_FFMPEG_MBDECISION
         ////////////Macro block decision
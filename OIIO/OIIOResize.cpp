@@ -24,7 +24,11 @@
 
 #include <algorithm>
 #include <cfloat> // DBL_MAX
+#include <cmath>
 #include <limits>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include "ofxsMacros.h"
 
@@ -49,32 +53,50 @@ GCC_DIAG_ON(unused-parameter)
 #include "ofxsCoords.h"
 #include "ofxsCopier.h"
 #include "ofxsFormatResolution.h"
+#include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
 #include "ofxsThreadSuite.h"
 
 #include "IOUtility.h"
 
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
+
 using namespace OFX;
 
 using std::string;
+using std::vector;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginName "ResizeOIIO"
 #define kPluginGrouping "Transform"
-#define kPluginDescription "Resize input stream, using OpenImageIO.\n"                                                                                                                                                                                                                                               \
-                           "Note that only full images can be rendered, so it may be slower for interactive editing than the Reformat plugin.\n"                                                                                                                                                                     \
-                           "However, the rendering algorithms are different between Reformat and Resize: Resize applies 1-dimensional filters in the horizontal and vertical directins, whereas Reformat resamples the image, so in some cases this plugin may give more visually pleasant results than Reformat.\n" \
+#define kPluginDescription "Resize input stream, using OpenImageIO filters.\n"                                                                                                                                                                                                                                       \
+                           "Separable filters are applied by a multithreaded resampler which only computes the requested region, other filters use OpenImageIO's resize algorithm.\n"                                                                                                                                \
+                           "The rendering algorithms are different between Reformat and Resize: Resize applies 1-dimensional filters in the horizontal and vertical directins, whereas Reformat resamples the image, so in some cases this plugin may give more visually pleasant results than Reformat.\n" \
                            "This plugin does not concatenate transforms (as opposed to Reformat)."
 
 #define kPluginIdentifier "fr.inria.openfx.OIIOResize"
 // History:
 // version 1.0: initial version
 // version 2.0: add the "default" filter, which is blackman-harris when increasing resolution, lanczos3 when decreasing resolution
+// version 2.1: separable resampler with cached filter weights, supports tiles
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -120,6 +142,282 @@ enum ResizeTypeEnum {
 
 OIIO_NAMESPACE_USING
 
+#define kResizeWeightsCacheSize 16 // number of weight tables kept by getResizeWeights()
+
+/**
+ * @brief 1-dimensional filter weights for resizing srcSize pixels to dstSize pixels.
+ * Destination pixel i is the weighted sum of the source pixels first[i] to first[i]+count[i]-1,
+ * using the weights weights[i*maxTaps] to weights[i*maxTaps+count[i]-1].
+ **/
+struct ResizeWeights {
+    int maxTaps;
+    vector<int> first;
+    vector<int> count;
+    vector<float> weights;
+};
+
+typedef std::shared_ptr<const ResizeWeights> ResizeWeightsPtr;
+
+struct ResizeWeightsKey {
+    string filterName;
+    float filterWidth;
+    int srcSize;
+    int dstSize;
+
+    bool operator<(const ResizeWeightsKey& other) const
+    {
+        if (filterName != other.filterName) {
+            return filterName < other.filterName;
+        }
+        if (filterWidth != other.filterWidth) {
+            return filterWidth < other.filterWidth;
+        }
+        if (srcSize != other.srcSize) {
+            return srcSize < other.srcSize;
+        }
+
+        return dstSize < other.dstSize;
+    }
+};
+
+static Mutex gResizeWeightsMutex;
+static std::map<ResizeWeightsKey, ResizeWeightsPtr> gResizeWeights;
+
+// Get the weights of a separable filter along one direction.
+// The filter is expressed in destination pixel units, as in ImageBufAlgo::resize().
+// Weight tables are cached, since they only depend on the filter and the source and destination sizes.
+static ResizeWeightsPtr
+getResizeWeights(const Filter2D& filter,
+                 const char* filterName,
+                 bool horizontal,
+                 int srcSize,
+                 int dstSize)
+{
+    assert(filter.separable() && srcSize > 0 && dstSize > 0);
+    ResizeWeightsKey key;
+    key.filterName = filterName;
+    key.filterWidth = horizontal ? filter.width() : filter.height();
+    key.srcSize = srcSize;
+    key.dstSize = dstSize;
+
+    {
+        AutoMutex lock(gResizeWeightsMutex);
+        std::map<ResizeWeightsKey, ResizeWeightsPtr>::const_iterator found = gResizeWeights.find(key);
+        if (found != gResizeWeights.end()) {
+            return found->second;
+        }
+    }
+
+    std::shared_ptr<ResizeWeights> weights = std::make_shared<ResizeWeights>();
+    const float ratio = float(dstSize) / float(srcSize); // > 1 when increasing resolution
+    const float radius = 0.5f * key.filterWidth / ratio; // filter radius, in source pixels
+    weights->maxTaps = (std::max)(1, (int)std::ceil(2.f * radius) + 1);
+    weights->first.resize(dstSize);
+    weights->count.resize(dstSize);
+    weights->weights.assign((size_t)dstSize * weights->maxTaps, 0.f);
+    for (int i = 0; i < dstSize; ++i) {
+        // the center of destination pixel i, in source pixel coordinates
+        const float center = (i + 0.5f) / ratio - 0.5f;
+        int j1 = (std::max)(0, (int)std::ceil(center - radius));
+        int j2 = (std::min)((std::min)(srcSize, (int)std::floor(center + radius) + 1), j1 + weights->maxTaps);
+        float* w = &weights->weights[(size_t)i * weights->maxTaps];
+        float sum = 0.f;
+        for (int j = j1; j < j2; ++j) {
+            const float x = (j - center) * ratio;
+            w[j - j1] = horizontal ? filter.xfilt(x) : filter.yfilt(x);
+            sum += w[j - j1];
+        }
+        if ((j2 <= j1) || (sum == 0.f)) {
+            // no source pixel within the filter support, use the nearest one
+            j1 = (std::max)(0, (std::min)(srcSize - 1, (int)std::floor(center + 0.5f)));
+            j2 = j1 + 1;
+            std::fill(w, w + weights->maxTaps, 0.f);
+            w[0] = 1.f;
+        } else {
+            for (int j = 0; j < j2 - j1; ++j) {
+                w[j] /= sum;
+            }
+        }
+        weights->first[i] = j1;
+        weights->count[i] = j2 - j1;
+    }
+
+    AutoMutex lock(gResizeWeightsMutex);
+    if (gResizeWeights.size() >= kResizeWeightsCacheSize) {
+        // tables still in use by a render are kept alive by their shared pointer
+        gResizeWeights.clear();
+    }
+    gResizeWeights[key] = weights;
+
+    return weights;
+} // getResizeWeights
+
+class ResizeProcessorBase
+    : public PixelProcessorFilterBase {
+protected:
+    ResizeWeightsPtr _xWeights;
+    ResizeWeightsPtr _yWeights;
+    OfxRectI _srcFormat; // the source pixel region that is resized...
+    OfxRectI _dstFormat; // ...to this destination pixel region
+
+public:
+    ResizeProcessorBase(ImageEffect& instance)
+        : PixelProcessorFilterBase(instance)
+        , _xWeights()
+        , _yWeights()
+    {
+        _srcFormat.x1 = _srcFormat.y1 = _srcFormat.x2 = _srcFormat.y2 = 0;
+        _dstFormat.x1 = _dstFormat.y1 = _dstFormat.x2 = _dstFormat.y2 = 0;
+    }
+
+    void setValues(const ResizeWeightsPtr& xWeights,
+                   const ResizeWeightsPtr& yWeights,
+                   const OfxRectI& srcFormat,
+                   const OfxRectI& dstFormat)
+    {
+        _xWeights = xWeights;
+        _yWeights = yWeights;
+        _srcFormat = srcFormat;
+        _dstFormat = dstFormat;
+    }
+};
+
+// Separable resampler: each source row needed by a band of destination rows is first filtered horizontally,
+// and the destination rows are then computed by filtering these rows vertically.
+// The inner loops only contain multiply-adds on contiguous floats, so that the compiler can vectorize them.
+template <typename PIX, int nComponents>
+class ResizeProcessor
+    : public ResizeProcessorBase {
+public:
+    ResizeProcessor(ImageEffect& instance)
+        : ResizeProcessorBase(instance)
+    {
+    }
+
+private:
+    virtual void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_xWeights && _yWeights);
+        OfxRectI window;
+        if (!Coords::rectIntersection(procWindow, _dstFormat, &window)) {
+            return;
+        }
+        const ResizeWeights& xw = *_xWeights;
+        const ResizeWeights& yw = *_yWeights;
+        const int width = window.x2 - window.x1;
+        const int rowElements = width * nComponents;
+
+        // the range of source columns used by this window, relative to _srcFormat.x1
+        const int ix1 = window.x1 - _dstFormat.x1;
+        const int ix2 = window.x2 - _dstFormat.x1;
+        const int sx1 = xw.first[ix1];
+        const int sx2 = xw.first[ix2 - 1] + xw.count[ix2 - 1];
+        assert(sx1 <= sx2);
+
+        vector<float> srcRow((sx2 - sx1) * nComponents);
+        // horizontally filtered source rows, used as a ring buffer of yw.maxTaps rows
+        vector<float> hRows((size_t)yw.maxTaps * rowElements);
+        vector<float> dstRow(rowElements);
+        int nextSrcRow = -1; // the next source row to filter horizontally, relative to _srcFormat.y1
+
+        for (int y = window.y1; y < window.y2; ++y) {
+            if (((y - window.y1) % 100 == 0) && _effect.abort()) {
+                // check for abort only every 100 lines
+                break;
+            }
+
+            const int iy = y - _dstFormat.y1;
+            const int first = yw.first[iy];
+            const int last = first + yw.count[iy];
+            assert(last - first <= yw.maxTaps);
+            for (int sy = (std::max)(first, nextSrcRow); sy < last; ++sy) {
+                fetchSrcRow(_srcFormat.y1 + sy, _srcFormat.x1 + sx1, sx2 - sx1, &srcRow.front());
+                filterRow(xw, ix1, ix2, sx1, &srcRow.front(), &hRows[(size_t)(sy % yw.maxTaps) * rowElements]);
+            }
+            nextSrcRow = (std::max)(nextSrcRow, last);
+
+            std::fill(dstRow.begin(), dstRow.end(), 0.f);
+            const float* w = &yw.weights[(size_t)iy * yw.maxTaps];
+            for (int sy = first; sy < last; ++sy) {
+                const float wy = w[sy - first];
+                const float* hRow = &hRows[(size_t)(sy % yw.maxTaps) * rowElements];
+                float* d = &dstRow.front();
+                for (int k = 0; k < rowElements; ++k) {
+                    d[k] += wy * hRow[k];
+                }
+            }
+
+            PIX* dstPix = (PIX*)getDstPixelAddress(window.x1, y);
+            assert(dstPix);
+            for (int k = 0; k < rowElements; ++k) {
+                dstPix[k] = toPIX(dstRow[k]);
+            }
+        }
+    } // multiThreadProcessImages
+
+    // fill buf with the n source pixels of row y starting at column x, as float. Pixels outside of the source image are black.
+    void fetchSrcRow(int y,
+                     int x,
+                     int n,
+                     float* buf) const
+    {
+        std::fill(buf, buf + n * nComponents, 0.f);
+        if ((y < _srcBounds.y1) || (_srcBounds.y2 <= y)) {
+            return;
+        }
+        const int x1 = (std::max)(x, _srcBounds.x1);
+        const int x2 = (std::min)(x + n, _srcBounds.x2);
+        if (x1 >= x2) {
+            return;
+        }
+        const PIX* srcPix = (const PIX*)getSrcPixelAddress(x1, y);
+        assert(srcPix);
+        float* b = buf + (x1 - x) * nComponents;
+        for (int k = 0; k < (x2 - x1) * nComponents; ++k) {
+            b[k] = (float)srcPix[k];
+        }
+    }
+
+    // filter horizontally the source row to compute the destination columns ix1 to ix2-1
+    static void filterRow(const ResizeWeights& xw,
+                          int ix1,
+                          int ix2,
+                          int sx1,
+                          const float* srcRow,
+                          float* hRow)
+    {
+        for (int ix = ix1; ix < ix2; ++ix, hRow += nComponents) {
+            const float* w = &xw.weights[(size_t)ix * xw.maxTaps];
+            const float* s = srcRow + (xw.first[ix] - sx1) * nComponents;
+            float sum[nComponents];
+            for (int c = 0; c < nComponents; ++c) {
+                sum[c] = 0.f;
+            }
+            const int count = xw.count[ix];
+            for (int j = 0; j < count; ++j, s += nComponents) {
+                for (int c = 0; c < nComponents; ++c) {
+                    sum[c] += w[j] * s[c];
+                }
+            }
+            for (int c = 0; c < nComponents; ++c) {
+                hRow[c] = sum[c];
+            }
+        }
+    }
+
+    static PIX toPIX(float v)
+    {
+        if (!std::numeric_limits<PIX>::is_integer) {
+            return PIX(v);
+        }
+        const float maxValue = (float)(std::numeric_limits<PIX>::max)();
+
+        return PIX((std::max)(0.f, (std::min)(v, maxValue)) + 0.5f);
+    }
+};
+
+
 class OIIOResizePlugin
     : public ImageEffect {
 public:
@@ -151,6 +449,9 @@ private:
     template <typename PIX, int nComps>
     void renderInternal(const RenderArguments& args, TypeDesc srcType, const Image* srcImg, TypeDesc dstType, Image* dstImg);
 
+    // get the selected filter. Returns false for the "impulse" filter (no interpolation).
+    bool getFilterDesc(float wratio, float hratio, FilterDesc* fd) const;
+
     void fillWithBlack(PixelProcessorFilterBase& processor,
                        const OfxRectI& renderWindow,
                        const OfxPointD& renderScale,
@@ -405,12 +706,67 @@ OIIOResizePlugin::render(const RenderArguments& args)
 
 template <typename PIX, int nComps>
 void
-OIIOResizePlugin::renderInternal(const RenderArguments& /*args*/,
+OIIOResizePlugin::renderInternal(const RenderArguments& args,
                                  TypeDesc srcType,
                                  const Image* srcImg,
                                  TypeDesc dstType,
                                  Image* dstImg)
 {
+    // the source and destination formats, in pixel coordinates
+    OfxRectI srcFormat;
+    Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(args.time), args.renderScale, _srcClip->getPixelAspectRatio(), &srcFormat);
+    OfxRectI dstFormat;
+    Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(args.time), args.renderScale, _dstClip->getPixelAspectRatio(), &dstFormat);
+
+    void* dstPixelData;
+    OfxRectI dstBounds;
+    PixelComponentEnum dstComponents;
+    BitDepthEnum dstBitDepth;
+    int dstRowBytes;
+    getImageData(dstImg, &dstPixelData, &dstBounds, &dstComponents, &dstBitDepth, &dstRowBytes);
+
+    if (Coords::rectIsEmpty(srcFormat) || Coords::rectIsEmpty(dstFormat)) {
+        BlackFiller<PIX> proc(*this, nComps);
+        fillWithBlack(proc, args.renderWindow, args.renderScale, dstPixelData, dstBounds, dstComponents, nComps, dstBitDepth, dstRowBytes);
+
+        return;
+    }
+
+    const float wratio = float(dstFormat.x2 - dstFormat.x1) / float(srcFormat.x2 - srcFormat.x1);
+    const float hratio = float(dstFormat.y2 - dstFormat.y1) / float(srcFormat.y2 - srcFormat.y1);
+    FilterDesc fd;
+    const bool interpolate = getFilterDesc(wratio, hratio, &fd);
+    auto_ptr<Filter2D> filter;
+    if (interpolate) {
+        // older versions of OIIO 1.2 don't have ImageBufAlgo::resize(dstBuf, srcBuf, fd.name, fd.width)
+        float w = fd.width * (std::max)(1.0f, wratio);
+        float h = fd.width * (std::max)(1.0f, hratio);
+        filter.reset(Filter2D::create(fd.name, w, h));
+    }
+
+    if (filter.get() && filter->separable()) {
+        const void* srcPixelData;
+        OfxRectI srcBounds;
+        PixelComponentEnum srcComponents;
+        BitDepthEnum srcBitDepth;
+        int srcRowBytes;
+        getImageData(srcImg, &srcPixelData, &srcBounds, &srcComponents, &srcBitDepth, &srcRowBytes);
+
+        ResizeProcessor<PIX, nComps> processor(*this);
+        processor.setDstImg(dstPixelData, dstBounds, dstComponents, nComps, dstBitDepth, dstRowBytes);
+        processor.setSrcImg(srcPixelData, srcBounds, srcComponents, nComps, srcBitDepth, srcRowBytes, 0);
+        processor.setRenderWindow(args.renderWindow, args.renderScale);
+        processor.setValues(getResizeWeights(*filter, fd.name, true, srcFormat.x2 - srcFormat.x1, dstFormat.x2 - dstFormat.x1),
+                            getResizeWeights(*filter, fd.name, false, srcFormat.y2 - srcFormat.y1, dstFormat.y2 - dstFormat.y1),
+                            srcFormat,
+                            dstFormat);
+        processor.process();
+
+        return;
+    }
+
+    // impulse or non-separable filter: use OpenImageIO on the render window.
+    // The data window of each ImageBuf is the image bounds, and the full window is the clip format.
     ImageSpec srcSpec(srcType);
     const OfxRectI srcBounds = srcImg->getBounds();
 
@@ -419,75 +775,77 @@ OIIOResizePlugin::renderInternal(const RenderArguments& /*args*/,
     srcSpec.width = srcBounds.x2 - srcBounds.x1;
     srcSpec.height = srcBounds.y2 - srcBounds.y1;
     srcSpec.nchannels = nComps;
-    srcSpec.full_x = srcSpec.x;
-    srcSpec.full_y = srcSpec.y;
-    srcSpec.full_width = srcSpec.width;
-    srcSpec.full_height = srcSpec.height;
+    srcSpec.full_x = srcFormat.x1;
+    srcSpec.full_y = srcFormat.y1;
+    srcSpec.full_width = srcFormat.x2 - srcFormat.x1;
+    srcSpec.full_height = srcFormat.y2 - srcFormat.y1;
     srcSpec.default_channel_names();
 
     const ImageBuf srcBuf("src", srcSpec, const_cast<void*>(srcImg->getPixelAddress(srcBounds.x1, srcBounds.y1)));
 
-    /// This code assumes that the dstImg has the target size hence that we don't support tiles
-    const OfxRectI dstBounds = dstImg->getBounds();
     ImageSpec dstSpec(dstType);
     dstSpec.x = dstBounds.x1;
     dstSpec.y = dstBounds.y1;
     dstSpec.width = dstBounds.x2 - dstBounds.x1;
     dstSpec.height = dstBounds.y2 - dstBounds.y1;
     dstSpec.nchannels = nComps;
-    dstSpec.full_x = dstSpec.x;
-    dstSpec.full_y = dstSpec.y;
-    dstSpec.full_width = dstSpec.width;
-    dstSpec.full_height = dstSpec.height;
+    dstSpec.full_x = dstFormat.x1;
+    dstSpec.full_y = dstFormat.y1;
+    dstSpec.full_width = dstFormat.x2 - dstFormat.x1;
+    dstSpec.full_height = dstFormat.y2 - dstFormat.y1;
     dstSpec.default_channel_names();
 
     ImageBuf dstBuf("dst", dstSpec, dstImg->getPixelAddress(dstBounds.x1, dstBounds.y1));
-    int filter;
-    _filter->getValue(filter);
+    const ROI roi(args.renderWindow.x1, args.renderWindow.x2, args.renderWindow.y1, args.renderWindow.y2, 0, 1, 0, nComps);
 
-    if (filter == 0) {
+    if (!interpolate) {
         /// Use nearest neighboor
-        if (!ImageBufAlgo::resample(dstBuf, srcBuf, /*interpolate*/ false, ROI::All(), MultiThread::getNumCPUs())) {
+        if (!ImageBufAlgo::resample(dstBuf, srcBuf, /*interpolate*/ false, roi, MultiThread::getNumCPUs())) {
             setPersistentMessage(Message::eMessageError, "", dstBuf.geterror());
         }
     } else {
-        assert(srcSpec.full_width && srcSpec.full_height);
-        float wratio = float(dstSpec.full_width) / float(srcSpec.full_width);
-        float hratio = float(dstSpec.full_height) / float(srcSpec.full_height);
-        const int num_filters = Filter2D::num_filters();
-        /// interpolate using the selected filter
-        FilterDesc fd;
-        filter -= 1;
-        if (filter < num_filters) {
-            Filter2D::get_filterdesc(filter, &fd);
-        } else {
-            string filtername;
-            // "default" filter
-            // No filter name supplied -- pick a good default
-            // see imgbufalgo_xform.cpp:477
-            if (wratio > 1.0f || hratio > 1.0f) {
-                filtername = "blackman-harris";
-            } else {
-                filtername = "lanczos3";
-            }
-            filter = 0;
-            Filter2D::get_filterdesc(filter, &fd);
-            while (fd.name != filtername) {
-                ++filter;
-                Filter2D::get_filterdesc(filter, &fd);
-            }
-        }
-        // older versions of OIIO 1.2 don't have ImageBufAlgo::resize(dstBuf, srcBuf, fd.name, fd.width)
-        float w = fd.width * (std::max)(1.0f, wratio);
-        float h = fd.width * (std::max)(1.0f, hratio);
-        auto_ptr<Filter2D> filter(Filter2D::create(fd.name, w, h));
-
-        if (!ImageBufAlgo::resize(dstBuf, srcBuf, filter.get(), ROI::All(), MultiThread::getNumCPUs())) {
+        if (!ImageBufAlgo::resize(dstBuf, srcBuf, filter.get(), roi, MultiThread::getNumCPUs())) {
             setPersistentMessage(Message::eMessageError, "", dstBuf.geterror());
         }
     }
 } // OIIOResizePlugin::renderInternal
 
+bool
+OIIOResizePlugin::getFilterDesc(float wratio,
+                                float hratio,
+                                FilterDesc* fd) const
+{
+    int filter;
+    _filter->getValue(filter);
+    if (filter == 0) {
+        return false;
+    }
+    const int num_filters = Filter2D::num_filters();
+    /// interpolate using the selected filter
+    filter -= 1;
+    if (filter < num_filters) {
+        Filter2D::get_filterdesc(filter, fd);
+    } else {
+        string filtername;
+        // "default" filter
+        // No filter name supplied -- pick a good default
+        // see imgbufalgo_xform.cpp:477
+        if (wratio > 1.0f || hratio > 1.0f) {
+            filtername = "blackman-harris";
+        } else {
+            filtername = "lanczos3";
+        }
+        filter = 0;
+        Filter2D::get_filterdesc(filter, fd);
+        while (fd->name != filtername) {
+            ++filter;
+            Filter2D::get_filterdesc(filter, fd);
+        }
+    }
+
+    return true;
+}
+
 void
 OIIOResizePlugin::fillWithBlack(PixelProcessorFilterBase& processor,
                                 const OfxRectI& renderWindow,
@@ -728,14 +1086,44 @@ void
 OIIOResizePlugin::getRegionsOfInterest(const RegionsOfInterestArguments& args,
                                        RegionOfInterestSetter& rois)
 {
+    if (!_srcClip || !_srcClip->isConnected()) {
+        return;
+    }
+    const OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
     if (!kSupportsTiles) {
         // The effect requires full images to render any region
+        rois.setRegionOfInterest(*_srcClip, srcRoD);
 
-        if (_srcClip && _srcClip->isConnected()) {
-            OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
-            rois.setRegionOfInterest(*_srcClip, srcRoD);
-        }
+        return;
+    }
+
+    const OfxRectD dstRoD = _dstClip->getRegionOfDefinition(args.time);
+    if ((srcRoD.x1 >= srcRoD.x2) || (srcRoD.y1 >= srcRoD.y2) || (dstRoD.x1 >= dstRoD.x2) || (dstRoD.y1 >= dstRoD.y2)) {
+        rois.setRegionOfInterest(*_srcClip, srcRoD);
+
+        return;
+    }
+
+    // the source region covered by the region of interest, padded by the filter radius (plus one pixel for rounding)
+    const double sx = (srcRoD.x2 - srcRoD.x1) / (dstRoD.x2 - dstRoD.x1);
+    const double sy = (srcRoD.y2 - srcRoD.y1) / (dstRoD.y2 - dstRoD.y1);
+    FilterDesc fd;
+    double rx = 0.5;
+    double ry = 0.5;
+    if (getFilterDesc(float(1. / sx), float(1. / sy), &fd)) {
+        rx = 0.5 * fd.width * (std::max)(1., sx);
+        ry = 0.5 * fd.width * (std::max)(1., sy);
+    }
+    const double srcPar = _srcClip->getPixelAspectRatio();
+    OfxRectD roi;
+    roi.x1 = srcRoD.x1 + (args.regionOfInterest.x1 - dstRoD.x1) * sx - (rx + 1.) * srcPar / args.renderScale.x;
+    roi.x2 = srcRoD.x1 + (args.regionOfInterest.x2 - dstRoD.x1) * sx + (rx + 1.) * srcPar / args.renderScale.x;
+    roi.y1 = srcRoD.y1 + (args.regionOfInterest.y1 - dstRoD.y1) * sy - (ry + 1.) / args.renderScale.y;
+    roi.y2 = srcRoD.y1 + (args.regionOfInterest.y2 - dstRoD.y1) * sy + (ry + 1.) / args.renderScale.y;
+    if (!Coords::rectIntersection(roi, srcRoD, &roi)) {
+        roi.x1 = roi.y1 = roi.x2 = roi.y2 = 0.;
     }
+    rois.setRegionOfInterest(*_srcClip, roi);
 }
 
 void
@@ -796,7 +1184,7 @@ OIIOResizePluginFactory<majorVersion>::describe(ImageEffectDescriptor& desc)
     desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
-    /// We don't support tiles: we can only resize the whole RoD at once
+    /// Only the render window is resized, see getRegionsOfInterest()
     desc.setSupportsTiles(kSupportsTiles);
 
     desc.setSupportsMultipleClipPARs(true); // plugin may setPixelAspectRatio on output clip
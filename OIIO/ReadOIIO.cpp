@@ -26,6 +26,7 @@
 #include <climits>
 #include <cmath>
 #include <cstddef>
+#include <cstdlib> // getenv, strtol
 #include <cstring> // memset
 #include <fstream>
 #include <iostream>
@@ -162,6 +163,30 @@ typedef ImageInput* ImageInputPtr;
 #define kGroupAdvanced "advanced"
 #define kGroupAdvancedLabel "Advanced Options", "Advanced format-specific option"
 
+#define kGroupCache "advancedCache"
+#define kGroupCacheLabel "Image Cache", "Settings for the OpenImageIO ImageCache. The cache is only used by hosts which request it (e.g. Natron < 2.2), or if the environment variable " kEnvCache "=1 is set. "\
+                                        "The cache is shared by all ReadOIIO instances, so the settings from the last modified instance apply. "                                                     \
+                                        "Each setting can be overridden by an environment variable, which takes precedence over the parameter value (e.g. to size the cache on render farm machines)."
+
+// environment variables
+#define kEnvCache "OFX_READ_OIIO_CACHE"
+#define kEnvCacheMaxMemoryMB "OFX_READ_OIIO_CACHE_MAX_MEMORY_MB"
+#define kEnvCacheMaxOpenFiles "OFX_READ_OIIO_CACHE_MAX_OPEN_FILES"
+#define kEnvCacheAutoTile "OFX_READ_OIIO_CACHE_AUTOTILE"
+#define kEnvCachePlayback "OFX_READ_OIIO_CACHE_PLAYBACK"
+
+#define kParamCacheMaxMemoryMB "cacheMaxMemoryMB"
+#define kParamCacheMaxMemoryMBLabel "Max Memory (MB)", "Maximum amount of memory used by the cache for pixel data, in megabytes. 0 keeps the OpenImageIO default. Overridden by the " kEnvCacheMaxMemoryMB " environment variable."
+
+#define kParamCacheMaxOpenFiles "cacheMaxOpenFiles"
+#define kParamCacheMaxOpenFilesLabel "Max Open Files", "Maximum number of file handles kept open by the cache. 0 keeps the OpenImageIO default. Overridden by the " kEnvCacheMaxOpenFiles " environment variable."
+
+#define kParamCacheAutoTile "cacheAutoTile"
+#define kParamCacheAutoTileLabel "Auto Tile", "If nonzero, scanline images are cached as tiles of this size, so that only the parts of the image that are needed are kept in memory. 0 caches whole images. Overridden by the " kEnvCacheAutoTile " environment variable."
+
+#define kParamCacheDuringPlayback "cacheDuringPlayback"
+#define kParamCacheDuringPlaybackLabel "Use During Playback", "Also use the cache during playback. This is disabled by default, because the cache may use a lot of memory when playing scanline-based EXR sequences. Overridden by the " kEnvCachePlayback " environment variable."
+
 #define kGroupRaw "advancedRaw"
 #define kGroupRawLabel "RAW", "Options for a variety of digital camera \"raw\" formats supported by the LibRaw library (http://www.libraw.org/)."
 
@@ -356,6 +381,30 @@ unused(const T&)
 
 static bool gHostSupportsDynamicChoices = false;
 static bool gHostSupportsMultiPlane = false;
+// the ImageCache attributes when the plugin was loaded, restored when the parameters are set back to 0
+static float gCacheDefaultMaxMemoryMB = 0.f;
+static int gCacheDefaultMaxOpenFiles = 0;
+
+/// Get the integer value of an environment variable, returns false if it is not set or not an integer.
+static bool
+getEnvInt(const char* name,
+          int* value)
+{
+    const char* str = std::getenv(name);
+
+    if (!str || !*str) {
+        return false;
+    }
+    char* end = NULL;
+    long v = std::strtol(str, &end, 10);
+    if (end == str) {
+        return false;
+    }
+    *value = (int)v;
+
+    return true;
+}
+
 struct LayerChannelIndexes {
     // The index of the subimage in the file
     int subImageIdx;
@@ -498,8 +547,18 @@ private:
     // retrieve the config used to open the file
     void getConfig(ImageSpec* config) const;
 
+    // set the ImageCache attributes from the parameters and the environment
+    void setCacheAttributes(bool resetDefaults);
+
+    // should the ImageCache be used for this render?
+    bool useCacheForRender(bool isPlayback) const;
+
     //// OIIO image cache
     ImageCache* _cache;
+    IntParam* _cacheMaxMemoryMB;
+    IntParam* _cacheMaxOpenFiles;
+    IntParam* _cacheAutoTile;
+    BooleanParam* _cacheDuringPlayback;
 
     BooleanParam* _rawAutoBright;
     BooleanParam* _rawUseCameraWB;
@@ -547,6 +606,10 @@ ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
 #endif
                           )
     , _cache(NULL)
+    , _cacheMaxMemoryMB(NULL)
+    , _cacheMaxOpenFiles(NULL)
+    , _cacheAutoTile(NULL)
+    , _cacheDuringPlayback(NULL)
     , _outputLayer(NULL)
     , _outputLayerString(NULL)
     , _availableViews(NULL)
@@ -573,6 +636,28 @@ ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
     }
 #endif
 
+    _cacheMaxMemoryMB = fetchIntParam(kParamCacheMaxMemoryMB);
+    _cacheMaxOpenFiles = fetchIntParam(kParamCacheMaxOpenFiles);
+    _cacheAutoTile = fetchIntParam(kParamCacheAutoTile);
+    _cacheDuringPlayback = fetchBooleanParam(kParamCacheDuringPlayback);
+    assert(_cacheMaxMemoryMB && _cacheMaxOpenFiles && _cacheAutoTile && _cacheDuringPlayback);
+    {
+        GroupParam* group = fetchGroupParam(kGroupCache);
+        if (group) {
+            group->setIsSecretAndDisabled(!_cache);
+        }
+    }
+    {
+        // parameters overridden by the environment can not be edited
+        int value;
+        _cacheMaxMemoryMB->setEnabled(!getEnvInt(kEnvCacheMaxMemoryMB, &value));
+        _cacheMaxOpenFiles->setEnabled(!getEnvInt(kEnvCacheMaxOpenFiles, &value));
+        _cacheAutoTile->setEnabled(!getEnvInt(kEnvCacheAutoTile, &value));
+        _cacheDuringPlayback->setEnabled(!getEnvInt(kEnvCachePlayback, &value));
+    }
+    // the cache may be shared with other instances: only apply the values that were changed from the defaults
+    setCacheAttributes(false);
+
     if (gHostSupportsDynamicChoices && gHostSupportsMultiPlane) {
         _outputLayer = fetchChoiceParam(kParamChannelOutputLayer);
         _outputLayerString = fetchStringParam(kParamChannelOutputLayerChoice);
@@ -626,6 +711,53 @@ ReadOIIOPlugin::clearAnyCache()
     }
 }
 
+// Apply the cache parameters and the environment overrides to the cache.
+// If resetDefaults is false, parameters left at their default value are not applied, so that
+// creating an instance does not override the values set by another instance on the shared cache.
+void
+ReadOIIOPlugin::setCacheAttributes(bool resetDefaults)
+{
+    if (!_cache) {
+        return;
+    }
+    int maxMemoryMB = _cacheMaxMemoryMB->getValue();
+    getEnvInt(kEnvCacheMaxMemoryMB, &maxMemoryMB);
+    if (maxMemoryMB > 0) {
+        _cache->attribute("max_memory_MB", (float)maxMemoryMB);
+    } else if (resetDefaults && (gCacheDefaultMaxMemoryMB > 0.f)) {
+        _cache->attribute("max_memory_MB", gCacheDefaultMaxMemoryMB);
+    }
+    int maxOpenFiles = _cacheMaxOpenFiles->getValue();
+    getEnvInt(kEnvCacheMaxOpenFiles, &maxOpenFiles);
+    if (maxOpenFiles > 0) {
+        _cache->attribute("max_open_files", maxOpenFiles);
+    } else if (resetDefaults && (gCacheDefaultMaxOpenFiles > 0)) {
+        _cache->attribute("max_open_files", gCacheDefaultMaxOpenFiles);
+    }
+    int autoTile = _cacheAutoTile->getValue();
+    bool autoTileFromEnv = getEnvInt(kEnvCacheAutoTile, &autoTile);
+    // 0 is the OIIO default (no autotile)
+    if (resetDefaults || autoTileFromEnv || (autoTile > 0)) {
+        _cache->attribute("autotile", (std::max)(autoTile, 0));
+    }
+}
+
+bool
+ReadOIIOPlugin::useCacheForRender(bool isPlayback) const
+{
+    if (!_cache) {
+        return false;
+    }
+    if (!isPlayback) {
+        return true;
+    }
+    // By default, do not use the cache during playback because the OIIO cache eats too much RAM when playing scaline-based EXRs.
+    int duringPlayback = (int)_cacheDuringPlayback->getValue();
+    getEnvInt(kEnvCachePlayback, &duringPlayback);
+
+    return duringPlayback != 0;
+}
+
 static string
 oiio_versions()
 {
@@ -748,6 +880,8 @@ ReadOIIOPlugin::changedParam(const InstanceChangedArgs& args,
                 }
             }
         }
+    } else if ((paramName == kParamCacheMaxMemoryMB) || (paramName == kParamCacheMaxOpenFiles) || (paramName == kParamCacheAutoTile)) {
+        setCacheAttributes(true);
     } else {
         GenericReaderPlugin::changedParam(args, paramName);
     }
@@ -2224,9 +2358,9 @@ ReadOIIOPlugin::decodePlane(const string& filename,
     unused(renderScale);
     unused(pixelComponentCount);
 #if OIIO_VERSION >= 10605
-    // Use cache only if not during playback because the OIIO cache eats too much RAM when playing scaline-based EXRs.
+    // Use cache only if not during playback (unless requested) because the OIIO cache eats too much RAM when playing scaline-based EXRs.
     // Do not use cache in OIIO 1.5.x because it does not support channel ranges correctly.
-    const bool useCache = _cache && !isPlayback;
+    const bool useCache = useCacheForRender(isPlayback);
 #else
     const bool useCache = false;
 #endif
@@ -2907,7 +3041,10 @@ ReadOIIOPlugin::metadata(const string& filename)
         } else {
             ss << type.c_str(); // use the name implied by type
         }
-        ss << " " << img->format_name() << std::endl;
+        if (img.get()) {
+            ss << " " << img->format_name();
+        }
+        ss << std::endl;
 
         ss << "    channel list: ";
         for (int i = 0; i < subImages[sIt].nchannels; ++i) {
@@ -2978,6 +3115,11 @@ ReadOIIOPlugin::metadata(const string& filename)
     if (!_cache) {
         assert(img.get());
         img->close();
+    } else {
+        // statistics about the (shared) ImageCache, e.g. to measure hit rates
+        ss << std::endl
+           << "OpenImageIO ImageCache statistics:" << std::endl
+           << _cache->getstats(1);
     }
 
     return ss.str();
@@ -3136,6 +3278,24 @@ ReadOIIOPluginFactory::load()
     }
     _extensions.assign(extensionsl.begin(), extensionsl.end());
 #endif
+
+#ifdef OFX_READ_OIIO_USES_CACHE
+    {
+        // remember the defaults, before any instance changes them
+#ifdef OFX_READ_OIIO_SHARED_CACHE
+        ImageCache* cache = ImageCache::create(true);
+#else
+        ImageCache* cache = ImageCache::create(false);
+#endif
+        cache->getattribute("max_memory_MB", gCacheDefaultMaxMemoryMB);
+        cache->getattribute("max_open_files", gCacheDefaultMaxOpenFiles);
+#ifdef OFX_READ_OIIO_SHARED_CACHE
+        ImageCache::destroy(cache); // don't teardown if it's a shared cache
+#else
+        ImageCache::destroy(cache, true); // teardown non-shared cache
+#endif
+    }
+#endif
 }
 
 void
@@ -3466,6 +3626,78 @@ ReadOIIOPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             }
 #endif
         }
+        {
+            GroupParamDescriptor* group = desc.defineGroupParam(kGroupCache);
+            if (group) {
+                group->setLabelAndHint(kGroupCacheLabel);
+                group->setOpen(false);
+                if (topgroup) {
+                    group->setParent(*topgroup);
+                }
+                if (page) {
+                    page->addChild(*group);
+                }
+            }
+
+            {
+                IntParamDescriptor* param = desc.defineIntParam(kParamCacheMaxMemoryMB);
+                param->setLabelAndHint(kParamCacheMaxMemoryMBLabel);
+                param->setRange(0, INT_MAX);
+                param->setDisplayRange(0, 16384);
+                param->setDefault(0);
+                param->setAnimates(false);
+                param->setEvaluateOnChange(false);
+                if (group) {
+                    param->setParent(*group);
+                }
+                if (page) {
+                    page->addChild(*param);
+                }
+            }
+            {
+                IntParamDescriptor* param = desc.defineIntParam(kParamCacheMaxOpenFiles);
+                param->setLabelAndHint(kParamCacheMaxOpenFilesLabel);
+                param->setRange(0, INT_MAX);
+                param->setDisplayRange(0, 1000);
+                param->setDefault(0);
+                param->setAnimates(false);
+                param->setEvaluateOnChange(false);
+                if (group) {
+                    param->setParent(*group);
+                }
+                if (page) {
+                    page->addChild(*param);
+                }
+            }
+            {
+                IntParamDescriptor* param = desc.defineIntParam(kParamCacheAutoTile);
+                param->setLabelAndHint(kParamCacheAutoTileLabel);
+                param->setRange(0, 4096);
+                param->setDisplayRange(0, 512);
+                param->setDefault(0);
+                param->setAnimates(false);
+                param->setEvaluateOnChange(false);
+                if (group) {
+                    param->setParent(*group);
+                }
+                if (page) {
+                    page->addChild(*param);
+                }
+            }
+            {
+                BooleanParamDescriptor* param = desc.defineBooleanParam(kParamCacheDuringPlayback);
+                param->setLabelAndHint(kParamCacheDuringPlaybackLabel);
+                param->setDefault(false);
+                param->setAnimates(false);
+                param->setEvaluateOnChange(false);
+                if (group) {
+                    param->setParent(*group);
+                }
+                if (page) {
+                    page->addChild(*param);
+                }
+            }
+        }
     }
 
     if (gHostSupportsMultiPlane && gHostSupportsDynamicChoices) {
@@ -3553,6 +3785,13 @@ ReadOIIOPluginFactory::createInstance(OfxImageEffectHandle handle,
     const ImageEffectHostDescription* h = getImageEffectHostDescription();
     // use OIIO Cache exclusively on Natron < 2.2 (renderscale support has been disabled since Natron 2.2.6)
     bool useOIIOCache = h->isNatron && (h->versionMajor < 2 || (h->versionMajor == 2 && h->versionMinor < 2));
+    {
+        // the environment may force the cache on or off
+        int useCacheEnv;
+        if (getEnvInt(kEnvCache, &useCacheEnv)) {
+            useOIIOCache = (useCacheEnv != 0);
+        }
+    }
     ReadOIIOPlugin* ret = new ReadOIIOPlugin(handle, _extensions, useOIIOCache);
 
     ret->restoreStateFromParams();
@@ -23,6 +23,8 @@
  */
 
 #include <cfloat> // DBL_MAX
+#include <cstring> // memcpy, strcmp
+#include <list>
 
 #include "ofxsMacros.h"
 
@@ -37,9 +39,12 @@ GCC_DIAG_ON(unused-parameter)
 #include "GenericOCIO.h"
 #include "GenericWriter.h"
 
+#include "ofxsMultiThread.h"
 #include <ofxsCoords.h>
 #include <ofxsMultiPlane.h>
 
+#include "tinythread.h" // for tthread::thread and tthread::condition_variable
+
 using namespace OFX;
 using namespace OFX::IO;
 #ifdef OFX_IO_USING_OCIO
@@ -266,11 +271,372 @@ enum EParamTileSize {
 #define kParamViewsSelectorHint "Select the views to render. When choosing All, make sure the output filename does not have a %v or %V view " \
                                 "pattern in which case each view would be written to a separate file."
 
+#define kParamWriteThreads "writeThreads"
+#define kParamWriteThreadsLabel "Write Threads"
+#define kParamWriteThreadsHint "Number of threads used to compress and write files in the background during a sequence render, " \
+                               "while the next frames are being rendered. 0 writes each frame synchronously in the render thread. " \
+                               "At most this number of frames is queued in memory, in addition to the frames being written. " \
+                               "Errors that happen while writing in the background are reported at the end of the sequence render."
+#define kParamWriteThreadsDefault 0
+#define kParamWriteThreadsMax 64
+
 #define kParamLibraryInfo "libraryInfo"
 #define kParamLibraryInfoLabel "OpenImageIO Info...", "Display information about the underlying library."
 
 static bool gIsMultiplanarV2 = false;
 
+/**
+ * @brief The capabilities of the ImageOutput for a given file format.
+ * Creating an ImageOutput just to call supports() is expensive, and it is done often from the UI thread,
+ * so these are computed once per file extension by getOutputFormatCapabilities().
+ **/
+struct OutputFormatCapabilities {
+    bool valid; // false if no ImageOutput could be created for this extension
+    string formatName;
+    bool tiles;
+    bool alpha;
+    bool displayWindow;
+    bool multiImage;
+    bool mipmap;
+    bool nChannels;
+    bool channelFormats; // per-channel data formats
+    bool quality;
+
+    OutputFormatCapabilities()
+        : valid(false)
+        , formatName()
+        , tiles(false)
+        , alpha(false)
+        , displayWindow(false)
+        , multiImage(false)
+        , mipmap(false)
+        , nChannels(false)
+        , channelFormats(false)
+        , quality(false)
+    {
+    }
+};
+
+static tthread::mutex gOutputFormatCapabilitiesMutex;
+static map<string, OutputFormatCapabilities> gOutputFormatCapabilities; // key is the lowercase file extension
+
+static OutputFormatCapabilities
+getOutputFormatCapabilities(const string& filename)
+{
+    string ext = Filesystem::extension(filename);
+    Strutil::to_lower(ext);
+
+    tthread::lock_guard<tthread::mutex> guard(gOutputFormatCapabilitiesMutex);
+    map<string, OutputFormatCapabilities>::const_iterator found = gOutputFormatCapabilities.find(ext);
+    if (found != gOutputFormatCapabilities.end()) {
+        return found->second;
+    }
+
+    OutputFormatCapabilities caps;
+#if OIIO_PLUGIN_VERSION >= 22
+    ImageOutputPtr output = ImageOutput::create(filename);
+#else
+    auto_ptr<ImageOutput> output(ImageOutput::create(filename));
+#endif
+    if (output.get()) {
+        caps.valid = true;
+        caps.formatName = output->format_name();
+        caps.tiles = output->supports("tiles");
+        caps.alpha = output->supports("alpha");
+        caps.displayWindow = output->supports("displaywindow");
+        caps.multiImage = output->supports("multiimage");
+        caps.mipmap = output->supports("mipmap");
+        caps.nChannels = output->supports("nchannels");
+        caps.channelFormats = output->supports("channelformats");
+        // search for uses of decode_compression_metadata() in OIIO source code.
+        // output->supports("quality") still returns false for all formats, but may
+        // be implemented someday, see https://github.com/OpenImageIO/oiio/issues/3859
+        caps.quality = (caps.formatName == "jpeg" ||
+                        caps.formatName == "webp" ||
+                        caps.formatName == "heic" ||
+                        caps.formatName == "avif" ||
+                        output->supports("quality"));
+    }
+    gOutputFormatCapabilities[ext] = caps;
+
+    return caps;
+}
+
+struct WriteOIIOEncodePlanesData {
+#if OIIO_PLUGIN_VERSION >= 22
+    ImageOutputPtr output;
+#else
+    auto_ptr<ImageOutput> output;
+#endif
+    vector<ImageSpec> specs;
+    string filename;
+
+    // If true, the file is opened and written by the writer threads (see WriteOIIOWriterPool),
+    // and encodePart() only copies the pixels of each part to pixels.
+    bool deferred;
+
+    // Copy of the pixels of each part, starting with the top scan-line, with specs[i].nchannels float channels.
+    vector<vector<float> > pixels;
+
+    // Number of threads that may be used to encode the tiles of a tiled file
+    int threads;
+
+    WriteOIIOEncodePlanesData()
+        : output()
+        , specs()
+        , filename()
+        , deferred(false)
+        , pixels()
+        , threads(1)
+    {
+    }
+};
+
+/**
+ * @brief Write a full float image, given a pointer to its top scan-line.
+ * Tiled images are written by bands of several rows of tiles using write_tiles(), so that
+ * the formats which compress several tiles concurrently (e.g. OpenEXR) can encode a whole band in parallel,
+ * while the memory used for the conversion to the file data format is limited to a band.
+ **/
+static bool
+writeOutputImage(ImageOutput* output,
+                 const ImageSpec& spec,
+                 int threads,
+                 const char* topScanLine,
+                 stride_t xStride,
+                 stride_t yStride)
+{
+    if ((spec.tile_width <= 0) || (spec.tile_height <= 0)) {
+        return output->write_image(TypeDesc::FLOAT, topScanLine, xStride, yStride, AutoStride);
+    }
+#if OIIO_VERSION >= 20000
+    output->threads(threads);
+#endif
+    const int bandHeight = spec.tile_height * (std::max)(threads, 1);
+    const int zend = spec.z + (std::max)(spec.depth, 1);
+    for (int y = 0; y < spec.height; y += bandHeight) {
+        const int yend = (std::min)(y + bandHeight, spec.height);
+        if (!output->write_tiles(spec.x, spec.x + spec.width,
+                                 spec.y + y, spec.y + yend,
+                                 spec.z, zend,
+                                 TypeDesc::FLOAT,
+                                 topScanLine + y * yStride,
+                                 xStride, yStride, AutoStride)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Remove the file if it exists (which means "overwrite" was checked), and open all subimages.
+ * Returns false and sets error on failure.
+ **/
+static bool
+openEncodePlanesOutput(WriteOIIOEncodePlanesData* data,
+                       string* error)
+{
+    // If the file exists (which means "overwrite" was checked), remove it first.
+    // See https://github.com/NatronGitHub/Natron/issues/666
+    if (Filesystem::exists(data->filename)) {
+        string err;
+        bool ok = Filesystem::remove(data->filename, err);
+        if (!ok) {
+            *error = err;
+
+            return false;
+        }
+    }
+    // Some formats only support opening all subimages at once.
+    // See https://openimageio.readthedocs.io/en/stable/imageoutput.html
+    if (!data->output->open(data->filename, data->specs.size(), &data->specs.front())) {
+        *error = data->output->geterror();
+
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Open, write and close a file which was prepared with the deferred flag set.
+ * This is executed by the writer threads, or by the render thread if they were stopped. Returns false and sets error on failure.
+ **/
+static bool
+writeDeferredEncodePlanes(WriteOIIOEncodePlanesData* data,
+                          string* error)
+{
+    assert(data->deferred && data->output.get());
+    if (!openEncodePlanesOutput(data, error)) {
+        return false;
+    }
+    for (std::size_t i = 0; i < data->pixels.size(); ++i) {
+        if ((i != 0) && !data->output->open(data->filename, data->specs[i], ImageOutput::AppendSubimage)) {
+            *error = data->output->geterror();
+
+            return false;
+        }
+        const ImageSpec& spec = data->specs[i];
+        const stride_t xStride = sizeof(float) * spec.nchannels;
+        if (!writeOutputImage(data->output.get(), spec, data->threads, (const char*)&data->pixels[i].front(), xStride, xStride * spec.width)) {
+            *error = data->output->geterror();
+
+            return false;
+        }
+    }
+    if (!data->output->close()) {
+        *error = data->output->geterror();
+
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief A bounded pool of threads that write files in the background.
+ * push() blocks while the queue is full, so that the render threads cannot get too far ahead of the writers.
+ * The first error is kept and returned by getError() and stop().
+ **/
+class WriteOIIOWriterPool
+{
+public:
+    WriteOIIOWriterPool()
+        : _mutex()
+        , _jobsCond()
+        , _spaceCond()
+        , _jobs()
+        , _threads()
+        , _maxJobs(0)
+        , _stopping(false)
+        , _error()
+    {
+    }
+
+    ~WriteOIIOWriterPool()
+    {
+        string error;
+
+        stop(&error);
+    }
+
+    void start(int nThreads)
+    {
+        string error;
+
+        stop(&error); // in case a previous sequence render was not ended properly
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        _maxJobs = nThreads;
+        for (int i = 0; i < nThreads; ++i) {
+            _threads.push_back(new tthread::thread(threadFunction, this));
+        }
+    }
+
+    bool isRunning()
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+
+        return !_threads.empty() && !_stopping;
+    }
+
+    // takes ownership of job, unless the pool is not running, in which case false is returned
+    bool push(WriteOIIOEncodePlanesData* job)
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+
+        while (!_threads.empty() && !_stopping && (_jobs.size() >= _maxJobs)) {
+            _spaceCond.wait(guard);
+        }
+        if (_threads.empty() || _stopping) {
+            // stopped since the job was prepared, nobody would write it
+            return false;
+        }
+        _jobs.push_back(job);
+        _jobsCond.notify_one();
+
+        return true;
+    }
+
+    bool getError(string* error)
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+
+        *error = _error;
+
+        return !_error.empty();
+    }
+
+    // wait for all queued jobs to be written and join the threads, returns false if any job failed
+    bool stop(string* error)
+    {
+        vector<tthread::thread*> threads;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_mutex);
+            _stopping = true;
+            threads.swap(_threads);
+            _jobsCond.notify_all();
+            _spaceCond.notify_all();
+        }
+        for (std::size_t i = 0; i < threads.size(); ++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        assert(_jobs.empty());
+        _maxJobs = 0;
+        _stopping = false;
+        *error = _error;
+        _error.clear();
+
+        return error->empty();
+    }
+
+private:
+    static void threadFunction(void* arg)
+    {
+        static_cast<WriteOIIOWriterPool*>(arg)->run();
+    }
+
+    void run()
+    {
+        for (;;) {
+            WriteOIIOEncodePlanesData* job = NULL;
+            {
+                tthread::lock_guard<tthread::mutex> guard(_mutex);
+                while (_jobs.empty() && !_stopping) {
+                    _jobsCond.wait(guard);
+                }
+                if (_jobs.empty()) {
+                    // stopping, and all jobs were processed
+                    return;
+                }
+                job = _jobs.front();
+                _jobs.pop_front();
+                _spaceCond.notify_all();
+            }
+            string error;
+            bool ok = writeDeferredEncodePlanes(job, &error);
+            delete job;
+            if (!ok) {
+                tthread::lock_guard<tthread::mutex> guard(_mutex);
+                if (_error.empty()) {
+                    _error = error.empty() ? string("Could not write file") : error;
+                }
+            }
+        }
+    }
+
+    tthread::mutex _mutex;
+    tthread::condition_variable _jobsCond; // signaled when a job is queued or when stopping
+    tthread::condition_variable _spaceCond; // signaled when a job is taken from the queue
+    std::list<WriteOIIOEncodePlanesData*> _jobs;
+    vector<tthread::thread*> _threads;
+    std::size_t _maxJobs;
+    bool _stopping;
+    string _error;
+};
+
 class WriteOIIOPlugin
     : public GenericWriterPlugin {
 public:
@@ -354,6 +720,9 @@ private:
 
     void endEncodeParts(void* user_data) OVERRIDE FINAL;
 
+    virtual void beginEncode(const string& filename, const OfxRectI& rodPixel, float pixelAspectRatio, const BeginSequenceRenderArguments& args) OVERRIDE FINAL;
+    virtual void endEncode(const EndSequenceRenderArguments& args) OVERRIDE FINAL;
+
     virtual void* allocateEncodePlanesUserData() OVERRIDE FINAL;
     virtual void destroyEncodePlanesUserData(void* data) OVERRIDE FINAL;
     virtual bool isImageFile(const string& fileExtension) const OVERRIDE FINAL;
@@ -376,8 +745,10 @@ private:
     ChoiceParam* _outputLayers;
     ChoiceParam* _parts;
     ChoiceParam* _views;
+    IntParam* _writeThreads;
     std::list<string> _currentInputComponents;
     std::list<string> _availableViews;
+    WriteOIIOWriterPool _writerPool;
 };
 
 WriteOIIOPlugin::WriteOIIOPlugin(OfxImageEffectHandle handle,
@@ -393,8 +764,10 @@ WriteOIIOPlugin::WriteOIIOPlugin(OfxImageEffectHandle handle,
     , _outputLayers(NULL)
     , _parts(NULL)
     , _views(NULL)
+    , _writeThreads(NULL)
     , _currentInputComponents()
     , _availableViews()
+    , _writerPool()
 {
 
     _bitDepth = fetchChoiceParam(kParamBitDepth);
@@ -404,6 +777,7 @@ WriteOIIOPlugin::WriteOIIOPlugin(OfxImageEffectHandle handle,
     _orientation = fetchChoiceParam(kParamOutputOrientation);
     _compression = fetchChoiceParam(kParamOutputCompression);
     _tileSize = fetchChoiceParam(kParamTileSize);
+    _writeThreads = fetchIntParam(kParamWriteThreads);
     if (gIsMultiplanarV2) {
         _outputLayers = fetchChoiceParam(kParamOutputChannels);
 
@@ -519,20 +893,6 @@ WriteOIIOPlugin::getClipPreferences(ClipPreferencesSetter& clipPreferences)
     GenericWriterPlugin::getClipPreferences(clipPreferences);
 
     if (gIsMultiplanarV2) {
-        string filename;
-        _fileParam->getValue(filename);
-#if OIIO_PLUGIN_VERSION >= 22
-        ImageOutputPtr output = ImageOutput::create(filename);
-#else
-        auto_ptr<ImageOutput> output(ImageOutput::create(filename));
-#endif
-        /*
-        bool supportsNChannels = false;
-        if ( output.get() ) {
-            supportsNChannels = output->supports("nchannels");
-        }
-        */
-
         MultiPlane::ImagePlaneDesc plane;
         OFX::Clip* clip = 0;
         int channelIndex = -1;
@@ -673,16 +1033,7 @@ getDefaultBitDepth(const string& filepath,
 bool
 WriteOIIOPlugin::displayWindowSupportedByFormat(const string& filename) const
 {
-#if OIIO_PLUGIN_VERSION >= 22
-    ImageOutputPtr output = ImageOutput::create(filename);
-#else
-    auto_ptr<ImageOutput> output(ImageOutput::create(filename));
-#endif
-    if (output.get()) {
-        return output->supports("displaywindow");
-    } else {
-        return false;
-    }
+    return getOutputFormatCapabilities(filename).displayWindow;
 }
 
 static bool
@@ -797,35 +1148,22 @@ WriteOIIOPlugin::onOutputFileChanged(const string& filename,
 bool
 WriteOIIOPlugin::supportsAlpha(const std::string& filename) const
 {
-    auto output = ImageOutput::create(filename);
-
-    return kSupportsRGBA && output->supports("alpha");
+    return kSupportsRGBA && getOutputFormatCapabilities(filename).alpha;
 }
 
 void
 WriteOIIOPlugin::refreshParamsVisibility(const string& filename)
 {
-#if OIIO_PLUGIN_VERSION >= 22
-    ImageOutputPtr output = ImageOutput::create(filename);
-#else
-    auto_ptr<ImageOutput> output(ImageOutput::create(filename));
-#endif
-    if (output.get()) {
-        _tileSize->setIsSecretAndDisabled(!output->supports("tiles"));
-        //_outputLayers->setIsSecretAndDisabled(!output->supports("nchannels"));
+    OutputFormatCapabilities caps = getOutputFormatCapabilities(filename);
+    if (caps.valid) {
+        _tileSize->setIsSecretAndDisabled(!caps.tiles);
+        //_outputLayers->setIsSecretAndDisabled(!caps.nChannels);
 
-        // hasQuality: search for uses of decode_compression_metadata() in OIIO source code.
-        // output->supports("quality") still returns false for all formats, but may
-        // be implemented someday, see https://github.com/OpenImageIO/oiio/issues/3859
-        bool hasQuality = (strcmp(output->format_name(), "jpeg") == 0 ||
-                           strcmp(output->format_name(), "webp") == 0 ||
-                           strcmp(output->format_name(), "heic") == 0 ||
-                           strcmp(output->format_name(), "avif") == 0 ||
-                           output->supports("quality"));
+        bool hasQuality = caps.quality;
         bool hasDWA = false;
         bool hasZIP = false;
-        bool isEXR = strcmp(output->format_name(), "openexr") == 0;
-        bool isTIFF = strcmp(output->format_name(), "tiff") == 0;
+        bool isEXR = caps.formatName == "openexr";
+        bool isTIFF = caps.formatName == "tiff";
         if (isEXR || isTIFF) {
             int compression_i;
             _compression->getValue(compression_i);
@@ -844,7 +1182,7 @@ WriteOIIOPlugin::refreshParamsVisibility(const string& filename)
             _views->setIsSecretAndDisabled(!isEXR);
         }
         if (_parts) {
-            _parts->setIsSecretAndDisabled(!output->supports("multiimage"));
+            _parts->setIsSecretAndDisabled(!caps.multiImage);
         }
     } else {
         _tileSize->setIsSecretAndDisabled(true);
@@ -861,14 +1199,28 @@ WriteOIIOPlugin::refreshParamsVisibility(const string& filename)
     }
 }
 
-struct WriteOIIOEncodePlanesData {
-#if OIIO_PLUGIN_VERSION >= 22
-    ImageOutputPtr output;
-#else
-    auto_ptr<ImageOutput> output;
-#endif
-    vector<ImageSpec> specs;
-};
+void
+WriteOIIOPlugin::beginEncode(const string& /*filename*/,
+                             const OfxRectI& /*rodPixel*/,
+                             float /*pixelAspectRatio*/,
+                             const BeginSequenceRenderArguments& /*args*/)
+{
+    int writeThreads = _writeThreads->getValue();
+    if (writeThreads > 0) {
+        _writerPool.start(writeThreads);
+    }
+}
+
+void
+WriteOIIOPlugin::endEncode(const EndSequenceRenderArguments& /*args*/)
+{
+    // wait for the files being written in the background, and report any error
+    string error;
+    if (!_writerPool.stop(&error)) {
+        setPersistentMessage(Message::eMessageError, "", error);
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+}
 
 void*
 WriteOIIOPlugin::allocateEncodePlanesUserData()
@@ -903,6 +1255,20 @@ WriteOIIOPlugin::beginEncodeParts(void* user_data,
     assert(!viewsToRender.empty());
     assert(user_data);
     WriteOIIOEncodePlanesData* data = (WriteOIIOEncodePlanesData*)user_data;
+    {
+        // stop early if a file could not be written in the background
+        string error;
+        if (_writerPool.getError(&error)) {
+            setPersistentMessage(Message::eMessageError, "", error);
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        }
+    }
+    data->filename = filename;
+    data->deferred = _writerPool.isRunning();
+    // share the CPUs between the writer threads when writing in the background
+    data->threads = (std::max)(1, (int)MultiThread::getNumCPUs() / (data->deferred ? (std::max)(1, _writeThreads->getValue()) : 1));
 #if OIIO_PLUGIN_VERSION >= 22
     data->output = ImageOutput::create(filename);
 #else
@@ -1399,20 +1765,15 @@ WriteOIIOPlugin::beginEncodeParts(void* user_data,
     }
     } // switch
 
-    // If the file exists (which means "overwrite" was checked), remove it first.
-    // See https://github.com/NatronGitHub/Natron/issues/666
-    if (Filesystem::exists(filename)) {
-        string err;
-        bool ok = Filesystem::remove(filename, err);
-        if (!ok) {
-            setPersistentMessage(Message::eMessageError, "", err);
-            throwSuiteStatusException(kOfxStatFailed);
-        }
+    if (data->deferred) {
+        // the file will be opened by a writer thread
+        data->pixels.resize(data->specs.size());
+
+        return;
     }
-    // Some formats only support opening all subimages at once.
-    // See https://openimageio.readthedocs.io/en/stable/imageoutput.html
-    if (!data->output->open(filename, data->specs.size(), &data->specs.front())) {
-        setPersistentMessage(Message::eMessageError, "", data->output->geterror());
+    string error;
+    if (!openEncodePlanesOutput(data, &error)) {
+        setPersistentMessage(Message::eMessageError, "", error);
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
@@ -1429,6 +1790,30 @@ WriteOIIOPlugin::encodePart(void* user_data,
 {
     assert(user_data);
     WriteOIIOEncodePlanesData* data = (WriteOIIOEncodePlanesData*)user_data;
+    if (data->deferred) {
+        // copy the pixels, top scan-line first, keeping only the channels that are written
+        const ImageSpec& spec = data->specs[planeIndex];
+        const int nChannels = spec.nchannels;
+        assert(nChannels <= pixelDataNComps);
+        vector<float>& pixels = data->pixels[planeIndex];
+        pixels.resize((size_t)spec.width * spec.height * nChannels);
+        float* dst = pixels.empty() ? NULL : &pixels.front();
+        for (int y = spec.height - 1; y >= 0; --y) {
+            const float* src = (const float*)((const char*)pixelData + (size_t)y * rowBytes);
+            if (nChannels == pixelDataNComps) {
+                std::memcpy(dst, src, sizeof(float) * spec.width * nChannels);
+                dst += spec.width * nChannels;
+            } else {
+                for (int x = 0; x < spec.width; ++x, src += pixelDataNComps) {
+                    for (int c = 0; c < nChannels; ++c) {
+                        *dst++ = src[c];
+                    }
+                }
+            }
+        }
+
+        return;
+    }
     if (planeIndex != 0) {
         if (!data->output->open(filename, data->specs[planeIndex], ImageOutput::AppendSubimage)) {
             setPersistentMessage(Message::eMessageError, "", data->output->geterror());
@@ -1438,16 +1823,14 @@ WriteOIIOPlugin::encodePart(void* user_data,
         }
     }
 
-    TypeDesc format = TypeDesc::FLOAT;
-
     // do not use auto-stride as the buffer may have more components that what we want to write
-    std::size_t xStride = format.size() * pixelDataNComps;
-    data->output->write_image(format,
-                              (char*)pixelData + (data->specs[planeIndex].height - 1) * rowBytes, // invert y
-                              xStride, // xstride
-                              -rowBytes, // ystride
-                              AutoStride // zstride
-    );
+    std::size_t xStride = sizeof(float) * pixelDataNComps;
+    writeOutputImage(data->output.get(),
+                     data->specs[planeIndex],
+                     data->threads,
+                     (const char*)pixelData + (data->specs[planeIndex].height - 1) * rowBytes, // invert y
+                     xStride, // xstride
+                     -rowBytes); // ystride
 }
 
 void
@@ -1455,6 +1838,26 @@ WriteOIIOPlugin::endEncodeParts(void* user_data)
 {
     assert(user_data);
     WriteOIIOEncodePlanesData* data = (WriteOIIOEncodePlanesData*)user_data;
+    if (data->deferred) {
+        // hand the output and the pixels over to the writer threads (this may block if the queue is full)
+        WriteOIIOEncodePlanesData* job = new WriteOIIOEncodePlanesData;
+        job->output.reset(data->output.release());
+        job->specs.swap(data->specs);
+        job->filename.swap(data->filename);
+        job->deferred = true;
+        job->pixels.swap(data->pixels);
+        if (!_writerPool.push(job)) {
+            // the writer threads were stopped after the file was prepared: write it now
+            auto_ptr<WriteOIIOEncodePlanesData> jobOwner(job);
+            string error;
+            if (!writeDeferredEncodePlanes(job, &error)) {
+                setPersistentMessage(Message::eMessageError, "", error.empty() ? string("Could not write file") : error);
+                throwSuiteStatusException(kOfxStatFailed);
+            }
+        }
+
+        return;
+    }
     data->output->close();
 }
 
@@ -1762,6 +2165,19 @@ WriteOIIOPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             }
         }
     }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamWriteThreads);
+        param->setLabel(kParamWriteThreadsLabel);
+        param->setHint(kParamWriteThreadsHint);
+        param->setRange(0, kParamWriteThreadsMax);
+        param->setDisplayRange(0, 8);
+        param->setDefault(kParamWriteThreadsDefault);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamLibraryInfo);
         param->setLabelAndHint(kParamLibraryInfoLabel);
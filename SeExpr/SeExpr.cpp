@@ -24,8 +24,10 @@
 
 #include <algorithm>
 #include <cfloat> // DBL_MAX
+#include <climits> // INT_MAX
+#include <cmath>
+#include <cstddef>
 #include <limits>
-#include <set>
 #include <vector>
 
 //#include <stdio.h> // for snprintf & _snprintf
@@ -316,6 +318,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSeExprRenderScaleXVarName "sx"
 #define kSeExprRenderScaleYVarName "sy"
 
+// number of pixels around the sampled position that are used by the cpixel/apixel interpolation filters
+#define kSeExprPixelFilterSupport 2
+
 #define kSeExprDefaultRGBScript "#Just copy the source RGB\nCs"
 #define kSeExprDefaultAlphaScript "#Just copy the source alpha\nAs"
 
@@ -462,7 +467,138 @@ isSpaces(const string& s)
     return s.find_first_not_of(" \t\n\v\f\r") == string::npos;
 }
 
+// Check if s is a single expression, without assignments, comments or strings,
+// so that it can be used as a component of a vector expression
+static bool
+isSingleExpression(const string& s)
+{
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '#':
+        case ';':
+        case '"':
+        case '\'':
+
+            return false;
+        case '=':
+            if ((i + 1 < s.size()) && (s[i + 1] == '=')) {
+                // ==
+                ++i;
+            } else if ((i == 0) || ((s[i - 1] != '!') && (s[i - 1] != '<') && (s[i - 1] != '>'))) {
+                // assignment
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
 class SeExprProcessorBase;
+class OFXSeExpression;
+class StubSeExpression;
+
+// frame ranges read by cpixel/apixel, indexed by input
+typedef map<int, vector<OfxRangeD>> FrameRangesNeeded;
+
+// Maximum number of idle expressions kept by a SeExprCache for a given script
+#define kSeExprCacheMaxPerScript 64
+// Maximum number of idle expressions kept by a SeExprCache
+#define kSeExprCacheMax 512
+
+/**
+ * @brief A cache of parsed and prepared expressions, indexed by script and type (vector or scalar).
+ * Parsing and preparing an expression costs much more than rendering a small tile, so the expressions
+ * are kept between renders. An expression may only be used by one thread at a time: acquire() removes it
+ * from the cache, and release() gives it back.
+ **/
+template <class EXPR>
+class SeExprCache {
+    typedef map<pair<string, bool>, vector<EXPR*>> ExprMap;
+    SeExprInternal::Mutex _lock;
+    ExprMap _exprs;
+    std::size_t _size;
+
+public:
+    SeExprCache()
+        : _lock()
+        , _exprs()
+        , _size(0)
+    {
+    }
+
+    ~SeExprCache()
+    {
+        clear();
+    }
+
+    /** @brief get an idle expression for this script, or NULL if there is none */
+    EXPR* acquire(const string& script,
+                  bool wantVec)
+    {
+        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
+        typename ExprMap::iterator found = _exprs.find(make_pair(script, wantVec));
+        if ((found == _exprs.end()) || found->second.empty()) {
+            return NULL;
+        }
+        EXPR* expr = found->second.back();
+        found->second.pop_back();
+        --_size;
+
+        return expr;
+    }
+
+    /** @brief give back an expression that is not used anymore (it may be deleted) */
+    void release(EXPR* expr)
+    {
+        if (!expr) {
+            return;
+        }
+        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
+        vector<EXPR*>& exprs = _exprs[make_pair(expr->getExpr(), expr->wantVec())];
+        if ((exprs.size() >= kSeExprCacheMaxPerScript) || (_size >= kSeExprCacheMax)) {
+            delete expr;
+        } else {
+            exprs.push_back(expr);
+            ++_size;
+        }
+    }
+
+    /** @brief delete all idle expressions, e.g. when the scripts were changed */
+    void clear()
+    {
+        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
+        for (typename ExprMap::iterator it = _exprs.begin(); it != _exprs.end(); ++it) {
+            for (typename vector<EXPR*>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+                delete *it2;
+            }
+        }
+        _exprs.clear();
+        _size = 0;
+    }
+
+    /** @brief gives the expression back to the cache when going out of scope */
+    class Releaser {
+        SeExprCache& _cache;
+        EXPR* _expr;
+
+    public:
+        Releaser(SeExprCache& cache,
+                 EXPR* expr)
+            : _cache(cache)
+            , _expr(expr)
+        {
+        }
+
+        ~Releaser()
+        {
+            _cache.release(_expr);
+        }
+    };
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -501,9 +637,21 @@ public:
 
     RGBParam** getRGBParams() { return _colorParams; }
 
+    SeExprCache<OFXSeExpression>& getExprCache() { return _exprCache; }
+
+    static void clearStubCache(bool simple) { _stubCache[simple ? 1 : 0].clear(); }
+
 private:
     void setupAndProcess(SeExprProcessorBase& processor, const RenderArguments& args);
 
+    StubSeExpression* acquireStubExpression(const string& script, bool wantVec, OfxTime time);
+
+    bool getPixelFramesNeeded(OfxTime time, FrameRangesNeeded* framesNeeded, bool useDefaultRange[kSourceClipCount], string* error);
+
+    OfxRangeD getDefaultFrameRange(OfxTime time);
+
+    void prefetchPixelImages(SeExprProcessorBase& processor, OfxTime time, const FrameRangesNeeded& framesNeeded, const bool useDefaultRange[kSourceClipCount]);
+
     PixelComponentEnum getOutputComponents() const;
 
 private:
@@ -536,6 +684,11 @@ private:
     Double2DParam* _size;
     BooleanParam* _interactive;
     ChoiceParam* _outputComponents;
+    // The rendering expressions reference the parameters of this instance, so they are cached per instance.
+    SeExprCache<OFXSeExpression> _exprCache;
+    // The expressions used to compute the frames and regions needed do not depend on the instance.
+    // Each plugin (SeExpr and SeExprSimple) has its own cache, which is cleared when it is unloaded.
+    static SeExprCache<StubSeExpression> _stubCache[2];
 };
 
 PixelComponentEnum
@@ -550,8 +703,21 @@ SeExprPlugin::getOutputComponents() const
 
 class OFXSeExpression;
 
-// Base class for processor, note that we do not use the multi-thread suite.
-class SeExprProcessorBase {
+// The expressions evaluated by a rendering thread.
+// OFXSeExpression holds the per-pixel variables, and SeExpr stores the local variables of
+// the script in the expression itself, so that each thread must use its own expressions.
+struct SeExprThreadExprs {
+    OFXSeExpression* rExpr;
+    OFXSeExpression* gExpr;
+    OFXSeExpression* bExpr;
+    OFXSeExpression* rgbExpr;
+    OFXSeExpression* alphaExpr;
+};
+
+// Base class for processor.
+// The render window is split into bands of rows, which are processed by the threads of the multi-thread suite.
+class SeExprProcessorBase
+    : public MultiThread::Processor {
 protected:
     OfxTime _renderTime;
     int _renderView;
@@ -561,6 +727,12 @@ protected:
     OFXSeExpression* _bExpr;
     OFXSeExpression* _rgbExpr;
     OFXSeExpression* _alphaExpr;
+    vector<SeExprThreadExprs> _threadExprs; // the first thread uses the expressions above, the others use copies
+    OfxRectI _renderWindow;
+    // values of the custom parameters at the render time, referenced by the expressions
+    double _doubleParamValues[kParamsCount][1];
+    double _double2DParamValues[kParamsCount][2];
+    double _colorParamValues[kParamsCount][3];
     const Image* _srcCurTime[kSourceClipCount];
     int _nSrcComponents[kSourceClipCount];
     Image* _dstImg;
@@ -572,7 +744,9 @@ protected:
     // <clipIndex, <time, image> >
     typedef map<OfxTime, const Image*> FetchedImagesForClipMap;
     typedef map<int, FetchedImagesForClipMap> FetchedImagesMap;
-    FetchedImagesMap _images;
+    FetchedImagesMap _images; // fetched by the render thread before processing, only read by the rendering threads
+    mutable SeExprInternal::Mutex _lateImagesLock;
+    mutable FetchedImagesMap _lateImages; // the images that were not prefetched, protected by _lateImagesLock
 
 public:
     SeExprProcessorBase(SeExprPlugin* instance);
@@ -584,6 +758,12 @@ public:
         return _plugin;
     }
 
+    const double* getDoubleParamValue(int i) const { return _doubleParamValues[i]; }
+
+    const double* getDouble2DParamValue(int i) const { return _double2DParamValues[i]; }
+
+    const double* getColorParamValue(int i) const { return _colorParamValues[i]; }
+
     void setDstImg(Image* dstImg)
     {
         _dstImg = dstImg;
@@ -626,6 +806,13 @@ public:
 
     void prefetchImage(int inputIndex,
                        OfxTime time)
+    {
+        (void)fetchImage(inputIndex, time);
+    }
+
+    // prefetchImage() followed by getImage(), must not be called from the rendering threads
+    const Image* fetchImage(int inputIndex,
+                            OfxTime time)
     {
         // find or create input
         FetchedImagesForClipMap& foundInput = _images[inputIndex];
@@ -633,7 +820,7 @@ public:
         FetchedImagesForClipMap::iterator foundImage = foundInput.find(time);
         if (foundImage != foundInput.end()) {
             // image already fetched
-            return;
+            return foundImage->second;
         }
 
         Clip* clip = _plugin->getClip(inputIndex);
@@ -641,34 +828,78 @@ public:
 
         if (!clip->isConnected()) {
             // clip is not connected, image is NULL
-            return;
+            return NULL;
         }
 
         Image* img = clip->fetchImage(time);
         if (!img) {
-            return;
+            return NULL;
         }
         pair<FetchedImagesForClipMap::iterator, bool> ret = foundInput.insert(make_pair(time, img));
         assert(ret.second);
+
+        return img;
     }
 
+    // may be called from any rendering thread: the prefetched images are not modified while processing
     const Image* getImage(int inputIndex,
-                          OfxTime time)
+                          OfxTime time) const
     {
-        // find or create input
-        FetchedImagesForClipMap& foundInput = _images[inputIndex];
+        FetchedImagesMap::const_iterator foundInput = _images.find(inputIndex);
+        if (foundInput != _images.end()) {
+            FetchedImagesForClipMap::const_iterator foundImage = foundInput->second.find(time);
+            if (foundImage != foundInput->second.end()) {
+                return foundImage->second;
+            }
+        }
 
-        FetchedImagesForClipMap::iterator foundImage = foundInput.find(time);
+        return fetchLateImage(inputIndex, time);
+    }
+
+private:
+    // An image that was not prefetched, e.g. a frame outside of the default frame range read by
+    // a cpixel/apixel call with an unknown frame: it is fetched under a lock, since any rendering
+    // thread may ask for it. Failed fetches are remembered too.
+    const Image* fetchLateImage(int inputIndex,
+                                OfxTime time) const
+    {
+        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lateImagesLock);
+        FetchedImagesForClipMap& foundInput = _lateImages[inputIndex];
+        FetchedImagesForClipMap::const_iterator foundImage = foundInput.find(time);
         if (foundImage != foundInput.end()) {
             return foundImage->second;
         }
 
-        return NULL;
+        Clip* clip = _plugin->getClip(inputIndex);
+        assert(clip);
+        const Image* img = (clip && clip->isConnected()) ? clip->fetchImage(time) : NULL;
+        foundInput.insert(make_pair(time, img));
+
+        return img;
     }
 
-    virtual void process(OfxRectI procWindow) = 0;
+public:
+
+    /** @brief process the render window, using all available threads */
+    void process(const OfxRectI& renderWindow);
+
+    /** @brief get a prepared expression from the plugin's SeExprCache, or create a new one */
+    OFXSeExpression* createExpr(const string& script,
+                                bool wantVec,
+                                bool simple,
+                                OfxTime time,
+                                const OfxPointD& renderScale,
+                                double par,
+                                const OfxRectI& dstPixelRod);
 
 private:
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL;
+
+    /** @brief process a band of rows, called from a rendering thread */
+    virtual void processRows(const OfxRectI& procWindow, const SeExprThreadExprs& exprs) = 0;
+
+    void fetchParamValues(OfxTime time);
+
     void setExprs(OfxTime time,
                   const string& rgbExpr,
                   const string& alphaExpr,
@@ -692,22 +923,22 @@ private:
                         const OfxPointI& outputSize);
 };
 
-// implementation of the "apixel" function
-template <typename PIX, int nComps, FilterEnum interp, bool alpha>
+// An image used by cpixel/apixel, with the values needed to compute pixel addresses
+struct PixelImage {
+    bool valid; // true if img was looked up for this input and time
+    OfxTime time;
+    const Image* img;
+    const char* data;
+    OfxRectI bounds;
+    int rowBytes;
+};
+
+// convert the interpolated pixel to the result of cpixel/apixel
+template <int nComps, bool alpha>
 static void
-pixelForDepthCompsFilter(const Image* img,
-                         double x,
-                         double y,
-                         SeExpr2::Vec3d& result)
+pixelToResult(const float* pix,
+              SeExpr2::Vec3d& result)
 {
-    result = SeExpr2::Vec3d(0., 0., 0.);
-    if ((alpha && (nComps != 1) && (nComps != 4)) || (!alpha && (nComps <= 1))) {
-        // no value
-        return;
-    }
-    float pix[4];
-    // In OFX pixel coordinates, the center of pixel (0,0) has coordinates (0.5,0.5)
-    ofxsFilterInterpolate2D<PIX, nComps, interp, /*clamp=*/true>(x + 0.5, y + 0.5, img, /*blackOutside=*/false, pix);
     if (alpha) {
         if (nComps == 1) {
             // alpha input
@@ -727,21 +958,126 @@ pixelForDepthCompsFilter(const Image* img,
     }
 }
 
+// address of the pixel nearest to (x,y) in the image bounds, or NULL if the image is empty
+template <typename PIX, int nComps>
+static inline const PIX*
+pixelAddressNearest(const PixelImage& pimg,
+                    int x,
+                    int y)
+{
+    const OfxRectI& bounds = pimg.bounds;
+    if ((bounds.x2 <= bounds.x1) || (bounds.y2 <= bounds.y1)) {
+        return NULL;
+    }
+    x = (std::max)(bounds.x1, (std::min)(x, bounds.x2 - 1));
+    y = (std::max)(bounds.y1, (std::min)(y, bounds.y2 - 1));
+
+    return (const PIX*)(pimg.data + (std::ptrdiff_t)(y - bounds.y1) * pimg.rowBytes) + (std::ptrdiff_t)(x - bounds.x1) * nComps;
+}
+
+// clamp a coordinate to the integer range before converting it
+static inline int
+floorClamped(double v)
+{
+    return (int)std::floor((std::max)((double)INT_MIN / 2, (std::min)(v, (double)INT_MAX / 2)));
+}
+
+// nearest neighbor, same as ofxsFilterInterpolate2D<eFilterImpulse> with blackOutside=false
+template <typename PIX, int nComps, bool alpha>
+static void
+pixelNearest(const PixelImage& pimg,
+             double x,
+             double y,
+             SeExpr2::Vec3d& result)
+{
+    float pix[4] = { 0.f, 0.f, 0.f, 0.f };
+    // the center of pixel (0,0) is at (0,0)
+    const PIX* p = pixelAddressNearest<PIX, nComps>(pimg, floorClamped(x + 0.5), floorClamped(y + 0.5));
+
+    if (p) {
+        for (int c = 0; c < nComps; ++c) {
+            pix[c] = p[c];
+        }
+    }
+    pixelToResult<nComps, alpha>(pix, result);
+}
+
+// bilinear interpolation, same as ofxsFilterInterpolate2D<eFilterBilinear> with blackOutside=false
 template <typename PIX, int nComps, bool alpha>
 static void
-pixelForDepthComps(const Image* img,
+pixelBilinear(const PixelImage& pimg,
+              double x,
+              double y,
+              SeExpr2::Vec3d& result)
+{
+    const int ix = floorClamped(x);
+    const int iy = floorClamped(y);
+    const double dx = x - ix;
+    const double dy = y - iy;
+
+    if ((dx == 0.) && (dy == 0.)) {
+        // integer position, e.g. when applying a convolution kernel
+        return pixelNearest<PIX, nComps, alpha>(pimg, x, y, result);
+    }
+    float pix[4] = { 0.f, 0.f, 0.f, 0.f };
+    const PIX* p00 = pixelAddressNearest<PIX, nComps>(pimg, ix, iy);
+    if (p00) {
+        const PIX* p10 = pixelAddressNearest<PIX, nComps>(pimg, ix + 1, iy);
+        const PIX* p01 = pixelAddressNearest<PIX, nComps>(pimg, ix, iy + 1);
+        const PIX* p11 = pixelAddressNearest<PIX, nComps>(pimg, ix + 1, iy + 1);
+        for (int c = 0; c < nComps; ++c) {
+            pix[c] = (float)((1. - dy) * ((1. - dx) * p00[c] + dx * p10[c]) + dy * ((1. - dx) * p01[c] + dx * p11[c]));
+        }
+    }
+    pixelToResult<nComps, alpha>(pix, result);
+}
+
+// implementation of the "apixel" function
+template <typename PIX, int nComps, FilterEnum interp, bool alpha>
+static void
+pixelForDepthCompsFilter(const Image* img,
+                         double x,
+                         double y,
+                         SeExpr2::Vec3d& result)
+{
+    result = SeExpr2::Vec3d(0., 0., 0.);
+    if ((alpha && (nComps != 1) && (nComps != 4)) || (!alpha && (nComps <= 1))) {
+        // no value
+        return;
+    }
+    float pix[4];
+    // In OFX pixel coordinates, the center of pixel (0,0) has coordinates (0.5,0.5)
+    ofxsFilterInterpolate2D<PIX, nComps, interp, /*clamp=*/true>(x + 0.5, y + 0.5, img, /*blackOutside=*/false, pix);
+    pixelToResult<nComps, alpha>(pix, result);
+}
+
+template <typename PIX, int nComps, bool alpha>
+static void
+pixelForDepthComps(const PixelImage& pimg,
                    FilterEnum interp,
                    double x,
                    double y,
                    SeExpr2::Vec3d& result)
 {
+    const Image* img = pimg.img;
+
     switch (interp) {
     case eFilterImpulse:
+        result = SeExpr2::Vec3d(0., 0., 0.);
+        if ((alpha && (nComps != 1) && (nComps != 4)) || (!alpha && (nComps <= 1))) {
+            // no value
+            return;
+        }
 
-        return pixelForDepthCompsFilter<PIX, nComps, eFilterImpulse, alpha>(img, x, y, result);
+        return pixelNearest<PIX, nComps, alpha>(pimg, x, y, result);
     case eFilterBilinear:
+        result = SeExpr2::Vec3d(0., 0., 0.);
+        if ((alpha && (nComps != 1) && (nComps != 4)) || (!alpha && (nComps <= 1))) {
+            // no value
+            return;
+        }
 
-        return pixelForDepthCompsFilter<PIX, nComps, eFilterBilinear, alpha>(img, x, y, result);
+        return pixelBilinear<PIX, nComps, alpha>(pimg, x, y, result);
     case eFilterCubic:
 
         return pixelForDepthCompsFilter<PIX, nComps, eFilterCubic, alpha>(img, x, y, result);
@@ -770,27 +1106,27 @@ pixelForDepthComps(const Image* img,
 
 template <typename PIX, bool alpha>
 static void
-pixelForDepth(const Image* img,
+pixelForDepth(const PixelImage& pimg,
               FilterEnum interp,
               double x,
               double y,
               SeExpr2::Vec3d& result)
 {
-    int nComponents = img->getPixelComponentCount();
+    int nComponents = pimg.img->getPixelComponentCount();
 
     switch (nComponents) {
     case 1:
 
-        return pixelForDepthComps<PIX, 1, alpha>(img, interp, x, y, result);
+        return pixelForDepthComps<PIX, 1, alpha>(pimg, interp, x, y, result);
     case 2:
 
-        return pixelForDepthComps<PIX, 2, alpha>(img, interp, x, y, result);
+        return pixelForDepthComps<PIX, 2, alpha>(pimg, interp, x, y, result);
     case 3:
 
-        return pixelForDepthComps<PIX, 3, alpha>(img, interp, x, y, result);
+        return pixelForDepthComps<PIX, 3, alpha>(pimg, interp, x, y, result);
     case 4:
 
-        return pixelForDepthComps<PIX, 4, alpha>(img, interp, x, y, result);
+        return pixelForDepthComps<PIX, 4, alpha>(pimg, interp, x, y, result);
     default:
         result = SeExpr2::Vec3d(0., 0., 0.);
     }
@@ -800,17 +1136,56 @@ template <bool alpha>
 class PixelFuncX
     : public SeExpr2::ExprFuncX {
     SeExprProcessorBase* _processor;
+    // The last image used for each input. The expression is used by a single thread,
+    // so that this avoids locking the processor's images for each call.
+    mutable PixelImage _pixelImages[kSourceClipCount];
 
 public:
     PixelFuncX(SeExprProcessorBase* processor)
         : SeExpr2::ExprFuncX(true) // Thread Safe
         , _processor(processor)
     {
+        clearPixelImages();
     }
 
     virtual ~PixelFuncX() { }
 
+    void setProcessor(SeExprProcessorBase* processor)
+    {
+        _processor = processor;
+        clearPixelImages();
+    }
+
 private:
+    void clearPixelImages()
+    {
+        for (int i = 0; i < kSourceClipCount; ++i) {
+            _pixelImages[i].valid = false;
+            _pixelImages[i].img = NULL;
+        }
+    }
+
+    const PixelImage& getPixelImage(int inputIndex,
+                                    OfxTime time) const
+    {
+        PixelImage& pimg = _pixelImages[inputIndex];
+
+        if (!pimg.valid || (pimg.time != time)) {
+            pimg.valid = true;
+            pimg.time = time;
+            // the frames read by the expression were prefetched by SeExprPlugin::prefetchPixelImages(),
+            // except those it could not predict, which getImage() fetches under a lock
+            pimg.img = _processor->getImage(inputIndex, time);
+            if (pimg.img) {
+                pimg.data = (const char*)pimg.img->getPixelData();
+                pimg.bounds = pimg.img->getBounds();
+                pimg.rowBytes = pimg.img->getRowBytes();
+            }
+        }
+
+        return pimg;
+    }
+
     virtual bool prep(SeExpr2::ExprFuncNode* node,
                       bool /*wantVec*/)
     {
@@ -890,22 +1265,21 @@ private:
 
             return;
         }
-        _processor->prefetchImage(inputIndex, frame);
-        const Image* img = _processor->getImage(inputIndex, frame);
-        if (!img) {
+        const PixelImage& pimg = getPixelImage(inputIndex, frame);
+        if (!pimg.img) {
             // be black and transparent
             result.setValue(0., 0., 0.);
         } else {
-            BitDepthEnum depth = img->getPixelDepth();
+            BitDepthEnum depth = pimg.img->getPixelDepth();
             switch (depth) {
             case eBitDepthFloat:
-                pixelForDepth<float, alpha>(img, interp, x, y, result);
+                pixelForDepth<float, alpha>(pimg, interp, x, y, result);
                 break;
             case eBitDepthUByte:
-                pixelForDepth<unsigned char, alpha>(img, interp, x, y, result);
+                pixelForDepth<unsigned char, alpha>(pimg, interp, x, y, result);
                 break;
             case eBitDepthUShort:
-                pixelForDepth<unsigned short, alpha>(img, interp, x, y, result);
+                pixelForDepth<unsigned short, alpha>(pimg, interp, x, y, result);
                 break;
             default:
                 result.setValue(0., 0., 0.);
@@ -915,122 +1289,40 @@ private:
     } // eval
 };
 
-class DoubleParamVarRef
+// The value of a custom parameter.
+// The parameter values are read once per render by the processor (see SeExprProcessorBase::fetchParamValues()),
+// so that eval() does not need any lock.
+class ParamVarRef
     : public SeExprVarRef {
-    // Used to call getValue only once per expression evaluation and not once per pixel
-    // Using SeExpr lock is faster than calling the multi-thread suite to get a mutex
-    SeExprInternal::Mutex _lock;
-    bool _varSet;
-    double _value;
-    DoubleParam* _param;
+    const int _dim;
+    const double* _value;
 
 public:
-    DoubleParamVarRef(DoubleParam* param)
+    ParamVarRef(int dim)
         : SeExprVarRef()
-        , _lock()
-        , _varSet(false)
-        , _value(0)
-        , _param(param)
+        , _dim(dim)
+        , _value(NULL)
     {
+        assert(dim >= 1 && dim <= 3);
     }
 
-    virtual ~DoubleParamVarRef() { }
-
-    //! returns true for a vector type, false for a scalar type
-    virtual bool isVec() { return false; }
+    virtual ~ParamVarRef() { }
 
-    //! returns this variable's value by setting result, node refers to
-    //! where in the parse tree the evaluation is occurring
-    virtual void eval(const SeExprVarNode* /*node*/,
-                      SeExpr2::Vec3d& result)
-    {
-        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
-        if (!_varSet) {
-            _param->getValue(_value);
-            _varSet = true;
-        } else {
-            result[0] = _value;
-        }
-    }
-};
-
-class Double2DParamVarRef
-    : public SeExprVarRef {
-    // Used to call getValue only once per expression evaluation and not once per pixel
-    // Using SeExpr lock is faster than calling the multi-thread suite to get a mutex
-    SeExprInternal::Mutex _lock;
-    bool _varSet;
-    double _value[2];
-    Double2DParam* _param;
-
-public:
-    Double2DParamVarRef(Double2DParam* param)
-        : SeExprVarRef()
-        , _lock()
-        , _varSet(false)
-        , _value()
-        , _param(param)
-    {
-    }
-
-    virtual ~Double2DParamVarRef() { }
+    void setValue(const double* value) { _value = value; }
 
     //! returns true for a vector type, false for a scalar type
-    virtual bool isVec() { return true; }
+    virtual bool isVec() { return _dim > 1; }
 
     //! returns this variable's value by setting result, node refers to
     //! where in the parse tree the evaluation is occurring
     virtual void eval(const SeExprVarNode* /*node*/,
                       SeExpr2::Vec3d& result)
     {
-        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
-        if (!_varSet) {
-            _param->getValue(_value[0], _value[1]);
-            _varSet = true;
-        } else {
-            result[0] = _value[0];
-            result[1] = _value[1];
-        }
-    }
-};
-
-class ColorParamVarRef
-    : public SeExprVarRef {
-    // Used to call getValue only once per expression evaluation and not once per pixel
-    // Using SeExpr lock is faster than calling the multi-thread suite to get a mutex
-    SeExprInternal::Mutex _lock;
-    bool _varSet;
-    double _value[3];
-    RGBParam* _param;
-
-public:
-    ColorParamVarRef(RGBParam* param)
-        : SeExprVarRef()
-        , _lock()
-        , _varSet(false)
-        , _value()
-        , _param(param)
-    {
-    }
-
-    virtual ~ColorParamVarRef() { }
-
-    //! returns true for a vector type, false for a scalar type
-    virtual bool isVec() { return true; }
-
-    //! returns this variable's value by setting result, node refers to
-    //! where in the parse tree the evaluation is occurring
-    virtual void eval(const SeExprVarNode* /*node*/,
-                      SeExpr2::Vec3d& result)
-    {
-        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
-        if (!_varSet) {
-            _param->getValue(_value[0], _value[1], _value[2]);
-            _varSet = true;
-        } else {
-            result[0] = _value[0];
+        assert(_value);
+        result[0] = _value[0];
+        if (_dim > 1) {
             result[1] = _value[1];
-            result[2] = _value[2];
+            result[2] = (_dim > 2) ? _value[2] : 0.;
         }
     }
 };
@@ -1102,10 +1394,57 @@ private:
     virtual void eval(const SeExpr2::ExprFuncNode* node, SeExpr2::Vec3d& result) const;
 };
 
-typedef map<int, vector<OfxTime>> FramesNeeded;
+/**
+ * @brief Bounds of a scalar argument of cpixel/apixel, of the form base + [offsetMin, offsetMax]
+ **/
+struct PixelArgBound {
+    enum BaseEnum {
+        eBaseUnknown = 0, // the argument depends on something else, e.g. a pixel value
+        eBaseConstant,
+        eBaseX,
+        eBaseY,
+        eBaseFrame,
+    };
+
+    BaseEnum base;
+    double offsetMin;
+    double offsetMax;
+
+    PixelArgBound()
+        : base(eBaseUnknown)
+        , offsetMin(0.)
+        , offsetMax(0.)
+    {
+    }
+
+    PixelArgBound(BaseEnum b,
+                  double omin,
+                  double omax)
+        : base(b)
+        , offsetMin(omin)
+        , offsetMax(omax)
+    {
+        if (!(std::isfinite)(omin) || !(std::isfinite)(omax)) {
+            base = eBaseUnknown;
+        }
+    }
+};
+
+// a call to cpixel/apixel found in the expression
+struct PixelCall {
+    int inputIndex;
+    vector<PixelArgBound> frames; // one bound per branch of the conditionals in the frame argument
+    PixelArgBound x;
+    PixelArgBound y;
+};
+
+typedef vector<PixelCall> PixelCalls;
 
 /**
  * @brief Used to determine what are the frames needed and RoIs of the expression
+ *
+ * When the expression is prepared, the arguments of each cpixel/apixel call are analyzed,
+ * so that all the calls are known, even in branches that are not evaluated.
  **/
 class StubSeExpression
     : public SeExpression {
@@ -1113,7 +1452,9 @@ class StubSeExpression
     mutable StubPixelFuncX _pixel;
     mutable SeExprFunc _pixelFunction;
     mutable SimpleScalar _currentTime;
-    mutable FramesNeeded _images;
+    mutable SimpleScalar _xCoord;
+    mutable SimpleScalar _yCoord;
+    PixelCalls _pixelCalls;
 
 public:
     StubSeExpression(const string& expr,
@@ -1122,36 +1463,50 @@ public:
 
     virtual ~StubSeExpression();
 
+    /** @brief prepare a cached expression for a new evaluation at the given time */
+    void setTime(OfxTime time)
+    {
+        _currentTime._value = time;
+    }
+
     /** override resolveVar to add external variables */
     virtual SeExprVarRef* resolveVar(const string& name) const OVERRIDE FINAL;
 
     /** override resolveFunc to add external functions */
     virtual SeExprFunc* resolveFunc(const string& name) const OVERRIDE FINAL;
 
-    void onPixelCalled(int inputIndex,
-                       OfxTime time)
+    /** @brief analyze the arguments of a prepared cpixel/apixel call */
+    void onPixelPrepared(const SeExpr2::ExprFuncNode* node,
+                         int inputIndex)
     {
-        // Register image needed
-        FramesNeeded::iterator foundInput = _images.find(inputIndex);
-        if (foundInput == _images.end()) {
-            vector<OfxTime> times;
-            times.push_back(time);
-            _images.insert(make_pair(inputIndex, times));
-        } else {
-            if (std::find(foundInput->second.begin(), foundInput->second.end(), time) == foundInput->second.end()) {
-                foundInput->second.push_back(time);
-            }
-        }
+        PixelCall call;
+
+        call.inputIndex = inputIndex;
+        analyzeFrameArg(node->child(1), &call.frames);
+        call.x = analyzePixelArg(node->child(2));
+        call.y = analyzePixelArg(node->child(3));
+        _pixelCalls.push_back(call);
     }
 
-    const FramesNeeded& getFramesNeeded() const
+    /** @brief all the cpixel/apixel calls in the expression, valid if isValid() is true */
+    const PixelCalls& getPixelCalls() const
     {
-        return _images;
+        return _pixelCalls;
     }
+
+private:
+    PixelArgBound analyzePixelArg(const SeExprNode* node) const;
+
+    void analyzeFrameArg(const SeExprNode* node, vector<PixelArgBound>* bounds) const;
+
+    PixelArgBound::BaseEnum probeVar(const SeExprNode* node) const;
 };
 
+SeExprCache<StubSeExpression> SeExprPlugin::_stubCache[2];
+
 class OFXSeExpression
     : public SeExpression {
+    SeExprProcessorBase* _processor;
     const bool _simple;
     mutable PixelFuncX<false> _cpixel;
     mutable SeExprFunc _cpixelFunction;
@@ -1179,9 +1534,9 @@ class OFXSeExpression
     SimpleScalar _inputB[kSourceClipCount];
     SimpleVec _inputColors[kSourceClipCount];
     SimpleScalar _inputAlphas[kSourceClipCount];
-    DoubleParamVarRef* _doubleRef[kParamsCount];
-    Double2DParamVarRef* _double2DRef[kParamsCount];
-    ColorParamVarRef* _colorRef[kParamsCount];
+    ParamVarRef* _doubleRef[kParamsCount];
+    ParamVarRef* _double2DRef[kParamsCount];
+    ParamVarRef* _colorRef[kParamsCount];
 
 public:
     OFXSeExpression(SeExprProcessorBase* processor,
@@ -1195,6 +1550,16 @@ public:
 
     virtual ~OFXSeExpression();
 
+    /** @brief create and parse a copy of this expression, to be used by another thread */
+    OFXSeExpression* clone() const;
+
+    /** @brief set the rendering values (and parameter values) of an expression taken from the SeExprCache */
+    void bind(SeExprProcessorBase* processor,
+              OfxTime time,
+              const OfxPointD& renderScale,
+              double par,
+              const OfxRectI& outputRod);
+
     /** override resolveVar to add external variables */
     virtual SeExprVarRef* resolveVar(const string& name) const OVERRIDE FINAL;
 
@@ -1204,14 +1569,26 @@ public:
     /** NOT MT-SAFE, this object is to be used PER-THREAD*/
     void setXY(int x,
                int y)
+    {
+        setX(x);
+        setY(y);
+    }
+
+    /** NOT MT-SAFE, set the variables that depend on x only */
+    void setX(int x)
     {
         _xCoord._value = x;
-        _yCoord._value = y;
         assert(_dstPixelRod.x2 - _dstPixelRod.x1);
-        assert(_dstPixelRod.y2 - _dstPixelRod.y1);
         _uCoord._value = (x + 0.5 - _dstPixelRod.x1) / (_dstPixelRod.x2 - _dstPixelRod.x1);
-        _vCoord._value = (y + 0.5 - _dstPixelRod.y1) / (_dstPixelRod.y2 - _dstPixelRod.y1);
         _xCanCoord._value = (x + 0.5) * _par._value / _scalex._value;
+    }
+
+    /** NOT MT-SAFE, set the variables that depend on y only, once per row */
+    void setY(int y)
+    {
+        _yCoord._value = y;
+        assert(_dstPixelRod.y2 - _dstPixelRod.y1);
+        _vCoord._value = (y + 0.5 - _dstPixelRod.y1) / (_dstPixelRod.y2 - _dstPixelRod.y1);
         _yCanCoord._value = (y + 0.5) / _scaley._value;
     }
 
@@ -1255,6 +1632,7 @@ OFXSeExpression::OFXSeExpression(SeExprProcessorBase* processor,
                                  double par,
                                  const OfxRectI& outputRod)
     : SeExpression(expr, wantVec)
+    , _processor(processor)
     , _simple(simple)
     , _cpixel(processor)
     , _cpixelFunction(_cpixel, 4, 5)
@@ -1340,15 +1718,13 @@ OFXSeExpression::OFXSeExpression(SeExprProcessorBase* processor,
     }
 
     assert(processor);
-    SeExprPlugin* plugin = processor->getPlugin();
-    DoubleParam** doubleParams = plugin->getDoubleParams();
-    Double2DParam** double2DParams = plugin->getDouble2DParams();
-    RGBParam** colorParams = plugin->getRGBParams();
-
     for (int i = 0; i < kParamsCount; ++i) {
-        _doubleRef[i] = new DoubleParamVarRef(doubleParams[i]);
-        _double2DRef[i] = new Double2DParamVarRef(double2DParams[i]);
-        _colorRef[i] = new ColorParamVarRef(colorParams[i]);
+        _doubleRef[i] = new ParamVarRef(1);
+        _doubleRef[i]->setValue(processor->getDoubleParamValue(i));
+        _double2DRef[i] = new ParamVarRef(2);
+        _double2DRef[i]->setValue(processor->getDouble2DParamValue(i));
+        _colorRef[i] = new ParamVarRef(3);
+        _colorRef[i]->setValue(processor->getColorParamValue(i));
         const string istr = unsignedToString(i + 1);
         _variables[kParamDouble + istr] = _doubleRef[i];
         _variables[kParamDouble2D + istr] = _double2DRef[i];
@@ -1365,6 +1741,46 @@ OFXSeExpression::~OFXSeExpression()
     }
 }
 
+OFXSeExpression*
+OFXSeExpression::clone() const
+{
+    OfxPointD renderScale;
+    renderScale.x = _scalex._value;
+    renderScale.y = _scaley._value;
+    OFXSeExpression* expr = _processor->createExpr(getExpr(), wantVec(), _simple, _curTime._value, renderScale, _par._value, _dstPixelRod);
+
+    for (int i = 0; i < kSourceClipCount; ++i) {
+        expr->setSize(i, (int)_inputWidths[i]._value, (int)_inputHeights[i]._value);
+    }
+    expr->setSize(-1, (int)_outputWidth._value, (int)_outputHeight._value);
+    // parse now, rather than on the first evaluation in the rendering thread
+    (void)expr->isValid();
+
+    return expr;
+}
+
+void
+OFXSeExpression::bind(SeExprProcessorBase* processor,
+                      OfxTime time,
+                      const OfxPointD& renderScale,
+                      double par,
+                      const OfxRectI& outputRod)
+{
+    _processor = processor;
+    _cpixel.setProcessor(processor);
+    _apixel.setProcessor(processor);
+    _dstPixelRod = outputRod;
+    _scalex._value = renderScale.x;
+    _scaley._value = renderScale.y;
+    _curTime._value = time;
+    _par._value = par;
+    for (int i = 0; i < kParamsCount; ++i) {
+        _doubleRef[i]->setValue(processor->getDoubleParamValue(i));
+        _double2DRef[i]->setValue(processor->getDouble2DParamValue(i));
+        _colorRef[i]->setValue(processor->getColorParamValue(i));
+    }
+}
+
 SeExprVarRef*
 OFXSeExpression::resolveVar(const string& varName) const
 {
@@ -1425,22 +1841,15 @@ StubPixelFuncX::prep(SeExpr2::ExprFuncNode* node,
 
         return false;
     }
+    _expr->onPixelPrepared(node, inputIndex);
 
     return true;
 }
 
 void
-StubPixelFuncX::eval(const SeExpr2::ExprFuncNode* node,
+StubPixelFuncX::eval(const SeExpr2::ExprFuncNode* /*node*/,
                      SeExpr2::Vec3d& result) const
 {
-    SeExpr2::Vec3d v;
-
-    node->child(0)->eval(v);
-    int inputIndex = (int)SeExpr::round(v[0]) - 1;
-    node->child(1)->eval(v);
-    OfxTime frame = SeExpr::round(v[0]);
-
-    _expr->onPixelCalled(inputIndex, frame);
     result[0] = result[1] = result[2] = std::numeric_limits<double>::quiet_NaN();
 }
 
@@ -1453,9 +1862,14 @@ StubSeExpression::StubSeExpression(const string& expr,
     , _pixel(this)
     , _pixelFunction(_pixel, 4, 5)
     , _currentTime()
+    , _xCoord()
+    , _yCoord()
+    , _pixelCalls()
 {
     _nanScalar._value = std::numeric_limits<double>::quiet_NaN();
     _currentTime._value = time;
+    _xCoord._value = std::numeric_limits<double>::quiet_NaN();
+    _yCoord._value = std::numeric_limits<double>::quiet_NaN();
 }
 
 StubSeExpression::~StubSeExpression()
@@ -1466,11 +1880,170 @@ StubSeExpression::~StubSeExpression()
 SeExprVarRef*
 StubSeExpression::resolveVar(const string& varName) const
 {
-    if (varName == kSeExprCurrentTimeVarName) {
-        return &_currentTime;
-    }
+    if (varName == kSeExprCurrentTimeVarName) {
+        return &_currentTime;
+    }
+    if (varName == kSeExprXCoordVarName) {
+        return &_xCoord;
+    }
+    if (varName == kSeExprYCoordVarName) {
+        return &_yCoord;
+    }
+
+    return &_nanScalar;
+}
+
+// Find out whether a variable node is x, y or frame, by checking that its value follows
+// the value of the variable. A local variable with the same name does not, since its
+// assignment is not evaluated here.
+PixelArgBound::BaseEnum
+StubSeExpression::probeVar(const SeExprNode* node) const
+{
+    const double probes[2] = { 12345.25, -678.5 };
+    SimpleScalar* vars[3] = { &_xCoord, &_yCoord, &_currentTime };
+    const PixelArgBound::BaseEnum bases[3] = { PixelArgBound::eBaseX, PixelArgBound::eBaseY, PixelArgBound::eBaseFrame };
+
+    for (int i = 0; i < 3; ++i) {
+        const double value = vars[i]->_value;
+        bool follows = true;
+        for (int p = 0; p < 2 && follows; ++p) {
+            SeExpr2::Vec3d v;
+            vars[i]->_value = probes[p];
+            node->eval(v);
+            follows = (v[0] == probes[p]);
+        }
+        vars[i]->_value = value;
+        if (follows) {
+            return bases[i];
+        }
+    }
+
+    return PixelArgBound::eBaseUnknown;
+}
+
+// Conservative bounds of a prepared scalar expression. Only sums and differences of
+// constants with x, y or frame give known bounds: anything else, such as a pixel value,
+// a function call or a local variable, makes the bounds unknown.
+PixelArgBound
+StubSeExpression::analyzePixelArg(const SeExprNode* node) const
+{
+    if (!node || node->isVec()) {
+        return PixelArgBound();
+    }
+    if (dynamic_cast<const SeExprNumNode*>(node)) {
+        SeExpr2::Vec3d v;
+        node->eval(v);
+
+        return PixelArgBound(PixelArgBound::eBaseConstant, v[0], v[0]);
+    }
+    if (dynamic_cast<const SeExprVarNode*>(node)) {
+        return PixelArgBound(probeVar(node), 0., 0.);
+    }
+    if (dynamic_cast<const SeExprNegNode*>(node)) {
+        PixelArgBound a = analyzePixelArg(node->child(0));
+        if (a.base != PixelArgBound::eBaseConstant) {
+            return PixelArgBound();
+        }
+
+        return PixelArgBound(a.base, -a.offsetMax, -a.offsetMin);
+    }
+    if (dynamic_cast<const SeExprCondNode*>(node)) {
+        // c ? a : b
+        PixelArgBound a = analyzePixelArg(node->child(1));
+        PixelArgBound b = analyzePixelArg(node->child(2));
+        if ((a.base == PixelArgBound::eBaseUnknown) || (a.base != b.base)) {
+            return PixelArgBound();
+        }
+
+        return PixelArgBound(a.base, (std::min)(a.offsetMin, b.offsetMin), (std::max)(a.offsetMax, b.offsetMax));
+    }
+    if (node->numChildren() != 2) {
+        return PixelArgBound();
+    }
+    PixelArgBound a = analyzePixelArg(node->child(0));
+    PixelArgBound b = analyzePixelArg(node->child(1));
+    if ((a.base == PixelArgBound::eBaseUnknown) || (b.base == PixelArgBound::eBaseUnknown)) {
+        return PixelArgBound();
+    }
+    if (dynamic_cast<const SeExprAddNode*>(node)) {
+        if (a.base == PixelArgBound::eBaseConstant) {
+            std::swap(a, b);
+        }
+        if (b.base != PixelArgBound::eBaseConstant) {
+            return PixelArgBound();
+        }
+
+        return PixelArgBound(a.base, a.offsetMin + b.offsetMin, a.offsetMax + b.offsetMax);
+    }
+    if (dynamic_cast<const SeExprSubNode*>(node)) {
+        if (b.base != PixelArgBound::eBaseConstant) {
+            return PixelArgBound();
+        }
+
+        return PixelArgBound(a.base, a.offsetMin - b.offsetMax, a.offsetMax - b.offsetMin);
+    }
+    if ((a.base != PixelArgBound::eBaseConstant) || (b.base != PixelArgBound::eBaseConstant)) {
+        return PixelArgBound();
+    }
+    if (dynamic_cast<const SeExprMulNode*>(node)) {
+        const double p[4] = { a.offsetMin * b.offsetMin, a.offsetMin * b.offsetMax, a.offsetMax * b.offsetMin, a.offsetMax * b.offsetMax };
+
+        return PixelArgBound(PixelArgBound::eBaseConstant, *std::min_element(p, p + 4), *std::max_element(p, p + 4));
+    }
+    if (dynamic_cast<const SeExprDivNode*>(node)) {
+        if ((b.offsetMin <= 0.) && (0. <= b.offsetMax)) {
+            return PixelArgBound();
+        }
+        const double p[4] = { a.offsetMin / b.offsetMin, a.offsetMin / b.offsetMax, a.offsetMax / b.offsetMin, a.offsetMax / b.offsetMax };
+
+        return PixelArgBound(PixelArgBound::eBaseConstant, *std::min_element(p, p + 4), *std::max_element(p, p + 4));
+    }
+
+    return PixelArgBound();
+} // StubSeExpression::analyzePixelArg
+
+// Bounds of the frame argument of cpixel/apixel. Unlike analyzePixelArg(), the branches of a
+// conditional are kept apart, so that "c ? frame-50 : frame+50" needs two frames, not 101.
+// Adding or subtracting a constant shifts each branch.
+void
+StubSeExpression::analyzeFrameArg(const SeExprNode* node,
+                                  vector<PixelArgBound>* bounds) const
+{
+    if (node && !node->isVec()) {
+        if (dynamic_cast<const SeExprCondNode*>(node)) {
+            // c ? a : b
+            analyzeFrameArg(node->child(1), bounds);
+            analyzeFrameArg(node->child(2), bounds);
 
-    return &_nanScalar;
+            return;
+        }
+        const bool isAdd = (dynamic_cast<const SeExprAddNode*>(node) != nullptr);
+        const bool isSub = (dynamic_cast<const SeExprSubNode*>(node) != nullptr);
+        if ((isAdd || isSub) && (node->numChildren() == 2)) {
+            int operand = 0;
+            PixelArgBound b = analyzePixelArg(node->child(1));
+            if (isAdd && (b.base != PixelArgBound::eBaseConstant)) {
+                operand = 1;
+                b = analyzePixelArg(node->child(0));
+            }
+            if (b.base == PixelArgBound::eBaseConstant) {
+                vector<PixelArgBound> a;
+                analyzeFrameArg(node->child(operand), &a);
+                for (std::size_t i = 0; i < a.size(); ++i) {
+                    if (a[i].base == PixelArgBound::eBaseUnknown) {
+                        bounds->push_back(a[i]);
+                    } else if (isAdd) {
+                        bounds->push_back(PixelArgBound(a[i].base, a[i].offsetMin + b.offsetMin, a[i].offsetMax + b.offsetMax));
+                    } else {
+                        bounds->push_back(PixelArgBound(a[i].base, a[i].offsetMin - b.offsetMax, a[i].offsetMax - b.offsetMin));
+                    }
+                }
+
+                return;
+            }
+        }
+    }
+    bounds->push_back(analyzePixelArg(node));
 }
 
 /** override resolveFunc to add external functions */
@@ -1497,6 +2070,7 @@ SeExprProcessorBase::SeExprProcessorBase(SeExprPlugin* instance)
     , _bExpr(NULL)
     , _rgbExpr(NULL)
     , _alphaExpr(NULL)
+    , _threadExprs()
     , _srcCurTime()
     , _dstImg(NULL)
     , _maskInvert(false)
@@ -1504,25 +2078,67 @@ SeExprProcessorBase::SeExprProcessorBase(SeExprPlugin* instance)
     , _doMasking(false)
     , _mix(0.)
     , _images()
+    , _lateImagesLock()
+    , _lateImages()
 {
+    _renderWindow.x1 = _renderWindow.y1 = _renderWindow.x2 = _renderWindow.y2 = 0;
     for (int i = 0; i < kSourceClipCount; ++i) {
         _srcCurTime[i] = 0;
         _nSrcComponents[i] = 0;
     }
+    for (int i = 0; i < kParamsCount; ++i) {
+        _doubleParamValues[i][0] = 0.;
+        _double2DParamValues[i][0] = _double2DParamValues[i][1] = 0.;
+        _colorParamValues[i][0] = _colorParamValues[i][1] = _colorParamValues[i][2] = 0.;
+    }
 }
 
 SeExprProcessorBase::~SeExprProcessorBase()
 {
-    delete _rExpr;
-    delete _gExpr;
-    delete _bExpr;
-    delete _rgbExpr;
-    delete _alphaExpr;
+    // give the expressions back to the cache, those of the first thread are released below
+    SeExprCache<OFXSeExpression>& cache = _plugin->getExprCache();
+    for (std::size_t t = 1; t < _threadExprs.size(); ++t) {
+        cache.release(_threadExprs[t].rExpr);
+        cache.release(_threadExprs[t].gExpr);
+        cache.release(_threadExprs[t].bExpr);
+        cache.release(_threadExprs[t].rgbExpr);
+        cache.release(_threadExprs[t].alphaExpr);
+    }
+    cache.release(_rExpr);
+    cache.release(_gExpr);
+    cache.release(_bExpr);
+    cache.release(_rgbExpr);
+    cache.release(_alphaExpr);
     for (FetchedImagesMap::iterator it = _images.begin(); it != _images.end(); ++it) {
         for (FetchedImagesForClipMap::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
             delete it2->second;
         }
     }
+    for (FetchedImagesMap::iterator it = _lateImages.begin(); it != _lateImages.end(); ++it) {
+        for (FetchedImagesForClipMap::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            delete it2->second;
+        }
+    }
+}
+
+OFXSeExpression*
+SeExprProcessorBase::createExpr(const string& script,
+                                bool wantVec,
+                                bool simple,
+                                OfxTime time,
+                                const OfxPointD& renderScale,
+                                double par,
+                                const OfxRectI& dstPixelRod)
+{
+    OFXSeExpression* expr = _plugin->getExprCache().acquire(script, wantVec);
+
+    if (expr) {
+        expr->bind(this, time, renderScale, par, dstPixelRod);
+
+        return expr;
+    }
+
+    return new OFXSeExpression(this, script, wantVec, simple, time, renderScale, par, dstPixelRod);
 }
 
 void
@@ -1537,6 +2153,7 @@ SeExprProcessorBase::setValues(OfxTime time,
                                const OfxPointD& renderScale,
                                double par)
 {
+    fetchParamValues(time);
     setExprs(time, rgbExpr, alphaExpr, dstPixelRod, renderScale, par);
     setValuesOther(time, view, mix, inputSizes, outputSize);
 }
@@ -1555,10 +2172,25 @@ SeExprProcessorBase::setValuesSimple(OfxTime time,
                                      const OfxPointD& renderScale,
                                      double par)
 {
+    fetchParamValues(time);
     setExprsSimple(time, rExpr, gExpr, bExpr, aExpr, dstPixelRod, renderScale, par);
     setValuesOther(time, view, mix, inputSizes, outputSize);
 }
 
+void
+SeExprProcessorBase::fetchParamValues(OfxTime time)
+{
+    DoubleParam** doubleParams = _plugin->getDoubleParams();
+    Double2DParam** double2DParams = _plugin->getDouble2DParams();
+    RGBParam** colorParams = _plugin->getRGBParams();
+
+    for (int i = 0; i < kParamsCount; ++i) {
+        doubleParams[i]->getValueAtTime(time, _doubleParamValues[i][0]);
+        double2DParams[i]->getValueAtTime(time, _double2DParamValues[i][0], _double2DParamValues[i][1]);
+        colorParams[i]->getValueAtTime(time, _colorParamValues[i][0], _colorParamValues[i][1], _colorParamValues[i][2]);
+    }
+}
+
 void
 SeExprProcessorBase::setExprs(OfxTime time,
                               const string& rgbExpr,
@@ -1568,10 +2200,10 @@ SeExprProcessorBase::setExprs(OfxTime time,
                               double par)
 {
     if (!isSpaces(rgbExpr)) {
-        _rgbExpr = new OFXSeExpression(this, rgbExpr, /*wantVec=*/true, /*simple=*/false, time, renderScale, par, dstPixelRod);
+        _rgbExpr = createExpr(rgbExpr, /*wantVec=*/true, /*simple=*/false, time, renderScale, par, dstPixelRod);
     }
     if (!isSpaces(alphaExpr)) {
-        _alphaExpr = new OFXSeExpression(this, alphaExpr, /*wantVec=*/false, /*simple=*/false, time, renderScale, par, dstPixelRod);
+        _alphaExpr = createExpr(alphaExpr, /*wantVec=*/false, /*simple=*/false, time, renderScale, par, dstPixelRod);
     }
 }
 
@@ -1586,16 +2218,34 @@ SeExprProcessorBase::setExprsSimple(OfxTime time,
                                     double par)
 {
     if (!isSpaces(rExpr)) {
-        _rExpr = new OFXSeExpression(this, rExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
+        _rExpr = createExpr(rExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
     }
     if (!isSpaces(gExpr)) {
-        _gExpr = new OFXSeExpression(this, gExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
+        _gExpr = createExpr(gExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
     }
     if (!isSpaces(bExpr)) {
-        _bExpr = new OFXSeExpression(this, bExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
+        _bExpr = createExpr(bExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
+    }
+    if (_rExpr && _gExpr && _bExpr && _rExpr->isValid() && _gExpr->isValid() && _bExpr->isValid() &&
+        isSingleExpression(rExpr) && isSingleExpression(gExpr) && isSingleExpression(bExpr)) {
+        // Fuse the three channel expressions into a single vector expression,
+        // so that each pixel runs the interpreter and sets the variables once instead of three times.
+        // The channel expressions are still used if the fused expression is not valid.
+        const string rgbExpr = "[(" + rExpr + "), (" + gExpr + "), (" + bExpr + ")]";
+        OFXSeExpression* expr = createExpr(rgbExpr, /*wantVec=*/true, /*simple=*/true, time, renderScale, par, dstPixelRod);
+        SeExprCache<OFXSeExpression>& cache = _plugin->getExprCache();
+        if (expr->isValid()) {
+            _rgbExpr = expr;
+            cache.release(_rExpr);
+            cache.release(_gExpr);
+            cache.release(_bExpr);
+            _rExpr = _gExpr = _bExpr = NULL;
+        } else {
+            cache.release(expr);
+        }
     }
     if (!isSpaces(aExpr)) {
-        _alphaExpr = new OFXSeExpression(this, aExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
+        _alphaExpr = createExpr(aExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
     }
 }
 
@@ -1674,7 +2324,9 @@ SeExprProcessorBase::isExprOk(string* error)
         return false;
     }
 
-    // Run the expression once to initialize all the images fields before multi-threading
+    // Evaluate the expressions once on the render thread, so that any lazy preparation done by the
+    // first evaluation happens before multi-threading. The images do not need to be fetched here:
+    // SeExprPlugin::prefetchPixelImages() fetched them, and getImage() fetches the others under a lock.
     if (_rExpr) {
         (void)_rExpr->evaluate();
     }
@@ -1702,6 +2354,56 @@ SeExprProcessorBase::isExprOk(string* error)
     return true;
 } // SeExprProcessorBase::isExprOk
 
+void
+SeExprProcessorBase::process(const OfxRectI& renderWindow)
+{
+    // make sure there are some actual pixels to process
+    if ((renderWindow.x2 <= renderWindow.x1) || (renderWindow.y2 <= renderWindow.y1)) {
+        return;
+    }
+    _renderWindow = renderWindow;
+
+    // one band of rows per thread
+    unsigned int nThreads = (std::min)(MultiThread::getNumCPUs(), (unsigned int)(renderWindow.y2 - renderWindow.y1));
+    nThreads = (std::max)(nThreads, 1u);
+
+    // create the expressions used by each thread before launching the threads
+    assert(_threadExprs.empty());
+    _threadExprs.resize(nThreads);
+    _threadExprs[0].rExpr = _rExpr;
+    _threadExprs[0].gExpr = _gExpr;
+    _threadExprs[0].bExpr = _bExpr;
+    _threadExprs[0].rgbExpr = _rgbExpr;
+    _threadExprs[0].alphaExpr = _alphaExpr;
+    for (unsigned int t = 1; t < nThreads; ++t) {
+        _threadExprs[t].rExpr = _rExpr ? _rExpr->clone() : NULL;
+        _threadExprs[t].gExpr = _gExpr ? _gExpr->clone() : NULL;
+        _threadExprs[t].bExpr = _bExpr ? _bExpr->clone() : NULL;
+        _threadExprs[t].rgbExpr = _rgbExpr ? _rgbExpr->clone() : NULL;
+        _threadExprs[t].alphaExpr = _alphaExpr ? _alphaExpr->clone() : NULL;
+    }
+
+    multiThread(nThreads);
+}
+
+void
+SeExprProcessorBase::multiThreadFunction(unsigned int threadID,
+                                         unsigned int nThreads)
+{
+    assert(threadID < _threadExprs.size() && nThreads <= _threadExprs.size());
+    if (threadID >= _threadExprs.size()) {
+        return;
+    }
+    // split the render window into bands of rows, each band checks for abort
+    const int height = _renderWindow.y2 - _renderWindow.y1;
+    OfxRectI procWindow = _renderWindow;
+    procWindow.y1 = _renderWindow.y1 + (int)(((long long)height * threadID) / nThreads);
+    procWindow.y2 = _renderWindow.y1 + (int)(((long long)height * (threadID + 1)) / nThreads);
+    if (procWindow.y1 < procWindow.y2) {
+        processRows(procWindow, _threadExprs[threadID]);
+    }
+}
+
 // template to do the RGBA processing
 template <class PIX, int nComponents, int maxValue>
 class SeExprProcessor
@@ -1715,113 +2417,207 @@ public:
     }
 
 private:
+    // Convert a row of an input image to normalized RGBA.
+    // Pixels outside of the image are black and transparent. Inputs without alpha get an alpha of 1 in the PIX range.
+    template <int nSrcComponents>
+    static void fillSrcSpanForComponents(const Image* img,
+                                         int x1,
+                                         int x2,
+                                         int y,
+                                         float* span)
+    {
+        std::fill(span, span + 4 * (x2 - x1), 0.f);
+        const OfxRectI& bounds = img->getBounds();
+        if ((y < bounds.y1) || (bounds.y2 <= y)) {
+            return;
+        }
+        const int xa = (std::max)(x1, bounds.x1);
+        const int xb = (std::min)(x2, bounds.x2);
+        if (xb <= xa) {
+            return;
+        }
+        const PIX* srcPix = (const PIX*)img->getPixelAddress(xa, y);
+        assert(srcPix);
+        float* spanPix = span + 4 * (xa - x1);
+        for (int x = xa; x < xb; ++x, srcPix += nSrcComponents, spanPix += 4) {
+            if (nSrcComponents == 4) {
+                spanPix[0] = srcPix[0] / (float)maxValue;
+                spanPix[1] = srcPix[1] / (float)maxValue;
+                spanPix[2] = srcPix[2] / (float)maxValue;
+                spanPix[3] = srcPix[3] / (float)maxValue;
+            } else if (nSrcComponents == 3) {
+                spanPix[0] = srcPix[0] / (float)maxValue;
+                spanPix[1] = srcPix[1] / (float)maxValue;
+                spanPix[2] = srcPix[2] / (float)maxValue;
+                spanPix[3] = 1 / (float)maxValue;
+            } else if (nSrcComponents == 2) {
+                spanPix[0] = srcPix[0] / (float)maxValue;
+                spanPix[1] = srcPix[1] / (float)maxValue;
+                spanPix[3] = 1 / (float)maxValue;
+            } else {
+                spanPix[3] = srcPix[0] / (float)maxValue;
+            }
+        }
+    }
+
+    void fillSrcSpan(int inputIndex,
+                     int x1,
+                     int x2,
+                     int y,
+                     float* span)
+    {
+        const Image* img = _srcCurTime[inputIndex];
+        assert(img);
+        switch (_nSrcComponents[inputIndex]) {
+        case 4:
+            fillSrcSpanForComponents<4>(img, x1, x2, y, span);
+            break;
+        case 3:
+            fillSrcSpanForComponents<3>(img, x1, x2, y, span);
+            break;
+        case 2:
+            fillSrcSpanForComponents<2>(img, x1, x2, y, span);
+            break;
+        default:
+            fillSrcSpanForComponents<1>(img, x1, x2, y, span);
+            break;
+        }
+    }
+
     // and do some processing
-    virtual void process(OfxRectI procWindow) OVERRIDE FINAL
+    virtual void processRows(const OfxRectI& procWindow,
+                             const SeExprThreadExprs& exprs) OVERRIDE FINAL
     {
         assert((nComponents == 4 /*&& _rgbExpr && _alphaExpr*/) || (nComponents == 3 /*&& _rgbExpr && !_alphaExpr*/) || (nComponents == 1 /*&& !_rgbExpr && _alphaExpr*/));
 
+        OFXSeExpression* const rExpr = exprs.rExpr;
+        OFXSeExpression* const gExpr = exprs.gExpr;
+        OFXSeExpression* const bExpr = exprs.bExpr;
+        OFXSeExpression* const rgbExpr = exprs.rgbExpr;
+        OFXSeExpression* const alphaExpr = exprs.alphaExpr;
+        OFXSeExpression* const allExprs[5] = { rExpr, gExpr, bExpr, rgbExpr, alphaExpr };
+        const int width = procWindow.x2 - procWindow.x1;
+
+        // The source pixels are converted one row at a time, and only for the connected inputs.
+        // The inputs which are not connected are black and transparent for the whole window.
+        int nInputs = 0;
+        int inputs[kSourceClipCount];
+        vector<float> srcSpans[kSourceClipCount];
+        for (int i = 0; i < kSourceClipCount; ++i) {
+            if (_srcCurTime[i]) {
+                inputs[nInputs++] = i;
+                srcSpans[i].resize(4 * width);
+            } else {
+                for (int e = 0; e < 5; ++e) {
+                    if (allExprs[e]) {
+                        allExprs[e]->setRGBA(i, 0.f, 0.f, 0.f, 0.f);
+                    }
+                }
+            }
+        }
+
         float tmpPix[4];
-        PIX srcPixels[kSourceClipCount][4];
+        PIX srcPix0[4];
 
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_plugin->abort()) {
                 break;
             }
 
+            for (int n = 0; n < nInputs; ++n) {
+                fillSrcSpan(inputs[n], procWindow.x1, procWindow.x2, y, &srcSpans[inputs[n]][0]);
+            }
+            for (int e = 0; e < 5; ++e) {
+                if (allExprs[e]) {
+                    allExprs[e]->setY(y);
+                }
+            }
+
             PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
 
             for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int i = kSourceClipCount - 1; i >= 0; --i) {
-                    const PIX* src_pixels = _srcCurTime[i] ? (const PIX*)_srcCurTime[i]->getPixelAddress(x, y) : 0;
-                    if (_nSrcComponents[i] == 4) {
-                        for (int k = 0; k < 4; ++k) {
-                            srcPixels[i][k] = src_pixels ? src_pixels[k] : 0;
+                const int dx = x - procWindow.x1;
+                for (int n = 0; n < nInputs; ++n) {
+                    const int i = inputs[n];
+                    const float* srcPix = &srcSpans[i][4 * dx];
+                    for (int e = 0; e < 5; ++e) {
+                        if (allExprs[e]) {
+                            allExprs[e]->setRGBA(i, srcPix[0], srcPix[1], srcPix[2], srcPix[3]);
                         }
-                    } else if (_nSrcComponents[i] == 3) {
-                        for (int k = 0; k < 3; ++k) {
-                            srcPixels[i][k] = src_pixels ? src_pixels[k] : 0;
-                        }
-                        srcPixels[i][3] = src_pixels ? 1 : 0;
-                    } else if (_nSrcComponents[i] == 2) {
-                        for (int k = 0; k < 2; ++k) {
-                            srcPixels[i][k] = src_pixels ? src_pixels[k] : 0;
-                        }
-                        srcPixels[i][2] = 0;
-                        srcPixels[i][3] = src_pixels ? 1 : 0;
-                    } else {
-                        for (int k = 0; k < 3; ++k) {
-                            srcPixels[i][k] = 0;
-                        }
-                        srcPixels[i][3] = src_pixels ? src_pixels[0] : 0;
                     }
-                    float r = srcPixels[i][0] / (float)maxValue;
-                    float g = srcPixels[i][1] / (float)maxValue;
-                    float b = srcPixels[i][2] / (float)maxValue;
-                    float a = srcPixels[i][3] / (float)maxValue;
-                    if (_rExpr) {
-                        _rExpr->setRGBA(i, r, g, b, a);
-                    }
-                    if (_gExpr) {
-                        _gExpr->setRGBA(i, r, g, b, a);
+                }
+
+                // the source pixel from the first input, used for the mix and for the empty expressions
+                const PIX* src_pixels = _srcCurTime[0] ? (const PIX*)_srcCurTime[0]->getPixelAddress(x, y) : 0;
+                if (_nSrcComponents[0] == 4) {
+                    for (int k = 0; k < 4; ++k) {
+                        srcPix0[k] = src_pixels ? src_pixels[k] : 0;
                     }
-                    if (_bExpr) {
-                        _bExpr->setRGBA(i, r, g, b, a);
+                } else if (_nSrcComponents[0] == 3) {
+                    for (int k = 0; k < 3; ++k) {
+                        srcPix0[k] = src_pixels ? src_pixels[k] : 0;
                     }
-                    if (_rgbExpr) {
-                        _rgbExpr->setRGBA(i, r, g, b, a);
+                    srcPix0[3] = src_pixels ? 1 : 0;
+                } else if (_nSrcComponents[0] == 2) {
+                    for (int k = 0; k < 2; ++k) {
+                        srcPix0[k] = src_pixels ? src_pixels[k] : 0;
                     }
-                    if (_alphaExpr) {
-                        _alphaExpr->setRGBA(i, r, g, b, a);
+                    srcPix0[2] = 0;
+                    srcPix0[3] = src_pixels ? 1 : 0;
+                } else {
+                    for (int k = 0; k < 3; ++k) {
+                        srcPix0[k] = 0;
                     }
+                    srcPix0[3] = src_pixels ? src_pixels[0] : 0;
                 }
 
                 // initialize with values from first input (some expressions may be empty)
                 if (nComponents == 1) {
-                    tmpPix[0] = srcPixels[0][3];
+                    tmpPix[0] = srcPix0[3];
                 }
                 if (nComponents >= 3) {
-                    tmpPix[0] = srcPixels[0][0];
-                    tmpPix[1] = srcPixels[0][1];
-                    tmpPix[2] = srcPixels[0][2];
+                    tmpPix[0] = srcPix0[0];
+                    tmpPix[1] = srcPix0[1];
+                    tmpPix[2] = srcPix0[2];
                 }
                 if (nComponents == 4) {
-                    tmpPix[3] = srcPixels[0][3];
+                    tmpPix[3] = srcPix0[3];
                 }
 
                 // execute the valid expressions
-                if (_rExpr) {
-                    _rExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _rExpr->evaluate();
+                if (rExpr) {
+                    rExpr->setX(x);
+                    SeExpr2::Vec3d result = rExpr->evaluate();
                     if (nComponents >= 3) {
                         tmpPix[0] = result[0] * maxValue;
                     }
                 }
-                if (_gExpr) {
-                    _gExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _gExpr->evaluate();
+                if (gExpr) {
+                    gExpr->setX(x);
+                    SeExpr2::Vec3d result = gExpr->evaluate();
                     if (nComponents >= 3) {
                         tmpPix[1] = result[0] * maxValue;
                     }
                 }
-                if (_bExpr) {
-                    _bExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _bExpr->evaluate();
+                if (bExpr) {
+                    bExpr->setX(x);
+                    SeExpr2::Vec3d result = bExpr->evaluate();
                     if (nComponents >= 3) {
                         tmpPix[2] = result[0] * maxValue;
                     }
                 }
-                if (_rgbExpr) {
-                    _rgbExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _rgbExpr->evaluate();
+                if (rgbExpr) {
+                    rgbExpr->setX(x);
+                    SeExpr2::Vec3d result = rgbExpr->evaluate();
                     if (nComponents >= 3) {
                         tmpPix[0] = result[0] * maxValue;
                         tmpPix[1] = result[1] * maxValue;
                         tmpPix[2] = result[2] * maxValue;
                     }
                 }
-                if (_alphaExpr) {
-                    _alphaExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _alphaExpr->evaluate();
+                if (alphaExpr) {
+                    alphaExpr->setX(x);
+                    SeExpr2::Vec3d result = alphaExpr->evaluate();
                     if (nComponents == 4) {
                         tmpPix[3] = result[0] * maxValue;
                     } else if (nComponents == 1) {
@@ -1829,13 +2625,13 @@ private:
                     }
                 }
 
-                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixels[0], _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix0, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
 
                 // increment the dst pixel
                 dstPix += nComponents;
             }
         }
-    } // process
+    } // processRows
 };
 
 SeExprPlugin::SeExprPlugin(OfxImageEffectHandle handle,
@@ -1945,6 +2741,40 @@ SeExprPlugin::SeExprPlugin(OfxImageEffectHandle handle,
     }
 }
 
+// Fetch all the images which may be read by cpixel/apixel, on the render thread: the rendering
+// threads of the multi-thread suite only look them up.
+void
+SeExprPlugin::prefetchPixelImages(SeExprProcessorBase& processor,
+                                  OfxTime time,
+                                  const FrameRangesNeeded& framesNeeded,
+                                  const bool useDefaultRange[kSourceClipCount])
+{
+    const OfxRangeD defaultRange = getDefaultFrameRange(time);
+
+    for (int i = 0; i < kSourceClipCount; ++i) {
+        if (!_srcClip[i]->isConnected()) {
+            continue;
+        }
+        vector<OfxRangeD> ranges;
+        if (useDefaultRange[i]) {
+            ranges.push_back(defaultRange);
+        }
+        FrameRangesNeeded::const_iterator found = framesNeeded.find(i);
+        if (found != framesNeeded.end()) {
+            ranges.insert(ranges.end(), found->second.begin(), found->second.end());
+        }
+        for (std::size_t r = 0; r < ranges.size(); ++r) {
+            // cpixel/apixel round the frame
+            for (double t = SeExpr::round(ranges[r].min); t <= ranges[r].max; t += 1.) {
+                if (abort()) {
+                    return;
+                }
+                processor.prefetchImage(i, t);
+            }
+        }
+    }
+}
+
 void
 SeExprPlugin::setupAndProcess(SeExprProcessorBase& processor,
                               const RenderArguments& args)
@@ -2046,7 +2876,17 @@ SeExprPlugin::setupAndProcess(SeExprProcessorBase& processor,
         processor.setValues(time, args.renderView, mix, rgbScript, alphaScript, outputPixelRod, inputSizes, outputSize, args.renderScale, par);
     }
 
+    FrameRangesNeeded framesNeeded;
+    bool useDefaultRange[kSourceClipCount];
     string error;
+    if (!getPixelFramesNeeded(time, &framesNeeded, useDefaultRange, &error)) {
+        setPersistentMessage(Message::eMessageError, "", error);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    prefetchPixelImages(processor, time, framesNeeded, useDefaultRange);
+
     if (!processor.isExprOk(&error)) {
         setPersistentMessage(Message::eMessageError, "", error);
         throwSuiteStatusException(kOfxStatFailed);
@@ -2176,6 +3016,12 @@ SeExprPlugin::changedParam(const InstanceChangedArgs& args,
     // must clear persistent message, or render() is not called by Nuke after an error
     clearPersistentMessage();
 
+    if ((paramName == kParamRExpr) || (paramName == kParamGExpr) || (paramName == kParamBExpr) || (paramName == kParamAExpr) ||
+        (paramName == kParamScript) || (paramName == kParamAlphaScript)) {
+        // the expressions cached for the previous scripts will not be used anymore
+        _exprCache.clear();
+    }
+
     if ((paramName == kParamDoubleParamNumber) && (args.reason == eChangeUserEdit)) {
         int numVisible;
         _doubleParamCount->getValue(numVisible);
@@ -2407,34 +3253,79 @@ SeExprPlugin::getClipPreferences(ClipPreferencesSetter& clipPreferences)
     clipPreferences.setClipComponents(*_dstClip, outputComponents);
 } // SeExprPlugin::getClipPreferences
 
-void
-SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
-                              FramesNeededSetter& framesNeededSetter)
+// get a stub expression from the cache, or create a new one
+StubSeExpression*
+SeExprPlugin::acquireStubExpression(const string& script,
+                                    bool wantVec,
+                                    OfxTime time)
 {
-    if (!gHostIsNatron) {
-        bool validated;
-        _validate->getValue(validated);
-        if (!validated) {
-            setPersistentMessage(Message::eMessageError, "", "Validate the script before rendering/running.");
-            throwSuiteStatusException(kOfxStatFailed);
+    StubSeExpression* expr = _stubCache[_simple ? 1 : 0].acquire(script, wantVec);
+
+    if (expr) {
+        expr->setTime(time);
+
+        return expr;
+    }
+
+    return new StubSeExpression(script, wantVec, time);
+}
 
+static void
+addFrameRangeNeeded(double min,
+                    double max,
+                    vector<OfxRangeD>& ranges)
+{
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        if ((ranges[i].min <= min) && (max <= ranges[i].max)) {
+            // already needed
             return;
         }
     }
+    OfxRangeD range;
+    range.min = min;
+    range.max = max;
+    ranges.push_back(range);
+}
 
-    // To determine the frames needed of the expression, we just execute the expression for 1 pixel
-    // and record what are the calls made to getPixel in order to figure out the Roi.
-    // We trust that only evaluating the expression for 1 pixel will make all the calls to getPixel
-    // In other words, we do not support scripts that do not fetch all images needed for all pixels, e.g:
-    /*
-       if(x > 0) {
-       srcCol = getPixel(0,frame,5,5)
-       } else {
-       srcCol = [0,0,0]
-       }
-     */
-    const double time = args.time;
-    FramesNeeded framesNeeded;
+// add the frames fetched by the cpixel/apixel calls of an expression at the given time
+static void
+addFramesNeeded(const PixelCalls& calls,
+                OfxTime time,
+                FrameRangesNeeded& framesNeeded,
+                bool useDefaultRange[kSourceClipCount])
+{
+    for (PixelCalls::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+        assert(it->inputIndex >= 0 && it->inputIndex < kSourceClipCount);
+        vector<OfxRangeD>& ranges = framesNeeded[it->inputIndex];
+        for (vector<PixelArgBound>::const_iterator frame = it->frames.begin(); frame != it->frames.end(); ++frame) {
+            // cpixel/apixel round the frame
+            switch (frame->base) {
+            case PixelArgBound::eBaseFrame:
+                addFrameRangeNeeded(SeExpr::round(time + frame->offsetMin), SeExpr::round(time + frame->offsetMax), ranges);
+                break;
+            case PixelArgBound::eBaseConstant:
+                addFrameRangeNeeded(SeExpr::round(frame->offsetMin), SeExpr::round(frame->offsetMax), ranges);
+                break;
+            default:
+                useDefaultRange[it->inputIndex] = true;
+                break;
+            }
+        }
+    }
+}
+
+// Compute the frames read by the cpixel/apixel calls of the expressions at the given time.
+// To determine the frames needed of the expression, we use the bounds of the frame argument
+// of every call to cpixel/apixel in the expression, which were computed when it was prepared.
+// If the frame depends on something else than the current frame, e.g. a pixel value,
+// useDefaultRange is set for that input, and the default frame range should be used.
+bool
+SeExprPlugin::getPixelFramesNeeded(OfxTime time,
+                                   FrameRangesNeeded* framesNeeded,
+                                   bool useDefaultRange[kSourceClipCount],
+                                   string* error)
+{
+    std::fill(useDefaultRange, useDefaultRange + kSourceClipCount, false);
     PixelComponentEnum outputComponents = getOutputComponents();
     if ((outputComponents == ePixelComponentRGB) || (outputComponents == ePixelComponentRGBA)) { // RGB || RGBA
         for (int e = 0; e < (_simple ? 3 : 1); ++e) {
@@ -2445,33 +3336,18 @@ SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
             }
 
             if (isSpaces(script)) {
-                framesNeeded[0].push_back(time);
+                addFrameRangeNeeded(time, time, (*framesNeeded)[0]);
             } else {
-                StubSeExpression expr(script, /*wantVec=*/!_simple, time);
+                StubSeExpression* stub = acquireStubExpression(script, /*wantVec=*/!_simple, time);
+                SeExprCache<StubSeExpression>::Releaser releaser(_stubCache[_simple ? 1 : 0], stub);
+                StubSeExpression& expr = *stub;
                 if (!expr.isValid()) {
-                    setPersistentMessage(Message::eMessageError, "", expr.parseError());
-                    throwSuiteStatusException(kOfxStatFailed);
+                    *error = expr.parseError();
 
-                    return;
+                    return false;
                 }
 
-                (void)expr.evaluate();
-                const FramesNeeded& rgbNeeded = expr.getFramesNeeded();
-                for (FramesNeeded::const_iterator it = rgbNeeded.begin(); it != rgbNeeded.end(); ++it) {
-                    vector<OfxTime>& frames = framesNeeded[it->first];
-                    for (std::size_t j = 0; j < it->second.size(); ++j) {
-                        bool found = false;
-                        for (std::size_t i = 0; i < frames.size(); ++i) {
-                            if (frames[i] == it->second[j]) {
-                                found = true;
-                                break;
-                            }
-                        }
-                        if (!found) {
-                            frames.push_back(it->second[j]);
-                        }
-                    }
-                }
+                addFramesNeeded(expr.getPixelCalls(), time, *framesNeeded, useDefaultRange);
             }
         }
     }
@@ -2483,50 +3359,72 @@ SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
         }
 
         if (isSpaces(script)) {
-            framesNeeded[0].push_back(time);
+            addFrameRangeNeeded(time, time, (*framesNeeded)[0]);
         } else {
-            StubSeExpression expr(script, false, time);
+            StubSeExpression* stub = acquireStubExpression(script, false, time);
+            SeExprCache<StubSeExpression>::Releaser releaser(_stubCache[_simple ? 1 : 0], stub);
+            StubSeExpression& expr = *stub;
             if (!expr.isValid()) {
-                setPersistentMessage(Message::eMessageError, "", expr.parseError());
-                throwSuiteStatusException(kOfxStatFailed);
+                *error = expr.parseError();
 
-                return;
+                return false;
             }
 
-            (void)expr.evaluate();
-            const FramesNeeded& alphaNeeded = expr.getFramesNeeded();
-            for (FramesNeeded::const_iterator it = alphaNeeded.begin(); it != alphaNeeded.end(); ++it) {
-                vector<OfxTime>& frames = framesNeeded[it->first];
-                for (std::size_t j = 0; j < it->second.size(); ++j) {
-                    bool found = false;
-                    for (std::size_t i = 0; i < frames.size(); ++i) {
-                        if (frames[i] == it->second[j]) {
-                            found = true;
-                            break;
-                        }
-                    }
-                    if (!found) {
-                        frames.push_back(it->second[j]);
-                    }
-                }
-            }
+            addFramesNeeded(expr.getPixelCalls(), time, *framesNeeded, useDefaultRange);
         }
     }
 
-    bool useDefaultRange[kSourceClipCount];
-    std::fill(useDefaultRange, useDefaultRange + kSourceClipCount, false);
-    for (FramesNeeded::const_iterator it = framesNeeded.begin(); it != framesNeeded.end(); ++it) {
-        assert(it->first >= 0 && it->first < kSourceClipCount);
-        for (std::size_t i = 0; i < it->second.size(); ++i) {
-            if (it->second[i] != it->second[i]) {
-                // This number is NaN! The user probably used something dependant on a pixel value as a time for the getPixel function
-                //  we fall back on using the default frame range
-                useDefaultRange[it->first] = true;
-            }
+    return true;
+} // SeExprPlugin::getPixelFramesNeeded
+
+// The frame range of the inputs for which it could not be computed from the expression
+OfxRangeD
+SeExprPlugin::getDefaultFrameRange(OfxTime time)
+{
+    OfxRangeD range;
+    int t1, t2;
+    _frameRange->getValueAtTime(time, t1, t2);
+    bool absolute;
+    _frameRangeAbsolute->getValueAtTime(time, absolute);
+    if (absolute) {
+        range.min = (std::min)(t1, t2);
+        range.max = (std::max)(t1, t2);
+    } else {
+        range.min = time + (std::min)(t1, t2);
+        range.max = time + (std::max)(t1, t2);
+    }
+
+    return range;
+}
+
+void
+SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
+                              FramesNeededSetter& framesNeededSetter)
+{
+    if (!gHostIsNatron) {
+        bool validated;
+        _validate->getValue(validated);
+        if (!validated) {
+            setPersistentMessage(Message::eMessageError, "", "Validate the script before rendering/running.");
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
         }
     }
 
-    for (FramesNeeded::const_iterator it = framesNeeded.begin(); it != framesNeeded.end(); ++it) {
+    const double time = args.time;
+    FrameRangesNeeded framesNeeded;
+    bool useDefaultRange[kSourceClipCount];
+    string error;
+    if (!getPixelFramesNeeded(time, &framesNeeded, useDefaultRange, &error)) {
+        setPersistentMessage(Message::eMessageError, "", error);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    for (FrameRangesNeeded::const_iterator it = framesNeeded.begin(); it != framesNeeded.end(); ++it) {
+        assert(it->first >= 0 && it->first < kSourceClipCount);
         if (useDefaultRange[it->first]) {
             continue;
         }
@@ -2535,12 +3433,10 @@ SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
 
         bool hasFetchedCurrentTime = false;
         for (std::size_t i = 0; i < it->second.size(); ++i) {
-            assert(it->second[i] == it->second[i]);
-            OfxRangeD range;
-            if (it->second[i] == time) {
+            const OfxRangeD& range = it->second[i];
+            if ((range.min <= time) && (time <= range.max)) {
                 hasFetchedCurrentTime = true;
             }
-            range.min = range.max = it->second[i];
             framesNeededSetter.setFramesNeeded(*clip, range);
         }
         if (!hasFetchedCurrentTime) {
@@ -2552,18 +3448,7 @@ SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
 
     // for clips that could not have their range computed from the expression,
     // use the default range
-    OfxRangeD range;
-    int t1, t2;
-    _frameRange->getValueAtTime(time, t1, t2);
-    bool absolute;
-    _frameRangeAbsolute->getValueAtTime(time, absolute);
-    if (absolute) {
-        range.min = (std::min)(t1, t2);
-        range.max = (std::max)(t1, t2);
-    } else {
-        range.min = time + (std::min)(t1, t2);
-        range.max = time + (std::max)(t1, t2);
-    }
+    OfxRangeD range = getDefaultFrameRange(time);
 
     for (int i = 0; i < kSourceClipCount; ++i) {
         if (useDefaultRange[i]) {
@@ -2574,6 +3459,46 @@ SeExprPlugin::getFramesNeeded(const FramesNeededArguments& args,
     }
 } // SeExprPlugin::getFramesNeeded
 
+// Pixel range [*pmin, *pmax) fetched by cpixel/apixel for a position argument,
+// including the support of the interpolation filter.
+// Returns false if the position is not bounded within the render window.
+static bool
+getPixelRoI(const PixelArgBound& bound,
+            const OfxRectI& renderWindow,
+            int* pmin,
+            int* pmax)
+{
+    if ((renderWindow.x2 <= renderWindow.x1) || (renderWindow.y2 <= renderWindow.y1)) {
+        return false;
+    }
+    double vmin, vmax;
+
+    switch (bound.base) {
+    case PixelArgBound::eBaseConstant:
+        vmin = bound.offsetMin;
+        vmax = bound.offsetMax;
+        break;
+    case PixelArgBound::eBaseX:
+        vmin = renderWindow.x1 + bound.offsetMin;
+        vmax = renderWindow.x2 - 1 + bound.offsetMax;
+        break;
+    case PixelArgBound::eBaseY:
+        vmin = renderWindow.y1 + bound.offsetMin;
+        vmax = renderWindow.y2 - 1 + bound.offsetMax;
+        break;
+    default:
+
+        return false;
+    }
+    if ((std::fabs(vmin) > INT_MAX / 2) || (std::fabs(vmax) > INT_MAX / 2)) {
+        return false;
+    }
+    *pmin = (int)std::floor(vmin) - kSeExprPixelFilterSupport;
+    *pmax = (int)std::floor(vmax) + 1 + kSeExprPixelFilterSupport;
+
+    return true;
+}
+
 // override the roi call
 void
 SeExprPlugin::getRegionsOfInterest(const RegionsOfInterestArguments& args,
@@ -2609,19 +3534,16 @@ SeExprPlugin::getRegionsOfInterest(const RegionsOfInterestArguments& args,
             }
         }
     } else {
-        // Notify that we will need the RoI for all connected input clips at the current time
-        for (int i = 0; i < kSourceClipCount; ++i) {
-            Clip* clip = getClip(i);
-            assert(clip);
-            if (clip->isConnected()) {
-                rois.setRegionOfInterest(*clip, args.regionOfInterest);
-            }
-        }
-
-        // To determine the ROIs of the expression, we just execute the expression at the 4 corners of the render window
-        // and record what are the calls made to getPixel in order to figure out the Roi.
-
-        std::set<Clip*> processedClips;
+        // All connected input clips are needed at the render window, for the input pixel variables.
+        // To determine the RoIs of the expression, we use the bounds of the position arguments
+        // of every call to cpixel/apixel in the expression, which were computed when it was prepared.
+        const double par = _dstClip->getPixelAspectRatio();
+        OfxRectI renderWindow;
+        Coords::toPixelEnclosing(args.regionOfInterest, args.renderScale, par, &renderWindow);
+        OfxRectD srcRoI[kSourceClipCount];
+        bool fullRoD[kSourceClipCount];
+        std::fill(srcRoI, srcRoI + kSourceClipCount, args.regionOfInterest);
+        std::fill(fullRoD, fullRoD + kSourceClipCount, false);
 
         PixelComponentEnum outputComponents = getOutputComponents();
 
@@ -2670,29 +3592,44 @@ SeExprPlugin::getRegionsOfInterest(const RegionsOfInterestArguments& args,
                 continue;
             }
 
-            StubSeExpression expr(script, wantVec, time);
+            StubSeExpression* stub = acquireStubExpression(script, wantVec, time);
+
+            SeExprCache<StubSeExpression>::Releaser releaser(_stubCache[_simple ? 1 : 0], stub);
+
+            StubSeExpression& expr = *stub;
             if (!expr.isValid()) {
                 setPersistentMessage(Message::eMessageError, "", expr.parseError());
                 throwSuiteStatusException(kOfxStatFailed);
 
                 return;
             }
-            // Now evaluate the expression once and determine whether the user will call getPixel.
-            // If he/she does, then we have no choice but to ask for the entire input image because we do not know
-            // what the user may need (typically when applying UVMaps and stuff)
-
-            (void)expr.evaluate();
-            const FramesNeeded& framesNeeded = expr.getFramesNeeded();
-
-            for (FramesNeeded::const_iterator it = framesNeeded.begin(); it != framesNeeded.end(); ++it) {
-                Clip* clip = getClip(it->first);
-                assert(clip);
-                pair<std::set<Clip*>::iterator, bool> ret = processedClips.insert(clip);
-                if (ret.second) {
-                    if (clip->isConnected()) {
-                        rois.setRegionOfInterest(*clip, clip->getRegionOfDefinition(time));
-                    }
+
+            const PixelCalls& calls = expr.getPixelCalls();
+            for (PixelCalls::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+                assert(it->inputIndex >= 0 && it->inputIndex < kSourceClipCount);
+                int i = it->inputIndex;
+                if (fullRoD[i]) {
+                    continue;
                 }
+                OfxRectI pixelRoI;
+                if (!getPixelRoI(it->x, renderWindow, &pixelRoI.x1, &pixelRoI.x2) ||
+                    !getPixelRoI(it->y, renderWindow, &pixelRoI.y1, &pixelRoI.y2)) {
+                    // the position depends on something else, e.g. a pixel value, or on the frame:
+                    // we have no choice but to ask for the entire input image
+                    fullRoD[i] = true;
+                    continue;
+                }
+                OfxRectD canonicalRoI;
+                Coords::toCanonical(pixelRoI, args.renderScale, par, &canonicalRoI);
+                Coords::rectBoundingBox(srcRoI[i], canonicalRoI, &srcRoI[i]);
+            }
+        }
+
+        for (int i = 0; i < kSourceClipCount; ++i) {
+            Clip* clip = getClip(i);
+            assert(clip);
+            if (clip->isConnected()) {
+                rois.setRegionOfInterest(*clip, fullRoD[i] ? clip->getRegionOfDefinition(time) : srcRoI[i]);
             }
         }
     }
@@ -2992,6 +3929,7 @@ public:
     }
 
     virtual void load() OVERRIDE FINAL { ofxsThreadSuiteCheck(); }
+    virtual void unload() OVERRIDE FINAL { SeExprPlugin::clearStubCache(simple); }
     virtual void describe(ImageEffectDescriptor& desc) OVERRIDE FINAL;
     virtual void describeInContext(ImageEffectDescriptor& desc, ContextEnum context) OVERRIDE FINAL;
     virtual ImageEffect* createInstance(OfxImageEffectHandle handle, ContextEnum context) OVERRIDE FINAL;
@@ -24,6 +24,8 @@
 #include <algorithm>
 #include <cfloat> // DBL_MAX
 #include <cmath>
+#include <memory>
+#include <vector>
 //#include <iostream>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #define NOMINMAX 1
@@ -72,6 +74,7 @@ typedef SeVec3d Vec3d;
 #include "ofxsCoords.h"
 #include "ofxsMaskMix.h"
 #include "ofxsMatrix2D.h"
+#include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
 #include "ofxsRamp.h"
 #include "ofxsThreadSuite.h"
@@ -96,8 +99,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "net.sf.openfx.SeGrain"
 // History:
 // version 1.0: initial version
+// version 1.1: add Tiled Grain
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -115,6 +119,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStaticSeedLabel "Static Seed"
 #define kParamStaticSeedHint "When enabled, the seed is not combined with the frame number, and thus the effect is the same for all frames for a given seed number."
 
+#define kParamTiledGrain "tiledGrain"
+#define kParamTiledGrainLabel "Tiled Grain"
+#define kParamTiledGrainHint "When enabled, a few periodic tiles of grain are computed once for each channel, and each frame uses one of these tiles with a pseudo-random offset, instead of computing the grain noise for every pixel of every frame. The grain is statistically equivalent but not identical, and much faster to render on long sequences. Tiles are not used for very large grain sizes, nor at render scales which are not a power of two. The tiles use up to 48 MB of memory per instance."
+
 #define kParamPresets "grainPresets"
 #define kParamPresetsLabel "Presets"
 #define kParamPresetsHint "Presets for common types of film."
@@ -122,6 +130,19 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kSizeMin 0.001 // minimum grain size
 
+// fbm() parameters used for the grain
+#define kGrainOctaves 2
+#define kGrainLacunarity 2.
+#define kGrainGain 0.5
+
+#define kGrainTileCount 4 // number of tiles per channel, one of them is used at each frame
+#define kGrainTileGrains 64 // minimum number of grains across a tile
+#define kGrainTileSizeMin 128 // tile sizes are powers of two, in full resolution pixels
+#define kGrainTileSizeMax 1024
+#define kGrainTileZStep 1000. // offset of the noise z coordinate between tiles
+#define kGrainTileCacheMax 6 // maximum number of channel tile sets kept by each instance
+#define kGrainTileCacheMaxBytes (48 * 1024 * 1024) // maximum size of the tiles kept by each instance: three channel tile sets of the largest size
+
 struct PresetStruct {
     // Size:
     double red_size;
@@ -233,6 +254,241 @@ static struct PresetStruct gPresets[NUMPRESETS] = {
 
 static bool gHostIsNatron = false;
 
+// transform from pixel coordinates (at render scale) to noise coordinates for one channel
+static Matrix3x3
+grainTransform(double renderScaleX,
+               double size,
+               double irregularity,
+               double z)
+{
+    Matrix3x3 sizeMat(1. / renderScaleX / (std::max)(size, kSizeMin), 0., 0.,
+                      0., 1. / renderScaleX / (std::max)(size, kSizeMin), 0.,
+                      0., 0., z);
+    double rads = irregularity * 45. * M_PI / 180.;
+    double ca = std::cos(rads);
+    double sa = std::sin(rads);
+    Matrix3x3 rotX(1, 0, 0,
+                   0, ca, sa,
+                   0, -sa, ca);
+    Matrix3x3 rotY(0, 1, 0,
+                   sa, 0, ca,
+                   ca, 0, -sa);
+
+    return rotY * rotX * sizeMat;
+}
+
+static inline double
+grainNoise(const Matrix3x3& transform,
+           double x,
+           double y)
+{
+    Point3D p = transform * Point3D(x, y, 1);
+    double args[3] = { p.x, p.y, p.z };
+    double result;
+
+    // double fbm(int n, const SeVec3d* args) in SeExprBuiltins.cpp
+    SeExpr2::FBM<3, 1, false>(args, &result, kGrainOctaves, kGrainLacunarity, kGrainGain);
+
+    return result;
+}
+
+// pseudo-random hash of an integer
+static inline unsigned int
+grainHash(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+
+    return x;
+}
+
+// size of the grain tiles for a channel at full resolution, or 0 if the grain is too large to be tiled
+static int
+grainTileCanonicalSize(double size)
+{
+    const double grainsSize = kGrainTileGrains * (std::max)(size, kSizeMin);
+
+    if (grainsSize > kGrainTileSizeMax) {
+        return 0;
+    }
+    int tileSize = kGrainTileSizeMin;
+    while (tileSize < grainsSize) {
+        tileSize *= 2;
+    }
+
+    return tileSize;
+}
+
+// Size of the grain tiles for a channel at the render scale, or 0 if the grain cannot be tiled.
+// This is the full resolution size scaled, so that a proxy render has the same grain period
+// as the full resolution render, and it must still be a power of two.
+static int
+grainTileSize(double renderScaleX,
+              double size)
+{
+    const double scaledSize = grainTileCanonicalSize(size) * renderScaleX;
+    int tileSize = 1;
+
+    while (tileSize < scaledSize) {
+        tileSize *= 2;
+    }
+
+    return (tileSize == scaledSize) ? tileSize : 0;
+}
+
+/**
+ * @brief Periodic tiles of grain noise for one channel.
+ *
+ * Each tile blends the noise at the pixel and at the pixel shifted by one tile size
+ * horizontally and/or vertically, so that it wraps seamlessly, and the blend is
+ * normalized to keep the variance of the noise.
+ **/
+struct GrainTiles {
+    int size; // the tiles are size x size pixels, size is a power of two
+    std::vector<float> data; // kGrainTileCount tiles
+
+    const float* tile(int i) const { return &data[(std::size_t)i * size * size]; }
+};
+
+typedef std::shared_ptr<const GrainTiles> GrainTilesPtr;
+
+class GrainTilesProcessor
+    : public MultiThread::Processor {
+public:
+    GrainTilesProcessor(const Matrix3x3 transforms[kGrainTileCount],
+                        GrainTiles& tiles)
+        : _transforms(transforms)
+        , _tiles(tiles)
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int size = _tiles.size;
+
+        for (int row = (int)threadID; row < kGrainTileCount * size; row += (int)nThreads) {
+            const int t = row / size;
+            const int j = row % size;
+            const double y = j + 0.5;
+            const double wy = y / size;
+            float* dst = &_tiles.data[(std::size_t)row * size];
+            for (int i = 0; i < size; ++i) {
+                const double x = i + 0.5;
+                const double wx = x / size;
+                const double w00 = (1. - wx) * (1. - wy);
+                const double w10 = wx * (1. - wy);
+                const double w01 = (1. - wx) * wy;
+                const double w11 = wx * wy;
+                const double n = (w00 * grainNoise(_transforms[t], x, y) +
+                                  w10 * grainNoise(_transforms[t], x - size, y) +
+                                  w01 * grainNoise(_transforms[t], x, y - size) +
+                                  w11 * grainNoise(_transforms[t], x - size, y - size));
+                dst[i] = (float)(n / std::sqrt(w00 * w00 + w10 * w10 + w01 * w01 + w11 * w11));
+            }
+        }
+    }
+
+    const Matrix3x3* _transforms;
+    GrainTiles& _tiles;
+};
+
+/**
+ * @brief Grain tiles of the last parameter values used by an instance.
+ **/
+class GrainTilesCache {
+    struct Entry {
+        double renderScaleX;
+        double size;
+        double irregularity;
+        double seed;
+        int channel;
+        GrainTilesPtr tiles;
+        unsigned long lastUse;
+    };
+
+public:
+    GrainTilesCache()
+        : _mutex()
+        , _entries()
+        , _bytes(0)
+        , _useCount(0)
+    {
+    }
+
+    // get the tiles for a channel, computing them if necessary, or NULL if the grain cannot be tiled
+    GrainTilesPtr get(double renderScaleX,
+                      double size,
+                      double irregularity,
+                      double seed,
+                      int c)
+    {
+        const int tileSize = grainTileSize(renderScaleX, size);
+
+        if (tileSize == 0) {
+            return GrainTilesPtr();
+        }
+        {
+            MultiThread::AutoMutex lock(_mutex);
+            for (std::vector<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                if ((it->renderScaleX == renderScaleX) && (it->size == size) && (it->irregularity == irregularity) &&
+                    (it->seed == seed) && (it->channel == c)) {
+                    it->lastUse = ++_useCount;
+
+                    return it->tiles;
+                }
+            }
+        }
+
+        // compute the tiles without holding the lock, using the same transform as the static seed
+        Matrix3x3 transforms[kGrainTileCount];
+        for (int t = 0; t < kGrainTileCount; ++t) {
+            transforms[t] = grainTransform(renderScaleX, size, irregularity, (1 + c) * seed + irregularity / 2. + t * kGrainTileZStep);
+        }
+        std::shared_ptr<GrainTiles> tiles = std::make_shared<GrainTiles>();
+        tiles->size = tileSize;
+        tiles->data.resize((std::size_t)kGrainTileCount * tileSize * tileSize);
+        GrainTilesProcessor processor(transforms, *tiles);
+        processor.multiThread();
+
+        MultiThread::AutoMutex lock(_mutex);
+        const std::size_t bytes = tiles->data.size() * sizeof(float);
+        while (!_entries.empty() && ((_entries.size() >= kGrainTileCacheMax) || (_bytes + bytes > kGrainTileCacheMaxBytes))) {
+            // forget the least recently used tiles (a render still using them keeps a reference)
+            std::vector<Entry>::iterator oldest = _entries.begin();
+            for (std::vector<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                if (it->lastUse < oldest->lastUse) {
+                    oldest = it;
+                }
+            }
+            _bytes -= oldest->tiles->data.size() * sizeof(float);
+            _entries.erase(oldest);
+        }
+        _bytes += bytes;
+        Entry entry;
+        entry.renderScaleX = renderScaleX;
+        entry.size = size;
+        entry.irregularity = irregularity;
+        entry.seed = seed;
+        entry.channel = c;
+        entry.tiles = tiles;
+        entry.lastUse = ++_useCount;
+        _entries.push_back(entry);
+
+        return entry.tiles;
+    } // get
+
+private:
+    MultiThread::Mutex _mutex;
+    std::vector<Entry> _entries;
+    std::size_t _bytes; // size of the tiles in _entries
+    unsigned long _useCount;
+};
+
 class SeGrainProcessorBase
     : public ImageProcessor {
 protected:
@@ -251,6 +507,9 @@ protected:
     double _black[3];
     double _minimum[3];
     Matrix3x3 _invtransform[3];
+    GrainTilesPtr _tiles[3];
+    const float* _tile[3]; // the tile used at this frame, or NULL to compute the noise
+    OfxPointI _tileOffset[3];
 
 public:
     SeGrainProcessorBase(ImageEffect& instance,
@@ -266,6 +525,7 @@ public:
         , _seed(0.)
         , _colorCorr(0.)
     {
+        std::fill(_tile, _tile + 3, (const float*)NULL);
     }
 
     void setSrcImg(const Image* v) { _srcImg = v; }
@@ -300,19 +560,28 @@ public:
             _black[c] = black[c];
             _minimum[c] = minimum[c];
 
-            Matrix3x3 sizeMat(1. / _renderScale.x / (std::max)(size[c], kSizeMin), 0., 0.,
-                              0., 1. / _renderScale.x / (std::max)(size[c], kSizeMin), 0.,
-                              0., 0., (staticSeed ? 0. : _time) + (1 + c) * seed + irregularity[c] / 2.);
-            double rads = irregularity[c] * 45. * M_PI / 180.;
-            double ca = std::cos(rads);
-            double sa = std::sin(rads);
-            Matrix3x3 rotX(1, 0, 0,
-                           0, ca, sa,
-                           0, -sa, ca);
-            Matrix3x3 rotY(0, 1, 0,
-                           sa, 0, ca,
-                           ca, 0, -sa);
-            _invtransform[c] = rotY * rotX * sizeMat;
+            _invtransform[c] = grainTransform(_renderScale.x, size[c], irregularity[c], (staticSeed ? 0. : _time) + (1 + c) * seed + irregularity[c] / 2.);
+        }
+    }
+
+    // use grain tiles instead of computing the noise, for the channels that have tiles
+    void setTiles(const GrainTilesPtr tiles[3],
+                  bool staticSeed)
+    {
+        // with a static seed, the grain is the same for all frames
+        const unsigned int frame = staticSeed ? 0 : (unsigned int)(int)std::floor(_time + 0.5);
+
+        for (int c = 0; c < 3; ++c) {
+            _tiles[c] = tiles[c];
+            _tile[c] = NULL;
+            if (_tiles[c]) {
+                const unsigned int h = grainHash(frame * 3 + c);
+                _tile[c] = _tiles[c]->tile(h % kGrainTileCount);
+                // the offset is drawn in full resolution pixels, so that it does not depend on the render scale
+                const int canonicalMask = (int)(_tiles[c]->size / _renderScale.x + 0.5) - 1;
+                _tileOffset[c].x = (int)std::floor((grainHash(h) & canonicalMask) * _renderScale.x);
+                _tileOffset[c].y = (int)std::floor((grainHash(h + 1) & canonicalMask) * _renderScale.x);
+            }
         }
     }
 };
@@ -332,11 +601,8 @@ public:
 
     void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs)
     {
-        // renderScale is handled upstream, see sizeMat
+        // renderScale is handled upstream, see grainTransform
         unused(rs);
-        const int octaves = 2;
-        const double lacunarity = 2.;
-        const double gain = 0.5;
         float unpPix[4];
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
@@ -344,19 +610,31 @@ public:
                 break;
             }
 
+            // the rows of the grain tiles for this row
+            const float* tileRow[3];
+            int tileMask[3];
+            for (int c = 0; c < 3; ++c) {
+                tileRow[c] = NULL;
+                tileMask[c] = 0;
+                if (_tile[c]) {
+                    tileMask[c] = _tiles[c]->size - 1;
+                    tileRow[c] = _tile[c] + (std::size_t)((y + _tileOffset[c].y) & tileMask[c]) * _tiles[c]->size;
+                }
+            }
+
             PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
-                Point3D p(x + 0.5, y + 0.5, 1);
                 const PIX* srcPix = (const PIX*)(_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 ofxsToRGBA<PIX, nComponents, maxValue>(srcPix, unpPix);
 
                 double result[3];
                 for (int c = 0; c < 3; ++c) {
-                    Point3D pc = _invtransform[c] * p;
-                    double args[3] = { pc.x, pc.y, pc.z };
-                    // process the pixel (the actual computation goes here)
-                    // double fbm(int n, const SeVec3d* args) in SeExprBuiltins.cpp
-                    SeExpr2::FBM<3, 1, false>(args, &result[c], octaves, lacunarity, gain);
+                    if (tileRow[c]) {
+                        result[c] = tileRow[c][(x + _tileOffset[c].x) & tileMask[c]];
+                    } else {
+                        // process the pixel (the actual computation goes here)
+                        result[c] = grainNoise(_invtransform[c], x + 0.5, y + 0.5);
+                    }
                 }
                 if (_colorCorr != 0.) {
                     // apply color correction:
@@ -409,6 +687,7 @@ public:
 
         _seed = fetchDoubleParam(kParamSeed);
         _staticSeed = fetchBooleanParam(kParamStaticSeed);
+        _tiledGrain = fetchBooleanParam(kParamTiledGrain);
         _presets = fetchChoiceParam(kParamPresets);
         _sizeAll = fetchDoubleParam(kParamSizeAll);
         _size[0] = fetchDoubleParam(kParamSizeRed);
@@ -423,7 +702,7 @@ public:
         _colorCorr = fetchDoubleParam(kParamColorCorr);
         _intensityBlack = fetchRGBParam(kParamIntensityBlack);
         _intensityMinimum = fetchRGBParam(kParamIntensityMinimum);
-        assert(_seed && _staticSeed && _presets && _sizeAll && _size[0] && _size[1] && _size[2] && _irregularity[0] && _irregularity[1] && _irregularity[2] && _intensity[0] && _intensity[1] && _intensity[2] && _colorCorr && _intensityBlack && _intensityMinimum);
+        assert(_seed && _staticSeed && _tiledGrain && _presets && _sizeAll && _size[0] && _size[1] && _size[2] && _irregularity[0] && _irregularity[1] && _irregularity[2] && _intensity[0] && _intensity[1] && _intensity[2] && _colorCorr && _intensityBlack && _intensityMinimum);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
         assert(_sublabel);
 
@@ -475,6 +754,7 @@ private:
     BooleanParam* _maskInvert;
     DoubleParam* _seed;
     BooleanParam* _staticSeed;
+    BooleanParam* _tiledGrain;
     ChoiceParam* _presets;
     DoubleParam* _sizeAll;
     DoubleParam* _size[3];
@@ -484,6 +764,7 @@ private:
     RGBParam* _intensityBlack;
     RGBParam* _intensityMinimum;
     StringParam* _sublabel;
+    GrainTilesCache _tilesCache;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -557,6 +838,13 @@ SeGrainPlugin::setupAndProcess(SeGrainProcessorBase& processor,
     _intensityMinimum->getValueAtTime(time, minimum[0], minimum[1], minimum[2]);
 
     processor.setValues(mix, seed, staticSeed, size, irregularity, intensity, colorCorr, black, minimum);
+    if (_tiledGrain->getValueAtTime(time)) {
+        GrainTilesPtr tiles[3];
+        for (int c = 0; c < 3; ++c) {
+            tiles[c] = _tilesCache.get(args.renderScale.x, size[c], irregularity[c], seed, c);
+        }
+        processor.setTiles(tiles, staticSeed);
+    }
     processor.process();
 } // SeGrainPlugin::setupAndProcess
 
@@ -805,6 +1093,17 @@ SeGrainPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamTiledGrain);
+        param->setLabel(kParamTiledGrainLabel);
+        param->setHint(kParamTiledGrainHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamPresets);
         param->setLabel(kParamPresetsLabel);
@@ -27,6 +27,7 @@
 #include <algorithm>
 #include <cfloat> // DBL_MAX
 #include <cmath>
+#include <vector>
 //#include <iostream>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #define NOMINMAX 1
@@ -258,6 +259,9 @@ enum VoronoiTypeEnum {
 
 #define kGroupColor "colorGroup"
 
+// number of pixels whose octaves of FBM and turbulence are evaluated together
+#define kNoiseBlockSize 8
+
 static bool gHostIsNatron = false;
 
 class SeNoiseProcessorBase
@@ -382,6 +386,194 @@ public:
         _point1 = point1;
         _color1 = color1;
     }
+
+protected:
+    /** @brief compute the noise for the pixels [x1,x2) of row y, noiseComponents values per pixel */
+    void computeNoiseRow(int y,
+                         int x1,
+                         int x2,
+                         int noiseComponents,
+                         double* noise)
+    {
+        // dispatch on the noise type once per row rather than once per pixel
+        switch (_noiseType) {
+        case eNoiseTypeCellNoise:
+            computeNoiseRowForType<eNoiseTypeCellNoise>(y, x1, x2, noiseComponents, noise);
+            break;
+        case eNoiseTypeNoise:
+            computeNoiseRowForType<eNoiseTypeNoise>(y, x1, x2, noiseComponents, noise);
+            break;
+#ifdef SENOISE_PERLIN
+        case eNoiseTypePerlin:
+            computeNoiseRowForType<eNoiseTypePerlin>(y, x1, x2, noiseComponents, noise);
+            break;
+#endif
+        case eNoiseTypeFBM:
+            computeNoiseRowForType<eNoiseTypeFBM>(y, x1, x2, noiseComponents, noise);
+            break;
+        case eNoiseTypeTurbulence:
+            computeNoiseRowForType<eNoiseTypeTurbulence>(y, x1, x2, noiseComponents, noise);
+            break;
+#ifdef SENOISE_VORONOI
+        case eNoiseTypeVoronoi:
+            computeNoiseRowForType<eNoiseTypeVoronoi>(y, x1, x2, noiseComponents, noise);
+            break;
+#endif
+        }
+    }
+
+private:
+    /** @brief SeExpr2::FBM<3, 1, turbulence>() for n <= kNoiseBlockSize points: the octave loop is the outer loop, so that
+        the position update of each octave is done for the whole block */
+    template <bool turbulence>
+    void computeFBMBlock(int n,
+                         const double pos[3][kNoiseBlockSize],
+                         double* out) const
+    {
+        double P[3][kNoiseBlockSize];
+        double result[kNoiseBlockSize];
+
+        for (int k = 0; k < 3; ++k) {
+            std::copy(pos[k], pos[k] + n, P[k]);
+        }
+        std::fill(result, result + n, 0.);
+        double scale = 1.;
+        int octave = 0;
+        for (;;) {
+            for (int j = 0; j < n; ++j) {
+                const double args[3] = { P[0][j], P[1][j], P[2][j] };
+                double localResult;
+                SeExpr2::Noise<3, 1>(args, &localResult);
+                result[j] += (turbulence ? std::fabs(localResult) : localResult) * scale;
+            }
+            if (++octave >= _octaves) {
+                break;
+            }
+            scale *= _gain;
+            // same frequency and offset as SeExpr2::FBM()
+            for (int k = 0; k < 3; ++k) {
+                for (int j = 0; j < n; ++j) {
+                    P[k][j] *= _lacunarity;
+                    P[k][j] += 1234.;
+                }
+            }
+        }
+        std::copy(result, result + n, out);
+    }
+
+    template <NoiseTypeEnum noiseType>
+    void computeNoiseRowForType(int y,
+                                int x1,
+                                int x2,
+                                int noiseComponents,
+                                double* noise)
+    {
+#ifdef SENOISE_VORONOI
+        SeExpr2::VoronoiPointData voronoiPointData;
+#endif
+        // cell noise only depends on the cell containing the point:
+        // remember the last cell and its value for each component
+        double cells[3][3];
+        double cellValues[3];
+        bool hasCell[3] = { false, false, false };
+
+        // The position in noise space is an affine function of x along the row: it is p0 + k * dp for the pixel x1 + k,
+        // rather than the product of the 3x3 matrix by each pixel position. The difference with the matrix product is a few
+        // ulps of the position (it does not accumulate along the row), so the continuous noises differ by less than 1e-12.
+        // Cell noise may only differ for points within a few ulps of a cell boundary.
+        Point3D p0(x1 + 0.5, y + 0.5, 1);
+        p0 = _invtransform * p0;
+        const Point3D dp = _invtransform * Point3D(1., 0., 0.);
+
+        double pos[3][kNoiseBlockSize];
+        double values[kNoiseBlockSize];
+        for (int xb = x1; xb < x2; xb += kNoiseBlockSize) {
+            const int n = (std::min)(kNoiseBlockSize, x2 - xb);
+            for (int j = 0; j < n; ++j) {
+                const double k = xb - x1 + j;
+                pos[0][j] = p0.x + k * dp.x;
+                pos[1][j] = p0.y + k * dp.y;
+                pos[2][j] = p0.z + k * dp.z;
+            }
+            for (int i = 0; i < noiseComponents; ++i) {
+                switch (noiseType) {
+                case eNoiseTypeCellNoise: {
+                    for (int j = 0; j < n; ++j) {
+                        const double args[3] = { pos[0][j], pos[1][j], pos[2][j] };
+                        const double cell[3] = { std::floor(args[0]), std::floor(args[1]), std::floor(args[2]) };
+                        if (!hasCell[i] || (cell[0] != cells[i][0]) || (cell[1] != cells[i][1]) || (cell[2] != cells[i][2])) {
+                            // double cellnoise(const Vec3d& p)
+                            SeExpr2::CellNoise<3, 1>(args, &cellValues[i]);
+                            std::copy(cell, cell + 3, cells[i]);
+                            hasCell[i] = true;
+                        }
+                        values[j] = cellValues[i];
+                    }
+                    break;
+                }
+                case eNoiseTypeNoise: {
+                    for (int j = 0; j < n; ++j) {
+                        const double args[3] = { pos[0][j], pos[1][j], pos[2][j] };
+                        // double noise(int n, const Vec3d* args)
+                        SeExpr2::Noise<3, 1>(args, &values[j]);
+                        values[j] = .5 * values[j] + .5;
+                    }
+                    break;
+                }
+#ifdef SENOISE_PERLIN
+                case eNoiseTypePerlin: {
+                    for (int j = 0; j < n; ++j) {
+                        SeExpr2::Vec3d pargs(pos[0][j], pos[1][j], pos[2][j]);
+                        values[j] = SeExpr::perlin(1, &pargs);
+                    }
+                    break;
+                }
+#endif
+                case eNoiseTypeFBM: {
+                    // double fbm(int n, const Vec3d* args) in SeExprBuiltins.cpp
+                    computeFBMBlock<false>(n, pos, values);
+                    for (int j = 0; j < n; ++j) {
+                        values[j] = .5 * values[j] + .5;
+                    }
+                    break;
+                }
+                case eNoiseTypeTurbulence: {
+                    // double turbulence(int n, const Vec3d* args)
+                    computeFBMBlock<true>(n, pos, values);
+                    break;
+                }
+#ifdef SENOISE_VORONOI
+                case eNoiseTypeVoronoi: {
+                    SeExpr2::Vec3d vargs[7];
+                    vargs[1][0] = (int)_voronoiType + 1;
+                    vargs[2][0] = _jitter;
+                    vargs[3][0] = _fbmScale;
+                    vargs[4][0] = _octaves;
+                    vargs[5][0] = _lacunarity;
+                    vargs[6][0] = _gain;
+                    for (int j = 0; j < n; ++j) {
+                        vargs[0] = SeExpr2::Vec3d(pos[0][j], pos[1][j], pos[2][j]);
+                        values[j] = SeExpr2::voronoiFn(voronoiPointData, 7, vargs)[0];
+                    }
+                    break;
+                }
+#endif
+                }
+                for (int j = 0; j < n; ++j) {
+                    noise[j * noiseComponents + i] = values[j];
+                }
+                // resultComps = resultComps*resultComps; // gamma = 0.5 (TODO: gamma param)
+                //  shift xyz for next component by some large enough pseudo-random integer number
+                //  (so that cell noise still works).
+                for (int j = 0; j < n; ++j) {
+                    pos[0][j] -= 17853;
+                    pos[1][j] += 15707;
+                    pos[2][j] -= 31415;
+                }
+            }
+            noise += n * noiseComponents;
+        }
+    } // computeNoiseRowForType
 };
 
 template <class PIX, int nComponents, int maxValue>
@@ -409,87 +601,34 @@ public:
         assert((!processR && !processG && !processB) || (nComponents == 3 || nComponents == 4));
         assert(!processA || (nComponents == 1 || nComponents == 4));
         assert(nComponents == 3 || nComponents == 4);
+        if ((procWindow.x2 <= procWindow.x1) || (procWindow.y2 <= procWindow.y1)) {
+            return;
+        }
         float unpPix[4];
         float tmpPix[4];
-#ifdef SENOISE_VORONOI
-        SeExpr2::VoronoiPointData voronoiPointData;
-#endif
         const double norm2 = (_point1.x - _point0.x) * (_point1.x - _point0.x) + (_point1.y - _point0.y) * (_point1.y - _point0.y);
         const double nx = norm2 == 0. ? 0. : (_point1.x - _point0.x) / norm2;
         const double ny = norm2 == 0. ? 0. : (_point1.y - _point0.y) / norm2;
+        const double par = _dstImg->getPixelAspectRatio();
         int noiseComponents = _noiseColored ? 3 : 1;
+        std::vector<double> noise((procWindow.x2 - procWindow.x1) * noiseComponents);
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if (_effect.abort()) {
                 break;
             }
 
+            computeNoiseRow(y, procWindow.x1, procWindow.x2, noiseComponents, &noise.front());
+
             PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
-            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+            const double* resultComps = &noise.front();
+            for (int x = procWindow.x1; x < procWindow.x2; x++, resultComps += noiseComponents) {
                 const PIX* srcPix = (const PIX*)(_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 ofxsToRGBA<PIX, nComponents, maxValue>(srcPix, unpPix);
                 double t_r = _replace ? 0. : unpPix[0];
                 double t_g = _replace ? 0. : unpPix[1];
                 double t_b = _replace ? 0. : unpPix[2];
                 double t_a = _replace ? 0. : unpPix[3];
-                Point3D p(x + 0.5, y + 0.5, 1);
-                p = _invtransform * p;
-                double args[3] = { p.x, p.y, p.z };
-                // process the pixel (the actual computation goes here)
-                double resultComps[3];
-                for (int i = 0; i < noiseComponents; ++i) {
-                    switch (_noiseType) {
-                    case eNoiseTypeCellNoise: {
-                        // double cellnoise(const Vec3d& p)
-                        SeExpr2::CellNoise<3, 1>(args, &resultComps[i]);
-                        break;
-                    }
-                    case eNoiseTypeNoise: {
-                        // double noise(int n, const Vec3d* args)
-                        SeExpr2::Noise<3, 1>(args, &resultComps[i]);
-                        resultComps[i] = .5 * resultComps[i] + .5;
-                        break;
-                    }
-#ifdef SENOISE_PERLIN
-                    case eNoiseTypePerlin: {
-                        n = SeExpr::perlin(1, &p);
-                        break;
-                    }
-#endif
-                    case eNoiseTypeFBM: {
-                        // double fbm(int n, const Vec3d* args) in SeExprBuiltins.cpp
-                        SeExpr2::FBM<3, 1, false>(args, &resultComps[i], _octaves, _lacunarity, _gain);
-                        resultComps[i] = .5 * resultComps[i] + .5;
-                        break;
-                    }
-                    case eNoiseTypeTurbulence: {
-                        // double turbulence(int n, const Vec3d* args)
-                        SeExpr2::FBM<3, 1, true>(args, &resultComps[i], _octaves, _lacunarity, _gain);
-                        break;
-                        // resultComps = .5*resultComps+.5;
-                    }
-#ifdef SENOISE_VORONOI
-                    case eNoiseTypeVoronoi: {
-                        SeExpr2::Vec3d vargs[7];
-                        vargs[0] = SeExpr2::Vec3d(args[0], args[1], args[2]);
-                        vargs[1][0] = (int)_voronoiType + 1;
-                        vargs[2][0] = _jitter;
-                        vargs[3][0] = _fbmScale;
-                        vargs[4][0] = _octaves;
-                        vargs[5][0] = _lacunarity;
-                        vargs[6][0] = _gain;
-                        resultComps[i] = SeExpr2::voronoiFn(voronoiPointData, 7, vargs)[0];
-                        break;
-                    }
-#endif
-                    }
-                    // resultComps = resultComps*resultComps; // gamma = 0.5 (TODO: gamma param)
-                    //  shift xyz for next component by some large enough pseudo-random integer number
-                    //  (so that cell noise still works).
-                    args[0] -= 17853;
-                    args[1] += 15707;
-                    args[2] -= 31415;
-                }
                 OfxRGBAColourD result;
                 if (_noiseColored) {
                     result.r = resultComps[0];
@@ -508,7 +647,7 @@ public:
                     OfxPointD p;
                     p_pixel.x = x;
                     p_pixel.y = y;
-                    Coords::toCanonical(p_pixel, rs, _dstImg->getPixelAspectRatio(), &p);
+                    Coords::toCanonical(p_pixel, rs, par, &p);
 
                     double t = ofxsRampFunc(_point0, nx, ny, _type, p);
 
@@ -0,0 +1,2154 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Render benchmark for the SeExpr, SeExprSimple, SeNoise and SeGrain plugins.
+ *
+ * The plugins are linked into this executable and driven through their OFX
+ * entry points by a minimal in-process host: images are synthetic float RGBA
+ * buffers held in memory, parameters are set directly by the host, and the
+ * render action is timed for a fixed matrix of expressions and noise types.
+ *
+ * Before each render the host calls the getRegionsOfInterest and
+ * getFramesNeeded actions, and fetching an input image at a time or over a
+ * region the plugin did not ask for fails the case, as does an exception
+ * thrown by a render thread.
+ *
+ * Usage: SeExprBench [--quick] [--iterations N] [--threads N] [--json FILE]
+ *
+ * --quick renders small images once per configuration, which is what the
+ * ctest entry runs to check that every configuration still renders.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ofxCore.h"
+#include "ofxImageEffect.h"
+#include "ofxMemory.h"
+#include "ofxMessage.h"
+#include "ofxMultiThread.h"
+#include "ofxParam.h"
+#include "ofxProgress.h"
+#include "ofxProperty.h"
+#include "ofxTimeLine.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#define kBenchHostName "fr.inria.openfx.SeExprBench"
+#define kBenchFrameRate 24.
+#define kBenchDuration 100.
+#define kBenchTime 1.
+#define kBenchIterationsDefault 5
+
+namespace {
+// everything is rendered at full resolution
+const double gRenderScale[2] = { 1., 1. };
+
+////////////////////////////////////////////////////////////////////////////////
+// properties
+
+// A property holds values of a single type, but lookups are lenient: getting a
+// property that was never set returns a zero value, as some hosts do.
+struct Property
+{
+    vector<int> ints;
+    vector<double> doubles;
+    vector<string> strings;
+    vector<void*> pointers;
+};
+
+class PropertySet
+{
+public:
+    PropertySet() {}
+
+    PropertySet(const PropertySet& other)
+        : _props(other.props())
+    {
+    }
+
+    PropertySet& operator=(const PropertySet& other)
+    {
+        if (this != &other) {
+            map<string, Property> props = other.props();
+            std::lock_guard<std::mutex> guard(_mutex);
+            _props.swap(props);
+        }
+
+        return *this;
+    }
+
+    map<string, Property> props() const
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        return _props;
+    }
+
+    template <typename T>
+    void set(const char* name,
+             int index,
+             const T& value)
+    {
+        if (index < 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(_mutex);
+        vector<T>& values = valuesOf<T>(_props[name]);
+        if ((int)values.size() <= index) {
+            values.resize(index + 1);
+        }
+        values[index] = value;
+    }
+
+    template <typename T>
+    void setN(const char* name,
+              int count,
+              const T* values)
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        vector<T>& dst = valuesOf<T>(_props[name]);
+        dst.assign(values, values + count);
+    }
+
+    // strings are returned by address, so that the pointer remains valid until the property is set again
+    template <typename T>
+    bool get(const char* name,
+             int index,
+             T* value) const
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        map<string, Property>::const_iterator found = _props.find(name);
+        if (found == _props.end()) {
+            return false;
+        }
+        const vector<T>& values = valuesOf<T>(const_cast<Property&>(found->second));
+        if ((index < 0) || ((int)values.size() <= index)) {
+            return false;
+        }
+        *value = values[index];
+
+        return true;
+    }
+
+    const char* getString(const char* name,
+                          int index) const
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        map<string, Property>::const_iterator found = _props.find(name);
+        if ((found == _props.end()) || (index < 0) || ((int)found->second.strings.size() <= index)) {
+            return "";
+        }
+
+        return found->second.strings[index].c_str();
+    }
+
+    int getDimension(const char* name) const
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        map<string, Property>::const_iterator found = _props.find(name);
+        if (found == _props.end()) {
+            return 0;
+        }
+        const Property& p = found->second;
+
+        return (int)std::max(std::max(p.ints.size(), p.doubles.size()), std::max(p.strings.size(), p.pointers.size()));
+    }
+
+    void reset(const char* name)
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _props.erase(name);
+    }
+
+    // convenience setters used by the host
+    void setInt(const char* name, int value) { set<int>(name, 0, value); }
+    void setDouble(const char* name, double value) { set<double>(name, 0, value); }
+    void setString(const char* name, const string& value) { set<string>(name, 0, value); }
+    void setPointer(const char* name, void* value) { set<void*>(name, 0, value); }
+
+    int getInt(const char* name, int index = 0) const
+    {
+        int i = 0;
+        double d = 0.;
+        if (get<int>(name, index, &i)) {
+            return i;
+        }
+        if (get<double>(name, index, &d)) {
+            return (int)d;
+        }
+
+        return 0;
+    }
+
+    double getDouble(const char* name, int index = 0) const
+    {
+        int i = 0;
+        double d = 0.;
+        if (get<double>(name, index, &d)) {
+            return d;
+        }
+        if (get<int>(name, index, &i)) {
+            return i;
+        }
+
+        return 0.;
+    }
+
+private:
+    template <typename T>
+    static vector<T>& valuesOf(Property& p);
+
+    mutable std::mutex _mutex;
+    map<string, Property> _props;
+};
+
+template <>
+vector<int>&
+PropertySet::valuesOf<int>(Property& p)
+{
+    return p.ints;
+}
+
+template <>
+vector<double>&
+PropertySet::valuesOf<double>(Property& p)
+{
+    return p.doubles;
+}
+
+template <>
+vector<string>&
+PropertySet::valuesOf<string>(Property& p)
+{
+    return p.strings;
+}
+
+template <>
+vector<void*>&
+PropertySet::valuesOf<void*>(Property& p)
+{
+    return p.pointers;
+}
+
+inline PropertySet*
+propSet(OfxPropertySetHandle h)
+{
+    return reinterpret_cast<PropertySet*>(h);
+}
+
+inline OfxPropertySetHandle
+propHandle(PropertySet* p)
+{
+    return reinterpret_cast<OfxPropertySetHandle>(p);
+}
+
+OfxStatus
+propSetPointer(OfxPropertySetHandle h,
+               const char* property,
+               int index,
+               void* value)
+{
+    propSet(h)->set<void*>(property, index, value);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetString(OfxPropertySetHandle h,
+              const char* property,
+              int index,
+              const char* value)
+{
+    propSet(h)->set<string>(property, index, value ? value : "");
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetDouble(OfxPropertySetHandle h,
+              const char* property,
+              int index,
+              double value)
+{
+    propSet(h)->set<double>(property, index, value);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetInt(OfxPropertySetHandle h,
+           const char* property,
+           int index,
+           int value)
+{
+    propSet(h)->set<int>(property, index, value);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetPointerN(OfxPropertySetHandle h,
+                const char* property,
+                int count,
+                void* const* value)
+{
+    propSet(h)->setN<void*>(property, count, value);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetStringN(OfxPropertySetHandle h,
+               const char* property,
+               int count,
+               const char* const* value)
+{
+    vector<string> values(value, value + count);
+
+    propSet(h)->setN<string>(property, count, values.empty() ? NULL : &values[0]);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetDoubleN(OfxPropertySetHandle h,
+               const char* property,
+               int count,
+               const double* value)
+{
+    propSet(h)->setN<double>(property, count, value);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propSetIntN(OfxPropertySetHandle h,
+            const char* property,
+            int count,
+            const int* value)
+{
+    propSet(h)->setN<int>(property, count, value);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetPointer(OfxPropertySetHandle h,
+               const char* property,
+               int index,
+               void** value)
+{
+    if (!propSet(h)->get<void*>(property, index, value)) {
+        *value = NULL;
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetString(OfxPropertySetHandle h,
+              const char* property,
+              int index,
+              char** value)
+{
+    *value = const_cast<char*>(propSet(h)->getString(property, index));
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetDouble(OfxPropertySetHandle h,
+              const char* property,
+              int index,
+              double* value)
+{
+    *value = propSet(h)->getDouble(property, index);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetInt(OfxPropertySetHandle h,
+           const char* property,
+           int index,
+           int* value)
+{
+    *value = propSet(h)->getInt(property, index);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetPointerN(OfxPropertySetHandle h,
+                const char* property,
+                int count,
+                void** value)
+{
+    for (int i = 0; i < count; ++i) {
+        propGetPointer(h, property, i, &value[i]);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetStringN(OfxPropertySetHandle h,
+               const char* property,
+               int count,
+               char** value)
+{
+    for (int i = 0; i < count; ++i) {
+        propGetString(h, property, i, &value[i]);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetDoubleN(OfxPropertySetHandle h,
+               const char* property,
+               int count,
+               double* value)
+{
+    for (int i = 0; i < count; ++i) {
+        propGetDouble(h, property, i, &value[i]);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetIntN(OfxPropertySetHandle h,
+            const char* property,
+            int count,
+            int* value)
+{
+    for (int i = 0; i < count; ++i) {
+        propGetInt(h, property, i, &value[i]);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propReset(OfxPropertySetHandle h,
+          const char* property)
+{
+    propSet(h)->reset(property);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetDimension(OfxPropertySetHandle h,
+                 const char* property,
+                 int* count)
+{
+    *count = propSet(h)->getDimension(property);
+
+    return kOfxStatOK;
+}
+
+OfxPropertySuiteV1 gPropertySuite = {
+    propSetPointer, propSetString, propSetDouble, propSetInt,
+    propSetPointerN, propSetStringN, propSetDoubleN, propSetIntN,
+    propGetPointer, propGetString, propGetDouble, propGetInt,
+    propGetPointerN, propGetStringN, propGetDoubleN, propGetIntN,
+    propReset, propGetDimension
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// parameters
+
+enum ValueKindEnum
+{
+    eValueKindNone,
+    eValueKindInt,
+    eValueKindDouble,
+    eValueKindString,
+};
+
+// number and type of the values passed to paramGetValue/paramSetValue for a given parameter type
+void
+getValueLayout(const string& type,
+               ValueKindEnum* kind,
+               int* dim)
+{
+    *kind = eValueKindNone;
+    *dim = 0;
+    if ((type == kOfxParamTypeInteger) || (type == kOfxParamTypeBoolean) || (type == kOfxParamTypeChoice)) {
+        *kind = eValueKindInt;
+        *dim = 1;
+    } else if (type == kOfxParamTypeInteger2D) {
+        *kind = eValueKindInt;
+        *dim = 2;
+    } else if (type == kOfxParamTypeInteger3D) {
+        *kind = eValueKindInt;
+        *dim = 3;
+    } else if (type == kOfxParamTypeDouble) {
+        *kind = eValueKindDouble;
+        *dim = 1;
+    } else if (type == kOfxParamTypeDouble2D) {
+        *kind = eValueKindDouble;
+        *dim = 2;
+    } else if ((type == kOfxParamTypeDouble3D) || (type == kOfxParamTypeRGB)) {
+        *kind = eValueKindDouble;
+        *dim = 3;
+    } else if (type == kOfxParamTypeRGBA) {
+        *kind = eValueKindDouble;
+        *dim = 4;
+    } else if ((type == kOfxParamTypeString) || (type == kOfxParamTypeCustom)) {
+        *kind = eValueKindString;
+        *dim = 1;
+    }
+}
+
+struct Param
+{
+    PropertySet props;
+    string type;
+    ValueKindEnum kind;
+    int dim;
+    int ints[4];
+    double doubles[4];
+    string str;
+};
+
+struct ParamSet
+{
+    PropertySet props;
+    vector<std::shared_ptr<Param> > params;
+    map<string, Param*> byName;
+
+    Param* find(const string& name) const
+    {
+        map<string, Param*>::const_iterator found = byName.find(name);
+
+        return (found == byName.end()) ? NULL : found->second;
+    }
+};
+
+inline Param*
+param(OfxParamHandle h)
+{
+    return reinterpret_cast<Param*>(h);
+}
+
+inline ParamSet*
+paramSet(OfxParamSetHandle h)
+{
+    return reinterpret_cast<ParamSet*>(h);
+}
+
+OfxStatus
+paramDefine(OfxParamSetHandle h,
+            const char* paramType,
+            const char* name,
+            OfxPropertySetHandle* propertySet)
+{
+    ParamSet* ps = paramSet(h);
+
+    if (ps->find(name)) {
+        return kOfxStatErrExists;
+    }
+    std::shared_ptr<Param> p(new Param);
+    p->type = paramType;
+    getValueLayout(p->type, &p->kind, &p->dim);
+    std::fill(p->ints, p->ints + 4, 0);
+    std::fill(p->doubles, p->doubles + 4, 0.);
+    p->props.setString(kOfxParamPropType, paramType);
+    p->props.setString(kOfxPropName, name);
+    p->props.setString(kOfxParamPropScriptName, name);
+    ps->params.push_back(p);
+    ps->byName[name] = p.get();
+    if (propertySet) {
+        *propertySet = propHandle(&p->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetHandle(OfxParamSetHandle h,
+               const char* name,
+               OfxParamHandle* handle,
+               OfxPropertySetHandle* propertySet)
+{
+    Param* p = paramSet(h)->find(name);
+
+    if (!p) {
+        return kOfxStatErrUnknown;
+    }
+    *handle = reinterpret_cast<OfxParamHandle>(p);
+    if (propertySet) {
+        *propertySet = propHandle(&p->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramSetGetPropertySet(OfxParamSetHandle h,
+                       OfxPropertySetHandle* propHandle_)
+{
+    *propHandle_ = propHandle(&paramSet(h)->props);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetPropertySet(OfxParamHandle h,
+                    OfxPropertySetHandle* propHandle_)
+{
+    *propHandle_ = propHandle(&param(h)->props);
+
+    return kOfxStatOK;
+}
+
+void
+getValues(const Param* p,
+          va_list ap)
+{
+    for (int i = 0; i < p->dim; ++i) {
+        switch (p->kind) {
+        case eValueKindInt:
+            *va_arg(ap, int*) = p->ints[i];
+            break;
+        case eValueKindDouble:
+            *va_arg(ap, double*) = p->doubles[i];
+            break;
+        case eValueKindString:
+            *va_arg(ap, char**) = const_cast<char*>(p->str.c_str());
+            break;
+        case eValueKindNone:
+            break;
+        }
+    }
+}
+
+void
+setValues(Param* p,
+          va_list ap)
+{
+    for (int i = 0; i < p->dim; ++i) {
+        switch (p->kind) {
+        case eValueKindInt:
+            p->ints[i] = va_arg(ap, int);
+            break;
+        case eValueKindDouble:
+            p->doubles[i] = va_arg(ap, double);
+            break;
+        case eValueKindString: {
+            const char* s = va_arg(ap, const char*);
+            p->str = s ? s : "";
+            break;
+        }
+        case eValueKindNone:
+            break;
+        }
+    }
+}
+
+OfxStatus
+paramGetValue(OfxParamHandle h,
+              ...)
+{
+    va_list ap;
+
+    va_start(ap, h);
+    getValues(param(h), ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetValueAtTime(OfxParamHandle h,
+                    OfxTime time,
+                    ...)
+{
+    va_list ap;
+
+    va_start(ap, time);
+    getValues(param(h), ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+// parameters are never animated, so derivatives are zero and integrals are value*(time2-time1)
+OfxStatus
+paramGetDerivative(OfxParamHandle h,
+                   OfxTime time,
+                   ...)
+{
+    const Param* p = param(h);
+    va_list ap;
+
+    va_start(ap, time);
+    for (int i = 0; i < p->dim; ++i) {
+        if (p->kind == eValueKindDouble) {
+            *va_arg(ap, double*) = 0.;
+        }
+    }
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetIntegral(OfxParamHandle h,
+                 OfxTime time1,
+                 OfxTime time2,
+                 ...)
+{
+    const Param* p = param(h);
+    va_list ap;
+
+    va_start(ap, time2);
+    for (int i = 0; i < p->dim; ++i) {
+        if (p->kind == eValueKindDouble) {
+            *va_arg(ap, double*) = p->doubles[i] * (time2 - time1);
+        }
+    }
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramSetValue(OfxParamHandle h,
+              ...)
+{
+    va_list ap;
+
+    va_start(ap, h);
+    setValues(param(h), ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramSetValueAtTime(OfxParamHandle h,
+                    OfxTime time,
+                    ...)
+{
+    va_list ap;
+
+    va_start(ap, time);
+    setValues(param(h), ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetNumKeys(OfxParamHandle /*h*/,
+                unsigned int* numberOfKeys)
+{
+    *numberOfKeys = 0;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetKeyTime(OfxParamHandle /*h*/,
+                unsigned int /*nthKey*/,
+                OfxTime* /*time*/)
+{
+    return kOfxStatErrBadIndex;
+}
+
+OfxStatus
+paramGetKeyIndex(OfxParamHandle /*h*/,
+                 OfxTime /*time*/,
+                 int /*direction*/,
+                 int* index)
+{
+    *index = -1;
+
+    return kOfxStatFailed;
+}
+
+OfxStatus
+paramDeleteKey(OfxParamHandle /*h*/,
+               OfxTime /*time*/)
+{
+    return kOfxStatErrBadIndex;
+}
+
+OfxStatus
+paramDeleteAllKeys(OfxParamHandle /*h*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramCopy(OfxParamHandle paramTo,
+          OfxParamHandle paramFrom,
+          OfxTime /*dstOffset*/,
+          const OfxRangeD* /*frameRange*/)
+{
+    Param* to = param(paramTo);
+    const Param* from = param(paramFrom);
+
+    if (to->type != from->type) {
+        return kOfxStatErrValue;
+    }
+    std::copy(from->ints, from->ints + 4, to->ints);
+    std::copy(from->doubles, from->doubles + 4, to->doubles);
+    to->str = from->str;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramEditBegin(OfxParamSetHandle /*paramSet*/,
+               const char* /*name*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramEditEnd(OfxParamSetHandle /*paramSet*/)
+{
+    return kOfxStatOK;
+}
+
+OfxParameterSuiteV1 gParameterSuite = {
+    paramDefine, paramGetHandle, paramSetGetPropertySet, paramGetPropertySet,
+    paramGetValue, paramGetValueAtTime, paramGetDerivative, paramGetIntegral,
+    paramSetValue, paramSetValueAtTime,
+    paramGetNumKeys, paramGetKeyTime, paramGetKeyIndex, paramDeleteKey, paramDeleteAllKeys,
+    paramCopy, paramEditBegin, paramEditEnd
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// effects, clips and images
+
+struct Effect;
+
+struct Clip
+{
+    PropertySet props;
+    string name;
+    Effect* effect;
+    bool connected;
+    bool isOutput;
+    vector<float> pixels; // RGBA float output image, only allocated for the output clip
+    // source frames, generated on first use, indexed by frame number
+    std::mutex framesMutex;
+    map<int, vector<float> > frames;
+    // what the plugin asked for in the last getRegionsOfInterest and getFramesNeeded actions
+    OfxRectD roi;
+    vector<OfxRangeD> framesNeeded;
+
+    Clip()
+        : effect(NULL)
+        , connected(false)
+        , isOutput(false)
+        , pixels()
+        , framesMutex()
+        , frames()
+        , roi()
+        , framesNeeded()
+    {
+    }
+};
+
+struct Effect
+{
+    PropertySet props;
+    ParamSet params;
+    vector<std::shared_ptr<Clip> > clips;
+    int width;
+    int height;
+    OfxTime renderTime;
+
+    Effect()
+        : width(0)
+        , height(0)
+        , renderTime(0.)
+    {
+    }
+
+    Clip* findClip(const string& name) const
+    {
+        for (size_t i = 0; i < clips.size(); ++i) {
+            if (clips[i]->name == name) {
+                return clips[i].get();
+            }
+        }
+
+        return NULL;
+    }
+};
+
+inline Effect*
+effect(OfxImageEffectHandle h)
+{
+    return reinterpret_cast<Effect*>(h);
+}
+
+inline Clip*
+clip(OfxImageClipHandle h)
+{
+    return reinterpret_cast<Clip*>(h);
+}
+
+OfxStatus
+getPropertySet(OfxImageEffectHandle h,
+               OfxPropertySetHandle* propHandle_)
+{
+    *propHandle_ = propHandle(&effect(h)->props);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+getParamSet(OfxImageEffectHandle h,
+            OfxParamSetHandle* paramSet_)
+{
+    *paramSet_ = reinterpret_cast<OfxParamSetHandle>(&effect(h)->params);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipDefine(OfxImageEffectHandle h,
+           const char* name,
+           OfxPropertySetHandle* propertySet)
+{
+    Effect* e = effect(h);
+    Clip* c = e->findClip(name);
+
+    if (!c) {
+        std::shared_ptr<Clip> newClip(new Clip);
+        newClip->name = name;
+        newClip->effect = e;
+        newClip->props.setString(kOfxPropName, name);
+        e->clips.push_back(newClip);
+        c = newClip.get();
+    }
+    if (propertySet) {
+        *propertySet = propHandle(&c->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipGetHandle(OfxImageEffectHandle h,
+              const char* name,
+              OfxImageClipHandle* clip_,
+              OfxPropertySetHandle* propertySet)
+{
+    Clip* c = effect(h)->findClip(name);
+
+    if (!c) {
+        return kOfxStatErrBadIndex;
+    }
+    *clip_ = reinterpret_cast<OfxImageClipHandle>(c);
+    if (propertySet) {
+        *propertySet = propHandle(&c->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipGetPropertySet(OfxImageClipHandle h,
+                   OfxPropertySetHandle* propHandle_)
+{
+    *propHandle_ = propHandle(&clip(h)->props);
+
+    return kOfxStatOK;
+}
+
+// number of images fetched at a time or over a region that the plugin did not ask for
+std::atomic<int> gRequestErrors(0);
+
+void
+requestError(const char* format,
+             ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    std::fprintf(stderr, "SeExprBench: ");
+    std::vfprintf(stderr, format, args);
+    std::fprintf(stderr, "\n");
+    va_end(args);
+    ++gRequestErrors;
+}
+
+// deterministic source pattern, with enough variation to exercise the expressions, that changes from frame to frame
+void
+fillSource(vector<float>& pixels,
+           int width,
+           int height,
+           int frame)
+{
+    pixels.resize( (size_t)width * height * 4 );
+    for (int y = 0; y < height; ++y) {
+        float* pix = &pixels[(size_t)y * width * 4];
+        for (int x = 0; x < width; ++x, pix += 4) {
+            pix[0] = (float)x / width;
+            pix[1] = (float)y / height;
+            pix[2] = (float)( (x * 7 + y * 13 + frame * 5) % 256 ) / 255.f;
+            pix[3] = 1.f;
+        }
+    }
+}
+
+// the source frame at the given time, held until the instance is destroyed
+float*
+sourceFrame(Clip* c,
+            OfxTime time)
+{
+    const int frame = std::max( 0, std::min( (int)std::floor(time + 0.5), (int)kBenchDuration - 1 ) );
+    std::lock_guard<std::mutex> guard(c->framesMutex);
+    vector<float>& pixels = c->frames[frame];
+
+    if ( pixels.empty() ) {
+        fillSource(pixels, c->effect->width, c->effect->height, frame);
+    }
+
+    return &pixels[0];
+}
+
+bool
+isFrameNeeded(const Clip* c,
+              OfxTime time)
+{
+    for (size_t i = 0; i < c->framesNeeded.size(); ++i) {
+        if ( (c->framesNeeded[i].min - 1e-6 <= time) && (time <= c->framesNeeded[i].max + 1e-6) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline bool
+rectContains(const OfxRectD& r,
+             const OfxRectD& inner)
+{
+    return (r.x1 - 1e-6 <= inner.x1) && (r.y1 - 1e-6 <= inner.y1) && (inner.x2 <= r.x2 + 1e-6) && (inner.y2 <= r.y2 + 1e-6);
+}
+
+// Images are fetched from full-frame buffers at render scale 1. Their bounds
+// are the requested region (the region of interest, or the render window for
+// the output clip, if none is given) clipped to the project, and their data
+// points into the full-frame buffer, so that the row stride is the frame width.
+OfxStatus
+clipGetImage(OfxImageClipHandle h,
+             OfxTime time,
+             const OfxRectD* region,
+             OfxPropertySetHandle* imageHandle)
+{
+    Clip* c = clip(h);
+
+    if (!c->connected) {
+        return kOfxStatFailed;
+    }
+    const Effect* e = c->effect;
+    OfxRectD rect = c->roi;
+    float* pixels = NULL;
+    if (c->isOutput) {
+        if (time != e->renderTime) {
+            requestError("%s: image fetched at time %g while rendering time %g", c->name.c_str(), time, e->renderTime);
+        }
+        pixels = &c->pixels[0];
+    } else {
+        if ( !isFrameNeeded(c, time) ) {
+            requestError("%s: image fetched at time %g, which is not in the frames needed", c->name.c_str(), time);
+        }
+        pixels = sourceFrame(c, time);
+    }
+    if (region) {
+        if ( !rectContains(c->roi, *region) ) {
+            requestError("%s: image region (%g, %g, %g, %g) is not in the region of interest (%g, %g, %g, %g)", c->name.c_str(),
+                         region->x1, region->y1, region->x2, region->y2, c->roi.x1, c->roi.y1, c->roi.x2, c->roi.y2);
+        }
+        rect = *region;
+    }
+    int bounds[4] = {
+        std::max( 0, (int)std::floor(rect.x1) ),
+        std::max( 0, (int)std::floor(rect.y1) ),
+        std::min( e->width, (int)std::ceil(rect.x2) ),
+        std::min( e->height, (int)std::ceil(rect.y2) )
+    };
+    if ( (bounds[2] <= bounds[0]) || (bounds[3] <= bounds[1]) ) {
+        bounds[0] = bounds[1] = bounds[2] = bounds[3] = 0;
+    }
+    const int rod[4] = { 0, 0, e->width, e->height };
+    PropertySet* img = new PropertySet;
+    char uid[64];
+
+    std::snprintf(uid, sizeof(uid), "%p@%g", (void*)pixels, time);
+    img->setPointer(kOfxImagePropData, pixels + ( (size_t)bounds[1] * e->width + bounds[0] ) * 4);
+    img->setN<int>(kOfxImagePropBounds, 4, bounds);
+    img->setN<int>(kOfxImagePropRegionOfDefinition, 4, rod);
+    img->setInt(kOfxImagePropRowBytes, e->width * 4 * (int)sizeof(float));
+    img->setString(kOfxImageEffectPropPixelDepth, kOfxBitDepthFloat);
+    img->setString(kOfxImageEffectPropComponents, kOfxImageComponentRGBA);
+    img->setString(kOfxImageEffectPropPreMultiplication, kOfxImagePreMultiplied);
+    img->setN<double>(kOfxImageEffectPropRenderScale, 2, gRenderScale);
+    img->setDouble(kOfxImagePropPixelAspectRatio, 1.);
+    img->setString(kOfxImagePropField, kOfxImageFieldNone);
+    img->setString(kOfxImagePropUniqueIdentifier, uid);
+    *imageHandle = propHandle(img);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipReleaseImage(OfxPropertySetHandle imageHandle)
+{
+    delete propSet(imageHandle);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipGetRegionOfDefinition(OfxImageClipHandle h,
+                          OfxTime /*time*/,
+                          OfxRectD* bounds)
+{
+    const Effect* e = clip(h)->effect;
+
+    bounds->x1 = 0.;
+    bounds->y1 = 0.;
+    bounds->x2 = e->width;
+    bounds->y2 = e->height;
+
+    return kOfxStatOK;
+}
+
+int
+effectAbort(OfxImageEffectHandle /*h*/)
+{
+    return 0;
+}
+
+OfxStatus
+imageMemoryAlloc(OfxImageEffectHandle /*instanceHandle*/,
+                 size_t nBytes,
+                 OfxImageMemoryHandle* memoryHandle)
+{
+    void* data = std::malloc(nBytes ? nBytes : 1);
+
+    if (!data) {
+        return kOfxStatErrMemory;
+    }
+    *memoryHandle = reinterpret_cast<OfxImageMemoryHandle>(data);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+imageMemoryFree(OfxImageMemoryHandle memoryHandle)
+{
+    std::free(memoryHandle);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+imageMemoryLock(OfxImageMemoryHandle memoryHandle,
+                void** returnedPtr)
+{
+    *returnedPtr = memoryHandle;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+imageMemoryUnlock(OfxImageMemoryHandle /*memoryHandle*/)
+{
+    return kOfxStatOK;
+}
+
+OfxImageEffectSuiteV1 gImageEffectSuite = {
+    getPropertySet, getParamSet, clipDefine, clipGetHandle, clipGetPropertySet,
+    clipGetImage, clipReleaseImage, clipGetRegionOfDefinition, effectAbort,
+    imageMemoryAlloc, imageMemoryFree, imageMemoryLock, imageMemoryUnlock
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// multithread, memory, message, progress and timeline suites
+
+unsigned int gNumCPUs = 1;
+thread_local unsigned int gThreadIndex = 0;
+thread_local bool gIsSpawnedThread = false;
+
+// number of thread functions that threw an exception
+std::atomic<int> gThreadErrors(0);
+
+// the OFX C API must not throw, so an exception escaping a thread function is
+// reported, counted and turned into a failure of the multiThread call
+bool
+runThreadFunction(OfxThreadFunctionV1 func,
+                  unsigned int threadIndex,
+                  unsigned int threadMax,
+                  void* customArg)
+{
+    try {
+        func(threadIndex, threadMax, customArg);
+
+        return true;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "SeExprBench: exception in thread %u: %s\n", threadIndex, e.what());
+    } catch (...) {
+        std::fprintf(stderr, "SeExprBench: exception in thread %u\n", threadIndex);
+    }
+    ++gThreadErrors;
+
+    return false;
+}
+
+void
+spawnedThread(OfxThreadFunctionV1 func,
+              unsigned int threadIndex,
+              unsigned int threadMax,
+              void* customArg,
+              std::atomic<bool>* failed)
+{
+    gThreadIndex = threadIndex;
+    gIsSpawnedThread = true;
+    if ( !runThreadFunction(func, threadIndex, threadMax, customArg) ) {
+        *failed = true;
+    }
+}
+
+OfxStatus
+multiThread(OfxThreadFunctionV1 func,
+            unsigned int nThreads,
+            void* customArg)
+{
+    if (nThreads == 0) {
+        return kOfxStatErrValue;
+    }
+    // nested calls run on the calling thread
+    if ((nThreads == 1) || gIsSpawnedThread) {
+        for (unsigned int i = 0; i < nThreads; ++i) {
+            if ( !runThreadFunction(func, i, nThreads, customArg) ) {
+                return kOfxStatFailed;
+            }
+        }
+
+        return kOfxStatOK;
+    }
+    std::atomic<bool> failed(false);
+    vector<std::thread> threads;
+    threads.reserve(nThreads);
+    for (unsigned int i = 0; i < nThreads; ++i) {
+        threads.push_back( std::thread(spawnedThread, func, i, nThreads, customArg, &failed) );
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    return failed ? kOfxStatFailed : kOfxStatOK;
+}
+
+OfxStatus
+multiThreadNumCPUs(unsigned int* nCPUs)
+{
+    *nCPUs = gNumCPUs;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+multiThreadIndex(unsigned int* threadIndex)
+{
+    *threadIndex = gThreadIndex;
+
+    return kOfxStatOK;
+}
+
+int
+multiThreadIsSpawnedThread(void)
+{
+    return gIsSpawnedThread;
+}
+
+OfxStatus
+mutexCreate(OfxMutexHandle* mutex,
+            int lockCount)
+{
+    std::recursive_mutex* m = new std::recursive_mutex;
+
+    for (int i = 0; i < lockCount; ++i) {
+        m->lock();
+    }
+    *mutex = reinterpret_cast<OfxMutexHandle>(m);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexDestroy(const OfxMutexHandle mutex)
+{
+    delete reinterpret_cast<std::recursive_mutex*>(mutex);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexLock(const OfxMutexHandle mutex)
+{
+    reinterpret_cast<std::recursive_mutex*>(mutex)->lock();
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexUnLock(const OfxMutexHandle mutex)
+{
+    reinterpret_cast<std::recursive_mutex*>(mutex)->unlock();
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexTryLock(const OfxMutexHandle mutex)
+{
+    return reinterpret_cast<std::recursive_mutex*>(mutex)->try_lock() ? kOfxStatOK : kOfxStatFailed;
+}
+
+OfxMultiThreadSuiteV1 gMultiThreadSuite = {
+    multiThread, multiThreadNumCPUs, multiThreadIndex, multiThreadIsSpawnedThread,
+    mutexCreate, mutexDestroy, mutexLock, mutexUnLock, mutexTryLock
+};
+
+OfxStatus
+memoryAlloc(void* /*handle*/,
+            size_t nBytes,
+            void** allocatedData)
+{
+    *allocatedData = std::malloc(nBytes ? nBytes : 1);
+
+    return *allocatedData ? kOfxStatOK : kOfxStatErrMemory;
+}
+
+OfxStatus
+memoryFree(void* allocatedData)
+{
+    std::free(allocatedData);
+
+    return kOfxStatOK;
+}
+
+OfxMemorySuiteV1 gMemorySuite = {
+    memoryAlloc, memoryFree
+};
+
+void
+printMessage(const char* messageType,
+             const char* format,
+             va_list ap)
+{
+    std::fprintf(stderr, "SeExprBench: %s: ", messageType ? messageType : "");
+    std::vfprintf(stderr, format, ap);
+    std::fprintf(stderr, "\n");
+}
+
+OfxStatus
+message(void* /*handle*/,
+        const char* messageType,
+        const char* /*messageId*/,
+        const char* format,
+        ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    printMessage(messageType, format, ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+setPersistentMessage(void* /*handle*/,
+                     const char* messageType,
+                     const char* /*messageId*/,
+                     const char* format,
+                     ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    printMessage(messageType, format, ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clearPersistentMessage(void* /*handle*/)
+{
+    return kOfxStatOK;
+}
+
+OfxMessageSuiteV1 gMessageSuiteV1 = {
+    message
+};
+
+OfxMessageSuiteV2 gMessageSuiteV2 = {
+    message, setPersistentMessage, clearPersistentMessage
+};
+
+OfxStatus
+progressStart(void* /*effectInstance*/,
+              const char* /*label*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+progressUpdate(void* /*effectInstance*/,
+               double /*progress*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+progressEnd(void* /*effectInstance*/)
+{
+    return kOfxStatOK;
+}
+
+OfxProgressSuiteV1 gProgressSuite = {
+    progressStart, progressUpdate, progressEnd
+};
+
+OfxStatus
+getTime(void* /*instance*/,
+        double* time)
+{
+    *time = kBenchTime;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+gotoTime(void* /*instance*/,
+         double /*time*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+getTimeBounds(void* /*instance*/,
+              double* firstTime,
+              double* lastTime)
+{
+    *firstTime = 0.;
+    *lastTime = kBenchDuration - 1.;
+
+    return kOfxStatOK;
+}
+
+OfxTimeLineSuiteV1 gTimeLineSuite = {
+    getTime, gotoTime, getTimeBounds
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// host
+
+PropertySet gHostProps;
+
+const void*
+fetchSuite(OfxPropertySetHandle /*host*/,
+           const char* suiteName,
+           int suiteVersion)
+{
+    const string name(suiteName);
+
+    if ((name == kOfxPropertySuite) && (suiteVersion == 1)) {
+        return &gPropertySuite;
+    } else if ((name == kOfxImageEffectSuite) && (suiteVersion == 1)) {
+        return &gImageEffectSuite;
+    } else if ((name == kOfxParameterSuite) && (suiteVersion == 1)) {
+        return &gParameterSuite;
+    } else if ((name == kOfxMultiThreadSuite) && (suiteVersion == 1)) {
+        return &gMultiThreadSuite;
+    } else if ((name == kOfxMemorySuite) && (suiteVersion == 1)) {
+        return &gMemorySuite;
+    } else if ((name == kOfxMessageSuite) && (suiteVersion == 1)) {
+        return &gMessageSuiteV1;
+    } else if ((name == kOfxMessageSuite) && (suiteVersion == 2)) {
+        return &gMessageSuiteV2;
+    } else if ((name == kOfxProgressSuite) && (suiteVersion == 1)) {
+        return &gProgressSuite;
+    } else if ((name == kOfxTimeLineSuite) && (suiteVersion == 1)) {
+        return &gTimeLineSuite;
+    }
+
+    return NULL;
+}
+
+OfxHost gHost = {
+    NULL, fetchSuite
+};
+
+void
+describeHost()
+{
+    const int apiVersion[2] = { 1, 4 };
+    const int version[3] = { 1, 0, 0 };
+    const char* components[3] = { kOfxImageComponentRGBA, kOfxImageComponentRGB, kOfxImageComponentAlpha };
+    const char* contexts[3] = { kOfxImageEffectContextFilter, kOfxImageEffectContextGeneral, kOfxImageEffectContextGenerator };
+    const char* depths[1] = { kOfxBitDepthFloat };
+    const int pageRowColumnCount[2] = { 0, 0 };
+
+    gHostProps.setN<int>(kOfxPropAPIVersion, 2, apiVersion);
+    gHostProps.setString(kOfxPropName, kBenchHostName);
+    gHostProps.setString(kOfxPropLabel, "SeExprBench");
+    gHostProps.setN<int>(kOfxPropVersion, 3, version);
+    gHostProps.setString(kOfxPropVersionLabel, "1.0");
+    gHostProps.setInt(kOfxImageEffectHostPropIsBackground, 1);
+    gHostProps.setInt(kOfxImageEffectPropSupportsOverlays, 0);
+    gHostProps.setInt(kOfxImageEffectPropSupportsMultiResolution, 1);
+    gHostProps.setInt(kOfxImageEffectPropSupportsTiles, 1);
+    gHostProps.setInt(kOfxImageEffectPropTemporalClipAccess, 1);
+    gHostProps.setInt(kOfxImageEffectPropSupportsMultipleClipDepths, 0);
+    gHostProps.setInt(kOfxImageEffectPropSupportsMultipleClipPARs, 0);
+    gHostProps.setInt(kOfxImageEffectPropSetableFrameRate, 0);
+    gHostProps.setInt(kOfxImageEffectPropSetableFielding, 0);
+    gHostProps.setInt(kOfxImageEffectInstancePropSequentialRender, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsCustomInteract, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsStringAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsChoiceAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsBooleanAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsCustomAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropMaxParameters, -1);
+    gHostProps.setInt(kOfxParamHostPropMaxPages, 0);
+    gHostProps.setN<int>(kOfxParamHostPropPageRowColumnCount, 2, pageRowColumnCount);
+    vector<string> values;
+    values.assign(components, components + 3);
+    gHostProps.setN<string>(kOfxImageEffectPropSupportedComponents, 3, &values[0]);
+    values.assign(contexts, contexts + 3);
+    gHostProps.setN<string>(kOfxImageEffectPropSupportedContexts, 3, &values[0]);
+    values.assign(depths, depths + 1);
+    gHostProps.setN<string>(kOfxImageEffectPropSupportedPixelDepths, 1, &values[0]);
+    gHost.host = propHandle(&gHostProps);
+}
+
+OfxStatus
+callAction(const OfxPlugin* plugin,
+           const char* action,
+           const void* handle,
+           PropertySet* inArgs,
+           PropertySet* outArgs)
+{
+    return plugin->mainEntry(action, handle, inArgs ? propHandle(inArgs) : NULL, outArgs ? propHandle(outArgs) : NULL);
+}
+
+inline bool
+succeeded(OfxStatus stat)
+{
+    return (stat == kOfxStatOK) || (stat == kOfxStatReplyDefault);
+}
+
+// A loaded plugin, described in the filter context.
+struct LoadedPlugin
+{
+    const OfxPlugin* plugin;
+    Effect descriptor;
+    Effect contextDescriptor;
+};
+
+bool
+loadPlugin(const string& identifier,
+           LoadedPlugin* loaded)
+{
+    const int nPlugins = OfxGetNumberOfPlugins();
+
+    loaded->plugin = NULL;
+    for (int i = 0; i < nPlugins; ++i) {
+        OfxPlugin* p = OfxGetPlugin(i);
+        if (p && (identifier == p->pluginIdentifier)) {
+            loaded->plugin = p;
+            break;
+        }
+    }
+    if (!loaded->plugin) {
+        std::fprintf(stderr, "SeExprBench: plugin %s not found\n", identifier.c_str());
+
+        return false;
+    }
+    loaded->plugin->setHost(&gHost);
+    if (!succeeded( callAction(loaded->plugin, kOfxActionLoad, NULL, NULL, NULL) ) ||
+        !succeeded( callAction(loaded->plugin, kOfxActionDescribe, &loaded->descriptor, NULL, NULL) )) {
+        std::fprintf(stderr, "SeExprBench: could not describe %s\n", identifier.c_str());
+
+        return false;
+    }
+    loaded->contextDescriptor.props = loaded->descriptor.props;
+    PropertySet inArgs;
+    inArgs.setString(kOfxImageEffectPropContext, kOfxImageEffectContextFilter);
+    if (!succeeded( callAction(loaded->plugin, kOfxImageEffectActionDescribeInContext, &loaded->contextDescriptor, &inArgs, NULL) )) {
+        std::fprintf(stderr, "SeExprBench: could not describe %s in the filter context\n", identifier.c_str());
+
+        return false;
+    }
+
+    return true;
+}
+
+// initialize a parameter from its descriptor, denormalizing the defaults as a host supporting API 1.2 does
+void
+initParamValue(Param* p,
+               int width,
+               int height)
+{
+    const bool normalised = (p->props.getString(kOfxParamPropDefaultCoordinateSystem, 0) == string(kOfxParamCoordinatesNormalised));
+    const string doubleType = p->props.getString(kOfxParamPropDoubleType, 0);
+
+    for (int i = 0; i < p->dim; ++i) {
+        switch (p->kind) {
+        case eValueKindInt:
+            p->ints[i] = p->props.getInt(kOfxParamPropDefault, i);
+            break;
+        case eValueKindDouble: {
+            double value = p->props.getDouble(kOfxParamPropDefault, i);
+            if (normalised) {
+                bool isY = (doubleType == kOfxParamDoubleTypeY) || (doubleType == kOfxParamDoubleTypeYAbsolute) || (i == 1);
+                value *= isY ? height : width;
+            }
+            p->doubles[i] = value;
+            break;
+        }
+        case eValueKindString:
+            p->str = p->props.getString(kOfxParamPropDefault, 0);
+            break;
+        case eValueKindNone:
+            break;
+        }
+    }
+}
+
+std::shared_ptr<Effect>
+createInstance(const LoadedPlugin& loaded,
+               int width,
+               int height)
+{
+    std::shared_ptr<Effect> instance(new Effect);
+    const Effect& desc = loaded.contextDescriptor;
+    const double projectSize[2] = { (double)width, (double)height };
+    const double projectOffset[2] = { 0., 0. };
+    const double frameRange[2] = { 0., kBenchDuration - 1. };
+
+    instance->width = width;
+    instance->height = height;
+    instance->props = desc.props;
+    instance->props.setString(kOfxImageEffectPropContext, kOfxImageEffectContextFilter);
+    instance->props.setN<double>(kOfxImageEffectPropProjectSize, 2, projectSize);
+    instance->props.setN<double>(kOfxImageEffectPropProjectExtent, 2, projectSize);
+    instance->props.setN<double>(kOfxImageEffectPropProjectOffset, 2, projectOffset);
+    instance->props.setDouble(kOfxImageEffectPropProjectPixelAspectRatio, 1.);
+    instance->props.setDouble(kOfxImageEffectInstancePropEffectDuration, kBenchDuration);
+    instance->props.setDouble(kOfxImageEffectPropFrameRate, kBenchFrameRate);
+    instance->props.setInt(kOfxPropIsInteractive, 0);
+
+    for (size_t i = 0; i < desc.clips.size(); ++i) {
+        std::shared_ptr<Clip> c(new Clip);
+        c->name = desc.clips[i]->name;
+        c->effect = instance.get();
+        c->props = desc.clips[i]->props;
+        const bool isMask = c->props.getInt(kOfxImageClipPropIsMask) != 0;
+        c->isOutput = (c->name == kOfxImageEffectOutputClipName);
+        c->connected = c->isOutput || (c->name == kOfxImageEffectSimpleSourceClipName);
+        const bool connected = c->connected;
+        const char* components = isMask ? kOfxImageComponentAlpha : kOfxImageComponentRGBA;
+        c->props.setInt(kOfxImageClipPropConnected, connected);
+        c->props.setString(kOfxImageEffectPropComponents, components);
+        c->props.setString(kOfxImageClipPropUnmappedComponents, components);
+        c->props.setString(kOfxImageEffectPropPixelDepth, kOfxBitDepthFloat);
+        c->props.setString(kOfxImageClipPropUnmappedPixelDepth, kOfxBitDepthFloat);
+        c->props.setString(kOfxImageEffectPropPreMultiplication, kOfxImagePreMultiplied);
+        c->props.setDouble(kOfxImagePropPixelAspectRatio, 1.);
+        c->props.setDouble(kOfxImageEffectPropFrameRate, kBenchFrameRate);
+        c->props.setDouble(kOfxImageEffectPropUnmappedFrameRate, kBenchFrameRate);
+        c->props.setN<double>(kOfxImageEffectPropFrameRange, 2, frameRange);
+        c->props.setN<double>(kOfxImageEffectPropUnmappedFrameRange, 2, frameRange);
+        c->props.setString(kOfxImageClipPropFieldOrder, kOfxImageFieldNone);
+        c->props.setInt(kOfxImageClipPropContinuousSamples, 0);
+        if (c->isOutput) {
+            c->pixels.assign( (size_t)width * height * 4, 0.f );
+        }
+        instance->clips.push_back(c);
+    }
+
+    instance->params.props = desc.params.props;
+    for (size_t i = 0; i < desc.params.params.size(); ++i) {
+        const Param& d = *desc.params.params[i];
+        std::shared_ptr<Param> p(new Param(d));
+        initParamValue(p.get(), width, height);
+        instance->params.params.push_back(p);
+        instance->params.byName[p->props.getString(kOfxPropName, 0)] = p.get();
+    }
+
+    return instance;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// benchmark matrix
+
+struct ParamValue
+{
+    string name;
+    string value; // integer, boolean, string, or the label of a choice option
+};
+
+struct BenchCase
+{
+    string pluginIdentifier;
+    string config;
+    int width;
+    int height;
+    vector<ParamValue> values;
+};
+
+void
+addValue(BenchCase& c,
+         const string& name,
+         const string& value)
+{
+    ParamValue v;
+
+    v.name = name;
+    v.value = value;
+    c.values.push_back(v);
+}
+
+BenchCase
+makeCase(const string& pluginIdentifier,
+         const string& config,
+         int width,
+         int height)
+{
+    BenchCase c;
+
+    c.pluginIdentifier = pluginIdentifier;
+    c.config = config;
+    c.width = width;
+    c.height = height;
+
+    return c;
+}
+
+// The fixed matrix. Configurations are only ever added at the end, so that results can be compared across runs.
+vector<BenchCase>
+benchMatrix(bool quick)
+{
+    const int hdW = quick ? 240 : 1920;
+    const int hdH = quick ? 135 : 1080;
+    const int uhdW = quick ? 480 : 3840;
+    const int uhdH = quick ? 270 : 2160;
+    vector<BenchCase> cases;
+    BenchCase c;
+
+    c = makeCase("fr.inria.openfx.SeExpr", "copy", hdW, hdH);
+    addValue(c, "script", "Cs");
+    addValue(c, "alphaScript", "As");
+    addValue(c, "validate", "1");
+    cases.push_back(c);
+
+    c = makeCase("fr.inria.openfx.SeExpr", "arithmetic", hdW, hdH);
+    addValue(c, "script", "[Cs[0]+Cs[1], Cs[1], 0.5*Cs[2]] * 0.8 + 0.1");
+    addValue(c, "alphaScript", "As * 0.5");
+    addValue(c, "validate", "1");
+    cases.push_back(c);
+
+    c = makeCase("fr.inria.openfx.SeExpr", "fbm", hdW, hdH);
+    addValue(c, "script", "fbm([x/64, y/64, frame])");
+    addValue(c, "alphaScript", "As");
+    addValue(c, "validate", "1");
+    cases.push_back(c);
+
+    c = makeCase("fr.inria.openfx.SeExpr", "cpixel", hdW, hdH);
+    addValue(c, "script", "(cpixel(1,frame,x-1,y) + cpixel(1,frame,x+1,y) + cpixel(1,frame,x,y-1) + cpixel(1,frame,x,y+1)) / 4");
+    addValue(c, "alphaScript", "apixel(1,frame-1,x,y)");
+    addValue(c, "validate", "1");
+    cases.push_back(c);
+
+    c = makeCase("fr.inria.openfx.SeExprSimple", "arithmetic", hdW, hdH);
+    addValue(c, "rExpr", "r*0.8 + 0.1");
+    addValue(c, "gExpr", "g*0.8 + 0.1");
+    addValue(c, "bExpr", "b*0.8 + 0.1");
+    addValue(c, "aExpr", "a");
+    addValue(c, "validate", "1");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeNoise", "fbm8_4k", uhdW, uhdH);
+    addValue(c, "noiseType", "FBM");
+    addValue(c, "fbmOctaves", "8");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeNoise", "fbm6", hdW, hdH);
+    addValue(c, "noiseType", "FBM");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeNoise", "fbm6_colored", hdW, hdH);
+    addValue(c, "noiseType", "FBM");
+    addValue(c, "noiseColored", "1");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeNoise", "turbulence6", hdW, hdH);
+    addValue(c, "noiseType", "Turbulence");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeNoise", "noise", hdW, hdH);
+    addValue(c, "noiseType", "Noise");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeNoise", "cellnoise", hdW, hdH);
+    addValue(c, "noiseType", "Cell Noise");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeGrain", "default", hdW, hdH);
+    addValue(c, "tiledGrain", "0");
+    cases.push_back(c);
+
+    c = makeCase("net.sf.openfx.SeGrain", "tiled", hdW, hdH);
+    addValue(c, "tiledGrain", "1");
+    cases.push_back(c);
+
+    return cases;
+} // benchMatrix
+
+bool
+setParamValue(Effect* instance,
+              const ParamValue& v)
+{
+    Param* p = instance->params.find(v.name);
+
+    if (!p) {
+        std::fprintf(stderr, "SeExprBench: unknown parameter %s\n", v.name.c_str());
+
+        return false;
+    }
+    if (p->type == kOfxParamTypeChoice) {
+        const int nOptions = p->props.getDimension(kOfxParamPropChoiceOption);
+        for (int i = 0; i < nOptions; ++i) {
+            if (v.value == p->props.getString(kOfxParamPropChoiceOption, i)) {
+                p->ints[0] = i;
+
+                return true;
+            }
+        }
+        std::fprintf(stderr, "SeExprBench: parameter %s has no option %s\n", v.name.c_str(), v.value.c_str());
+
+        return false;
+    }
+    switch (p->kind) {
+    case eValueKindInt:
+        p->ints[0] = std::atoi( v.value.c_str() );
+
+        return true;
+    case eValueKindDouble:
+        p->doubles[0] = std::atof( v.value.c_str() );
+
+        return true;
+    case eValueKindString:
+        p->str = v.value;
+
+        return true;
+    case eValueKindNone:
+        break;
+    }
+    std::fprintf(stderr, "SeExprBench: parameter %s cannot be set\n", v.name.c_str());
+
+    return false;
+}
+
+void
+setRenderArgs(PropertySet* args,
+              const Effect& instance)
+{
+    const int renderWindow[4] = { 0, 0, instance.width, instance.height };
+
+    args->setDouble(kOfxPropTime, kBenchTime);
+    args->setString(kOfxImageEffectPropFieldToRender, kOfxImageFieldNone);
+    args->setN<int>(kOfxImageEffectPropRenderWindow, 4, renderWindow);
+    args->setN<double>(kOfxImageEffectPropRenderScale, 2, gRenderScale);
+    args->setInt(kOfxImageEffectPropSequentialRenderStatus, 0);
+    args->setInt(kOfxImageEffectPropInteractiveRenderStatus, 0);
+    args->setInt(kOfxImageEffectPropRenderQualityDraft, 0);
+}
+
+// Call the getRegionsOfInterest and getFramesNeeded actions for the render,
+// and record their results (or the defaults, if the plugin does not set them)
+// in the input clips, where clipGetImage checks the images fetched against them.
+bool
+getInputRequests(const LoadedPlugin& loaded,
+                 Effect* instance,
+                 const PropertySet& renderArgs)
+{
+    const OfxTime time = renderArgs.getDouble(kOfxPropTime);
+    OfxRectD renderWindow;
+    renderWindow.x1 = renderArgs.getInt(kOfxImageEffectPropRenderWindow, 0);
+    renderWindow.y1 = renderArgs.getInt(kOfxImageEffectPropRenderWindow, 1);
+    renderWindow.x2 = renderArgs.getInt(kOfxImageEffectPropRenderWindow, 2);
+    renderWindow.y2 = renderArgs.getInt(kOfxImageEffectPropRenderWindow, 3);
+    const double timeRange[2] = { time, time };
+    PropertySet roiArgs;
+    roiArgs.setDouble(kOfxPropTime, time);
+    roiArgs.setN<double>(kOfxImageEffectPropRenderScale, 2, gRenderScale);
+    roiArgs.setN<double>(kOfxImageEffectPropRegionOfInterest, 4, &renderWindow.x1);
+    PropertySet rois;
+    PropertySet timeArgs;
+    timeArgs.setDouble(kOfxPropTime, time);
+    PropertySet ranges;
+    for (size_t i = 0; i < instance->clips.size(); ++i) {
+        const Clip& c = *instance->clips[i];
+        if (!c.isOutput) {
+            rois.setN<double>( ("OfxImageClipPropRoI_" + c.name).c_str(), 4, &renderWindow.x1 );
+            ranges.setN<double>( ("OfxImageClipPropFrameRange_" + c.name).c_str(), 2, timeRange );
+        }
+    }
+    if ( !succeeded( callAction(loaded.plugin, kOfxImageEffectActionGetRegionsOfInterest, instance, &roiArgs, &rois) ) ||
+         !succeeded( callAction(loaded.plugin, kOfxImageEffectActionGetFramesNeeded, instance, &timeArgs, &ranges) ) ) {
+        return false;
+    }
+
+    instance->renderTime = time;
+    for (size_t i = 0; i < instance->clips.size(); ++i) {
+        Clip& c = *instance->clips[i];
+        if (c.isOutput) {
+            c.roi = renderWindow;
+            continue;
+        }
+        const string roiName = "OfxImageClipPropRoI_" + c.name;
+        c.roi.x1 = rois.getDouble(roiName.c_str(), 0);
+        c.roi.y1 = rois.getDouble(roiName.c_str(), 1);
+        c.roi.x2 = rois.getDouble(roiName.c_str(), 2);
+        c.roi.y2 = rois.getDouble(roiName.c_str(), 3);
+        const string rangeName = "OfxImageClipPropFrameRange_" + c.name;
+        const int n = ranges.getDimension( rangeName.c_str() ) / 2;
+        c.framesNeeded.resize(n);
+        for (int j = 0; j < n; ++j) {
+            c.framesNeeded[j].min = ranges.getDouble(rangeName.c_str(), 2 * j);
+            c.framesNeeded[j].max = ranges.getDouble(rangeName.c_str(), 2 * j + 1);
+        }
+    }
+
+    return true;
+}
+
+struct BenchResult
+{
+    string plugin;
+    string config;
+    int width;
+    int height;
+    int iterations;
+    double bestSeconds;
+    double medianSeconds;
+    double pixelsPerSecondPerCore;
+};
+
+bool
+runCase(const LoadedPlugin& loaded,
+        const BenchCase& bc,
+        int iterations,
+        BenchResult* result)
+{
+    std::shared_ptr<Effect> instance = createInstance(loaded, bc.width, bc.height);
+
+    for (size_t i = 0; i < bc.values.size(); ++i) {
+        if (!setParamValue(instance.get(), bc.values[i])) {
+            return false;
+        }
+    }
+    if (!succeeded( callAction(loaded.plugin, kOfxActionCreateInstance, instance.get(), NULL, NULL) )) {
+        std::fprintf(stderr, "SeExprBench: %s/%s: createInstance failed\n", bc.pluginIdentifier.c_str(), bc.config.c_str());
+
+        return false;
+    }
+
+    PropertySet renderArgs;
+    setRenderArgs(&renderArgs, *instance);
+    const double frameRange[2] = { kBenchTime, kBenchTime };
+    PropertySet sequenceArgs;
+    sequenceArgs.setN<double>(kOfxImageEffectPropFrameRange, 2, frameRange);
+    sequenceArgs.setDouble(kOfxImageEffectPropFrameStep, 1.);
+    sequenceArgs.setInt(kOfxPropIsInteractive, 0);
+    sequenceArgs.setN<double>(kOfxImageEffectPropRenderScale, 2, gRenderScale);
+    sequenceArgs.setInt(kOfxImageEffectPropSequentialRenderStatus, 0);
+    sequenceArgs.setInt(kOfxImageEffectPropInteractiveRenderStatus, 0);
+
+    gRequestErrors = 0;
+    gThreadErrors = 0;
+    bool ok = succeeded( callAction(loaded.plugin, kOfxImageEffectActionBeginSequenceRender, instance.get(), &sequenceArgs, NULL) );
+    vector<double> seconds;
+    // the first render is a warm-up (caches, tiles, expression parsing) and is not timed
+    for (int i = 0; ok && i <= iterations; ++i) {
+        if ( !getInputRequests(loaded, instance.get(), renderArgs) ) {
+            std::fprintf(stderr, "SeExprBench: %s/%s: getRegionsOfInterest or getFramesNeeded failed\n", bc.pluginIdentifier.c_str(), bc.config.c_str());
+            ok = false;
+            break;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ok = succeeded( callAction(loaded.plugin, kOfxImageEffectActionRender, instance.get(), &renderArgs, NULL) );
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ok = ok && (gRequestErrors == 0) && (gThreadErrors == 0);
+        if (ok && (i > 0)) {
+            seconds.push_back( elapsed.count() );
+        }
+    }
+    callAction(loaded.plugin, kOfxImageEffectActionEndSequenceRender, instance.get(), &sequenceArgs, NULL);
+    callAction(loaded.plugin, kOfxActionDestroyInstance, instance.get(), NULL, NULL);
+    if (!ok || seconds.empty()) {
+        std::fprintf(stderr, "SeExprBench: %s/%s: render failed\n", bc.pluginIdentifier.c_str(), bc.config.c_str());
+
+        return false;
+    }
+
+    std::sort( seconds.begin(), seconds.end() );
+    result->plugin = bc.pluginIdentifier;
+    result->config = bc.config;
+    result->width = bc.width;
+    result->height = bc.height;
+    result->iterations = (int)seconds.size();
+    result->bestSeconds = seconds.front();
+    result->medianSeconds = seconds[seconds.size() / 2];
+    result->pixelsPerSecondPerCore = (double)bc.width * bc.height / result->bestSeconds / gNumCPUs;
+
+    return true;
+} // runCase
+
+void
+writeJSON(std::FILE* f,
+          const vector<BenchResult>& results)
+{
+    std::fprintf(f, "{\n  \"cpus\": %u,\n  \"results\": [\n", gNumCPUs);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        std::fprintf(f,
+                     "    { \"plugin\": \"%s\", \"config\": \"%s\", \"width\": %d, \"height\": %d, \"iterations\": %d, "
+                     "\"bestSeconds\": %.6f, \"medianSeconds\": %.6f, \"pixelsPerSecondPerCore\": %.1f }%s\n",
+                     r.plugin.c_str(), r.config.c_str(), r.width, r.height, r.iterations,
+                     r.bestSeconds, r.medianSeconds, r.pixelsPerSecondPerCore,
+                     (i + 1 < results.size()) ? "," : "");
+    }
+    std::fprintf(f, "  ]\n}\n");
+}
+} // namespace
+
+int
+main(int argc,
+     char* argv[])
+{
+    bool quick = false;
+    int iterations = kBenchIterationsDefault;
+    unsigned int threads = std::thread::hardware_concurrency();
+    const char* jsonFilename = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if ( (arg == "--iterations") && (i + 1 < argc) ) {
+            iterations = std::atoi(argv[++i]);
+        } else if ( (arg == "--threads") && (i + 1 < argc) ) {
+            threads = (unsigned int)std::atoi(argv[++i]);
+        } else if ( (arg == "--json") && (i + 1 < argc) ) {
+            jsonFilename = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--quick] [--iterations N] [--threads N] [--json FILE]\n", argv[0]);
+
+            return 2;
+        }
+    }
+    if (quick) {
+        iterations = 1;
+    }
+    gNumCPUs = std::max(threads, 1u);
+    iterations = std::max(iterations, 1);
+
+    describeHost();
+
+    const vector<BenchCase> cases = benchMatrix(quick);
+    map<string, std::shared_ptr<LoadedPlugin> > plugins;
+    vector<BenchResult> results;
+    bool failed = false;
+    for (size_t i = 0; i < cases.size(); ++i) {
+        const BenchCase& bc = cases[i];
+        std::shared_ptr<LoadedPlugin>& loaded = plugins[bc.pluginIdentifier];
+        if (!loaded) {
+            loaded.reset(new LoadedPlugin);
+            if (!loadPlugin(bc.pluginIdentifier, loaded.get())) {
+                loaded->plugin = NULL;
+            }
+        }
+        BenchResult r;
+        if (!loaded->plugin || !runCase(*loaded, bc, iterations, &r)) {
+            failed = true;
+            continue;
+        }
+        std::printf("%-28s %-14s %5dx%-5d %9.4f s %12.0f pixels/s/core\n",
+                    r.plugin.c_str(), r.config.c_str(), r.width, r.height, r.bestSeconds, r.pixelsPerSecondPerCore);
+        results.push_back(r);
+    }
+    for (map<string, std::shared_ptr<LoadedPlugin> >::const_iterator it = plugins.begin(); it != plugins.end(); ++it) {
+        if (it->second->plugin) {
+            callAction(it->second->plugin, kOfxActionUnload, NULL, NULL, NULL);
+        }
+    }
+
+    if (jsonFilename) {
+        std::FILE* f = std::fopen(jsonFilename, "w");
+        if (!f) {
+            std::fprintf(stderr, "SeExprBench: cannot write %s\n", jsonFilename);
+
+            return 1;
+        }
+        writeJSON(f, results);
+        std::fclose(f);
+    } else {
+        writeJSON(stdout, results);
+    }
+
+    return failed ? 1 : 0;
+} // main